@@ -10,13 +10,18 @@ LOCAL_MODULE := libmp4
 LOCAL_DESCRIPTION := MP4 file library
 LOCAL_CATEGORY_PATH := libs
 LOCAL_SRC_FILES := \
+    src/mp4_arena.c \
+    src/mp4_bswap.c \
     src/mp4_demux.c \
-    src/mp4_log.c
+    src/mp4_log.c \
+    src/mp4_mux.c
 LOCAL_EXPORT_C_INCLUDES := $(LOCAL_PATH)/include
-LOCAL_CONDITIONAL_LIBRARIES := OPTIONAL:libulog
+LOCAL_CONDITIONAL_LIBRARIES := OPTIONAL:libulog OPTIONAL:liburing
 
 ifeq ("$(TARGET_OS)","windows")
   LOCAL_LDLIBS += -lws2_32
+else
+  LOCAL_LDLIBS += -lpthread
 endif
 
 include $(BUILD_LIBRARY)
@@ -32,3 +37,34 @@ LOCAL_CATEGORY_PATH := multimedia
 LOCAL_SRC_FILES := test/mp4_demux_test.c
 LOCAL_LIBRARIES := libmp4 libulog
 include $(BUILD_EXECUTABLE)
+
+##########################
+#  Benchmark executable  #
+##########################
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := mp4_demux_bench
+LOCAL_DESCRIPTION := MP4 file library demuxer benchmark program
+LOCAL_CATEGORY_PATH := multimedia
+LOCAL_SRC_FILES := test/mp4_demux_bench.c
+LOCAL_LIBRARIES := libmp4
+include $(BUILD_EXECUTABLE)
+
+####################
+#  Fuzzing target  #
+####################
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := mp4_demux_fuzz
+LOCAL_DESCRIPTION := MP4 file library demuxer libFuzzer target
+LOCAL_CATEGORY_PATH := multimedia
+LOCAL_SRC_FILES := test/mp4_demux_fuzz.c
+ifeq ("$(TARGET_CC_FLAVOUR)","clang")
+LOCAL_CFLAGS := -fsanitize=fuzzer,address
+LOCAL_LDFLAGS := -fsanitize=fuzzer,address
+else
+# without libFuzzer: replay the files given on the command line
+LOCAL_CFLAGS := -DMP4_DEMUX_FUZZ_STANDALONE
+endif
+LOCAL_LIBRARIES := libmp4
+include $(BUILD_EXECUTABLE)
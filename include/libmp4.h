@@ -44,6 +44,7 @@ extern "C"  {
 #endif /* __cplusplus */
 
 #include <inttypes.h>
+#include <stddef.h>
 
 
 enum mp4_track_type {
@@ -98,6 +99,7 @@ struct mp4_track_info {
 	uint64_t duration;
 	uint64_t creation_time;
 	uint64_t modification_time;
+	/* for fragmented files, samples of the currently loaded fragment */
 	uint32_t sample_count;
 	enum mp4_video_codec video_codec;
 	uint32_t video_width;
@@ -117,20 +119,274 @@ struct mp4_track_sample {
 	uint32_t metadata_size;
 	uint64_t sample_dts;
 	uint64_t next_sample_dts;
+	/* only set by mp4_demux_get_track_next_sample_view(), where the
+	 * pointers reference the file mapping and are valid until
+	 * mp4_demux_close(), by mp4_demux_track_process_ranges(), where
+	 * they are valid until the callback returns, and by
+	 * mp4_demux_prefetch_get_next_sample(), where they are valid
+	 * until the next call */
+	const uint8_t *sample_data;
+	const uint8_t *metadata_data;
+};
+
+
+/* Sample selection of mp4_demux_track_find_sample() */
+enum mp4_sample_lookup {
+	/* last sample at or before the time */
+	MP4_SAMPLE_LOOKUP_PREVIOUS = 0,
+	/* last sync sample at or before the time */
+	MP4_SAMPLE_LOOKUP_PREVIOUS_SYNC,
+	/* first sync sample at or after the time */
+	MP4_SAMPLE_LOOKUP_NEXT_SYNC,
+	/* sync sample closest to the time, the previous one on a tie */
+	MP4_SAMPLE_LOOKUP_NEAREST_SYNC,
+};
+
+
+struct mp4_track_sample_info {
+	unsigned int sample_index;
+	/* decoding time in microseconds */
+	uint64_t sample_dts;
+	uint64_t sample_offset;
+	uint32_t sample_size;
+	int sync;
+	/* sync sample to start decoding from to reach this sample; the
+	 * sample itself for sync samples */
+	unsigned int sync_sample_index;
+	uint64_t sync_sample_dts;
+};
+
+
+/* Telemetry decoded from a metadata track, as columns of 'count'
+ * entries, one per metadata sample; the values that are unknown or
+ * absent from a sample are NAN for floating point columns and 0
+ * otherwise */
+struct mp4_telemetry {
+	unsigned int count;
+	/* decoding time of the metadata sample in microseconds */
+	uint64_t *sample_dts;
+	/* 1 if the sample was decoded, 0 if it has an unexpected layout */
+	uint8_t *valid;
+	/* capture time in microseconds */
+	uint64_t *timestamp;
+	/* degrees, and meters above sea level */
+	double *latitude;
+	double *longitude;
+	double *altitude;
+	uint8_t *gps_sv_count;
+	/* meters above the ground */
+	float *ground_distance;
+	/* meters per second */
+	float *speed_north;
+	float *speed_east;
+	float *speed_down;
+	float *air_speed;
+	/* attitude quaternions of the drone and of the frame, one column
+	 * per w, x, y and z component */
+	float *drone_quat[4];
+	float *frame_quat[4];
+	/* milliseconds */
+	float *exposure_time;
+	uint16_t *gain;
+	/* dBm */
+	int8_t *wifi_rssi;
+	uint8_t *battery_percentage;
+};
+
+
+#define MP4_DEMUX_STATS_BOX_TYPE_MAX (64)
+
+
+struct mp4_demux_box_stats {
+	/* box type fourcc, 0 for the types beyond the table size */
+	uint32_t type;
+	uint32_t count;
+	/* parsing time in nanoseconds, including the child boxes; only
+	 * measured with MP4_DEMUX_FLAG_BOX_STATS */
+	uint64_t parse_time;
+};
+
+
+struct mp4_demux_stats {
+	/* bytes read from the file, or from its mapping */
+	uint64_t bytes_read;
+	/* read and seek calls to the backend: stdio, pread(), io_uring
+	 * or the custom I/O callbacks */
+	uint64_t read_count;
+	uint64_t seek_count;
+	/* sample reads served from the readahead window, and reads that
+	 * needed to refill it */
+	uint64_t sample_cache_hits;
+	uint64_t sample_cache_misses;
+	/* memory held by the sample tables in bytes */
+	size_t table_memory;
+	unsigned int box_type_count;
+	struct mp4_demux_box_stats box_types[MP4_DEMUX_STATS_BOX_TYPE_MAX];
 };
 
 
 struct mp4_demux;
+struct mp4_demux_reader;
+struct mp4_demux_prefetch;
+struct mp4_demux_telemetry;
+struct mp4_track;
+
+
+enum mp4_demux_flag {
+	/* map the file in memory instead of using buffered reads */
+	MP4_DEMUX_FLAG_MMAP = (1 << 0),
+	/* keep the run-length sample tables and resolve sample offsets
+	 * and decoding times on demand instead of expanding them */
+	MP4_DEMUX_FLAG_COMPACT_TABLES = (1 << 1),
+	/* parse the boxes only and build the sample tables of a track
+	 * and the chapter list on first use */
+	MP4_DEMUX_FLAG_LAZY_TABLES = (1 << 2),
+	/* the file may still be being written: opening does not require
+	 * a complete moov box, mp4_demux_poll() picks up the new boxes;
+	 * implies buffered reads */
+	MP4_DEMUX_FLAG_FOLLOW = (1 << 3),
+	/* allocate the boxes, tracks, tables and strings from an arena
+	 * released at once by mp4_demux_close() */
+	MP4_DEMUX_FLAG_ARENA = (1 << 4),
+	/* parse only the descriptive boxes for media, track and metadata
+	 * queries: the sample tables are skipped unread (the sample count
+	 * comes from the stsz header) and the sample and chapter
+	 * functions fail with -EOPNOTSUPP */
+	MP4_DEMUX_FLAG_HEADER_ONLY = (1 << 5),
+	/* with custom I/O, read the first and last 64 KiB of the file
+	 * before parsing, so that the top-level boxes and a trailing moov
+	 * of a remote file are found in a couple of reads */
+	MP4_DEMUX_FLAG_TAIL_PROBE = (1 << 6),
+	/* time the parsing of each box for the parse_time statistics,
+	 * which are left to 0 otherwise to save two clock reads per box */
+	MP4_DEMUX_FLAG_BOX_STATS = (1 << 7),
+};
+
+
+struct mp4_demux_config {
+	/* bitwise OR of enum mp4_demux_flag values */
+	uint32_t flags;
+	/* size in bytes of the sample readahead window, 0 to disable;
+	 * ignored for mapped files and buffers */
+	size_t readahead_size;
+	/* optional caller-owned memory used first by the arena, which
+	 * falls back to heap chunks when it is exhausted; the buffer must
+	 * remain valid until mp4_demux_close() */
+	void *arena_buffer;
+	size_t arena_size;
+	/* maximum number of bytes the demuxer may allocate, 0 for no
+	 * limit; allocations beyond it fail with -ENOMEM, which bounds
+	 * the cost of opening any file. The boxes, tables and strings are
+	 * counted cumulatively over the demuxer lifetime, as they are not
+	 * refunded when freed; the I/O and sample buffers (readahead,
+	 * prefetch, telemetry, ranges, cuts) only while allocated */
+	size_t max_memory;
+};
+
+
+struct mp4_io_callbacks {
+	/* read up to size bytes at the current position; returns the
+	 * number of bytes read (0 at end of stream) or a negative errno */
+	int64_t (*read)(void *opaque, void *buf, size_t size);
+	/* move to an absolute position; returns 0 or a negative errno */
+	int (*seek)(void *opaque, uint64_t offset);
+	/* returns the total stream size or a negative errno */
+	int64_t (*size)(void *opaque);
+	/* optional, called by mp4_demux_close() or when opening fails */
+	void (*close)(void *opaque);
+};
 
 
 struct mp4_demux *mp4_demux_open(
 	const char *filename);
 
 
+struct mp4_demux *mp4_demux_open_mmap(
+	const char *filename);
+
+
+struct mp4_demux *mp4_demux_open_ext(
+	const char *filename,
+	const struct mp4_demux_config *config);
+
+
+struct mp4_demux *mp4_demux_open_custom(
+	const struct mp4_io_callbacks *callbacks,
+	void *opaque,
+	const struct mp4_demux_config *config);
+
+
+struct mp4_demux *mp4_demux_open_buffer(
+	const uint8_t *buffer,
+	size_t size,
+	const struct mp4_demux_config *config);
+
+
+/* Open a file using a sample index saved by mp4_demux_index_save()
+ * instead of parsing it; fails with -ESTALE if the file size or
+ * modification time changed. The index must be 8-byte aligned and
+ * outlive the demuxer, its tables are used in place */
+struct mp4_demux *mp4_demux_open_index(
+	const char *filename,
+	const void *index,
+	size_t index_size,
+	const struct mp4_demux_config *config);
+
+
+/* Same as mp4_demux_open_index() with the index mapped from a file */
+struct mp4_demux *mp4_demux_open_index_file(
+	const char *filename,
+	const char *index_path,
+	const struct mp4_demux_config *config);
+
+
+/* Serialize the sample tables, track properties, chapters and metadata
+ * of a complete non-fragmented file; with a NULL buffer only the size
+ * is returned in index_size */
+int mp4_demux_index_save(
+	struct mp4_demux *demux,
+	void *buffer,
+	size_t buffer_size,
+	size_t *index_size);
+
+
+int mp4_demux_index_save_file(
+	struct mp4_demux *demux,
+	const char *index_path);
+
+
+/* Open each file of 'paths' in header-only mode on 'thread_count'
+ * worker threads, 0 for one per online CPU. 'cb' is called once per
+ * file from the worker threads, possibly concurrently, with the file
+ * index in 'paths' and either an open demuxer that can be queried
+ * until the callback returns, or NULL and a negative errno in
+ * 'status'; returns once all files are done */
+int mp4_demux_probe_files(
+	const char *const *paths,
+	unsigned int count,
+	unsigned int thread_count,
+	const struct mp4_demux_config *config,
+	void (*cb)(const char *path, unsigned int index, int status,
+		struct mp4_demux *demux, void *userdata),
+	void *userdata);
+
+
 int mp4_demux_close(
 	struct mp4_demux *demux);
 
 
+/* Parse the boxes appended since the last call; returns the number
+ * of samples that became available, 0 if none, or a negative errno.
+ * In follow mode the demuxer has no tracks until the moov box is
+ * complete */
+int mp4_demux_poll(
+	struct mp4_demux *demux);
+
+
+/* Seek all the tracks to the sample at or before 'time_offset' (in
+ * microseconds), or to the previous sync sample if 'sync' is set; a
+ * track with no such sample keeps its position, -ENOENT is returned
+ * only if no track could be positioned */
 int mp4_demux_seek(
 	struct mp4_demux *demux,
 	uint64_t time_offset,
@@ -142,6 +398,14 @@ int mp4_demux_get_media_info(
 	struct mp4_media_info *media_info);
 
 
+/* Get the I/O, cache and parsing counters accumulated since opening;
+ * the counters are updated atomically and may be read while other
+ * threads read samples */
+int mp4_demux_get_stats(
+	struct mp4_demux *demux,
+	struct mp4_demux_stats *stats);
+
+
 int mp4_demux_get_track_count(
 	struct mp4_demux *demux);
 
@@ -152,6 +416,194 @@ int mp4_demux_get_track_info(
 	struct mp4_track_info *track_info);
 
 
+/* Get a track handle by id or by index (the track_idx order of
+ * mp4_demux_get_track_info()); handles remain valid until the demuxer
+ * is closed and are NULL if there is no such track. The
+ * mp4_demux_track_*() functions below are the same as their track_id
+ * counterparts without the lookup, for the per-sample paths */
+struct mp4_track *mp4_demux_get_track(
+	struct mp4_demux *demux,
+	unsigned int track_id);
+
+
+struct mp4_track *mp4_demux_get_track_by_idx(
+	struct mp4_demux *demux,
+	unsigned int track_idx);
+
+
+int mp4_demux_track_get_info(
+	struct mp4_demux *demux,
+	struct mp4_track *track,
+	struct mp4_track_info *track_info);
+
+
+int mp4_demux_track_get_avc_decoder_config(
+	struct mp4_demux *demux,
+	struct mp4_track *track,
+	uint8_t **sps,
+	unsigned int *sps_size,
+	uint8_t **pps,
+	unsigned int *pps_size);
+
+
+int mp4_demux_track_get_next_sample(
+	struct mp4_demux *demux,
+	struct mp4_track *track,
+	uint8_t *sample_buffer,
+	unsigned int sample_buffer_size,
+	uint8_t *metadata_buffer,
+	unsigned int metadata_buffer_size,
+	struct mp4_track_sample *track_sample);
+
+
+int mp4_demux_track_get_next_sample_view(
+	struct mp4_demux *demux,
+	struct mp4_track *track,
+	struct mp4_track_sample *track_sample);
+
+
+int mp4_demux_track_get_next_samples(
+	struct mp4_demux *demux,
+	struct mp4_track *track,
+	uint8_t *sample_buffer,
+	size_t sample_buffer_size,
+	uint8_t *metadata_buffer,
+	size_t metadata_buffer_size,
+	struct mp4_track_sample *track_samples,
+	unsigned int max_samples);
+
+
+/* Find a sample by time (in microseconds) with a binary search over
+ * the sample tables, without moving the track read position; returns
+ * 0, -ENOENT if there is no such sample, or a negative errno value on
+ * error. Together with mp4_demux_track_read_sample() it is independent
+ * of the next sample functions, and both are safe to call from several
+ * threads once the sample tables are built (after a first call on the
+ * track, or at open without MP4_DEMUX_FLAG_LAZY_TABLES), except for
+ * reads with custom I/O. For fragmented files only the samples of the
+ * currently loaded fragment are available */
+int mp4_demux_track_find_sample(
+	struct mp4_demux *demux,
+	struct mp4_track *track,
+	uint64_t time,
+	enum mp4_sample_lookup lookup,
+	struct mp4_track_sample_info *sample_info);
+
+
+/* Read a sample, and its linked metadata sample, by index; same as
+ * mp4_demux_track_get_next_sample() otherwise */
+int mp4_demux_track_read_sample(
+	struct mp4_demux *demux,
+	struct mp4_track *track,
+	unsigned int sample_index,
+	uint8_t *sample_buffer,
+	unsigned int sample_buffer_size,
+	uint8_t *metadata_buffer,
+	unsigned int metadata_buffer_size,
+	struct mp4_track_sample *track_sample);
+
+
+/* Create an asynchronous reader of a track: up to 'depth' samples (0
+ * for a default depth) after the last delivered one are read ahead,
+ * through io_uring when available and on a background thread
+ * otherwise, while holding at most 'max_memory' bytes of sample data
+ * (0 for no limit; one sample is always read even if it is larger).
+ * The read position starts at sample 0 and is independent of the
+ * track own position. Requires a mapped or stdio-backed non-fragmented
+ * file; the prefetcher must be destroyed before the demuxer is
+ * closed */
+struct mp4_demux_prefetch *mp4_demux_prefetch_new(
+	struct mp4_demux *demux,
+	struct mp4_track *track,
+	unsigned int depth,
+	size_t max_memory);
+
+
+int mp4_demux_prefetch_destroy(
+	struct mp4_demux_prefetch *prefetch);
+
+
+/* Drop the pending reads and restart from a sample index, e.g. found
+ * with mp4_demux_track_find_sample() */
+int mp4_demux_prefetch_seek(
+	struct mp4_demux_prefetch *prefetch,
+	unsigned int sample_index);
+
+
+/* Deliver the next sample in order, waiting for its read if needed; the
+ * sample data and metadata pointers are set, and the sample size is 0
+ * at the end of the track. A sample that failed to be read is skipped
+ * by the next call */
+int mp4_demux_prefetch_get_next_sample(
+	struct mp4_demux_prefetch *prefetch,
+	struct mp4_track_sample *track_sample);
+
+
+/* Create a telemetry reader of the metadata track linked to a video
+ * track (or of the given metadata track itself): only the metadata
+ * samples are read, 'batch_size' at a time (0 for a default size) with
+ * one read per contiguous file range, and decoded into columns by a
+ * decoder chosen from the MIME format of the track. Returns NULL with
+ * -EOPNOTSUPP logged if the format is not known. The read position
+ * starts at sample 0 and is independent of the track own position;
+ * the reader must be destroyed before the demuxer is closed */
+struct mp4_demux_telemetry *mp4_demux_telemetry_new(
+	struct mp4_demux *demux,
+	struct mp4_track *track,
+	unsigned int batch_size);
+
+
+int mp4_demux_telemetry_destroy(
+	struct mp4_demux_telemetry *telemetry);
+
+
+int mp4_demux_telemetry_seek(
+	struct mp4_demux_telemetry *telemetry,
+	unsigned int sample_index);
+
+
+/* Read and decode the next batch of metadata samples; the columns are
+ * owned by the reader and valid until the next call. Returns the number
+ * of samples decoded, 0 at the end of the track, or a negative errno
+ * value on error */
+int mp4_demux_telemetry_read(
+	struct mp4_demux_telemetry *telemetry,
+	struct mp4_telemetry *columns);
+
+
+/* Split a track in up to max_ranges ranges of about the same number of
+ * samples, each starting on a sync sample except the first one which
+ * starts at sample 0; the first sample index of each range is written
+ * to first_samples and the number of ranges is returned, or a negative
+ * errno value on error */
+int mp4_demux_track_get_ranges(
+	struct mp4_demux *demux,
+	struct mp4_track *track,
+	unsigned int max_ranges,
+	unsigned int *first_samples);
+
+
+/* Read the ranges of mp4_demux_track_get_ranges() on 'thread_count'
+ * worker threads (0 for one per online CPU) and 'range_count' ranges
+ * (0 for one per thread). Each worker claims the next range and reads
+ * it with its own cursor and buffers; 'cb' is called from the worker
+ * threads, possibly concurrently, for each sample of a range in
+ * decoding order with the sample data and the linked metadata sample
+ * data. A negative return value from 'cb' stops the range and no new
+ * range is started. The track read position is not changed; requires
+ * a mapped or stdio-backed non-fragmented file. Returns once all the
+ * ranges are done, with 0 or the first error */
+int mp4_demux_track_process_ranges(
+	struct mp4_demux *demux,
+	struct mp4_track *track,
+	unsigned int range_count,
+	unsigned int thread_count,
+	int (*cb)(struct mp4_demux *demux, unsigned int range_index,
+		unsigned int sample_index,
+		const struct mp4_track_sample *sample, void *userdata),
+	void *userdata);
+
+
 int mp4_demux_get_track_avc_decoder_config(
 	struct mp4_demux *demux,
 	unsigned int track_id,
@@ -171,6 +623,100 @@ int mp4_demux_get_track_next_sample(
 	struct mp4_track_sample *track_sample);
 
 
+int mp4_demux_get_track_next_sample_view(
+	struct mp4_demux *demux,
+	unsigned int track_id,
+	struct mp4_track_sample *track_sample);
+
+
+/* read the next sample of any track in file offset order; linked
+ * metadata tracks are returned as separate samples and chapter tracks
+ * are skipped; track_id is set to 0 at the end of all tracks */
+int mp4_demux_get_next_sample(
+	struct mp4_demux *demux,
+	unsigned int *track_id,
+	uint8_t *sample_buffer,
+	unsigned int sample_buffer_size,
+	struct mp4_track_sample *track_sample);
+
+
+/* read up to max_samples consecutive samples; the payloads are packed
+ * in order in sample_buffer and metadata_buffer (either may be NULL to
+ * skip reading) and file-contiguous samples are read at once; returns
+ * the number of samples read, 0 at the end of the track, or a negative
+ * errno value on error */
+int mp4_demux_get_track_next_samples(
+	struct mp4_demux *demux,
+	unsigned int track_id,
+	uint8_t *sample_buffer,
+	size_t sample_buffer_size,
+	uint8_t *metadata_buffer,
+	size_t metadata_buffer_size,
+	struct mp4_track_sample *track_samples,
+	unsigned int max_samples);
+
+
+/* returns 1 if the sample is a sync sample, 0 if not, or a negative
+ * errno value on error */
+int mp4_demux_track_is_sync_sample(
+	struct mp4_demux *demux,
+	unsigned int track_id,
+	unsigned int sample_index);
+
+
+/* Copy the index of up to max_samples samples of a track starting at
+ * first_sample in one call: file offsets, sizes, decoding times in
+ * microseconds and sync flags (1 for sync samples); any array may be
+ * NULL to skip it. The track read position is not changed. Returns
+ * the number of samples copied, 0 past the last sample, or a negative
+ * errno value on error; for fragmented files only the samples of the
+ * currently loaded fragment are available */
+int mp4_demux_get_track_sample_index(
+	struct mp4_demux *demux,
+	unsigned int track_id,
+	unsigned int first_sample,
+	unsigned int max_samples,
+	uint64_t *offsets,
+	uint32_t *sizes,
+	uint64_t *dts,
+	uint8_t *sync);
+
+
+/* Create an independent read position on a track; readers share the
+ * parsed tables of the demuxer and use positional reads, so readers
+ * of the same demuxer can be used from different threads at once,
+ * and concurrently with the demuxer own sample functions. Requires a
+ * mapped or stdio-backed non-fragmented file; readers must be created
+ * and destroyed from the thread that owns the demuxer, and destroyed
+ * before it is closed */
+struct mp4_demux_reader *mp4_demux_reader_new(
+	struct mp4_demux *demux,
+	unsigned int track_id);
+
+
+int mp4_demux_reader_destroy(
+	struct mp4_demux_reader *reader);
+
+
+/* same as mp4_demux_seek() on the reader track only: -ENOENT is
+ * returned and the position is kept if the track has no sample to seek
+ * to */
+int mp4_demux_reader_seek(
+	struct mp4_demux_reader *reader,
+	uint64_t time_offset,
+	int sync);
+
+
+/* same as mp4_demux_get_track_next_sample() on the reader position */
+int mp4_demux_reader_get_next_sample(
+	struct mp4_demux_reader *reader,
+	uint8_t *sample_buffer,
+	unsigned int sample_buffer_size,
+	uint8_t *metadata_buffer,
+	unsigned int metadata_buffer_size,
+	struct mp4_track_sample *track_sample);
+
+
 int mp4_demux_get_chapters(
 	struct mp4_demux *demux,
 	unsigned int *chaptersCount,
@@ -193,6 +739,97 @@ int mp4_demux_get_metadata_cover(
 	enum mp4_metadata_cover_type *cover_type);
 
 
+struct mp4_mux;
+
+
+struct mp4_mux_config {
+	/* media creation and modification times in seconds since the
+	 * Unix epoch, 0 if unknown */
+	uint64_t creation_time;
+	uint64_t modification_time;
+	/* bytes reserved after the ftyp box for the moov box, 0 to write
+	 * it after the samples; if the moov box fits on close it is
+	 * written there for a fast-start layout without moving the
+	 * samples, otherwise the area is left as a free box. The moov box
+	 * takes about 2 KiB per track plus 4 bytes per sample, sync
+	 * sample and chunk */
+	size_t moov_reserve_size;
+	/* size in bytes of the sample write buffer, 0 for 1 MiB */
+	size_t write_buffer_size;
+};
+
+
+struct mp4_mux_sample {
+	const uint8_t *sample_data;
+	uint32_t sample_size;
+	/* sample of the linked metadata track, written with the same
+	 * decoding time; ignored if the track has no metadata */
+	const uint8_t *metadata_data;
+	uint32_t metadata_size;
+	/* decoding time in microseconds, non-decreasing within a track */
+	uint64_t sample_dts;
+	int sync;
+};
+
+
+struct mp4_mux *mp4_mux_open(
+	const char *filename,
+	const struct mp4_mux_config *config);
+
+
+/* Write the moov box and close the file; returns 0 or a negative
+ * errno value if the file could not be completed */
+int mp4_mux_close(
+	struct mp4_mux *mux);
+
+
+/* Add a track described as by mp4_demux_get_track_info(), with its
+ * media timescale; the id, duration and sample count are ignored.
+ * Only AVC video and metadata tracks are supported. For a video track
+ * with has_metadata set, a metadata track with the given content
+ * encoding and MIME format is also added with the next id and linked
+ * by a cdsc reference, its samples are given with the video samples.
+ * Tracks must be added before the first sample is written; returns
+ * the track id or a negative errno value */
+int mp4_mux_add_track(
+	struct mp4_mux *mux,
+	const struct mp4_track_info *track_info,
+	uint32_t timescale);
+
+
+int mp4_mux_set_track_avc_decoder_config(
+	struct mp4_mux *mux,
+	unsigned int track_id,
+	const uint8_t *sps,
+	unsigned int sps_size,
+	const uint8_t *pps,
+	unsigned int pps_size);
+
+
+/* Append a sample to the file; consecutive samples of a track are
+ * stored in the same chunk */
+int mp4_mux_write_track_sample(
+	struct mp4_mux *mux,
+	unsigned int track_id,
+	const struct mp4_mux_sample *sample);
+
+
+/* Copy the samples between start_time and end_time (microseconds,
+ * end excluded) to a new file without re-encoding: the start snaps to
+ * the previous sync sample of the first video track and the other
+ * tracks are cut at the same time, linked metadata keeping its
+ * pairing. Contiguous sample data is copied as byte ranges and only
+ * the sample tables are rewritten. Chapter and unsupported tracks are
+ * dropped; the times default to the source ones; use UINT64_MAX as
+ * end_time to cut up to the end */
+int mp4_demux_cut(
+	struct mp4_demux *demux,
+	uint64_t start_time,
+	uint64_t end_time,
+	const char *filename,
+	const struct mp4_mux_config *config);
+
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
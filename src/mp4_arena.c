@@ -0,0 +1,211 @@
+/**
+ * @file mp4_arena.c
+ * @brief MP4 file library - arena allocator implementation
+ * @date 14/10/2026
+ * @author aurelien.barre@akaaba.net
+ *
+ * Copyright (c) 2026 Aurelien Barre <aurelien.barre@akaaba.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *   * Neither the name of the copyright holder nor the names of the
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mp4_arena.h"
+#include "mp4_log.h"
+
+
+#define MP4_ARENA_ALIGN(_x) (((_x) + 7) & ~(size_t)7)
+
+
+struct mp4_arena_chunk {
+	struct mp4_arena_chunk *next;
+	size_t size;
+	size_t used;
+	/* followed by the chunk data, 8-byte aligned */
+};
+
+
+struct mp4_arena {
+	struct mp4_arena_chunk *current;
+	/* heap chunks; the caller buffer chunk is not in the list */
+	struct mp4_arena_chunk *chunks;
+	size_t chunkSize;
+	size_t used;
+	int inBuffer;
+};
+
+
+#define MP4_ARENA_CHUNK_HEADER \
+	MP4_ARENA_ALIGN(sizeof(struct mp4_arena_chunk))
+
+
+static struct mp4_arena_chunk *mp4_arena_add_chunk(
+	struct mp4_arena *arena,
+	size_t size)
+{
+	struct mp4_arena_chunk *chunk;
+
+	if (size < arena->chunkSize)
+		size = arena->chunkSize;
+	if (size > SIZE_MAX - MP4_ARENA_CHUNK_HEADER)
+		return NULL;
+
+	chunk = malloc(MP4_ARENA_CHUNK_HEADER + size);
+	if (chunk == NULL)
+		return NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->current = chunk;
+
+	return chunk;
+}
+
+
+struct mp4_arena *mp4_arena_new(
+	void *buffer,
+	size_t size,
+	size_t chunk_size)
+{
+	struct mp4_arena *arena;
+	size_t header = MP4_ARENA_ALIGN(sizeof(*arena)) +
+		MP4_ARENA_CHUNK_HEADER;
+
+	MP4_RETURN_VAL_IF_FAILED(chunk_size > 0, -EINVAL, NULL);
+
+	if (buffer) {
+		/* keep the arena state at the aligned start of the
+		 * caller buffer */
+		size_t pad = (8 - ((uintptr_t)buffer & 7)) & 7;
+		if (size >= pad + header) {
+			arena = (struct mp4_arena *)((uint8_t *)buffer + pad);
+			memset(arena, 0, sizeof(*arena));
+			arena->chunkSize = chunk_size;
+			arena->inBuffer = 1;
+			arena->current = (struct mp4_arena_chunk *)(
+				(uint8_t *)arena +
+				MP4_ARENA_ALIGN(sizeof(*arena)));
+			arena->current->next = NULL;
+			arena->current->size = (size - pad - header) &
+				~(size_t)7;
+			arena->current->used = 0;
+			return arena;
+		}
+	}
+
+	arena = calloc(1, sizeof(*arena));
+	MP4_RETURN_VAL_IF_FAILED(arena != NULL, -ENOMEM, NULL);
+	arena->chunkSize = chunk_size;
+
+	return arena;
+}
+
+
+void *mp4_arena_alloc(
+	struct mp4_arena *arena,
+	size_t size)
+{
+	struct mp4_arena_chunk *chunk;
+	void *ptr;
+
+	if ((arena == NULL) || (size > SIZE_MAX - 7))
+		return NULL;
+
+	size = MP4_ARENA_ALIGN(size);
+	chunk = arena->current;
+	if ((chunk == NULL) || (size > chunk->size - chunk->used)) {
+		/* large allocations get their own chunk so that the
+		 * current one keeps serving the small ones */
+		if ((chunk) && (size > arena->chunkSize / 2)) {
+			struct mp4_arena_chunk *current = arena->current;
+			chunk = mp4_arena_add_chunk(arena, size);
+			arena->current = current;
+		} else {
+			chunk = mp4_arena_add_chunk(arena, size);
+		}
+		if (chunk == NULL)
+			return NULL;
+	}
+
+	ptr = (uint8_t *)chunk + MP4_ARENA_CHUNK_HEADER + chunk->used;
+	chunk->used += size;
+	arena->used += size;
+
+	return ptr;
+}
+
+
+int mp4_arena_reserve(
+	struct mp4_arena *arena,
+	size_t size)
+{
+	struct mp4_arena_chunk *chunk;
+
+	MP4_RETURN_ERR_IF_FAILED(arena != NULL, -EINVAL);
+
+	chunk = arena->current;
+	if ((chunk) && (size <= chunk->size - chunk->used))
+		return 0;
+
+	chunk = mp4_arena_add_chunk(arena, size);
+	MP4_RETURN_ERR_IF_FAILED(chunk != NULL, -ENOMEM);
+
+	return 0;
+}
+
+
+size_t mp4_arena_get_used(
+	struct mp4_arena *arena)
+{
+	return (arena) ? arena->used : 0;
+}
+
+
+void mp4_arena_destroy(
+	struct mp4_arena *arena)
+{
+	struct mp4_arena_chunk *chunk, *next;
+
+	if (arena == NULL)
+		return;
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	if (!arena->inBuffer)
+		free(arena);
+}
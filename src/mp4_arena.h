@@ -0,0 +1,89 @@
+/**
+ * @file mp4_arena.h
+ * @brief MP4 file library - arena allocator
+ * @date 14/10/2026
+ * @author aurelien.barre@akaaba.net
+ *
+ * Copyright (c) 2026 Aurelien Barre <aurelien.barre@akaaba.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *   * Neither the name of the copyright holder nor the names of the
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MP4_ARENA_H_
+#define _MP4_ARENA_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+
+/* Bump allocator: allocations are never freed individually, all the
+ * memory is released at once by mp4_arena_destroy() */
+struct mp4_arena;
+
+
+/* Create an arena; if 'buffer' is not NULL the arena state and the
+ * first allocations are placed in it, and further allocations fall
+ * back to heap chunks of at least 'chunk_size' bytes */
+struct mp4_arena *mp4_arena_new(
+	void *buffer,
+	size_t size,
+	size_t chunk_size);
+
+
+/* Allocate 'size' bytes aligned on 8 bytes */
+void *mp4_arena_alloc(
+	struct mp4_arena *arena,
+	size_t size);
+
+
+/* Make sure the next allocations totalling 'size' bytes fit in a
+ * single chunk */
+int mp4_arena_reserve(
+	struct mp4_arena *arena,
+	size_t size);
+
+
+/* Bytes allocated from the arena */
+size_t mp4_arena_get_used(
+	struct mp4_arena *arena);
+
+
+void mp4_arena_destroy(
+	struct mp4_arena *arena);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_MP4_ARENA_H_ */
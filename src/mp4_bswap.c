@@ -0,0 +1,356 @@
+/**
+ * @file mp4_bswap.c
+ * @brief MP4 file library - big-endian array decoding
+ * @date 14/10/2026
+ * @author aurelien.barre@akaaba.net
+ *
+ * Copyright (c) 2026 Aurelien Barre <aurelien.barre@akaaba.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *   * Neither the name of the copyright holder nor the names of the
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "mp4_bswap.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define MP4_BSWAP_X86
+#  include <immintrin.h>
+#elif defined(__ARM_NEON)
+#  define MP4_BSWAP_NEON
+#  include <arm_neon.h>
+#endif
+
+
+static inline uint32_t mp4_be32_load(
+	const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+
+static inline uint64_t mp4_be64_load(
+	const uint8_t *p)
+{
+	return ((uint64_t)mp4_be32_load(p) << 32) |
+		(uint64_t)mp4_be32_load(p + 4);
+}
+
+
+#ifdef MP4_BSWAP_X86
+
+__attribute__((target("avx2")))
+static size_t mp4_be32_decode_avx2(
+	uint32_t *dst,
+	const uint8_t *src,
+	size_t count)
+{
+	const __m256i mask = _mm256_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		__m256i v = _mm256_loadu_si256(
+			(const __m256i *)(src + 4 * i));
+		_mm256_storeu_si256((__m256i *)(dst + i),
+			_mm256_shuffle_epi8(v, mask));
+	}
+
+	return i;
+}
+
+
+__attribute__((target("avx2")))
+static size_t mp4_be32_decode_u64_avx2(
+	uint64_t *dst,
+	const uint8_t *src,
+	size_t count)
+{
+	const __m128i mask = _mm_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+		_mm256_storeu_si256((__m256i *)(dst + i),
+			_mm256_cvtepu32_epi64(_mm_shuffle_epi8(v, mask)));
+	}
+
+	return i;
+}
+
+
+__attribute__((target("avx2")))
+static size_t mp4_be64_decode_avx2(
+	uint64_t *dst,
+	const uint8_t *src,
+	size_t count)
+{
+	const __m256i mask = _mm256_setr_epi8(
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		__m256i v = _mm256_loadu_si256(
+			(const __m256i *)(src + 8 * i));
+		_mm256_storeu_si256((__m256i *)(dst + i),
+			_mm256_shuffle_epi8(v, mask));
+	}
+
+	return i;
+}
+
+
+__attribute__((target("avx2")))
+static size_t mp4_u64_fill_step_avx2(
+	uint64_t *dst,
+	uint64_t base,
+	uint64_t delta,
+	size_t count)
+{
+	__m256i v = _mm256_setr_epi64x(base, base + delta,
+		base + 2 * delta, base + 3 * delta);
+	const __m256i step = _mm256_set1_epi64x(4 * delta);
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		_mm256_storeu_si256((__m256i *)(dst + i), v);
+		v = _mm256_add_epi64(v, step);
+	}
+
+	return i;
+}
+
+
+__attribute__((target("ssse3")))
+static size_t mp4_be32_decode_ssse3(
+	uint32_t *dst,
+	const uint8_t *src,
+	size_t count)
+{
+	const __m128i mask = _mm_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+		_mm_storeu_si128((__m128i *)(dst + i),
+			_mm_shuffle_epi8(v, mask));
+	}
+
+	return i;
+}
+
+
+__attribute__((target("ssse3")))
+static size_t mp4_be32_decode_u64_ssse3(
+	uint64_t *dst,
+	const uint8_t *src,
+	size_t count)
+{
+	const __m128i mask = _mm_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	const __m128i zero = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		__m128i v = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *)(src + 4 * i)), mask);
+		_mm_storeu_si128((__m128i *)(dst + i),
+			_mm_unpacklo_epi32(v, zero));
+		_mm_storeu_si128((__m128i *)(dst + i + 2),
+			_mm_unpackhi_epi32(v, zero));
+	}
+
+	return i;
+}
+
+
+__attribute__((target("ssse3")))
+static size_t mp4_be64_decode_ssse3(
+	uint64_t *dst,
+	const uint8_t *src,
+	size_t count)
+{
+	const __m128i mask = _mm_setr_epi8(
+		7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	size_t i;
+
+	for (i = 0; i + 2 <= count; i += 2) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 8 * i));
+		_mm_storeu_si128((__m128i *)(dst + i),
+			_mm_shuffle_epi8(v, mask));
+	}
+
+	return i;
+}
+
+
+#define MP4_BSWAP_HAS_AVX2() __builtin_cpu_supports("avx2")
+#define MP4_BSWAP_HAS_SSSE3() __builtin_cpu_supports("ssse3")
+
+#endif /* MP4_BSWAP_X86 */
+
+
+#ifdef MP4_BSWAP_NEON
+
+static size_t mp4_be32_decode_neon(
+	uint32_t *dst,
+	const uint8_t *src,
+	size_t count)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		uint8x16_t v = vld1q_u8(src + 4 * i);
+		vst1q_u32(dst + i, vreinterpretq_u32_u8(vrev32q_u8(v)));
+	}
+
+	return i;
+}
+
+
+static size_t mp4_be32_decode_u64_neon(
+	uint64_t *dst,
+	const uint8_t *src,
+	size_t count)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		uint32x4_t v = vreinterpretq_u32_u8(
+			vrev32q_u8(vld1q_u8(src + 4 * i)));
+		vst1q_u64(dst + i, vmovl_u32(vget_low_u32(v)));
+		vst1q_u64(dst + i + 2, vmovl_u32(vget_high_u32(v)));
+	}
+
+	return i;
+}
+
+
+static size_t mp4_be64_decode_neon(
+	uint64_t *dst,
+	const uint8_t *src,
+	size_t count)
+{
+	size_t i;
+
+	for (i = 0; i + 2 <= count; i += 2) {
+		uint8x16_t v = vld1q_u8(src + 8 * i);
+		vst1q_u64(dst + i, vreinterpretq_u64_u8(vrev64q_u8(v)));
+	}
+
+	return i;
+}
+
+#endif /* MP4_BSWAP_NEON */
+
+
+void mp4_be32_decode(
+	uint32_t *dst,
+	const uint8_t *src,
+	size_t count)
+{
+	size_t i = 0;
+
+#if defined(MP4_BSWAP_X86)
+	if (MP4_BSWAP_HAS_AVX2())
+		i = mp4_be32_decode_avx2(dst, src, count);
+	else if (MP4_BSWAP_HAS_SSSE3())
+		i = mp4_be32_decode_ssse3(dst, src, count);
+#elif defined(MP4_BSWAP_NEON)
+	i = mp4_be32_decode_neon(dst, src, count);
+#endif
+
+	for (; i < count; i++)
+		dst[i] = mp4_be32_load(src + 4 * i);
+}
+
+
+void mp4_be32_decode_u64(
+	uint64_t *dst,
+	const uint8_t *src,
+	size_t count)
+{
+	size_t i = 0;
+
+#if defined(MP4_BSWAP_X86)
+	if (MP4_BSWAP_HAS_AVX2())
+		i = mp4_be32_decode_u64_avx2(dst, src, count);
+	else if (MP4_BSWAP_HAS_SSSE3())
+		i = mp4_be32_decode_u64_ssse3(dst, src, count);
+#elif defined(MP4_BSWAP_NEON)
+	i = mp4_be32_decode_u64_neon(dst, src, count);
+#endif
+
+	for (; i < count; i++)
+		dst[i] = mp4_be32_load(src + 4 * i);
+}
+
+
+void mp4_be64_decode(
+	uint64_t *dst,
+	const uint8_t *src,
+	size_t count)
+{
+	size_t i = 0;
+
+#if defined(MP4_BSWAP_X86)
+	if (MP4_BSWAP_HAS_AVX2())
+		i = mp4_be64_decode_avx2(dst, src, count);
+	else if (MP4_BSWAP_HAS_SSSE3())
+		i = mp4_be64_decode_ssse3(dst, src, count);
+#elif defined(MP4_BSWAP_NEON)
+	i = mp4_be64_decode_neon(dst, src, count);
+#endif
+
+	for (; i < count; i++)
+		dst[i] = mp4_be64_load(src + 8 * i);
+}
+
+
+void mp4_u64_fill_step(
+	uint64_t *dst,
+	uint64_t base,
+	uint64_t delta,
+	size_t count)
+{
+	size_t i = 0;
+
+#if defined(MP4_BSWAP_X86)
+	if (MP4_BSWAP_HAS_AVX2())
+		i = mp4_u64_fill_step_avx2(dst, base, delta, count);
+#endif
+
+	/* no loop-carried dependency: left to the compiler vectorizer
+	 * where there is no kernel */
+	for (; i < count; i++)
+		dst[i] = base + i * delta;
+}
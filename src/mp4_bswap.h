@@ -0,0 +1,88 @@
+/**
+ * @file mp4_bswap.h
+ * @brief MP4 file library - big-endian array decoding
+ * @date 14/10/2026
+ * @author aurelien.barre@akaaba.net
+ *
+ * Copyright (c) 2026 Aurelien Barre <aurelien.barre@akaaba.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *   * Neither the name of the copyright holder nor the names of the
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MP4_BSWAP_H_
+#define _MP4_BSWAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+
+/* Sample table decoding kernels: vectorized where the CPU supports it
+ * (selected at runtime on x86), with a scalar fallback; 'src' needs no
+ * particular alignment */
+
+
+/* Decode 'count' big-endian 32-bit values */
+void mp4_be32_decode(
+	uint32_t *dst,
+	const uint8_t *src,
+	size_t count);
+
+
+/* Decode 'count' big-endian 32-bit values widened to 64 bits */
+void mp4_be32_decode_u64(
+	uint64_t *dst,
+	const uint8_t *src,
+	size_t count);
+
+
+/* Decode 'count' big-endian 64-bit values */
+void mp4_be64_decode(
+	uint64_t *dst,
+	const uint8_t *src,
+	size_t count);
+
+
+/* Fill 'dst' with the 'count' values base + i * delta */
+void mp4_u64_fill_step(
+	uint64_t *dst,
+	uint64_t base,
+	uint64_t delta,
+	size_t count);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* !_MP4_BSWAP_H_ */
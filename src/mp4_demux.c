@@ -44,62 +44,48 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <errno.h>
+#include <math.h>
 
 #ifdef _WIN32
 #  include <winsock2.h>
 #else /* !_WIN32 */
 #  include <arpa/inet.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <pthread.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
 #endif /* !_WIN32 */
 
+#ifdef BUILD_LIBURING
+#  include <liburing.h>
+#endif /* BUILD_LIBURING */
+
 #include <libmp4.h>
 
+#include "mp4_priv.h"
 #include "mp4_log.h"
+#include "mp4_arena.h"
+#include "mp4_bswap.h"
+
 
+#define MP4_TFHD_BASE_DATA_OFFSET_PRESENT   (0x000001)
+#define MP4_TFHD_SAMPLE_DESC_INDEX_PRESENT  (0x000002)
+#define MP4_TFHD_DEFAULT_DURATION_PRESENT   (0x000008)
+#define MP4_TFHD_DEFAULT_SIZE_PRESENT       (0x000010)
+#define MP4_TFHD_DEFAULT_FLAGS_PRESENT      (0x000020)
+#define MP4_TFHD_DEFAULT_BASE_IS_MOOF       (0x020000)
 
-#define MP4_UUID                            0x75756964 /* "uuid" */
-#define MP4_FILE_TYPE_BOX                   0x66747970 /* "ftyp" */
-#define MP4_MOVIE_BOX                       0x6d6f6f76 /* "moov" */
-#define MP4_USER_DATA_BOX                   0x75647461 /* "udta" */
-#define MP4_MOVIE_HEADER_BOX                0x6d766864 /* "mvhd" */
-#define MP4_TRACK_BOX                       0x7472616b /* "trak" */
-#define MP4_TRACK_HEADER_BOX                0x746b6864 /* "tkhd" */
-#define MP4_TRACK_REFERENCE_BOX             0x74726566 /* "tref" */
-#define MP4_MEDIA_BOX                       0x6d646961 /* "mdia" */
-#define MP4_MEDIA_HEADER_BOX                0x6d646864 /* "mdhd" */
-#define MP4_HANDLER_REFERENCE_BOX           0x68646c72 /* "hdlr" */
-#define MP4_MEDIA_INFORMATION_BOX           0x6d696e66 /* "minf" */
-#define MP4_VIDEO_MEDIA_HEADER_BOX          0x766d6864 /* "vmhd" */
-#define MP4_SOUND_MEDIA_HEADER_BOX          0x736d6864 /* "smhd" */
-#define MP4_HINT_MEDIA_HEADER_BOX           0x686d6864 /* "hmhd" */
-#define MP4_NULL_MEDIA_HEADER_BOX           0x6e6d6864 /* "nmhd" */
-#define MP4_DATA_INFORMATION_BOX            0x64696e66 /* "dinf" */
-#define MP4_DATA_REFERENCE_BOX              0x64696566 /* "dref" */ /*TODO*/
-#define MP4_SAMPLE_TABLE_BOX                0x7374626c /* "stbl" */
-#define MP4_SAMPLE_DESCRIPTION_BOX          0x73747364 /* "stsd" */
-#define MP4_AVC_DECODER_CONFIG_BOX          0x61766343 /* "avcC" */
-#define MP4_DECODING_TIME_TO_SAMPLE_BOX     0x73747473 /* "stts" */
-#define MP4_SYNC_SAMPLE_BOX                 0x73747373 /* "stss" */
-#define MP4_SAMPLE_SIZE_BOX                 0x7374737a /* "stsz" */
-#define MP4_SAMPLE_TO_CHUNK_BOX             0x73747363 /* "stsc" */
-#define MP4_CHUNK_OFFSET_BOX                0x7374636f /* "stco" */
-#define MP4_CHUNK_OFFSET_64_BOX             0x636f3634 /* "co64" */
-#define MP4_META_BOX                        0x6d657461 /* "meta" */
-#define MP4_KEYS_BOX                        0x6b657973 /* "keys" */
-#define MP4_ILST_BOX                        0x696c7374 /* "ilst" */
-#define MP4_DATA_BOX                        0x64617461 /* "data" */
-#define MP4_LOCATION_BOX                    0xa978797a /* ".xyz" */
-
-#define MP4_HANDLER_TYPE_VIDEO              0x76696465 /* "vide" */
-#define MP4_HANDLER_TYPE_AUDIO              0x736f756e /* "soun" */
-#define MP4_HANDLER_TYPE_HINT               0x68696e74 /* "hint" */
-#define MP4_HANDLER_TYPE_METADATA           0x6d657461 /* "meta" */
-#define MP4_HANDLER_TYPE_TEXT               0x74657874 /* "text" */
-
-#define MP4_REFERENCE_TYPE_HINT             0x68696e74 /* "hint" */
-#define MP4_REFERENCE_TYPE_DESCRIPTION      0x63647363 /* "cdsc" */
-#define MP4_REFERENCE_TYPE_HINT_USED        0x68696e64 /* "hind" */
-#define MP4_REFERENCE_TYPE_CHAPTERS         0x63686170 /* "chap" */
+#define MP4_TRUN_DATA_OFFSET_PRESENT        (0x000001)
+#define MP4_TRUN_FIRST_FLAGS_PRESENT        (0x000004)
+#define MP4_TRUN_DURATION_PRESENT           (0x000100)
+#define MP4_TRUN_SIZE_PRESENT               (0x000200)
+#define MP4_TRUN_FLAGS_PRESENT              (0x000400)
+#define MP4_TRUN_CTO_PRESENT                (0x000800)
+
+#define MP4_SAMPLE_FLAG_NON_SYNC            (0x00010000)
 
 #define MP4_METADATA_CLASS_UTF8             (1)
 #define MP4_METADATA_CLASS_JPEG             (13)
@@ -119,10 +105,26 @@
 
 #define MP4_METADATA_KEY_COVER              "com.apple.quicktime.artwork"
 
-#define MP4_MAC_TO_UNIX_EPOCH_OFFSET (0x7c25b080UL)
-
 #define MP4_CHAPTERS_MAX (100)
 
+#define MP4_DEMUX_ARENA_CHUNK_SIZE (64 * 1024)
+
+#define MP4_DEMUX_IO_WINDOW_COUNT (3)
+#define MP4_DEMUX_IO_WINDOW_MAX_SIZE (16 * 1024 * 1024)
+
+/* the shared reads may run on several threads at once */
+#define MP4_DEMUX_STAT_ADD(_demux, _field, _val) \
+	__atomic_fetch_add(&(_demux)->stats._field, (_val), \
+		__ATOMIC_RELAXED)
+#define MP4_DEMUX_STAT_GET(_demux, _field) \
+	__atomic_load_n(&(_demux)->stats._field, __ATOMIC_RELAXED)
+#define MP4_DEMUX_TAIL_PROBE_SIZE (64 * 1024)
+#define MP4_DEMUX_CUT_BUFFER_SIZE (1024 * 1024)
+#define MP4_DEMUX_PREFETCH_DEPTH (8)
+
+/* multiplicative hash for the track id map */
+#define MP4_DEMUX_TRACK_HASH(_id) ((uint32_t)(_id) * 2654435761U)
+
 
 struct mp4_box {
 	uint32_t size;
@@ -142,6 +144,13 @@ struct mp4_box_item {
 };
 
 
+struct mp4_box_reader {
+	const uint8_t *data;
+	off_t size;
+	off_t offset;
+};
+
+
 struct mp4_time_to_sample_entry {
 	uint32_t sampleCount;
 	uint32_t sampleDelta;
@@ -155,6 +164,34 @@ struct mp4_sample_to_chunk_entry {
 };
 
 
+/* Position cache used in compact mode to resolve sample offsets and
+ * decoding times from the run-length sample tables; sequential and
+ * forward accesses only walk the tables from the cached position */
+struct mp4_sample_cursor {
+	uint32_t sttsEntry;
+	uint32_t sttsFirstSample;
+	uint64_t sttsFirstDts;
+	uint32_t stscEntry;
+	uint32_t chunk;
+	uint32_t chunkFirstSample;
+	uint32_t sample;
+	uint64_t sampleOffset;
+};
+
+
+/* Per-sample tables of a track, either those of the moov or those of
+ * the current movie fragment; see mp4_demux_fragment_swap() */
+struct mp4_sample_tables {
+	uint32_t sampleCount;
+	uint32_t *sampleSize;
+	uint64_t *sampleDecodingTime;
+	uint64_t *sampleOffset;
+	uint32_t syncSampleEntryCount;
+	uint32_t *syncSampleEntries;
+	uint8_t *syncSampleBits;
+};
+
+
 struct mp4_track {
 	uint32_t id;
 	enum mp4_track_type type;
@@ -165,6 +202,7 @@ struct mp4_track {
 	uint32_t currentSample;
 	uint32_t sampleCount;
 	uint32_t *sampleSize;
+	uint32_t constantSampleSize;
 	uint64_t *sampleDecodingTime;
 	uint64_t *sampleOffset;
 	uint32_t chunkCount;
@@ -175,8 +213,27 @@ struct mp4_track {
 	struct mp4_sample_to_chunk_entry *sampleToChunkEntries;
 	uint32_t syncSampleEntryCount;
 	uint32_t *syncSampleEntries;
+	uint8_t *syncSampleBits;
 	uint32_t referenceType;
 	uint32_t referenceTrackId;
+	struct mp4_sample_cursor cursor;
+	int sampleTablesBuilt;
+	/* the sample tables point into a loaded index */
+	int sampleTablesInIndex;
+
+	/* fragmented file: the sample tables hold the samples of the moov
+	 * (fragment 0) or of the current movie fragment, the other set is
+	 * kept in 'inactiveTables' */
+	int fragmented;
+	int fragmentLoaded;
+	struct mp4_sample_tables inactiveTables;
+	uint32_t defaultSampleDuration;
+	uint32_t defaultSampleSize;
+	uint32_t defaultSampleFlags;
+	off_t fragmentNextOffset;
+	uint64_t fragmentFirstDts;
+	uint64_t fragmentNextDts;
+	uint32_t fragmentSampleCapacity;
 
 	enum mp4_video_codec videoCodec;
 	uint32_t videoWidth;
@@ -203,21 +260,65 @@ struct mp4_track {
 };
 
 
+/* File range held in memory while parsing with custom I/O, so that
+ * the reads inside it need no backend round trip */
+struct mp4_io_window {
+	uint8_t *data;
+	off_t offset;
+	off_t size;
+};
+
+
 struct mp4_demux {
+	struct mp4_demux_config config;
 	FILE *file;
+	const uint8_t *map;
+	off_t mapOffset;
+	int mapOwned;
+	struct mp4_io_callbacks io;
+	void *ioOpaque;
+	off_t ioOffset;
+	/* actual backend position, the backend is only seeked before
+	 * a read; -1 if unknown */
+	off_t ioBackendOffset;
+	struct mp4_io_window ioWindow[MP4_DEMUX_IO_WINDOW_COUNT];
+	unsigned int ioWindowCount;
 	off_t fileSize;
+	int64_t fileMtime;
 	off_t readBytes;
+	uint8_t *boxBuffer;
+	size_t boxBufferSize;
+	/* the box buffer belongs to a probe worker */
+	int boxBufferBorrowed;
+	uint8_t *readahead;
+	off_t readaheadOffset;
+	size_t readaheadSize;
 	struct mp4_box_item root;
 	struct mp4_track *track;
 	unsigned int trackCount;
+	/* tracks in list order and open addressing id map, built once
+	 * the track list is complete */
+	struct mp4_track **trackArray;
+	struct mp4_track **trackMap;
+	uint32_t trackMapMask;
 	uint32_t timescale;
 	uint64_t duration;
 	uint64_t creationTime;
 	uint64_t modificationTime;
+	int fragmented;
+	off_t firstFragmentOffset;
+	/* follow mode: end of the top-level boxes parsed so far */
+	off_t parsedOffset;
+	int loaded;
+	const uint8_t *indexMap;
+	size_t indexMapSize;
+	struct mp4_arena *arena;
+	unsigned int readerCount;
 
 	char *chaptersName[MP4_CHAPTERS_MAX];
 	uint64_t chaptersTime[MP4_CHAPTERS_MAX];
 	unsigned int chaptersCount;
+	int chaptersBuilt;
 	unsigned int finalMetadataCount;
 	char **finalMetadataKey;
 	char **finalMetadataValue;
@@ -241,43 +342,108 @@ struct mp4_demux {
 	unsigned int metaMetadataCount;
 	char **metaMetadataKey;
 	char **metaMetadataValue;
+
+	/* instrumentation counters, see MP4_DEMUX_STAT_ADD() */
+	struct mp4_demux_stats stats;
+	/* bytes charged to config.max_memory */
+	size_t memoryUsed;
+};
+
+
+struct mp4_demux_reader {
+	struct mp4_demux *demux;
+	struct mp4_track *track;
+	uint32_t currentSample;
+	/* compact mode cursors, private to the reader */
+	struct mp4_sample_cursor cursor;
+	struct mp4_sample_cursor metadataCursor;
 };
 
 
-#define MP4_READ_32(_file, _val32, _readBytes) \
+/* Box payload readers: fields are decoded from the in-memory box payload,
+ * bounds are checked against the payload size instead of relying on
+ * a file read error */
+#define MP4_READ_32(_box, _val32, _readBytes) \
 	do { \
-		size_t _count = fread(&_val32, sizeof(uint32_t), 1, _file); \
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((_count == 1), -EIO, \
-			"failed to read %zu bytes from file", \
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED( \
+			((_readBytes) + (off_t)sizeof(uint32_t) <= \
+			(_box)->size), -EIO, \
+			"failed to read %zu bytes from box", \
+			sizeof(uint32_t)); \
+		memcpy(&_val32, (_box)->data + (_readBytes), \
 			sizeof(uint32_t)); \
 		_readBytes += sizeof(uint32_t); \
 	} while (0)
 
-#define MP4_READ_16(_file, _val16, _readBytes) \
+#define MP4_READ_16(_box, _val16, _readBytes) \
 	do { \
-		size_t _count = fread(&_val16, sizeof(uint16_t), 1, _file); \
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((_count == 1), -EIO, \
-			"failed to read %zu bytes from file", \
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED( \
+			((_readBytes) + (off_t)sizeof(uint16_t) <= \
+			(_box)->size), -EIO, \
+			"failed to read %zu bytes from box", \
+			sizeof(uint16_t)); \
+		memcpy(&_val16, (_box)->data + (_readBytes), \
 			sizeof(uint16_t)); \
 		_readBytes += sizeof(uint16_t); \
 	} while (0)
 
-#define MP4_READ_8(_file, _val8, _readBytes) \
+#define MP4_READ_8(_box, _val8, _readBytes) \
 	do { \
-		size_t _count = fread(&_val8, sizeof(uint8_t), 1, _file); \
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((_count == 1), -EIO, \
-			"failed to read %zu bytes from file", \
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED( \
+			((_readBytes) + (off_t)sizeof(uint8_t) <= \
+			(_box)->size), -EIO, \
+			"failed to read %zu bytes from box", \
+			sizeof(uint8_t)); \
+		memcpy(&_val8, (_box)->data + (_readBytes), \
 			sizeof(uint8_t)); \
 		_readBytes += sizeof(uint8_t); \
 	} while (0)
 
-#define MP4_SKIP(_file, _readBytes, _maxBytes) \
+#define MP4_READ_BYTES(_box, _ptr, _size, _readBytes) \
+	do { \
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED( \
+			((_readBytes) + (off_t)(_size) <= (_box)->size), \
+			-EIO, "failed to read %zu bytes from box", \
+			(size_t)(_size)); \
+		memcpy(_ptr, (_box)->data + (_readBytes), _size); \
+		_readBytes += (_size); \
+	} while (0)
+
+#define MP4_SKIP(_box, _readBytes, _maxBytes) \
+	do { \
+		if (_readBytes < _maxBytes) \
+			_readBytes = _maxBytes; \
+	} while (0)
+
+/* File readers: only used to walk the box headers, box payloads are
+ * loaded at once using mp4_demux_load_box() */
+#define MP4_IO_READ_32(_demux, _val32, _readBytes) \
+	do { \
+		int _err = mp4_demux_io_read(_demux, &_val32, \
+			sizeof(uint32_t)); \
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((_err == 0), _err, \
+			"failed to read %zu bytes from file", \
+			sizeof(uint32_t)); \
+		_readBytes += sizeof(uint32_t); \
+	} while (0)
+
+#define MP4_IO_READ_16(_demux, _val16, _readBytes) \
+	do { \
+		int _err = mp4_demux_io_read(_demux, &_val16, \
+			sizeof(uint16_t)); \
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((_err == 0), _err, \
+			"failed to read %zu bytes from file", \
+			sizeof(uint16_t)); \
+		_readBytes += sizeof(uint16_t); \
+	} while (0)
+
+#define MP4_IO_SKIP(_demux, _readBytes, _maxBytes) \
 	do { \
 		if (_readBytes < _maxBytes) { \
-			int _ret = fseeko(_file, \
-				_maxBytes - _readBytes, SEEK_CUR); \
+			int _err = mp4_demux_io_skip(_demux, \
+				_maxBytes - _readBytes); \
 			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED( \
-				_ret == 0, -errno, \
+				_err == 0, _err, \
 				"failed to seek %ld bytes forward in file", \
 				_maxBytes - _readBytes); \
 			_readBytes = _maxBytes; \
@@ -285,3009 +451,8780 @@ struct mp4_demux {
 	} while (0)
 
 
-static off_t mp4_demux_parse_children(
-	struct mp4_demux *demux,
-	struct mp4_box_item *parent,
-	off_t maxBytes,
-	struct mp4_track *track);
+static inline uint32_t mp4_demux_be32(
+	const uint8_t *buf)
+{
+	return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+		((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+}
 
 
-static int mp4_demux_is_sync_sample(
-	struct mp4_demux *demux,
-	struct mp4_track *track,
-	unsigned int sampleIdx,
-	int *prevSyncSampleIdx)
+static inline uint64_t mp4_demux_be64(
+	const uint8_t *buf)
 {
-	unsigned int i;
+	return ((uint64_t)mp4_demux_be32(buf) << 32) |
+		(uint64_t)mp4_demux_be32(buf + 4);
+}
 
-	if (!track->syncSampleEntries)
-		return 1;
 
-	for (i = 0; i < track->syncSampleEntryCount; i++) {
-		if (track->syncSampleEntries[i] - 1 == sampleIdx)
-			return 1;
-		else if (track->syncSampleEntries[i] - 1 > sampleIdx) {
-			if ((prevSyncSampleIdx) && (i > 0)) {
-				*prevSyncSampleIdx =
-					track->syncSampleEntries[i - 1] - 1;
-			}
-			return 0;
-		}
-	}
+/* Charge an allocation to the configured memory budget; the lifetime
+ * data is not freed with its size so it is charged cumulatively, the
+ * scratch buffers are refunded when released. The range and prefetch
+ * workers charge their buffers concurrently */
+static int mp4_demux_charge_memory(
+	struct mp4_demux *demux,
+	size_t size)
+{
+	size_t max = demux->config.max_memory;
+	size_t used = __atomic_load_n(&demux->memoryUsed, __ATOMIC_RELAXED);
+
+	do {
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+			((max == 0) || (size <= max - used)), -ENOMEM,
+			"memory budget exceeded: %zu + %zu bytes, max %zu",
+			used, size, max);
+	} while (!__atomic_compare_exchange_n(&demux->memoryUsed, &used,
+		used + size, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-	if ((prevSyncSampleIdx) && (i > 0))
-		*prevSyncSampleIdx = track->syncSampleEntries[i - 1] - 1;
 	return 0;
 }
 
 
-static off_t mp4_demux_parse_ftyp(
+static void mp4_demux_release_memory(
 	struct mp4_demux *demux,
-	struct mp4_box_item *parent,
-	off_t maxBytes)
+	size_t size)
 {
-	off_t boxReadBytes = 0;
-	uint32_t val32;
+	__atomic_fetch_sub(&demux->memoryUsed, size, __ATOMIC_RELAXED);
+}
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 8);
 
-	/* major_brand */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t majorBrand = ntohl(val32);
-	MP4_LOGD("# ftyp: major_brand=%c%c%c%c",
-		(char)((majorBrand >> 24) & 0xFF),
-		(char)((majorBrand >> 16) & 0xFF),
-		(char)((majorBrand >> 8) & 0xFF),
-		(char)(majorBrand & 0xFF));
+/* Grow a scratch buffer (box buffer, I/O windows, readahead and sample
+ * buffers), charging the growth while it is allocated */
+static void *mp4_demux_scratch_realloc(
+	struct mp4_demux *demux,
+	void *ptr,
+	size_t oldSize,
+	size_t size)
+{
+	void *newPtr;
+
+	if (size <= oldSize)
+		return ptr;
+	if (mp4_demux_charge_memory(demux, size - oldSize) < 0)
+		return NULL;
+	newPtr = realloc(ptr, size);
+	if (newPtr == NULL)
+		mp4_demux_release_memory(demux, size - oldSize);
+	return newPtr;
+}
 
-	/* minor_version */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t minorVersion = ntohl(val32);
-	MP4_LOGD("# ftyp: minor_version=%" PRIu32, minorVersion);
 
-	int k = 0;
-	while (boxReadBytes + 4 <= maxBytes) {
-		/* compatible_brands[] */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		uint32_t compatibleBrands = ntohl(val32);
-		MP4_LOGD("# ftyp: compatible_brands[%d]=%c%c%c%c", k,
-			(char)((compatibleBrands >> 24) & 0xFF),
-			(char)((compatibleBrands >> 16) & 0xFF),
-			(char)((compatibleBrands >> 8) & 0xFF),
-			(char)(compatibleBrands & 0xFF));
-		k++;
-	}
+static void mp4_demux_scratch_free(
+	struct mp4_demux *demux,
+	void *ptr,
+	size_t size)
+{
+	free(ptr);
+	mp4_demux_release_memory(demux, size);
+}
 
-	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
 
-	return boxReadBytes;
+/* Allocators for the demuxer lifetime data (boxes, tracks, tables and
+ * strings): with an arena allocations are never freed individually */
+static void *mp4_demux_malloc(
+	struct mp4_demux *demux,
+	size_t size)
+{
+	if (mp4_demux_charge_memory(demux, size) < 0)
+		return NULL;
+	if (demux->arena)
+		return mp4_arena_alloc(demux->arena, size);
+	return malloc(size);
 }
 
 
-static off_t mp4_demux_parse_mvhd(
+/* Allocate 'count' table entries of 'size' bytes, NULL on overflow */
+static void *mp4_demux_malloc_array(
 	struct mp4_demux *demux,
-	struct mp4_box_item *parent,
-	off_t maxBytes)
+	size_t count,
+	size_t size)
 {
-	off_t boxReadBytes = 0;
-	uint32_t val32;
+	if ((size != 0) && (count > SIZE_MAX / size))
+		return NULL;
+	return mp4_demux_malloc(demux, count * size);
+}
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 25 * 4), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 25 * 4);
 
-	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t flags = ntohl(val32);
-	uint8_t version = (flags >> 24) & 0xFF;
-	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# mvhd: version=%d", version);
-	MP4_LOGD("# mvhd: flags=%" PRIu32, flags);
+static void *mp4_demux_calloc(
+	struct mp4_demux *demux,
+	size_t count,
+	size_t size)
+{
+	void *ptr;
+
+	if ((size != 0) && (count > SIZE_MAX / size))
+		return NULL;
+	if (mp4_demux_charge_memory(demux, count * size) < 0)
+		return NULL;
+	if (!demux->arena)
+		return calloc(count, size);
+	ptr = mp4_arena_alloc(demux->arena, count * size);
+	if (ptr)
+		memset(ptr, 0, count * size);
+	return ptr;
+}
 
-	if (version == 1) {
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 28 * 4),
-			-EINVAL, "invalid size: %ld expected %d min",
-			maxBytes, 28 * 4);
 
-		/* creation_time */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		demux->creationTime = (uint64_t)ntohl(val32) << 32;
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		demux->creationTime |=
-			(uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
-		MP4_LOGD("# mvhd: creation_time=%" PRIu64,
-			demux->creationTime);
+static void *mp4_demux_realloc(
+	struct mp4_demux *demux,
+	void *ptr,
+	size_t oldSize,
+	size_t size)
+{
+	void *newPtr;
+
+	if ((size > oldSize) &&
+		(mp4_demux_charge_memory(demux, size - oldSize) < 0))
+		return NULL;
+	if (!demux->arena)
+		return realloc(ptr, size);
+	if (size <= oldSize)
+		return ptr;
+	newPtr = mp4_arena_alloc(demux->arena, size);
+	if ((newPtr) && (ptr))
+		memcpy(newPtr, ptr, oldSize);
+	return newPtr;
+}
 
-		/* modification_time */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		demux->modificationTime = (uint64_t)ntohl(val32) << 32;
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		demux->modificationTime |=
-			(uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
-		MP4_LOGD("# mvhd: modification_time=%" PRIu64,
-			demux->modificationTime);
 
-		/* timescale */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		demux->timescale = ntohl(val32);
-		MP4_LOGD("# mvhd: timescale=%" PRIu32, demux->timescale);
+static char *mp4_demux_strdup(
+	struct mp4_demux *demux,
+	const char *str)
+{
+	size_t len;
+	char *dup;
+
+	len = strlen(str) + 1;
+	if (mp4_demux_charge_memory(demux, len) < 0)
+		return NULL;
+	if (!demux->arena)
+		return strdup(str);
+	dup = mp4_arena_alloc(demux->arena, len);
+	if (dup)
+		memcpy(dup, str, len);
+	return dup;
+}
 
-		/* duration */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		demux->duration = (uint64_t)ntohl(val32) << 32;
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		demux->duration |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
-		unsigned int hrs = (unsigned int)(
-			(demux->duration + demux->timescale / 2) /
-			demux->timescale / 60 / 60);
-		unsigned int min = (unsigned int)(
-			(demux->duration + demux->timescale / 2) /
-			demux->timescale / 60 - hrs * 60);
-		unsigned int sec = (unsigned int)(
-			(demux->duration + demux->timescale / 2) /
-			demux->timescale - hrs * 60 * 60 - min * 60);
-		MP4_LOGD("# mvhd: duration=%" PRIu64 " (%02d:%02d:%02d)",
-			demux->duration, hrs, min, sec);
-	} else {
-		/* creation_time */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		demux->creationTime = ntohl(val32);
-		MP4_LOGD("# mvhd: creation_time=%" PRIu64,
-			demux->creationTime);
 
-		/* modification_time */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		demux->modificationTime = ntohl(val32);
-		MP4_LOGD("# mvhd: modification_time=%" PRIu64,
-			demux->modificationTime);
+static void mp4_demux_free(
+	struct mp4_demux *demux,
+	void *ptr)
+{
+	if (!demux->arena)
+		free(ptr);
+}
 
-		/* timescale */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		demux->timescale = ntohl(val32);
-		MP4_LOGD("# mvhd: timescale=%" PRIu32, demux->timescale);
 
-		/* duration */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		demux->duration = ntohl(val32);
-		unsigned int hrs = (unsigned int)(
-			(demux->duration + demux->timescale / 2) /
-			demux->timescale / 60 / 60);
-		unsigned int min = (unsigned int)(
-			(demux->duration + demux->timescale / 2) /
-			demux->timescale / 60 - hrs * 60);
-		unsigned int sec = (unsigned int)(
-			(demux->duration + demux->timescale / 2) /
-			demux->timescale - hrs * 60 * 60 - min * 60);
-		MP4_LOGD("# mvhd: duration=%" PRIu64 " (%02d:%02d:%02d)",
-			demux->duration, hrs, min, sec);
+/* Memory holding the file range of 'size' bytes at 'offset' if it is
+ * inside an I/O window, NULL otherwise */
+static const uint8_t *mp4_demux_io_window_get(
+	struct mp4_demux *demux,
+	off_t offset,
+	size_t size)
+{
+	unsigned int i;
+
+	for (i = 0; i < demux->ioWindowCount; i++) {
+		struct mp4_io_window *w = &demux->ioWindow[i];
+		if ((offset >= w->offset) && (offset - w->offset <= w->size) &&
+			(size <= (size_t)(w->size - (offset - w->offset))))
+			return w->data + (offset - w->offset);
 	}
 
-	/* rate */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	float rate = (float)ntohl(val32) / 65536.;
-	MP4_LOGD("# mvhd: rate=%.4f", rate);
+	return NULL;
+}
 
-	/* volume & reserved */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	float volume = (float)((ntohl(val32) >> 16) & 0xFFFF) / 256.;
-	MP4_LOGD("# mvhd: volume=%.2f", volume);
 
-	/* reserved */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	MP4_READ_32(demux->file, val32, boxReadBytes);
+static void mp4_demux_io_window_clear(
+	struct mp4_demux *demux)
+{
+	unsigned int i;
 
-	/* matrix */
-	int k;
-	for (k = 0; k < 9; k++)
-		MP4_READ_32(demux->file, val32, boxReadBytes);
+	for (i = 0; i < demux->ioWindowCount; i++) {
+		mp4_demux_scratch_free(demux, demux->ioWindow[i].data,
+			demux->ioWindow[i].size);
+	}
+	memset(demux->ioWindow, 0, sizeof(demux->ioWindow));
+	demux->ioWindowCount = 0;
+}
 
-	/* pre_defined */
-	for (k = 0; k < 6; k++)
-		MP4_READ_32(demux->file, val32, boxReadBytes);
 
-	/* next_track_ID */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t next_track_ID = ntohl(val32);
-	MP4_LOGD("# mvhd: next_track_ID=%" PRIu32, next_track_ID);
+static int mp4_demux_io_read(
+	struct mp4_demux *demux,
+	void *buf,
+	size_t size)
+{
+	if (demux->map) {
+		if ((off_t)size > demux->fileSize - demux->mapOffset)
+			return -EIO;
+		memcpy(buf, demux->map + demux->mapOffset, size);
+		demux->mapOffset += size;
+		MP4_DEMUX_STAT_ADD(demux, bytes_read, size);
+		return 0;
+	}
 
-	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+	if (demux->io.read) {
+		const uint8_t *w = mp4_demux_io_window_get(demux,
+			demux->ioOffset, size);
+		if (w) {
+			memcpy(buf, w, size);
+			demux->ioOffset += size;
+			return 0;
+		}
+		if (demux->ioBackendOffset != demux->ioOffset) {
+			int ret = demux->io.seek(demux->ioOpaque,
+				demux->ioOffset);
+			MP4_DEMUX_STAT_ADD(demux, seek_count, 1);
+			if (ret < 0)
+				return ret;
+			demux->ioBackendOffset = demux->ioOffset;
+		}
+		uint8_t *p = buf;
+		while (size > 0) {
+			int64_t ret = demux->io.read(demux->ioOpaque, p, size);
+			MP4_DEMUX_STAT_ADD(demux, read_count, 1);
+			if (ret < 0) {
+				demux->ioBackendOffset = -1;
+				return (int)ret;
+			}
+			if ((ret == 0) || ((uint64_t)ret > size)) {
+				demux->ioBackendOffset = -1;
+				return -EIO;
+			}
+			p += ret;
+			size -= ret;
+			demux->ioOffset += ret;
+			demux->ioBackendOffset += ret;
+			MP4_DEMUX_STAT_ADD(demux, bytes_read, ret);
+		}
+		return 0;
+	}
 
-	return boxReadBytes;
+	size_t count = fread(buf, size, 1, demux->file);
+	MP4_DEMUX_STAT_ADD(demux, read_count, 1);
+	if (count != 1)
+		return -EIO;
+	MP4_DEMUX_STAT_ADD(demux, bytes_read, size);
+	return 0;
 }
 
 
-static off_t mp4_demux_parse_tkhd(
+static int mp4_demux_io_seek(
 	struct mp4_demux *demux,
-	struct mp4_box_item *parent,
-	off_t maxBytes,
-	struct mp4_track *track)
-{
-	off_t boxReadBytes = 0;
-	uint32_t val32;
+	off_t offset);
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
-		"invalid track");
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 21 * 4), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 21 * 4);
+static int mp4_demux_io_skip(
+	struct mp4_demux *demux,
+	off_t size)
+{
+	if (demux->map) {
+		if (size > demux->fileSize - demux->mapOffset)
+			return -EIO;
+		demux->mapOffset += size;
+		return 0;
+	}
 
-	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t flags = ntohl(val32);
-	uint8_t version = (flags >> 24) & 0xFF;
-	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# tkhd: version=%d", version);
-	MP4_LOGD("# tkhd: flags=%" PRIu32, flags);
+	if (demux->io.read)
+		return mp4_demux_io_seek(demux, demux->ioOffset + size);
 
-	if (version == 1) {
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 24 * 4),
-			-EINVAL, "invalid size: %ld expected %d min",
-			maxBytes, 24 * 4);
+	int ret = fseeko(demux->file, size, SEEK_CUR);
+	MP4_DEMUX_STAT_ADD(demux, seek_count, 1);
+	return (ret == 0) ? 0 : -errno;
+}
 
-		/* creation_time */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		uint64_t creationTime = (uint64_t)ntohl(val32) << 32;
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		creationTime |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
-		MP4_LOGD("# tkhd: creation_time=%" PRIu64,
-			creationTime);
 
-		/* modification_time */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		uint64_t modificationTime = (uint64_t)ntohl(val32) << 32;
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		modificationTime |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
-		MP4_LOGD("# tkhd: modification_time=%" PRIu64,
-			modificationTime);
+static int mp4_demux_io_seek(
+	struct mp4_demux *demux,
+	off_t offset)
+{
+	if (demux->map) {
+		if ((offset < 0) || (offset > demux->fileSize))
+			return -EINVAL;
+		demux->mapOffset = offset;
+		return 0;
+	}
 
-		/* track_ID */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->id = ntohl(val32);
-		MP4_LOGD("# tkhd: track_ID=%" PRIu32, track->id);
+	if (demux->io.read) {
+		if (offset < 0)
+			return -EINVAL;
+		/* avoid round trips to the backend: consecutive seeks and
+		 * seeks into an I/O window cost nothing */
+		demux->ioOffset = offset;
+		return 0;
+	}
 
-		/* reserved */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
+	int ret = fseeko(demux->file, offset, SEEK_SET);
+	MP4_DEMUX_STAT_ADD(demux, seek_count, 1);
+	return (ret == 0) ? 0 : -errno;
+}
 
-		/* duration */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		uint64_t duration = (uint64_t)ntohl(val32) << 32;
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		duration |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
-		unsigned int hrs = (unsigned int)(
-			(duration + demux->timescale / 2) /
-			demux->timescale / 60 / 60);
-		unsigned int min = (unsigned int)(
-			(duration + demux->timescale / 2) /
-			demux->timescale / 60 - hrs * 60);
-		unsigned int sec = (unsigned int)(
-			(duration + demux->timescale / 2) /
-			demux->timescale - hrs * 60 * 60 - min * 60);
-		MP4_LOGD("# tkhd: duration=%" PRIu64 " (%02d:%02d:%02d)",
-			duration, hrs, min, sec);
-	} else {
-		/* creation_time */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		uint32_t creationTime = ntohl(val32);
-		MP4_LOGD("# tkhd: creation_time=%" PRIu32,
-			creationTime);
 
-		/* modification_time */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		uint32_t modificationTime = ntohl(val32);
-		MP4_LOGD("# tkhd: modification_time=%" PRIu32,
-			modificationTime);
+static off_t mp4_demux_io_tell(
+	struct mp4_demux *demux)
+{
+	if (demux->map)
+		return demux->mapOffset;
+	if (demux->io.read)
+		return demux->ioOffset;
 
-		/* track_ID */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->id = ntohl(val32);
-		MP4_LOGD("# tkhd: track_ID=%" PRIu32, track->id);
+	return ftello(demux->file);
+}
 
-		/* reserved */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
 
-		/* duration */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		uint32_t duration = ntohl(val32);
-		unsigned int hrs = (unsigned int)(
-			(duration + demux->timescale / 2) /
-			demux->timescale / 60 / 60);
-		unsigned int min = (unsigned int)(
-			(duration + demux->timescale / 2) /
-			demux->timescale / 60 - hrs * 60);
-		unsigned int sec = (unsigned int)(
-			(duration + demux->timescale / 2) /
-			demux->timescale - hrs * 60 * 60 - min * 60);
-		MP4_LOGD("# tkhd: duration=%" PRIu32 " (%02d:%02d:%02d)",
-			duration, hrs, min, sec);
-	}
+static int mp4_demux_io_eof(
+	struct mp4_demux *demux)
+{
+	if (demux->map)
+		return (demux->mapOffset >= demux->fileSize);
+	if (demux->io.read)
+		return (demux->ioOffset >= demux->fileSize);
 
-	/* reserved */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	MP4_READ_32(demux->file, val32, boxReadBytes);
+	return feof(demux->file);
+}
 
-	/* layer & alternate_group */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	int16_t layer = (int16_t)(ntohl(val32) >> 16);
-	int16_t alternateGroup = (int16_t)(ntohl(val32) & 0xFFFF);
-	MP4_LOGD("# tkhd: layer=%i", layer);
-	MP4_LOGD("# tkhd: alternate_group=%i", alternateGroup);
 
-	/* volume & reserved */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	float volume = (float)((ntohl(val32) >> 16) & 0xFFFF) / 256.;
-	MP4_LOGD("# tkhd: volume=%.2f", volume);
+/* Read 'size' bytes at absolute offset 'offset' */
+static int mp4_demux_io_pread(
+	struct mp4_demux *demux,
+	off_t offset,
+	void *buf,
+	size_t size)
+{
+	if (demux->map) {
+		if ((offset < 0) || (offset > demux->fileSize) ||
+			((off_t)size > demux->fileSize - offset))
+			return -EIO;
+		memcpy(buf, demux->map + offset, size);
+		MP4_DEMUX_STAT_ADD(demux, bytes_read, size);
+		return 0;
+	}
 
-	/* matrix */
-	int k;
-	for (k = 0; k < 9; k++)
-		MP4_READ_32(demux->file, val32, boxReadBytes);
+	if (demux->io.read) {
+		int ret = mp4_demux_io_seek(demux, offset);
+		if (ret < 0)
+			return ret;
+		return mp4_demux_io_read(demux, buf, size);
+	}
 
-	/* width */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	float width = (float)ntohl(val32) / 65536.;
-	MP4_LOGD("# tkhd: width=%.2f", width);
+	int ret = fseeko(demux->file, offset, SEEK_SET);
+	MP4_DEMUX_STAT_ADD(demux, seek_count, 1);
+	if (ret != 0)
+		return -errno;
+	return mp4_demux_io_read(demux, buf, size);
+}
 
-	/* height */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	float height = (float)ntohl(val32) / 65536.;
-	MP4_LOGD("# tkhd: height=%.2f", height);
 
-	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+/* With custom I/O, read the file range of 'size' bytes at 'offset' in
+ * one backend read and keep it in memory until the end of the parsing;
+ * the current position is left unchanged. Failing to allocate the
+ * window is not an error, the range is then read piecewise */
+static int mp4_demux_io_window_load(
+	struct mp4_demux *demux,
+	off_t offset,
+	off_t size)
+{
+	struct mp4_io_window *w;
+	off_t pos = demux->ioOffset;
+
+	if ((demux->map) || (!demux->io.read) || (size <= 0) ||
+		(size > MP4_DEMUX_IO_WINDOW_MAX_SIZE) ||
+		(demux->ioWindowCount >= MP4_DEMUX_IO_WINDOW_COUNT) ||
+		(mp4_demux_io_window_get(demux, offset, size)))
+		return 0;
+
+	w = &demux->ioWindow[demux->ioWindowCount];
+	w->data = mp4_demux_scratch_realloc(demux, NULL, 0, size);
+	if (w->data == NULL)
+		return 0;
+	demux->ioOffset = offset;
+	int ret = mp4_demux_io_read(demux, w->data, size);
+	demux->ioOffset = pos;
+	if (ret < 0) {
+		mp4_demux_scratch_free(demux, w->data, size);
+		w->data = NULL;
+		return ret;
+	}
+	w->offset = offset;
+	w->size = size;
+	demux->ioWindowCount++;
 
-	return boxReadBytes;
+	return 0;
 }
 
 
-static off_t mp4_demux_parse_tref(
+/* Read sample data at absolute offset 'offset' through the readahead
+ * window if enabled: a miss loads readahead_size bytes from 'offset'
+ * in one read, which usually covers the rest of the chunk and the
+ * interleaved samples of the other tracks */
+static int mp4_demux_io_pread_sample(
 	struct mp4_demux *demux,
-	struct mp4_box_item *parent,
-	off_t maxBytes,
-	struct mp4_track *track)
+	off_t offset,
+	void *buf,
+	size_t size)
 {
-	off_t boxReadBytes = 0;
-	uint32_t val32;
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
-		"invalid track");
+	size_t capacity = demux->config.readahead_size;
+
+	if (size == 0)
+		return 0;
+	if ((demux->map) || (capacity == 0) || (size > capacity))
+		return mp4_demux_io_pread(demux, offset, buf, size);
+
+	if ((offset < demux->readaheadOffset) ||
+		(offset - demux->readaheadOffset >
+		(off_t)demux->readaheadSize) ||
+		(size > demux->readaheadSize -
+		(size_t)(offset - demux->readaheadOffset))) {
+		if (demux->readahead == NULL) {
+			demux->readahead = mp4_demux_scratch_realloc(demux,
+				NULL, 0, capacity);
+			MP4_RETURN_ERR_IF_FAILED((demux->readahead != NULL),
+				-ENOMEM);
+		}
+		if ((offset < 0) || (offset > demux->fileSize))
+			return -EIO;
+		size_t fill = capacity;
+		if ((off_t)fill > demux->fileSize - offset)
+			fill = demux->fileSize - offset;
+		if (size > fill)
+			return -EIO;
+		demux->readaheadSize = 0;
+		int ret = mp4_demux_io_pread(demux, offset,
+			demux->readahead, fill);
+		MP4_DEMUX_STAT_ADD(demux, sample_cache_misses, 1);
+		if (ret < 0)
+			return ret;
+		demux->readaheadOffset = offset;
+		demux->readaheadSize = fill;
+	} else {
+		MP4_DEMUX_STAT_ADD(demux, sample_cache_hits, 1);
+	}
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 3 * 4), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 3 * 4);
+	memcpy(buf, demux->readahead + (offset - demux->readaheadOffset),
+		size);
 
-	/* reference type size */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t referenceTypeSize = ntohl(val32);
-	MP4_LOGD("# tref: reference_type_size=%" PRIu32, referenceTypeSize);
+	return 0;
+}
 
-	/* reference type */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	track->referenceType = ntohl(val32);
-	MP4_LOGD("# tref: reference_type=%c%c%c%c",
-		(char)((track->referenceType >> 24) & 0xFF),
-		(char)((track->referenceType >> 16) & 0xFF),
-		(char)((track->referenceType >> 8) & 0xFF),
-		(char)(track->referenceType & 0xFF));
 
-	/* track IDs */
-	/* NB: only read the first track ID, ignore multiple references */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	track->referenceTrackId = ntohl(val32);
-	MP4_LOGD("# tref: track_id=%" PRIu32, track->referenceTrackId);
+/* Read 'size' bytes at absolute offset 'offset' without touching the
+ * demuxer I/O state, so that it can be called from several threads at
+ * once; only mapped files and stdio files support it */
+static int mp4_demux_io_pread_shared(
+	struct mp4_demux *demux,
+	off_t offset,
+	void *buf,
+	size_t size)
+{
+	if (demux->map) {
+		if ((offset < 0) || (offset > demux->fileSize) ||
+			((off_t)size > demux->fileSize - offset))
+			return -EIO;
+		memcpy(buf, demux->map + offset, size);
+		MP4_DEMUX_STAT_ADD(demux, bytes_read, size);
+		return 0;
+	}
 
-	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+#ifdef _WIN32
+	return -ENOSYS;
+#else /* !_WIN32 */
+	if (demux->file == NULL)
+		return -EOPNOTSUPP;
+
+	int fd = fileno(demux->file);
+	uint8_t *p = buf;
+	while (size > 0) {
+		ssize_t ret = pread(fd, p, size, offset);
+		MP4_DEMUX_STAT_ADD(demux, read_count, 1);
+		if ((ret < 0) && (errno == EINTR))
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			return -EIO;
+		MP4_DEMUX_STAT_ADD(demux, bytes_read, ret);
+		p += ret;
+		size -= ret;
+		offset += ret;
+	}
 
-	return boxReadBytes;
+	return 0;
+#endif /* !_WIN32 */
 }
 
 
-static off_t mp4_demux_parse_mdhd(
+/* Random access read for the sample index accessors: a shared read
+ * when the backend supports it, so that the demuxer own read position
+ * and readahead window are untouched, a plain read otherwise */
+static int mp4_demux_io_pread_random(
 	struct mp4_demux *demux,
-	struct mp4_box_item *parent,
-	off_t maxBytes,
-	struct mp4_track *track)
+	off_t offset,
+	void *buf,
+	size_t size)
 {
-	off_t boxReadBytes = 0;
-	uint32_t val32;
+#ifndef _WIN32
+	if ((demux->map) || (demux->file))
+		return mp4_demux_io_pread_shared(demux, offset, buf, size);
+#endif /* !_WIN32 */
+	return mp4_demux_io_pread(demux, offset, buf, size);
+}
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
-		"invalid track");
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 6 * 4), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 6 * 4);
+/* Contiguous file range pending a single read into a buffer */
+struct mp4_read_run {
+	uint64_t offset;
+	size_t bufOffset;
+	size_t size;
+};
 
-	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t flags = ntohl(val32);
-	uint8_t version = (flags >> 24) & 0xFF;
-	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# mdhd: version=%d", version);
-	MP4_LOGD("# mdhd: flags=%" PRIu32, flags);
 
-	if (version == 1) {
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 9 * 4),
-			-EINVAL, "invalid size: %ld expected %d min",
-			maxBytes, 9 * 4);
+static int mp4_demux_read_run_flush(
+	struct mp4_demux *demux,
+	struct mp4_read_run *run,
+	uint8_t *buf)
+{
+	int ret = 0;
 
-		/* creation_time */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->creationTime = (uint64_t)ntohl(val32) << 32;
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->creationTime |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
-		MP4_LOGD("# mdhd: creation_time=%" PRIu64,
-			track->creationTime);
+	if (run->size > 0) {
+		ret = mp4_demux_io_pread_sample(demux, run->offset,
+			buf + run->bufOffset, run->size);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to read %zu bytes from file", run->size);
+	}
+	run->bufOffset += run->size;
+	run->size = 0;
 
-		/* modification_time */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->modificationTime = (uint64_t)ntohl(val32) << 32;
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->modificationTime |=
-			(uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
-		MP4_LOGD("# mdhd: modification_time=%" PRIu64,
-			track->modificationTime);
+	return ret;
+}
 
-		/* timescale */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->timescale = ntohl(val32);
-		MP4_LOGD("# mdhd: timescale=%" PRIu32, track->timescale);
 
-		/* duration */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->duration = (uint64_t)ntohl(val32) << 32;
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->duration |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
-		unsigned int hrs = (unsigned int)(
-			(track->duration + track->timescale / 2) /
-			track->timescale / 60 / 60);
-		unsigned int min = (unsigned int)(
-			(track->duration + track->timescale / 2) /
-			track->timescale / 60 - hrs * 60);
-		unsigned int sec = (unsigned int)(
-			(track->duration + track->timescale / 2) /
-			track->timescale - hrs * 60 * 60 - min * 60);
-		MP4_LOGD("# mdhd: duration=%" PRIu64 " (%02d:%02d:%02d)",
-			track->duration, hrs, min, sec);
-	} else {
-		/* creation_time */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->creationTime = ntohl(val32);
-		MP4_LOGD("# mdhd: creation_time=%" PRIu64,
-			track->creationTime);
+/* Append the range at 'offset' to the pending run, reading the run
+ * first if the new range does not directly follow it in the file */
+static int mp4_demux_read_run_add(
+	struct mp4_demux *demux,
+	struct mp4_read_run *run,
+	uint8_t *buf,
+	uint64_t offset,
+	size_t size)
+{
+	if ((run->size > 0) && (offset != run->offset + run->size)) {
+		int ret = mp4_demux_read_run_flush(demux, run, buf);
+		if (ret < 0)
+			return ret;
+	}
+	if (run->size == 0)
+		run->offset = offset;
+	run->size += size;
 
-		/* modification_time */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->modificationTime = ntohl(val32);
-		MP4_LOGD("# mdhd: modification_time=%" PRIu64,
-			track->modificationTime);
+	return 0;
+}
 
-		/* timescale */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->timescale = ntohl(val32);
-		MP4_LOGD("# mdhd: timescale=%" PRIu32, track->timescale);
 
-		/* duration */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->duration = (uint64_t)ntohl(val32);
-		unsigned int hrs = (unsigned int)(
-			(track->duration + track->timescale / 2) /
-			track->timescale / 60 / 60);
-		unsigned int min = (unsigned int)(
-			(track->duration + track->timescale / 2) /
-			track->timescale / 60 - hrs * 60);
-		unsigned int sec = (unsigned int)(
-			(track->duration + track->timescale / 2) /
-			track->timescale - hrs * 60 * 60 - min * 60);
-		MP4_LOGD("# mdhd: duration=%" PRIu64 " (%02d:%02d:%02d)",
-			track->duration, hrs, min, sec);
+/* Read a whole box payload of 'size' bytes at the current file position
+ * in a single read; the returned reader is valid until the next call.
+ * When the file is mapped the reader points directly into the mapping */
+static int mp4_demux_load_box(
+	struct mp4_demux *demux,
+	struct mp4_box_reader *box,
+	off_t size)
+{
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((size >= 0), -EINVAL,
+		"invalid size: %ld", size);
+
+	if (demux->map) {
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+			(size <= demux->fileSize - demux->mapOffset), -EIO,
+			"failed to read %ld bytes from file", size);
+		box->offset = demux->mapOffset;
+		box->size = size;
+		box->data = demux->map + demux->mapOffset;
+		demux->mapOffset += size;
+		MP4_DEMUX_STAT_ADD(demux, bytes_read, size);
+		return 0;
 	}
 
-	/* language & pre_defined */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint16_t language = (uint16_t)(ntohl(val32) >> 16) & 0x7FFF;
-	MP4_LOGD("# mdhd: language=%" PRIu16, language);
+	if (demux->ioWindowCount > 0) {
+		const uint8_t *w = mp4_demux_io_window_get(demux,
+			demux->ioOffset, size);
+		if (w) {
+			box->offset = demux->ioOffset;
+			box->size = size;
+			box->data = w;
+			demux->ioOffset += size;
+			return 0;
+		}
+	}
 
-	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+	if ((size_t)size > demux->boxBufferSize) {
+		uint8_t *buf = mp4_demux_scratch_realloc(demux,
+			demux->boxBuffer, demux->boxBufferSize, size);
+		MP4_RETURN_ERR_IF_FAILED((buf != NULL), -ENOMEM);
+		demux->boxBuffer = buf;
+		demux->boxBufferSize = size;
+	}
 
-	return boxReadBytes;
+	box->offset = mp4_demux_io_tell(demux);
+	box->size = size;
+	box->data = demux->boxBuffer;
+
+	if (size > 0) {
+		int ret = mp4_demux_io_read(demux, demux->boxBuffer, size);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to read %ld bytes from file", size);
+	}
+
+	return 0;
 }
 
 
-static off_t mp4_demux_parse_vmhd(
+static off_t mp4_demux_parse_children(
 	struct mp4_demux *demux,
 	struct mp4_box_item *parent,
 	off_t maxBytes,
-	struct mp4_track *track)
-{
-	off_t boxReadBytes = 0;
-	uint32_t val32;
-	uint16_t val16;
+	struct mp4_track *track);
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 3 * 4), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 3 * 4);
 
-	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t flags = ntohl(val32);
-	uint8_t version = (flags >> 24) & 0xFF;
-	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# vmhd: version=%d", version);
-	MP4_LOGD("# vmhd: flags=%" PRIu32, flags);
+static int mp4_demux_is_sync_sample(
+	struct mp4_demux *demux,
+	struct mp4_track *track,
+	unsigned int sampleIdx,
+	int *prevSyncSampleIdx)
+{
+	uint32_t lo = 0, hi = track->syncSampleEntryCount;
 
-	/* graphicsmode */
-	MP4_READ_16(demux->file, val16, boxReadBytes);
-	uint16_t graphicsmode = ntohs(val16);
-	MP4_LOGD("# vmhd: graphicsmode=%" PRIu16, graphicsmode);
+	if (!track->syncSampleEntries)
+		return 1;
 
-	/* opcolor */
-	uint16_t opcolor[3];
-	MP4_READ_16(demux->file, val16, boxReadBytes);
-	opcolor[0] = ntohs(val16);
-	MP4_READ_16(demux->file, val16, boxReadBytes);
-	opcolor[1] = ntohs(val16);
-	MP4_READ_16(demux->file, val16, boxReadBytes);
-	opcolor[2] = ntohs(val16);
-	MP4_LOGD("# vmhd: opcolor=(%" PRIu16 ",%" PRIu16 ",%" PRIu16 ")",
-		opcolor[0], opcolor[1], opcolor[2]);
+	if ((track->syncSampleBits) && (sampleIdx < track->sampleCount) &&
+		(track->syncSampleBits[sampleIdx >> 3] &
+		(1 << (sampleIdx & 7))))
+		return 1;
 
-	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+	/* find the first sync sample entry after sampleIdx; the entries
+	 * are 1-based sample numbers in increasing order */
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (track->syncSampleEntries[mid] - 1 <= sampleIdx)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	return boxReadBytes;
+	if ((lo > 0) && (track->syncSampleEntries[lo - 1] - 1 == sampleIdx))
+		return 1;
+
+	if ((prevSyncSampleIdx) && (lo > 0))
+		*prevSyncSampleIdx = track->syncSampleEntries[lo - 1] - 1;
+	return 0;
 }
 
 
-static off_t mp4_demux_parse_smhd(
-	struct mp4_demux *demux,
-	struct mp4_box_item *parent,
-	off_t maxBytes,
-	struct mp4_track *track)
+/* Find the first sync sample at or after sampleIdx; returns
+ * track->sampleCount if there is none */
+static uint32_t mp4_demux_next_sync_sample(
+	struct mp4_track *track,
+	uint32_t sampleIdx)
 {
-	off_t boxReadBytes = 0;
-	uint32_t val32;
+	uint32_t lo = 0, hi = track->syncSampleEntryCount;
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 2 * 4), -EINVAL,
-			"invalid size: %ld expected %d min", maxBytes, 2 * 4);
+	if (!track->syncSampleEntries)
+		return sampleIdx;
 
-	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t flags = ntohl(val32);
-	uint8_t version = (flags >> 24) & 0xFF;
-	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# smhd: version=%d", version);
-	MP4_LOGD("# smhd: flags=%" PRIu32, flags);
+	/* the entries are 1-based sample numbers in increasing order */
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (track->syncSampleEntries[mid] <= sampleIdx)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	/* balance & reserved */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	float balance = (float)(
-		(int16_t)((ntohl(val32) >> 16) & 0xFFFF)) / 256.;
-	MP4_LOGD("# smhd: balance=%.2f", balance);
+	if ((lo < track->syncSampleEntryCount) &&
+		(track->syncSampleEntries[lo] - 1 < track->sampleCount))
+		return track->syncSampleEntries[lo] - 1;
+	return track->sampleCount;
+}
 
-	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
 
-	return boxReadBytes;
+static void mp4_demux_sample_cursor_reset(
+	struct mp4_track *track,
+	struct mp4_sample_cursor *cursor)
+{
+	memset(cursor, 0, sizeof(*cursor));
+	if (track->sampleToChunkEntryCount > 0)
+		cursor->chunk = track->sampleToChunkEntries[0].firstChunk - 1;
+	if (cursor->chunk < track->chunkCount)
+		cursor->sampleOffset = track->chunkOffset[cursor->chunk];
 }
 
 
-static off_t mp4_demux_parse_hmhd(
-	struct mp4_demux *demux,
-	struct mp4_box_item *parent,
-	off_t maxBytes,
-	struct mp4_track *track)
+/* The sample accessors below expect sampleIdx < track->sampleCount */
+static uint32_t mp4_demux_sample_size(
+	struct mp4_track *track,
+	uint32_t sampleIdx)
 {
-	off_t boxReadBytes = 0;
-	uint32_t val32;
+	if (track->sampleSize)
+		return track->sampleSize[sampleIdx];
+	else
+		return track->constantSampleSize;
+}
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 5 * 4), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 5 * 4);
 
-	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t flags = ntohl(val32);
-	uint8_t version = (flags >> 24) & 0xFF;
-	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# hmhd: version=%d", version);
-	MP4_LOGD("# hmhd: flags=%" PRIu32, flags);
+static uint64_t mp4_demux_sample_offset(
+	struct mp4_track *track,
+	struct mp4_sample_cursor *cursor,
+	uint32_t sampleIdx)
+{
+	const struct mp4_sample_to_chunk_entry *entries =
+		track->sampleToChunkEntries;
+	uint32_t entryCount = track->sampleToChunkEntryCount;
+
+	if (track->sampleOffset)
+		return track->sampleOffset[sampleIdx];
+
+	if (sampleIdx < cursor->chunkFirstSample)
+		mp4_demux_sample_cursor_reset(track, cursor);
+
+	/* find the chunk, skipping whole runs of identical chunks */
+	while (cursor->stscEntry < entryCount) {
+		uint32_t spc = entries[cursor->stscEntry].samplesPerChunk;
+		uint32_t endChunk = (cursor->stscEntry + 1 < entryCount) ?
+			entries[cursor->stscEntry + 1].firstChunk - 1 :
+			track->chunkCount;
+		uint64_t runSamples =
+			(uint64_t)(endChunk - cursor->chunk) * spc;
+		if (sampleIdx < cursor->chunkFirstSample + runSamples) {
+			uint32_t k =
+				(sampleIdx - cursor->chunkFirstSample) / spc;
+			if (k > 0) {
+				cursor->chunk += k;
+				cursor->chunkFirstSample += k * spc;
+				cursor->sample = cursor->chunkFirstSample;
+				cursor->sampleOffset =
+					track->chunkOffset[cursor->chunk];
+			}
+			break;
+		}
+		cursor->chunkFirstSample += runSamples;
+		cursor->chunk = endChunk;
+		cursor->stscEntry++;
+		cursor->sample = cursor->chunkFirstSample;
+		if (cursor->chunk < track->chunkCount) {
+			cursor->sampleOffset =
+				track->chunkOffset[cursor->chunk];
+		}
+	}
 
-	/* maxPDUsize & avgPDUsize */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint16_t maxPDUsize = (uint16_t)((ntohl(val32) >> 16) & 0xFFFF);
-	uint16_t avgPDUsize = (uint16_t)(ntohl(val32) & 0xFFFF);
-	MP4_LOGD("# hmhd: maxPDUsize=%" PRIu16, maxPDUsize);
-	MP4_LOGD("# hmhd: avgPDUsize=%" PRIu16, avgPDUsize);
+	if (track->sampleSize == NULL) {
+		return track->chunkOffset[cursor->chunk] +
+			(uint64_t)(sampleIdx - cursor->chunkFirstSample) *
+			track->constantSampleSize;
+	}
 
-	/* maxbitrate */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t maxbitrate = ntohl(val32);
-	MP4_LOGD("# hmhd: maxbitrate=%" PRIu32, maxbitrate);
+	if (sampleIdx < cursor->sample) {
+		cursor->sample = cursor->chunkFirstSample;
+		cursor->sampleOffset = track->chunkOffset[cursor->chunk];
+	}
+	while (cursor->sample < sampleIdx) {
+		cursor->sampleOffset += track->sampleSize[cursor->sample];
+		cursor->sample++;
+	}
 
-	/* avgbitrate */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t avgbitrate = ntohl(val32);
-	MP4_LOGD("# hmhd: avgbitrate=%" PRIu32, avgbitrate);
+	return cursor->sampleOffset;
+}
 
-	/* reserved */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
 
-	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+static uint64_t mp4_demux_sample_dts(
+	struct mp4_track *track,
+	struct mp4_sample_cursor *cursor,
+	uint32_t sampleIdx)
+{
+	const struct mp4_time_to_sample_entry *entries =
+		track->timeToSampleEntries;
 
-	return boxReadBytes;
+	if (track->sampleDecodingTime)
+		return track->sampleDecodingTime[sampleIdx];
+
+	if (sampleIdx < cursor->sttsFirstSample) {
+		cursor->sttsEntry = 0;
+		cursor->sttsFirstSample = 0;
+		cursor->sttsFirstDts = 0;
+	}
+
+	while (cursor->sttsEntry < track->timeToSampleEntryCount) {
+		uint32_t count = entries[cursor->sttsEntry].sampleCount;
+		uint32_t delta = entries[cursor->sttsEntry].sampleDelta;
+		uint32_t n = sampleIdx - cursor->sttsFirstSample;
+		if (n < count)
+			return cursor->sttsFirstDts + (uint64_t)n * delta;
+		cursor->sttsFirstSample += count;
+		cursor->sttsFirstDts += (uint64_t)count * delta;
+		cursor->sttsEntry++;
+	}
+
+	return cursor->sttsFirstDts;
 }
 
 
-static off_t mp4_demux_parse_nmhd(
-	struct mp4_demux *demux,
-	struct mp4_box_item *parent,
-	off_t maxBytes,
-	struct mp4_track *track)
+/* Find the first sample with a decoding time greater than or equal to
+ * 'dts'; returns track->sampleCount if there is none */
+static uint32_t mp4_demux_sample_lower_bound(
+	struct mp4_track *track,
+	uint64_t dts)
 {
-	off_t boxReadBytes = 0;
-	uint32_t val32;
+	uint32_t i, firstSample = 0;
+	uint64_t firstDts = 0;
+
+	if (track->sampleDecodingTime) {
+		uint32_t lo = 0, hi = track->sampleCount;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (track->sampleDecodingTime[mid] < dts)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo;
+	}
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 4), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 4);
+	/* compact mode: walk the time to sample runs */
+	for (i = 0; i < track->timeToSampleEntryCount; i++) {
+		uint32_t count = track->timeToSampleEntries[i].sampleCount;
+		uint32_t delta = track->timeToSampleEntries[i].sampleDelta;
+		if ((count > 0) && (firstDts >= dts))
+			return firstSample;
+		if ((count > 0) && (delta > 0) &&
+			(firstDts + (uint64_t)(count - 1) * delta >= dts))
+			return firstSample + (uint32_t)(
+				(dts - firstDts + delta - 1) / delta);
+		firstSample += count;
+		firstDts += (uint64_t)count * delta;
+	}
 
-	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t flags = ntohl(val32);
-	uint8_t version = (flags >> 24) & 0xFF;
-	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# nmhd: version=%d", version);
-	MP4_LOGD("# nmhd: flags=%" PRIu32, flags);
+	return track->sampleCount;
+}
 
-	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
 
-	return boxReadBytes;
+/* Fill the sample and next sample decoding times in microseconds */
+static void mp4_demux_sample_times(
+	struct mp4_track *track,
+	struct mp4_sample_cursor *cursor,
+	uint32_t sampleIdx,
+	struct mp4_track_sample *trackSample)
+{
+	trackSample->sample_dts =
+		(mp4_demux_sample_dts(track, cursor, sampleIdx) *
+		1000000 + track->timescale / 2) / track->timescale;
+	if (sampleIdx < track->sampleCount - 1) {
+		trackSample->next_sample_dts = (mp4_demux_sample_dts(track,
+			cursor, sampleIdx + 1) * 1000000 +
+			track->timescale / 2) / track->timescale;
+	} else if (track->fragmented) {
+		/* the next sample is in the next fragment */
+		trackSample->next_sample_dts = (track->fragmentNextDts *
+			1000000 + track->timescale / 2) / track->timescale;
+	} else {
+		trackSample->next_sample_dts = 0;
+	}
 }
 
 
-static off_t mp4_demux_parse_hdlr(
+static off_t mp4_demux_parse_ftyp(
 	struct mp4_demux *demux,
 	struct mp4_box_item *parent,
-	off_t maxBytes,
-	struct mp4_track *track)
+	struct mp4_box_reader *box)
 {
+	off_t maxBytes = box->size;
 	off_t boxReadBytes = 0;
 	uint32_t val32;
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 6 * 4), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 6 * 4);
-
-	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t flags = ntohl(val32);
-	uint8_t version = (flags >> 24) & 0xFF;
-	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# hdlr: version=%d", version);
-	MP4_LOGD("# hdlr: flags=%" PRIu32, flags);
-
-	/* pre_defined */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-
-	/* handler_type */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t handlerType = ntohl(val32);
-	MP4_LOGD("# hdlr: handler_type=%c%c%c%c",
-		(char)((handlerType >> 24) & 0xFF),
-		(char)((handlerType >> 16) & 0xFF),
-		(char)((handlerType >> 8) & 0xFF),
-		(char)(handlerType & 0xFF));
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 8);
 
-	if ((track) && (parent) && (parent->parent) &&
-		(parent->parent->box.type == MP4_MEDIA_BOX)) {
-		switch (handlerType) {
-		case MP4_HANDLER_TYPE_VIDEO:
-			track->type = MP4_TRACK_TYPE_VIDEO;
-			break;
-		case MP4_HANDLER_TYPE_AUDIO:
-			track->type = MP4_TRACK_TYPE_AUDIO;
-			break;
-		case MP4_HANDLER_TYPE_HINT:
-			track->type = MP4_TRACK_TYPE_HINT;
-			break;
-		case MP4_HANDLER_TYPE_METADATA:
-			track->type = MP4_TRACK_TYPE_METADATA;
-			break;
-		case MP4_HANDLER_TYPE_TEXT:
-			track->type = MP4_TRACK_TYPE_TEXT;
-			break;
-		default:
-			track->type = MP4_TRACK_TYPE_UNKNOWN;
-			break;
-		}
-	}
+	/* major_brand */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t majorBrand = ntohl(val32);
+	MP4_LOGD("# ftyp: major_brand=%c%c%c%c",
+		(char)((majorBrand >> 24) & 0xFF),
+		(char)((majorBrand >> 16) & 0xFF),
+		(char)((majorBrand >> 8) & 0xFF),
+		(char)(majorBrand & 0xFF));
 
-	/* reserved */
-	unsigned int k;
-	for (k = 0; k < 3; k++)
-		MP4_READ_32(demux->file, val32, boxReadBytes);
+	/* minor_version */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t minorVersion = ntohl(val32);
+	MP4_LOGD("# ftyp: minor_version=%" PRIu32, minorVersion);
 
-	char name[100];
-	for (k = 0; (k < sizeof(name) - 1) && (boxReadBytes < maxBytes); k++) {
-		MP4_READ_8(demux->file, name[k], boxReadBytes);
-		if (name[k] == '\0')
-			break;
+	int k = 0;
+	while (boxReadBytes + 4 <= maxBytes) {
+		/* compatible_brands[] */
+		MP4_READ_32(box, val32, boxReadBytes);
+		uint32_t compatibleBrands = ntohl(val32);
+		MP4_LOGD("# ftyp: compatible_brands[%d]=%c%c%c%c", k,
+			(char)((compatibleBrands >> 24) & 0xFF),
+			(char)((compatibleBrands >> 16) & 0xFF),
+			(char)((compatibleBrands >> 8) & 0xFF),
+			(char)(compatibleBrands & 0xFF));
+		k++;
 	}
-	name[k + 1] = '\0';
-	MP4_LOGD("# hdlr: name=%s", name);
 
 	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+	MP4_SKIP(box, boxReadBytes, maxBytes);
 
 	return boxReadBytes;
 }
 
 
-static off_t mp4_demux_parse_avcc(
+static off_t mp4_demux_parse_mvhd(
 	struct mp4_demux *demux,
-	off_t maxBytes,
-	struct mp4_track *track)
+	struct mp4_box_item *parent,
+	struct mp4_box_reader *box)
 {
-	off_t boxReadBytes = 0, minBytes = 6;
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0;
 	uint32_t val32;
-	uint16_t val16;
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
-		"invalid track");
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 25 * 4), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 25 * 4);
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= minBytes), -EINVAL,
-		"invalid size: %ld expected %ld min", maxBytes, minBytes);
+	/* version & flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t flags = ntohl(val32);
+	uint8_t version = (flags >> 24) & 0xFF;
+	flags &= ((1 << 24) - 1);
+	MP4_LOGD("# mvhd: version=%d", version);
+	MP4_LOGD("# mvhd: flags=%" PRIu32, flags);
 
-	/* version & profile & level */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	val32 = htonl(val32);
-	uint8_t version = (val32 >> 24) & 0xFF;
-	uint8_t profile = (val32 >> 16) & 0xFF;
-	uint8_t profile_compat = (val32 >> 8) & 0xFF;
-	uint8_t level = val32 & 0xFF;
-	MP4_LOGD("# avcC: version=%d", version);
-	MP4_LOGD("# avcC: profile=%d", profile);
-	MP4_LOGD("# avcC: profile_compat=%d", profile_compat);
-	MP4_LOGD("# avcC: level=%d", level);
+	if (version == 1) {
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 28 * 4),
+			-EINVAL, "invalid size: %ld expected %d min",
+			maxBytes, 28 * 4);
 
-	/* length_size & sps_count */
-	MP4_READ_16(demux->file, val16, boxReadBytes);
-	val16 = htons(val16);
-	uint8_t lengthSize = ((val16 >> 8) & 0x3) + 1;
-	uint8_t spsCount = val16 & 0x1F;
-	MP4_LOGD("# avcC: length_size=%d", lengthSize);
-	MP4_LOGD("# avcC: sps_count=%d", spsCount);
+		/* creation_time */
+		MP4_READ_32(box, val32, boxReadBytes);
+		demux->creationTime = (uint64_t)ntohl(val32) << 32;
+		MP4_READ_32(box, val32, boxReadBytes);
+		demux->creationTime |=
+			(uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
+		MP4_LOGD("# mvhd: creation_time=%" PRIu64,
+			demux->creationTime);
 
-	minBytes += 2 * spsCount;
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= minBytes), -EINVAL,
-		"invalid size: %ld expected %ld min", maxBytes, minBytes);
+		/* modification_time */
+		MP4_READ_32(box, val32, boxReadBytes);
+		demux->modificationTime = (uint64_t)ntohl(val32) << 32;
+		MP4_READ_32(box, val32, boxReadBytes);
+		demux->modificationTime |=
+			(uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
+		MP4_LOGD("# mvhd: modification_time=%" PRIu64,
+			demux->modificationTime);
 
-	int i;
-	for (i = 0; i < spsCount; i++) {
-		/* sps_length */
-		MP4_READ_16(demux->file, val16, boxReadBytes);
-		uint16_t spsLength = htons(val16);
-		MP4_LOGD("# avcC: sps_length=%" PRIu16, spsLength);
+		/* timescale */
+		MP4_READ_32(box, val32, boxReadBytes);
+		demux->timescale = ntohl(val32);
+		MP4_LOGD("# mvhd: timescale=%" PRIu32, demux->timescale);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((demux->timescale != 0),
+			-EPROTO, "invalid timescale: 0");
 
-		minBytes += spsLength;
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= minBytes),
-			-EINVAL, "invalid size: %ld expected %ld min",
-			maxBytes, minBytes);
+		/* duration */
+		MP4_READ_32(box, val32, boxReadBytes);
+		demux->duration = (uint64_t)ntohl(val32) << 32;
+		MP4_READ_32(box, val32, boxReadBytes);
+		demux->duration |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
+		unsigned int hrs = (unsigned int)(
+			(demux->duration + demux->timescale / 2) /
+			demux->timescale / 60 / 60);
+		unsigned int min = (unsigned int)(
+			(demux->duration + demux->timescale / 2) /
+			demux->timescale / 60 - hrs * 60);
+		unsigned int sec = (unsigned int)(
+			(demux->duration + demux->timescale / 2) /
+			demux->timescale - hrs * 60 * 60 - min * 60);
+		MP4_LOGD("# mvhd: duration=%" PRIu64 " (%02d:%02d:%02d)",
+			demux->duration, hrs, min, sec);
+	} else {
+		/* creation_time */
+		MP4_READ_32(box, val32, boxReadBytes);
+		demux->creationTime = ntohl(val32);
+		MP4_LOGD("# mvhd: creation_time=%" PRIu64,
+			demux->creationTime);
 
-		if ((!track->videoSps) && (spsLength)) {
-			/* first SPS found */
-			track->videoSpsSize = spsLength;
-			track->videoSps = malloc(spsLength);
-			MP4_RETURN_ERR_IF_FAILED((track->videoSps != NULL),
-				-ENOMEM);
-			size_t count = fread(track->videoSps, spsLength,
-				1, demux->file);
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((count == 1), -EIO,
-				"failed to read %u bytes from file", spsLength);
-		} else {
-			/* ignore any other SPS */
-			int ret = fseeko(demux->file, spsLength, SEEK_CUR);
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(ret == 0, -errno,
-				"failed to seek %u bytes forward in file",
-				spsLength);
-		}
-		boxReadBytes += spsLength;
+		/* modification_time */
+		MP4_READ_32(box, val32, boxReadBytes);
+		demux->modificationTime = ntohl(val32);
+		MP4_LOGD("# mvhd: modification_time=%" PRIu64,
+			demux->modificationTime);
+
+		/* timescale */
+		MP4_READ_32(box, val32, boxReadBytes);
+		demux->timescale = ntohl(val32);
+		MP4_LOGD("# mvhd: timescale=%" PRIu32, demux->timescale);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((demux->timescale != 0),
+			-EPROTO, "invalid timescale: 0");
+
+		/* duration */
+		MP4_READ_32(box, val32, boxReadBytes);
+		demux->duration = ntohl(val32);
+		unsigned int hrs = (unsigned int)(
+			(demux->duration + demux->timescale / 2) /
+			demux->timescale / 60 / 60);
+		unsigned int min = (unsigned int)(
+			(demux->duration + demux->timescale / 2) /
+			demux->timescale / 60 - hrs * 60);
+		unsigned int sec = (unsigned int)(
+			(demux->duration + demux->timescale / 2) /
+			demux->timescale - hrs * 60 * 60 - min * 60);
+		MP4_LOGD("# mvhd: duration=%" PRIu64 " (%02d:%02d:%02d)",
+			demux->duration, hrs, min, sec);
 	}
 
-	minBytes++;
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= minBytes), -EINVAL,
-		"invalid size: %ld expected %ld min", maxBytes, minBytes);
+	/* rate */
+	MP4_READ_32(box, val32, boxReadBytes);
+	float rate = (float)ntohl(val32) / 65536.;
+	MP4_LOGD("# mvhd: rate=%.4f", rate);
 
-	/* pps_count */
-	uint8_t ppsCount;
-	MP4_READ_8(demux->file, ppsCount, boxReadBytes);
-	MP4_LOGD("# avcC: pps_count=%d", ppsCount);
+	/* volume & reserved */
+	MP4_READ_32(box, val32, boxReadBytes);
+	float volume = (float)((ntohl(val32) >> 16) & 0xFFFF) / 256.;
+	MP4_LOGD("# mvhd: volume=%.2f", volume);
 
-	minBytes += 2 * ppsCount;
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= minBytes), -EINVAL,
-		"invalid size: %ld expected %ld min", maxBytes, minBytes);
+	/* reserved */
+	MP4_READ_32(box, val32, boxReadBytes);
+	MP4_READ_32(box, val32, boxReadBytes);
 
-	for (i = 0; i < ppsCount; i++) {
-		/* pps_length */
-		MP4_READ_16(demux->file, val16, boxReadBytes);
-		uint16_t ppsLength = htons(val16);
-		MP4_LOGD("# avcC: pps_length=%" PRIu16, ppsLength);
+	/* matrix */
+	int k;
+	for (k = 0; k < 9; k++)
+		MP4_READ_32(box, val32, boxReadBytes);
 
-		minBytes += ppsLength;
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= minBytes),
-			-EINVAL, "invalid size: %ld expected %ld min",
-			maxBytes, minBytes);
+	/* pre_defined */
+	for (k = 0; k < 6; k++)
+		MP4_READ_32(box, val32, boxReadBytes);
 
-		if ((!track->videoPps) && (ppsLength)) {
-			/* first PPS found */
-			track->videoPpsSize = ppsLength;
-			track->videoPps = malloc(ppsLength);
-			MP4_RETURN_ERR_IF_FAILED((track->videoPps != NULL),
-				-ENOMEM);
-			size_t count = fread(track->videoPps, ppsLength,
-				1, demux->file);
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((count == 1), -EIO,
-				"failed to read %u bytes from file", ppsLength);
-		} else {
-			/* ignore any other PPS */
-			int ret = fseeko(demux->file, ppsLength, SEEK_CUR);
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(ret == 0, -errno,
-				"failed to seek %u bytes forward in file",
-				ppsLength);
-		}
-		boxReadBytes += ppsLength;
-	}
+	/* next_track_ID */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t next_track_ID = ntohl(val32);
+	MP4_LOGD("# mvhd: next_track_ID=%" PRIu32, next_track_ID);
 
 	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+	MP4_SKIP(box, boxReadBytes, maxBytes);
 
 	return boxReadBytes;
 }
 
 
-static off_t mp4_demux_parse_stsd(
+static off_t mp4_demux_parse_tkhd(
 	struct mp4_demux *demux,
 	struct mp4_box_item *parent,
-	off_t maxBytes,
+	struct mp4_box_reader *box,
 	struct mp4_track *track)
 {
+	off_t maxBytes = box->size;
 	off_t boxReadBytes = 0;
 	uint32_t val32;
-	uint16_t val16;
+	/* the mvhd box may come after the tracks */
+	uint32_t timescale = (demux->timescale != 0) ? demux->timescale : 1;
 
 	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
 		"invalid track");
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 8);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 21 * 4), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 21 * 4);
 
 	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
+	MP4_READ_32(box, val32, boxReadBytes);
 	uint32_t flags = ntohl(val32);
 	uint8_t version = (flags >> 24) & 0xFF;
 	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# stsd: version=%d", version);
-	MP4_LOGD("# stsd: flags=%" PRIu32, flags);
+	MP4_LOGD("# tkhd: version=%d", version);
+	MP4_LOGD("# tkhd: flags=%" PRIu32, flags);
 
-	/* entry_count */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t entryCount = ntohl(val32);
-	MP4_LOGD("# stsd: entry_count=%" PRIu32, entryCount);
+	if (version == 1) {
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 24 * 4),
+			-EINVAL, "invalid size: %ld expected %d min",
+			maxBytes, 24 * 4);
 
-	unsigned int i;
-	for (i = 0; i < entryCount; i++) {
-		switch (track->type) {
-		case MP4_TRACK_TYPE_VIDEO:
-		{
-			MP4_LOGD("# stsd: video handler type");
+		/* creation_time */
+		MP4_READ_32(box, val32, boxReadBytes);
+		uint64_t creationTime = (uint64_t)ntohl(val32) << 32;
+		MP4_READ_32(box, val32, boxReadBytes);
+		creationTime |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
+		MP4_LOGD("# tkhd: creation_time=%" PRIu64,
+			creationTime);
 
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 102),
-				-EINVAL, "invalid size: %ld expected %d min",
-				maxBytes, 102);
+		/* modification_time */
+		MP4_READ_32(box, val32, boxReadBytes);
+		uint64_t modificationTime = (uint64_t)ntohl(val32) << 32;
+		MP4_READ_32(box, val32, boxReadBytes);
+		modificationTime |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
+		MP4_LOGD("# tkhd: modification_time=%" PRIu64,
+			modificationTime);
 
-			/* size */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			uint32_t size = ntohl(val32);
-			MP4_LOGD("# stsd: size=%" PRIu32, size);
+		/* track_ID */
+		MP4_READ_32(box, val32, boxReadBytes);
+		track->id = ntohl(val32);
+		MP4_LOGD("# tkhd: track_ID=%" PRIu32, track->id);
 
-			/* type */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			uint32_t type = ntohl(val32);
-			MP4_LOGD("# stsd: type=%c%c%c%c",
-				(char)((type >> 24) & 0xFF),
-				(char)((type >> 16) & 0xFF),
-				(char)((type >> 8) & 0xFF),
-				(char)(type & 0xFF));
+		/* reserved */
+		MP4_READ_32(box, val32, boxReadBytes);
 
-			/* reserved */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
+		/* duration */
+		MP4_READ_32(box, val32, boxReadBytes);
+		uint64_t duration = (uint64_t)ntohl(val32) << 32;
+		MP4_READ_32(box, val32, boxReadBytes);
+		duration |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
+		unsigned int hrs = (unsigned int)(
+			(duration + timescale / 2) /
+			timescale / 60 / 60);
+		unsigned int min = (unsigned int)(
+			(duration + timescale / 2) /
+			timescale / 60 - hrs * 60);
+		unsigned int sec = (unsigned int)(
+			(duration + timescale / 2) /
+			timescale - hrs * 60 * 60 - min * 60);
+		MP4_LOGD("# tkhd: duration=%" PRIu64 " (%02d:%02d:%02d)",
+			duration, hrs, min, sec);
+	} else {
+		/* creation_time */
+		MP4_READ_32(box, val32, boxReadBytes);
+		uint32_t creationTime = ntohl(val32);
+		MP4_LOGD("# tkhd: creation_time=%" PRIu32,
+			creationTime);
 
-			/* reserved & data_reference_index */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			uint16_t dataReferenceIndex =
-				(uint16_t)(ntohl(val32) & 0xFFFF);
-			MP4_LOGD("# stsd: data_reference_index=%" PRIu16,
-				dataReferenceIndex);
+		/* modification_time */
+		MP4_READ_32(box, val32, boxReadBytes);
+		uint32_t modificationTime = ntohl(val32);
+		MP4_LOGD("# tkhd: modification_time=%" PRIu32,
+			modificationTime);
 
-			int k;
-			for (k = 0; k < 4; k++) {
-				/* pre_defined & reserved */
-				MP4_READ_32(demux->file, val32, boxReadBytes);
-			}
+		/* track_ID */
+		MP4_READ_32(box, val32, boxReadBytes);
+		track->id = ntohl(val32);
+		MP4_LOGD("# tkhd: track_ID=%" PRIu32, track->id);
 
-			/* width & height */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			track->videoWidth = ((ntohl(val32) >> 16) & 0xFFFF);
-			track->videoHeight = (ntohl(val32) & 0xFFFF);
-			MP4_LOGD("# stsd: width=%" PRIu16, track->videoWidth);
-			MP4_LOGD("# stsd: height=%" PRIu16, track->videoHeight);
+		/* reserved */
+		MP4_READ_32(box, val32, boxReadBytes);
 
-			/* horizresolution */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			float horizresolution = (float)(ntohl(val32)) / 65536.;
-			MP4_LOGD("# stsd: horizresolution=%.2f",
-				horizresolution);
+		/* duration */
+		MP4_READ_32(box, val32, boxReadBytes);
+		uint32_t duration = ntohl(val32);
+		unsigned int hrs = (unsigned int)(
+			(duration + timescale / 2) /
+			timescale / 60 / 60);
+		unsigned int min = (unsigned int)(
+			(duration + timescale / 2) /
+			timescale / 60 - hrs * 60);
+		unsigned int sec = (unsigned int)(
+			(duration + timescale / 2) /
+			timescale - hrs * 60 * 60 - min * 60);
+		MP4_LOGD("# tkhd: duration=%" PRIu32 " (%02d:%02d:%02d)",
+			duration, hrs, min, sec);
+	}
 
-			/* vertresolution */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			float vertresolution = (float)(ntohl(val32)) / 65536.;
-			MP4_LOGD("# stsd: vertresolution=%.2f",
-				vertresolution);
+	/* reserved */
+	MP4_READ_32(box, val32, boxReadBytes);
+	MP4_READ_32(box, val32, boxReadBytes);
 
-			/* reserved */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
+	/* layer & alternate_group */
+	MP4_READ_32(box, val32, boxReadBytes);
+	int16_t layer = (int16_t)(ntohl(val32) >> 16);
+	int16_t alternateGroup = (int16_t)(ntohl(val32) & 0xFFFF);
+	MP4_LOGD("# tkhd: layer=%i", layer);
+	MP4_LOGD("# tkhd: alternate_group=%i", alternateGroup);
 
-			/* frame_count */
-			MP4_READ_16(demux->file, val16, boxReadBytes);
-			uint16_t frameCount = ntohs(val16);
-			MP4_LOGD("# stsd: frame_count=%" PRIu16, frameCount);
+	/* volume & reserved */
+	MP4_READ_32(box, val32, boxReadBytes);
+	float volume = (float)((ntohl(val32) >> 16) & 0xFFFF) / 256.;
+	MP4_LOGD("# tkhd: volume=%.2f", volume);
 
-			/* compressorname */
-			char compressorname[32];
-			size_t count = fread(&compressorname,
-				sizeof(compressorname), 1, demux->file);
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((count == 1), -EIO,
-				"failed to read %zu bytes from file",
-				sizeof(compressorname));
-			boxReadBytes += sizeof(compressorname);
-			MP4_LOGD("# stsd: compressorname=%s", compressorname);
+	/* matrix */
+	int k;
+	for (k = 0; k < 9; k++)
+		MP4_READ_32(box, val32, boxReadBytes);
 
-			/* depth & pre_defined */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			uint16_t depth =
-				(uint16_t)((ntohl(val32) >> 16) & 0xFFFF);
-			MP4_LOGD("# stsd: depth=%" PRIu16, depth);
+	/* width */
+	MP4_READ_32(box, val32, boxReadBytes);
+	float width = (float)ntohl(val32) / 65536.;
+	MP4_LOGD("# tkhd: width=%.2f", width);
 
-			/* codec specific size */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			uint32_t codecSize = ntohl(val32);
-			MP4_LOGD("# stsd: codec_size=%" PRIu32, codecSize);
-
-			/* codec specific */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			uint32_t codec = ntohl(val32);
-			MP4_LOGD("# stsd: codec=%c%c%c%c",
-				(char)((codec >> 24) & 0xFF),
-				(char)((codec >> 16) & 0xFF),
-				(char)((codec >> 8) & 0xFF),
-				(char)(codec & 0xFF));
-
-			if (codec == MP4_AVC_DECODER_CONFIG_BOX) {
-				track->videoCodec = MP4_VIDEO_CODEC_AVC;
-				off_t ret = mp4_demux_parse_avcc(
-					demux, maxBytes - boxReadBytes, track);
-				if (ret < 0) {
-					MP4_LOGE("mp4_demux_parse_avcc() failed"
-						" (%ld)", ret);
-					return ret;
-				}
-				boxReadBytes += ret;
-			}
-			break;
-		}
-		case MP4_TRACK_TYPE_AUDIO:
-		{
-			MP4_LOGD("# stsd: audio handler type");
-
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 44),
-				-EINVAL, "invalid size: %ld expected %d min",
-				maxBytes, 44);
-
-			/* size */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			uint32_t size = ntohl(val32);
-			MP4_LOGD("# stsd: size=%" PRIu32, size);
-
-			/* type */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			uint32_t type = ntohl(val32);
-			MP4_LOGD("# stsd: type=%c%c%c%c",
-				(char)((type >> 24) & 0xFF),
-				(char)((type >> 16) & 0xFF),
-				(char)((type >> 8) & 0xFF),
-				(char)(type & 0xFF));
-
-			/* reserved */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-
-			/* reserved & data_reference_index */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			uint16_t dataReferenceIndex =
-				(uint16_t)(ntohl(val32) & 0xFFFF);
-			MP4_LOGD("# stsd: data_reference_index=%" PRIu16,
-				dataReferenceIndex);
-
-			/* reserved */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-
-			/* channelcount & samplesize */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			track->audioChannelCount =
-				((ntohl(val32) >> 16) & 0xFFFF);
-			track->audioSampleSize = (ntohl(val32) & 0xFFFF);
-			MP4_LOGD("# stsd: channelcount=%" PRIu16,
-				track->audioChannelCount);
-			MP4_LOGD("# stsd: samplesize=%" PRIu16,
-				track->audioSampleSize);
-
-			/* reserved */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-
-			/* samplerate */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			track->audioSampleRate = ntohl(val32);
-			MP4_LOGD("# stsd: samplerate=%.2f",
-				(float)track->audioSampleRate / 65536.);
-			break;
-		}
-		case MP4_TRACK_TYPE_HINT:
-			MP4_LOGD("# stsd: hint handler type");
-			break;
-		case MP4_TRACK_TYPE_METADATA:
-		{
-			MP4_LOGD("# stsd: metadata handler type");
-
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 24),
-				-EINVAL, "invalid size: %ld expected %d min",
-				maxBytes, 24);
-
-			/* size */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			uint32_t size = ntohl(val32);
-			MP4_LOGD("# stsd: size=%" PRIu32, size);
-
-			/* type */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			uint32_t type = ntohl(val32);
-			MP4_LOGD("# stsd: type=%c%c%c%c",
-				(char)((type >> 24) & 0xFF),
-				(char)((type >> 16) & 0xFF),
-				(char)((type >> 8) & 0xFF),
-				(char)(type & 0xFF));
-
-			/* reserved */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			MP4_READ_16(demux->file, val16, boxReadBytes);
-
-			/* data_reference_index */
-			MP4_READ_16(demux->file, val16, boxReadBytes);
-			uint16_t dataReferenceIndex = ntohl(val16);
-			MP4_LOGD("# stsd: size=%d", dataReferenceIndex);
-
-			char str[100];
-			unsigned int k;
-			for (k = 0; (k < sizeof(str) - 1) &&
-				(boxReadBytes < maxBytes); k++) {
-				MP4_READ_8(demux->file, str[k], boxReadBytes);
-				if (str[k] == '\0')
-					break;
-			}
-			str[k + 1] = '\0';
-			if (strlen(str) > 0)
-				track->metadataContentEncoding = strdup(str);
-			MP4_LOGD("# stsd: content_encoding=%s", str);
-
-			for (k = 0; (k < sizeof(str) - 1) &&
-				(boxReadBytes < maxBytes); k++) {
-				MP4_READ_8(demux->file, str[k], boxReadBytes);
-				if (str[k] == '\0')
-					break;
-			}
-			str[k + 1] = '\0';
-			if (strlen(str) > 0)
-				track->metadataMimeFormat = strdup(str);
-			MP4_LOGD("# stsd: mime_format=%s", str);
-
-			break;
-		}
-		case MP4_TRACK_TYPE_TEXT:
-			MP4_LOGD("# stsd: text handler type");
-			break;
-		default:
-			MP4_LOGD("# stsd: unknown handler type");
-			break;
-		}
-	}
+	/* height */
+	MP4_READ_32(box, val32, boxReadBytes);
+	float height = (float)ntohl(val32) / 65536.;
+	MP4_LOGD("# tkhd: height=%.2f", height);
 
 	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+	MP4_SKIP(box, boxReadBytes, maxBytes);
 
 	return boxReadBytes;
 }
 
 
-static off_t mp4_demux_parse_stts(
+static off_t mp4_demux_parse_tref(
 	struct mp4_demux *demux,
 	struct mp4_box_item *parent,
-	off_t maxBytes,
+	struct mp4_box_reader *box,
 	struct mp4_track *track)
 {
+	off_t maxBytes = box->size;
 	off_t boxReadBytes = 0;
 	uint32_t val32;
 
 	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
 		"invalid track");
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-		(track->timeToSampleEntries == NULL), -EEXIST,
-		"time to sample table already defined");
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 8);
-
-	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t flags = ntohl(val32);
-	uint8_t version = (flags >> 24) & 0xFF;
-	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# stts: version=%d", version);
-	MP4_LOGD("# stts: flags=%" PRIu32, flags);
-
-	/* entry_count */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	track->timeToSampleEntryCount = ntohl(val32);
-	MP4_LOGD("# stts: entry_count=%" PRIu32, track->timeToSampleEntryCount);
-
-	track->timeToSampleEntries = malloc(track->timeToSampleEntryCount *
-		sizeof(struct mp4_time_to_sample_entry));
-	MP4_RETURN_ERR_IF_FAILED((track->timeToSampleEntries != NULL), -ENOMEM);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 3 * 4), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 3 * 4);
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-		(maxBytes >= 8 + track->timeToSampleEntryCount * 8), -EINVAL,
-		"invalid size: %ld expected %d min",
-		maxBytes, 8 + track->timeToSampleEntryCount * 8);
+	/* reference type size */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t referenceTypeSize = ntohl(val32);
+	MP4_LOGD("# tref: reference_type_size=%" PRIu32, referenceTypeSize);
 
-	unsigned int i;
-	for (i = 0; i < track->timeToSampleEntryCount; i++) {
-		/* sample_count */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->timeToSampleEntries[i].sampleCount = ntohl(val32);
+	/* reference type */
+	MP4_READ_32(box, val32, boxReadBytes);
+	track->referenceType = ntohl(val32);
+	MP4_LOGD("# tref: reference_type=%c%c%c%c",
+		(char)((track->referenceType >> 24) & 0xFF),
+		(char)((track->referenceType >> 16) & 0xFF),
+		(char)((track->referenceType >> 8) & 0xFF),
+		(char)(track->referenceType & 0xFF));
 
-		/* sample_delta */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->timeToSampleEntries[i].sampleDelta = ntohl(val32);
-		/* MP4_LOGD("# stts: sample_count=%" PRIu32
-			" sample_delta=%" PRIu32,
-			track->timeToSampleEntries[i].sampleCount,
-			track->timeToSampleEntries[i].sampleDelta);*/
-	}
+	/* track IDs */
+	/* NB: only read the first track ID, ignore multiple references */
+	MP4_READ_32(box, val32, boxReadBytes);
+	track->referenceTrackId = ntohl(val32);
+	MP4_LOGD("# tref: track_id=%" PRIu32, track->referenceTrackId);
 
 	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+	MP4_SKIP(box, boxReadBytes, maxBytes);
 
 	return boxReadBytes;
 }
 
 
-static off_t mp4_demux_parse_stss(
+static off_t mp4_demux_parse_mdhd(
 	struct mp4_demux *demux,
 	struct mp4_box_item *parent,
-	off_t maxBytes,
+	struct mp4_box_reader *box,
 	struct mp4_track *track)
 {
+	off_t maxBytes = box->size;
 	off_t boxReadBytes = 0;
 	uint32_t val32;
 
 	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
 		"invalid track");
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-		(track->syncSampleEntries == NULL), -EEXIST,
-		"sync sample table already defined");
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 8);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 6 * 4), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 6 * 4);
 
 	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
+	MP4_READ_32(box, val32, boxReadBytes);
 	uint32_t flags = ntohl(val32);
 	uint8_t version = (flags >> 24) & 0xFF;
 	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# stss: version=%d", version);
-	MP4_LOGD("# stss: flags=%" PRIu32, flags);
+	MP4_LOGD("# mdhd: version=%d", version);
+	MP4_LOGD("# mdhd: flags=%" PRIu32, flags);
 
-	/* entry_count */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	track->syncSampleEntryCount = ntohl(val32);
-	MP4_LOGD("# stss: entry_count=%" PRIu32, track->syncSampleEntryCount);
+	if (version == 1) {
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 9 * 4),
+			-EINVAL, "invalid size: %ld expected %d min",
+			maxBytes, 9 * 4);
 
-	track->syncSampleEntries = malloc(
-		track->syncSampleEntryCount * sizeof(uint32_t));
-	MP4_RETURN_ERR_IF_FAILED((track->syncSampleEntries != NULL), -ENOMEM);
+		/* creation_time */
+		MP4_READ_32(box, val32, boxReadBytes);
+		track->creationTime = (uint64_t)ntohl(val32) << 32;
+		MP4_READ_32(box, val32, boxReadBytes);
+		track->creationTime |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
+		MP4_LOGD("# mdhd: creation_time=%" PRIu64,
+			track->creationTime);
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-		(maxBytes >= 8 + track->syncSampleEntryCount * 4), -EINVAL,
-		"invalid size: %ld expected %d min",
-		maxBytes, 8 + track->syncSampleEntryCount * 4);
+		/* modification_time */
+		MP4_READ_32(box, val32, boxReadBytes);
+		track->modificationTime = (uint64_t)ntohl(val32) << 32;
+		MP4_READ_32(box, val32, boxReadBytes);
+		track->modificationTime |=
+			(uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
+		MP4_LOGD("# mdhd: modification_time=%" PRIu64,
+			track->modificationTime);
 
-	unsigned int i;
-	for (i = 0; i < track->syncSampleEntryCount; i++) {
-		/* sample_number */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->syncSampleEntries[i] = ntohl(val32);
-		/*MP4_LOGD("# stss: sample_number=%" PRIu32,
-			track->syncSampleEntries[i]);*/
+		/* timescale */
+		MP4_READ_32(box, val32, boxReadBytes);
+		track->timescale = ntohl(val32);
+		MP4_LOGD("# mdhd: timescale=%" PRIu32, track->timescale);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track->timescale != 0),
+			-EPROTO, "invalid timescale: 0");
+
+		/* duration */
+		MP4_READ_32(box, val32, boxReadBytes);
+		track->duration = (uint64_t)ntohl(val32) << 32;
+		MP4_READ_32(box, val32, boxReadBytes);
+		track->duration |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
+		unsigned int hrs = (unsigned int)(
+			(track->duration + track->timescale / 2) /
+			track->timescale / 60 / 60);
+		unsigned int min = (unsigned int)(
+			(track->duration + track->timescale / 2) /
+			track->timescale / 60 - hrs * 60);
+		unsigned int sec = (unsigned int)(
+			(track->duration + track->timescale / 2) /
+			track->timescale - hrs * 60 * 60 - min * 60);
+		MP4_LOGD("# mdhd: duration=%" PRIu64 " (%02d:%02d:%02d)",
+			track->duration, hrs, min, sec);
+	} else {
+		/* creation_time */
+		MP4_READ_32(box, val32, boxReadBytes);
+		track->creationTime = ntohl(val32);
+		MP4_LOGD("# mdhd: creation_time=%" PRIu64,
+			track->creationTime);
+
+		/* modification_time */
+		MP4_READ_32(box, val32, boxReadBytes);
+		track->modificationTime = ntohl(val32);
+		MP4_LOGD("# mdhd: modification_time=%" PRIu64,
+			track->modificationTime);
+
+		/* timescale */
+		MP4_READ_32(box, val32, boxReadBytes);
+		track->timescale = ntohl(val32);
+		MP4_LOGD("# mdhd: timescale=%" PRIu32, track->timescale);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track->timescale != 0),
+			-EPROTO, "invalid timescale: 0");
+
+		/* duration */
+		MP4_READ_32(box, val32, boxReadBytes);
+		track->duration = (uint64_t)ntohl(val32);
+		unsigned int hrs = (unsigned int)(
+			(track->duration + track->timescale / 2) /
+			track->timescale / 60 / 60);
+		unsigned int min = (unsigned int)(
+			(track->duration + track->timescale / 2) /
+			track->timescale / 60 - hrs * 60);
+		unsigned int sec = (unsigned int)(
+			(track->duration + track->timescale / 2) /
+			track->timescale - hrs * 60 * 60 - min * 60);
+		MP4_LOGD("# mdhd: duration=%" PRIu64 " (%02d:%02d:%02d)",
+			track->duration, hrs, min, sec);
 	}
 
+	/* language & pre_defined */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint16_t language = (uint16_t)(ntohl(val32) >> 16) & 0x7FFF;
+	MP4_LOGD("# mdhd: language=%" PRIu16, language);
+
 	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+	MP4_SKIP(box, boxReadBytes, maxBytes);
 
 	return boxReadBytes;
 }
 
 
-static off_t mp4_demux_parse_stsz(
+static off_t mp4_demux_parse_vmhd(
 	struct mp4_demux *demux,
 	struct mp4_box_item *parent,
-	off_t maxBytes,
+	struct mp4_box_reader *box,
 	struct mp4_track *track)
 {
+	off_t maxBytes = box->size;
 	off_t boxReadBytes = 0;
 	uint32_t val32;
+	uint16_t val16;
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
-		"invalid track");
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track->sampleSize == NULL),
-		-EEXIST, "sample size table already defined");
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 12), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 12);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 3 * 4), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 3 * 4);
 
 	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
+	MP4_READ_32(box, val32, boxReadBytes);
 	uint32_t flags = ntohl(val32);
 	uint8_t version = (flags >> 24) & 0xFF;
 	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# stsz: version=%d", version);
-	MP4_LOGD("# stsz: flags=%" PRIu32, flags);
-
-	/* sample_size */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t sampleSize = ntohl(val32);
-	MP4_LOGD("# stsz: sample_size=%" PRIu32, sampleSize);
-
-	/* sample_count */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	track->sampleCount = ntohl(val32);
-	MP4_LOGD("# stsz: sample_count=%" PRIu32, track->sampleCount);
-
-	track->sampleSize = malloc(track->sampleCount * sizeof(uint32_t));
-	MP4_RETURN_ERR_IF_FAILED((track->sampleSize != NULL), -ENOMEM);
+	MP4_LOGD("# vmhd: version=%d", version);
+	MP4_LOGD("# vmhd: flags=%" PRIu32, flags);
 
-	if (sampleSize == 0) {
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-			(maxBytes >= 12 + track->sampleCount * 4), -EINVAL,
-			"invalid size: %ld expected %d min",
-			maxBytes, 12 + track->sampleCount * 4);
+	/* graphicsmode */
+	MP4_READ_16(box, val16, boxReadBytes);
+	uint16_t graphicsmode = ntohs(val16);
+	MP4_LOGD("# vmhd: graphicsmode=%" PRIu16, graphicsmode);
 
-		unsigned int i;
-		for (i = 0; i < track->sampleCount; i++) {
-			/* entry_size */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			track->sampleSize[i] = ntohl(val32);
-			/*MP4_LOGD("# stsz: entry_size=%" PRIu32,
-				track->sampleSize[i]);*/
-		}
-	} else {
-		unsigned int i;
-		for (i = 0; i < track->sampleCount; i++)
-			track->sampleSize[i] = sampleSize;
-	}
+	/* opcolor */
+	uint16_t opcolor[3];
+	MP4_READ_16(box, val16, boxReadBytes);
+	opcolor[0] = ntohs(val16);
+	MP4_READ_16(box, val16, boxReadBytes);
+	opcolor[1] = ntohs(val16);
+	MP4_READ_16(box, val16, boxReadBytes);
+	opcolor[2] = ntohs(val16);
+	MP4_LOGD("# vmhd: opcolor=(%" PRIu16 ",%" PRIu16 ",%" PRIu16 ")",
+		opcolor[0], opcolor[1], opcolor[2]);
 
 	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+	MP4_SKIP(box, boxReadBytes, maxBytes);
 
 	return boxReadBytes;
 }
 
 
-static off_t mp4_demux_parse_stsc(
+static off_t mp4_demux_parse_smhd(
 	struct mp4_demux *demux,
 	struct mp4_box_item *parent,
-	off_t maxBytes,
+	struct mp4_box_reader *box,
 	struct mp4_track *track)
 {
+	off_t maxBytes = box->size;
 	off_t boxReadBytes = 0;
 	uint32_t val32;
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
-		"invalid track");
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-		(track->sampleToChunkEntries == NULL), -EEXIST,
-		"sample to chunk table already defined");
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 8);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 2 * 4), -EINVAL,
+			"invalid size: %ld expected %d min", maxBytes, 2 * 4);
 
 	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
+	MP4_READ_32(box, val32, boxReadBytes);
 	uint32_t flags = ntohl(val32);
 	uint8_t version = (flags >> 24) & 0xFF;
 	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# stsc: version=%d", version);
-	MP4_LOGD("# stsc: flags=%" PRIu32, flags);
-
-	/* entry_count */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	track->sampleToChunkEntryCount = ntohl(val32);
-	MP4_LOGD("# stsc: entry_count=%" PRIu32,
-		track->sampleToChunkEntryCount);
-
-	track->sampleToChunkEntries = malloc(
-		track->sampleToChunkEntryCount *
-		sizeof(struct mp4_sample_to_chunk_entry));
-	MP4_RETURN_ERR_IF_FAILED((track->sampleToChunkEntries != NULL),
-		-ENOMEM);
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-		(maxBytes >= 8 + track->sampleToChunkEntryCount * 12), -EINVAL,
-		"invalid size: %ld expected %d min",
-		maxBytes, 8 + track->sampleToChunkEntryCount * 12);
+	MP4_LOGD("# smhd: version=%d", version);
+	MP4_LOGD("# smhd: flags=%" PRIu32, flags);
 
-	unsigned int i;
-	for (i = 0; i < track->sampleToChunkEntryCount; i++) {
-		/* first_chunk */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->sampleToChunkEntries[i].firstChunk = ntohl(val32);
-		/*MP4_LOGD("# stsc: first_chunk=%" PRIu32,
-			track->sampleToChunkEntries[i].firstChunk);*/
-
-		/* samples_per_chunk */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->sampleToChunkEntries[i].samplesPerChunk = ntohl(val32);
-		/*MP4_LOGD("# stsc: samples_per_chunk=%" PRIu32,
-			track->sampleToChunkEntries[i].samplesPerChunk);*/
-
-		/* sample_description_index */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->sampleToChunkEntries[i].sampleDescriptionIndex =
-			ntohl(val32);
-		/*MP4_LOGD("# stsc: sample_description_index=%" PRIu32,
-			track->sampleToChunkEntries[i].sampleDescriptionIndex);
-			*/
-	}
+	/* balance & reserved */
+	MP4_READ_32(box, val32, boxReadBytes);
+	float balance = (float)(
+		(int16_t)((ntohl(val32) >> 16) & 0xFFFF)) / 256.;
+	MP4_LOGD("# smhd: balance=%.2f", balance);
 
 	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+	MP4_SKIP(box, boxReadBytes, maxBytes);
 
 	return boxReadBytes;
 }
 
 
-static off_t mp4_demux_parse_stco(
+static off_t mp4_demux_parse_hmhd(
 	struct mp4_demux *demux,
 	struct mp4_box_item *parent,
-	off_t maxBytes,
+	struct mp4_box_reader *box,
 	struct mp4_track *track)
 {
+	off_t maxBytes = box->size;
 	off_t boxReadBytes = 0;
 	uint32_t val32;
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
-		"invalid track");
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track->chunkOffset == NULL),
-		-EEXIST, "chunk offset table already defined");
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 8);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 5 * 4), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 5 * 4);
 
 	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
+	MP4_READ_32(box, val32, boxReadBytes);
 	uint32_t flags = ntohl(val32);
 	uint8_t version = (flags >> 24) & 0xFF;
 	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# stco: version=%d", version);
-	MP4_LOGD("# stco: flags=%" PRIu32, flags);
+	MP4_LOGD("# hmhd: version=%d", version);
+	MP4_LOGD("# hmhd: flags=%" PRIu32, flags);
 
-	/* entry_count */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	track->chunkCount = ntohl(val32);
-	MP4_LOGD("# stco: entry_count=%" PRIu32, track->chunkCount);
+	/* maxPDUsize & avgPDUsize */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint16_t maxPDUsize = (uint16_t)((ntohl(val32) >> 16) & 0xFFFF);
+	uint16_t avgPDUsize = (uint16_t)(ntohl(val32) & 0xFFFF);
+	MP4_LOGD("# hmhd: maxPDUsize=%" PRIu16, maxPDUsize);
+	MP4_LOGD("# hmhd: avgPDUsize=%" PRIu16, avgPDUsize);
 
-	track->chunkOffset = malloc(track->chunkCount * sizeof(uint64_t));
-	MP4_RETURN_ERR_IF_FAILED((track->chunkOffset != NULL), -ENOMEM);
+	/* maxbitrate */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t maxbitrate = ntohl(val32);
+	MP4_LOGD("# hmhd: maxbitrate=%" PRIu32, maxbitrate);
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-		(maxBytes >= 8 + track->chunkCount * 4), -EINVAL,
-		"invalid size: %ld expected %d min",
-		maxBytes, 8 + track->chunkCount * 4);
+	/* avgbitrate */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t avgbitrate = ntohl(val32);
+	MP4_LOGD("# hmhd: avgbitrate=%" PRIu32, avgbitrate);
 
-	unsigned int i;
-	for (i = 0; i < track->chunkCount; i++) {
-		/* chunk_offset */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->chunkOffset[i] = (uint64_t)ntohl(val32);
-		/*MP4_LOGD("# stco: chunk_offset=%" PRIu64,
-			track->chunkOffset[i]);*/
-	}
+	/* reserved */
+	MP4_READ_32(box, val32, boxReadBytes);
 
 	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+	MP4_SKIP(box, boxReadBytes, maxBytes);
 
 	return boxReadBytes;
 }
 
 
-static off_t mp4_demux_parse_co64(
+static off_t mp4_demux_parse_nmhd(
 	struct mp4_demux *demux,
 	struct mp4_box_item *parent,
-	off_t maxBytes,
+	struct mp4_box_reader *box,
 	struct mp4_track *track)
 {
+	off_t maxBytes = box->size;
 	off_t boxReadBytes = 0;
 	uint32_t val32;
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
-		"invalid track");
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track->chunkOffset == NULL),
-		-EEXIST, "chunk offset table already defined");
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 8);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 4), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 4);
 
 	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
+	MP4_READ_32(box, val32, boxReadBytes);
 	uint32_t flags = ntohl(val32);
 	uint8_t version = (flags >> 24) & 0xFF;
 	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# co64: version=%d", version);
-	MP4_LOGD("# co64: flags=%" PRIu32, flags);
-
-	/* entry_count */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	track->chunkCount = ntohl(val32);
-	MP4_LOGD("# co64: entry_count=%" PRIu32, track->chunkCount);
-
-	track->chunkOffset = malloc(track->chunkCount * sizeof(uint64_t));
-	MP4_RETURN_ERR_IF_FAILED((track->chunkOffset != NULL), -ENOMEM);
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-		(maxBytes >= 8 + track->chunkCount * 8), -EINVAL,
-		"invalid size: %ld expected %d min",
-		maxBytes, 8 + track->chunkCount * 8);
-
-	unsigned int i;
-	for (i = 0; i < track->chunkCount; i++) {
-		/* chunk_offset */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->chunkOffset[i] = (uint64_t)ntohl(val32) << 32;
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		track->chunkOffset[i] |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
-		/*MP4_LOGD("# co64: chunk_offset=%" PRIu64,
-			track->chunkOffset[i]);*/
-	}
+	MP4_LOGD("# nmhd: version=%d", version);
+	MP4_LOGD("# nmhd: flags=%" PRIu32, flags);
 
 	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+	MP4_SKIP(box, boxReadBytes, maxBytes);
 
 	return boxReadBytes;
 }
 
 
-static off_t mp4_demux_parse_xyz(
+static off_t mp4_demux_parse_hdlr(
 	struct mp4_demux *demux,
 	struct mp4_box_item *parent,
-	off_t maxBytes,
+	struct mp4_box_reader *box,
 	struct mp4_track *track)
 {
+	off_t maxBytes = box->size;
 	off_t boxReadBytes = 0;
-	uint16_t val16;
+	uint32_t val32;
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((parent != NULL), -EINVAL,
-		"invalid parent");
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 6 * 4), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 6 * 4);
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 4), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 4);
+	/* version & flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t flags = ntohl(val32);
+	uint8_t version = (flags >> 24) & 0xFF;
+	flags &= ((1 << 24) - 1);
+	MP4_LOGD("# hdlr: version=%d", version);
+	MP4_LOGD("# hdlr: flags=%" PRIu32, flags);
 
-	/* location_size */
-	MP4_READ_16(demux->file, val16, boxReadBytes);
-	uint16_t locationSize = ntohs(val16);
-	MP4_LOGD("# xyz: location_size=%d", locationSize);
+	/* pre_defined */
+	MP4_READ_32(box, val32, boxReadBytes);
 
-	/* language_code */
-	MP4_READ_16(demux->file, val16, boxReadBytes);
-	uint16_t languageCode = ntohs(val16);
-	MP4_LOGD("# xyz: language_code=%d", languageCode);
+	/* handler_type */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t handlerType = ntohl(val32);
+	MP4_LOGD("# hdlr: handler_type=%c%c%c%c",
+		(char)((handlerType >> 24) & 0xFF),
+		(char)((handlerType >> 16) & 0xFF),
+		(char)((handlerType >> 8) & 0xFF),
+		(char)(handlerType & 0xFF));
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 4 + locationSize),
-		-EINVAL, "invalid size: %ld expected %d min",
-		maxBytes, 4 + locationSize);
+	if ((track) && (parent) && (parent->parent) &&
+		(parent->parent->box.type == MP4_MEDIA_BOX)) {
+		switch (handlerType) {
+		case MP4_HANDLER_TYPE_VIDEO:
+			track->type = MP4_TRACK_TYPE_VIDEO;
+			break;
+		case MP4_HANDLER_TYPE_AUDIO:
+			track->type = MP4_TRACK_TYPE_AUDIO;
+			break;
+		case MP4_HANDLER_TYPE_HINT:
+			track->type = MP4_TRACK_TYPE_HINT;
+			break;
+		case MP4_HANDLER_TYPE_METADATA:
+			track->type = MP4_TRACK_TYPE_METADATA;
+			break;
+		case MP4_HANDLER_TYPE_TEXT:
+			track->type = MP4_TRACK_TYPE_TEXT;
+			break;
+		default:
+			track->type = MP4_TRACK_TYPE_UNKNOWN;
+			break;
+		}
+	}
 
-	demux->udtaLocationKey = malloc(5);
-	MP4_RETURN_ERR_IF_FAILED((demux->udtaLocationKey != NULL), -ENOMEM);
-	demux->udtaLocationKey[0] = ((parent->box.type >> 24) & 0xFF);
-	demux->udtaLocationKey[1] = ((parent->box.type >> 16) & 0xFF);
-	demux->udtaLocationKey[2] = ((parent->box.type >> 8) & 0xFF);
-	demux->udtaLocationKey[3] = (parent->box.type & 0xFF);
-	demux->udtaLocationKey[4] = '\0';
+	/* reserved */
+	unsigned int k;
+	for (k = 0; k < 3; k++)
+		MP4_READ_32(box, val32, boxReadBytes);
 
-	demux->udtaLocationValue = malloc(locationSize + 1);
-	MP4_RETURN_ERR_IF_FAILED((demux->udtaLocationValue != NULL), -ENOMEM);
-	size_t count = fread(demux->udtaLocationValue, locationSize,
-		1, demux->file);
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((count == 1), -EIO,
-		"failed to read %u bytes from file", locationSize);
-	boxReadBytes += locationSize;
-	demux->udtaLocationValue[locationSize] = '\0';
-	MP4_LOGD("# xyz: location=%s", demux->udtaLocationValue);
+	char name[100];
+	for (k = 0; (k < sizeof(name) - 1) && (boxReadBytes < maxBytes); k++) {
+		MP4_READ_8(box, name[k], boxReadBytes);
+		if (name[k] == '\0')
+			break;
+	}
+	name[k] = '\0';
+	MP4_LOGD("# hdlr: name=%s", name);
 
 	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+	MP4_SKIP(box, boxReadBytes, maxBytes);
 
 	return boxReadBytes;
 }
 
 
-static int mp4_demux_count_ilst_sub_box(
+static off_t mp4_demux_parse_avcc(
 	struct mp4_demux *demux,
-	struct mp4_box_item *parent,
-	off_t maxBytes,
+	struct mp4_box_reader *box,
 	struct mp4_track *track)
 {
-	off_t totalReadBytes = 0, boxReadBytes = 0;
-	off_t originalOffset, realBoxSize;
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0, minBytes = 6;
 	uint32_t val32;
-	int lastBox = 0, count = 0;
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 8);
+	uint16_t val16;
 
-	originalOffset = ftello(demux->file);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
+		"invalid track");
 
-	while ((totalReadBytes + 8 <= maxBytes) && (!lastBox)) {
-		boxReadBytes = 0;
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= minBytes), -EINVAL,
+		"invalid size: %ld expected %ld min", maxBytes, minBytes);
 
-		/* box size */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		uint32_t size = ntohl(val32);
+	/* version & profile & level */
+	MP4_READ_32(box, val32, boxReadBytes);
+	val32 = htonl(val32);
+	uint8_t version = (val32 >> 24) & 0xFF;
+	uint8_t profile = (val32 >> 16) & 0xFF;
+	uint8_t profile_compat = (val32 >> 8) & 0xFF;
+	uint8_t level = val32 & 0xFF;
+	MP4_LOGD("# avcC: version=%d", version);
+	MP4_LOGD("# avcC: profile=%d", profile);
+	MP4_LOGD("# avcC: profile_compat=%d", profile_compat);
+	MP4_LOGD("# avcC: level=%d", level);
 
-		/* box type */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
+	/* length_size & sps_count */
+	MP4_READ_16(box, val16, boxReadBytes);
+	val16 = htons(val16);
+	uint8_t lengthSize = ((val16 >> 8) & 0x3) + 1;
+	uint8_t spsCount = val16 & 0x1F;
+	MP4_LOGD("# avcC: length_size=%d", lengthSize);
+	MP4_LOGD("# avcC: sps_count=%d", spsCount);
 
-		if (size == 0) {
-			/* box extends to end of file */
-			/*TODO*/
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, -ENOSYS,
-				"size == 0 for list element"
-				" is not implemented");
-		} else if (size == 1) {
+	minBytes += 2 * spsCount;
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= minBytes), -EINVAL,
+		"invalid size: %ld expected %ld min", maxBytes, minBytes);
+
+	int i;
+	for (i = 0; i < spsCount; i++) {
+		/* sps_length */
+		MP4_READ_16(box, val16, boxReadBytes);
+		uint16_t spsLength = htons(val16);
+		MP4_LOGD("# avcC: sps_length=%" PRIu16, spsLength);
+
+		minBytes += spsLength;
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= minBytes),
+			-EINVAL, "invalid size: %ld expected %ld min",
+			maxBytes, minBytes);
+
+		if ((!track->videoSps) && (spsLength)) {
+			/* first SPS found */
+			track->videoSpsSize = spsLength;
+			track->videoSps = mp4_demux_malloc(demux, spsLength);
+			MP4_RETURN_ERR_IF_FAILED((track->videoSps != NULL),
+				-ENOMEM);
+			MP4_READ_BYTES(box, track->videoSps, spsLength,
+				boxReadBytes);
+		} else {
+			/* ignore any other SPS */
 			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-				(maxBytes >= boxReadBytes + 16), -EINVAL,
-				"invalid size: %ld expected %ld min",
-				maxBytes, boxReadBytes + 16);
+				(maxBytes - boxReadBytes >= spsLength), -EINVAL,
+				"invalid size: %ld expected %u min",
+				maxBytes - boxReadBytes, spsLength);
+			boxReadBytes += spsLength;
+		}
+	}
 
-			/* large size */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			realBoxSize = (uint64_t)ntohl(val32) << 32;
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			realBoxSize |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
-		} else
-			realBoxSize = size;
+	minBytes++;
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= minBytes), -EINVAL,
+		"invalid size: %ld expected %ld min", maxBytes, minBytes);
 
-		count++;
+	/* pps_count */
+	uint8_t ppsCount;
+	MP4_READ_8(box, ppsCount, boxReadBytes);
+	MP4_LOGD("# avcC: pps_count=%d", ppsCount);
 
-		/* skip the rest of the box */
-		MP4_SKIP(demux->file, boxReadBytes, realBoxSize);
-		totalReadBytes += realBoxSize;
+	minBytes += 2 * ppsCount;
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= minBytes), -EINVAL,
+		"invalid size: %ld expected %ld min", maxBytes, minBytes);
+
+	for (i = 0; i < ppsCount; i++) {
+		/* pps_length */
+		MP4_READ_16(box, val16, boxReadBytes);
+		uint16_t ppsLength = htons(val16);
+		MP4_LOGD("# avcC: pps_length=%" PRIu16, ppsLength);
+
+		minBytes += ppsLength;
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= minBytes),
+			-EINVAL, "invalid size: %ld expected %ld min",
+			maxBytes, minBytes);
+
+		if ((!track->videoPps) && (ppsLength)) {
+			/* first PPS found */
+			track->videoPpsSize = ppsLength;
+			track->videoPps = mp4_demux_malloc(demux, ppsLength);
+			MP4_RETURN_ERR_IF_FAILED((track->videoPps != NULL),
+				-ENOMEM);
+			MP4_READ_BYTES(box, track->videoPps, ppsLength,
+				boxReadBytes);
+		} else {
+			/* ignore any other PPS */
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+				(maxBytes - boxReadBytes >= ppsLength), -EINVAL,
+				"invalid size: %ld expected %u min",
+				maxBytes - boxReadBytes, ppsLength);
+			boxReadBytes += ppsLength;
+		}
 	}
 
-	int ret = fseeko(demux->file, -totalReadBytes, SEEK_CUR);
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(ret == 0, -errno,
-		"failed to seek %ld bytes forward in file", -totalReadBytes);
+	/* skip the rest of the box */
+	MP4_SKIP(box, boxReadBytes, maxBytes);
 
-	return count;
+	return boxReadBytes;
 }
 
 
-static off_t mp4_demux_parse_meta_keys(
+static off_t mp4_demux_parse_stsd(
 	struct mp4_demux *demux,
 	struct mp4_box_item *parent,
-	off_t maxBytes,
+	struct mp4_box_reader *box,
 	struct mp4_track *track)
 {
+	off_t maxBytes = box->size;
 	off_t boxReadBytes = 0;
-	uint32_t val32, i;
+	uint32_t val32;
+	uint16_t val16;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
+		"invalid track");
 
 	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
 		"invalid size: %ld expected %d min", maxBytes, 8);
 
 	/* version & flags */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
+	MP4_READ_32(box, val32, boxReadBytes);
 	uint32_t flags = ntohl(val32);
 	uint8_t version = (flags >> 24) & 0xFF;
 	flags &= ((1 << 24) - 1);
-	MP4_LOGD("# keys: version=%d", version);
-	MP4_LOGD("# keys: flags=%" PRIu32, flags);
+	MP4_LOGD("# stsd: version=%d", version);
+	MP4_LOGD("# stsd: flags=%" PRIu32, flags);
 
 	/* entry_count */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	demux->metaMetadataCount = ntohl(val32);
-	MP4_LOGD("# keys: entry_count=%" PRIu32, demux->metaMetadataCount);
-
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-		(maxBytes >= 4 + demux->metaMetadataCount * 8), -EINVAL,
-		"invalid size: %ld expected %d min",
-		maxBytes, 4 + demux->metaMetadataCount * 8);
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t entryCount = ntohl(val32);
+	MP4_LOGD("# stsd: entry_count=%" PRIu32, entryCount);
 
-	demux->metaMetadataKey = calloc(
-		demux->metaMetadataCount, sizeof(char *));
-	MP4_RETURN_ERR_IF_FAILED((demux->metaMetadataKey != NULL), -ENOMEM);
+	unsigned int i;
+	for (i = 0; i < entryCount; i++) {
+		switch (track->type) {
+		case MP4_TRACK_TYPE_VIDEO:
+		{
+			MP4_LOGD("# stsd: video handler type");
 
-	demux->metaMetadataValue = calloc(
-		demux->metaMetadataCount, sizeof(char *));
-	MP4_RETURN_ERR_IF_FAILED((demux->metaMetadataValue != NULL), -ENOMEM);
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 102),
+				-EINVAL, "invalid size: %ld expected %d min",
+				maxBytes, 102);
 
-	for (i = 0; i < demux->metaMetadataCount; i++) {
-		/* key_size */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		uint32_t keySize = ntohl(val32);
-		MP4_LOGD("# keys: key_size=%" PRIu32, keySize);
+			/* size */
+			MP4_READ_32(box, val32, boxReadBytes);
+			uint32_t size = ntohl(val32);
+			MP4_LOGD("# stsd: size=%" PRIu32, size);
 
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((keySize >= 8), -EINVAL,
-			"invalid key size: %" PRIu32 " expected %d min",
-			keySize, 8);
-		keySize -= 8;
+			/* type */
+			MP4_READ_32(box, val32, boxReadBytes);
+			uint32_t type = ntohl(val32);
+			MP4_LOGD("# stsd: type=%c%c%c%c",
+				(char)((type >> 24) & 0xFF),
+				(char)((type >> 16) & 0xFF),
+				(char)((type >> 8) & 0xFF),
+				(char)(type & 0xFF));
 
-		/* key_namespace */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		uint32_t keyNamespace = ntohl(val32);
-		MP4_LOGD("# keys: key_namespace=%c%c%c%c",
-			(char)((keyNamespace >> 24) & 0xFF),
-			(char)((keyNamespace >> 16) & 0xFF),
-			(char)((keyNamespace >> 8) & 0xFF),
-			(char)(keyNamespace & 0xFF));
+			/* reserved */
+			MP4_READ_32(box, val32, boxReadBytes);
 
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-			(maxBytes - boxReadBytes >= keySize), -EINVAL,
-			"invalid size: %ld expected %d min",
-			maxBytes - boxReadBytes, keySize);
+			/* reserved & data_reference_index */
+			MP4_READ_32(box, val32, boxReadBytes);
+			uint16_t dataReferenceIndex =
+				(uint16_t)(ntohl(val32) & 0xFFFF);
+			MP4_LOGD("# stsd: data_reference_index=%" PRIu16,
+				dataReferenceIndex);
 
-		demux->metaMetadataKey[i] = malloc(keySize + 1);
-		MP4_RETURN_ERR_IF_FAILED((demux->metaMetadataKey[i] != NULL),
-			-ENOMEM);
-		size_t count = fread(demux->metaMetadataKey[i], keySize,
-			1, demux->file);
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((count == 1), -EIO,
-			"failed to read %u bytes from file", keySize);
-		boxReadBytes += keySize;
-		demux->metaMetadataKey[i][keySize] = '\0';
-		MP4_LOGD("# keys: key_value[%i]=%s",
-			i, demux->metaMetadataKey[i]);
-	}
+			int k;
+			for (k = 0; k < 4; k++) {
+				/* pre_defined & reserved */
+				MP4_READ_32(box, val32, boxReadBytes);
+			}
 
-	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+			/* width & height */
+			MP4_READ_32(box, val32, boxReadBytes);
+			track->videoWidth = ((ntohl(val32) >> 16) & 0xFFFF);
+			track->videoHeight = (ntohl(val32) & 0xFFFF);
+			MP4_LOGD("# stsd: width=%" PRIu16, track->videoWidth);
+			MP4_LOGD("# stsd: height=%" PRIu16, track->videoHeight);
 
-	return boxReadBytes;
-}
+			/* horizresolution */
+			MP4_READ_32(box, val32, boxReadBytes);
+			float horizresolution = (float)(ntohl(val32)) / 65536.;
+			MP4_LOGD("# stsd: horizresolution=%.2f",
+				horizresolution);
 
+			/* vertresolution */
+			MP4_READ_32(box, val32, boxReadBytes);
+			float vertresolution = (float)(ntohl(val32)) / 65536.;
+			MP4_LOGD("# stsd: vertresolution=%.2f",
+				vertresolution);
 
-static off_t mp4_demux_parse_meta_data(
-	struct mp4_demux *demux,
-	struct mp4_box_item *parent,
-	off_t maxBytes,
-	struct mp4_track *track)
-{
-	off_t boxReadBytes = 0;
-	uint32_t val32;
+			/* reserved */
+			MP4_READ_32(box, val32, boxReadBytes);
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((parent->parent != NULL), -EINVAL,
-		"invalid parent");
+			/* frame_count */
+			MP4_READ_16(box, val16, boxReadBytes);
+			uint16_t frameCount = ntohs(val16);
+			MP4_LOGD("# stsd: frame_count=%" PRIu16, frameCount);
 
-	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 9), -EINVAL,
-		"invalid size: %ld expected %d min", maxBytes, 9);
+			/* compressorname */
+			char compressorname[33];
+			MP4_READ_BYTES(box, compressorname, 32,
+				boxReadBytes);
+			compressorname[32] = '\0';
+			MP4_LOGD("# stsd: compressorname=%s", compressorname);
 
-	/* version & class */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
-	uint32_t clazz = ntohl(val32);
-	uint8_t version = (clazz >> 24) & 0xFF;
-	clazz &= 0xFF;
-	MP4_LOGD("# data: version=%d", version);
-	MP4_LOGD("# data: class=%" PRIu32, clazz);
+			/* depth & pre_defined */
+			MP4_READ_32(box, val32, boxReadBytes);
+			uint16_t depth =
+				(uint16_t)((ntohl(val32) >> 16) & 0xFFFF);
+			MP4_LOGD("# stsd: depth=%" PRIu16, depth);
 
-	/* reserved */
-	MP4_READ_32(demux->file, val32, boxReadBytes);
+			/* codec specific size */
+			MP4_READ_32(box, val32, boxReadBytes);
+			uint32_t codecSize = ntohl(val32);
+			MP4_LOGD("# stsd: codec_size=%" PRIu32, codecSize);
 
-	unsigned int valueLen = maxBytes - boxReadBytes;
+			/* codec specific */
+			MP4_READ_32(box, val32, boxReadBytes);
+			uint32_t codec = ntohl(val32);
+			MP4_LOGD("# stsd: codec=%c%c%c%c",
+				(char)((codec >> 24) & 0xFF),
+				(char)((codec >> 16) & 0xFF),
+				(char)((codec >> 8) & 0xFF),
+				(char)(codec & 0xFF));
 
-	if (clazz == MP4_METADATA_CLASS_UTF8) {
-		switch (parent->parent->box.type & 0xFFFFFF) {
-		case MP4_METADATA_TAG_TYPE_ARTIST:
-		case MP4_METADATA_TAG_TYPE_TITLE:
-		case MP4_METADATA_TAG_TYPE_DATE:
-		case MP4_METADATA_TAG_TYPE_COMMENT:
-		case MP4_METADATA_TAG_TYPE_COPYRIGHT:
-		case MP4_METADATA_TAG_TYPE_MAKER:
-		case MP4_METADATA_TAG_TYPE_MODEL:
-		case MP4_METADATA_TAG_TYPE_VERSION:
-		case MP4_METADATA_TAG_TYPE_ENCODER:
-		{
-			uint32_t idx = demux->udtaMetadataParseIdx++;
-			demux->udtaMetadataKey[idx] = malloc(5);
-			MP4_RETURN_ERR_IF_FAILED(
-				(demux->udtaMetadataKey[idx] != NULL), -ENOMEM);
-			demux->udtaMetadataKey[idx][0] =
-				((parent->parent->box.type >> 24) & 0xFF);
-			demux->udtaMetadataKey[idx][1] =
-				((parent->parent->box.type >> 16) & 0xFF);
-			demux->udtaMetadataKey[idx][2] =
-				((parent->parent->box.type >> 8) & 0xFF);
-			demux->udtaMetadataKey[idx][3] =
-				(parent->parent->box.type & 0xFF);
-			demux->udtaMetadataKey[idx][4] = '\0';
-			demux->udtaMetadataValue[idx] = malloc(valueLen + 1);
-			MP4_RETURN_ERR_IF_FAILED(
-				(demux->udtaMetadataValue[idx] != NULL),
-				-ENOMEM);
-			size_t count = fread(demux->udtaMetadataValue[idx],
-				valueLen, 1, demux->file);
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((count == 1), -EIO,
-				"failed to read %u bytes from file", valueLen);
-			boxReadBytes += valueLen;
-			demux->udtaMetadataValue[idx][valueLen] = '\0';
-			MP4_LOGD("# data: value[%s]=%s",
-				demux->udtaMetadataKey[idx],
-				demux->udtaMetadataValue[idx]);
+			if (codec == MP4_AVC_DECODER_CONFIG_BOX) {
+				track->videoCodec = MP4_VIDEO_CODEC_AVC;
+				struct mp4_box_reader avcc = {
+					.data = box->data + boxReadBytes,
+					.size = maxBytes - boxReadBytes,
+					.offset = box->offset + boxReadBytes,
+				};
+				off_t ret = mp4_demux_parse_avcc(
+					demux, &avcc, track);
+				if (ret < 0) {
+					MP4_LOGE("mp4_demux_parse_avcc() failed"
+						" (%ld)", ret);
+					return ret;
+				}
+				boxReadBytes += ret;
+			}
 			break;
 		}
-		default:
+		case MP4_TRACK_TYPE_AUDIO:
 		{
-			if ((parent->parent->box.type > 0) &&
-				(parent->parent->box.type <=
-				demux->metaMetadataCount)) {
-				uint32_t idx = parent->parent->box.type - 1;
-				demux->metaMetadataValue[idx] =
-					malloc(valueLen + 1);
-				MP4_RETURN_ERR_IF_FAILED(
-					(demux->metaMetadataValue[idx] != NULL),
-					-ENOMEM);
-				size_t count = fread(
-					demux->metaMetadataValue[idx], valueLen,
-					1, demux->file);
-				MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-					(count == 1), -EIO,
-					"failed to read %u bytes from file",
-					valueLen);
-				boxReadBytes += valueLen;
-				demux->metaMetadataValue[idx][valueLen] = '\0';
-				MP4_LOGD("# data: value[%s]=%s",
-					demux->metaMetadataKey[idx],
-					demux->metaMetadataValue[idx]);
-			}
+			MP4_LOGD("# stsd: audio handler type");
+
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 44),
+				-EINVAL, "invalid size: %ld expected %d min",
+				maxBytes, 44);
+
+			/* size */
+			MP4_READ_32(box, val32, boxReadBytes);
+			uint32_t size = ntohl(val32);
+			MP4_LOGD("# stsd: size=%" PRIu32, size);
+
+			/* type */
+			MP4_READ_32(box, val32, boxReadBytes);
+			uint32_t type = ntohl(val32);
+			MP4_LOGD("# stsd: type=%c%c%c%c",
+				(char)((type >> 24) & 0xFF),
+				(char)((type >> 16) & 0xFF),
+				(char)((type >> 8) & 0xFF),
+				(char)(type & 0xFF));
+
+			/* reserved */
+			MP4_READ_32(box, val32, boxReadBytes);
+
+			/* reserved & data_reference_index */
+			MP4_READ_32(box, val32, boxReadBytes);
+			uint16_t dataReferenceIndex =
+				(uint16_t)(ntohl(val32) & 0xFFFF);
+			MP4_LOGD("# stsd: data_reference_index=%" PRIu16,
+				dataReferenceIndex);
+
+			/* reserved */
+			MP4_READ_32(box, val32, boxReadBytes);
+			MP4_READ_32(box, val32, boxReadBytes);
+
+			/* channelcount & samplesize */
+			MP4_READ_32(box, val32, boxReadBytes);
+			track->audioChannelCount =
+				((ntohl(val32) >> 16) & 0xFFFF);
+			track->audioSampleSize = (ntohl(val32) & 0xFFFF);
+			MP4_LOGD("# stsd: channelcount=%" PRIu16,
+				track->audioChannelCount);
+			MP4_LOGD("# stsd: samplesize=%" PRIu16,
+				track->audioSampleSize);
+
+			/* reserved */
+			MP4_READ_32(box, val32, boxReadBytes);
+
+			/* samplerate */
+			MP4_READ_32(box, val32, boxReadBytes);
+			track->audioSampleRate = ntohl(val32);
+			MP4_LOGD("# stsd: samplerate=%.2f",
+				(float)track->audioSampleRate / 65536.);
 			break;
 		}
-		}
-	} else if ((clazz == MP4_METADATA_CLASS_JPEG) ||
-		(clazz == MP4_METADATA_CLASS_PNG) ||
-		(clazz == MP4_METADATA_CLASS_BMP)) {
-		uint32_t type = parent->parent->box.type;
-		if (type == MP4_METADATA_TAG_TYPE_COVER) {
-			demux->udtaCoverOffset = ftello(demux->file);
-			demux->udtaCoverSize = valueLen;
-			switch (clazz) {
-			default:
-			case MP4_METADATA_CLASS_JPEG:
-				demux->udtaCoverType =
-					MP4_METADATA_COVER_TYPE_JPEG;
-				break;
-			case MP4_METADATA_CLASS_PNG:
-				demux->udtaCoverType =
-					MP4_METADATA_COVER_TYPE_PNG;
-				break;
-			case MP4_METADATA_CLASS_BMP:
-				demux->udtaCoverType =
-					MP4_METADATA_COVER_TYPE_BMP;
-				break;
+		case MP4_TRACK_TYPE_HINT:
+			MP4_LOGD("# stsd: hint handler type");
+			break;
+		case MP4_TRACK_TYPE_METADATA:
+		{
+			MP4_LOGD("# stsd: metadata handler type");
+
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 24),
+				-EINVAL, "invalid size: %ld expected %d min",
+				maxBytes, 24);
+
+			/* size */
+			MP4_READ_32(box, val32, boxReadBytes);
+			uint32_t size = ntohl(val32);
+			MP4_LOGD("# stsd: size=%" PRIu32, size);
+
+			/* type */
+			MP4_READ_32(box, val32, boxReadBytes);
+			uint32_t type = ntohl(val32);
+			MP4_LOGD("# stsd: type=%c%c%c%c",
+				(char)((type >> 24) & 0xFF),
+				(char)((type >> 16) & 0xFF),
+				(char)((type >> 8) & 0xFF),
+				(char)(type & 0xFF));
+
+			/* reserved */
+			MP4_READ_32(box, val32, boxReadBytes);
+			MP4_READ_16(box, val16, boxReadBytes);
+
+			/* data_reference_index */
+			MP4_READ_16(box, val16, boxReadBytes);
+			uint16_t dataReferenceIndex = ntohl(val16);
+			MP4_LOGD("# stsd: size=%d", dataReferenceIndex);
+
+			char str[100];
+			unsigned int k;
+			for (k = 0; (k < sizeof(str) - 1) &&
+				(boxReadBytes < maxBytes); k++) {
+				MP4_READ_8(box, str[k], boxReadBytes);
+				if (str[k] == '\0')
+					break;
 			}
-			MP4_LOGD("# data: udta cover offset=0x%lX"
-				" size=%d type=%d", demux->udtaCoverOffset,
-				demux->udtaCoverSize, demux->udtaCoverType);
-		} else if ((type > 0) && (type <= demux->metaMetadataCount) &&
-			(!strcmp(demux->metaMetadataKey[type - 1],
-				MP4_METADATA_KEY_COVER))) {
-			demux->metaCoverOffset = ftello(demux->file);
-			demux->metaCoverSize = valueLen;
-			switch (clazz) {
-			default:
-			case MP4_METADATA_CLASS_JPEG:
-				demux->metaCoverType =
-					MP4_METADATA_COVER_TYPE_JPEG;
-				break;
-			case MP4_METADATA_CLASS_PNG:
-				demux->metaCoverType =
-					MP4_METADATA_COVER_TYPE_PNG;
-				break;
-			case MP4_METADATA_CLASS_BMP:
-				demux->metaCoverType =
-					MP4_METADATA_COVER_TYPE_BMP;
-				break;
+			str[k + 1] = '\0';
+			if (strlen(str) > 0)
+				track->metadataContentEncoding =
+					mp4_demux_strdup(demux, str);
+			MP4_LOGD("# stsd: content_encoding=%s", str);
+
+			for (k = 0; (k < sizeof(str) - 1) &&
+				(boxReadBytes < maxBytes); k++) {
+				MP4_READ_8(box, str[k], boxReadBytes);
+				if (str[k] == '\0')
+					break;
 			}
-			MP4_LOGD("# data: meta cover offset=0x%lX"
-				" size=%d type=%d", demux->metaCoverOffset,
-				demux->metaCoverSize, demux->metaCoverType);
+			str[k + 1] = '\0';
+			if (strlen(str) > 0)
+				track->metadataMimeFormat =
+					mp4_demux_strdup(demux, str);
+			MP4_LOGD("# stsd: mime_format=%s", str);
+
+			break;
+		}
+		case MP4_TRACK_TYPE_TEXT:
+			MP4_LOGD("# stsd: text handler type");
+			break;
+		default:
+			MP4_LOGD("# stsd: unknown handler type");
+			break;
 		}
 	}
 
 	/* skip the rest of the box */
-	MP4_SKIP(demux->file, boxReadBytes, maxBytes);
+	MP4_SKIP(box, boxReadBytes, maxBytes);
 
 	return boxReadBytes;
 }
 
 
-static off_t mp4_demux_parse_children(
+static off_t mp4_demux_parse_stts(
 	struct mp4_demux *demux,
 	struct mp4_box_item *parent,
-	off_t maxBytes,
+	struct mp4_box_reader *box,
 	struct mp4_track *track)
 {
-	off_t parentReadBytes = 0;
-	int ret = 0, lastBox = 0;
-	struct mp4_box_item *prev = NULL;
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0;
+	uint32_t val32;
 
-	while ((!feof(demux->file)) && (!lastBox) &&
-		(parentReadBytes + 8 < maxBytes)) {
-		off_t boxReadBytes = 0, realBoxSize;
-		uint32_t val32;
-		struct mp4_box box;
-		memset(&box, 0, sizeof(box));
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
+		"invalid track");
 
-		/* box size */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		box.size = ntohl(val32);
+	/* header-only: the table is left unread */
+	if (demux->config.flags & MP4_DEMUX_FLAG_HEADER_ONLY)
+		return 0;
 
-		/* box type */
-		MP4_READ_32(demux->file, val32, boxReadBytes);
-		box.type = ntohl(val32);
-		if ((parent) && (parent->box.type == MP4_ILST_BOX) &&
-			(box.type <= demux->metaMetadataCount))
-			MP4_LOGD("offset 0x%lX metadata box size %" PRIu32,
-				ftello(demux->file), box.size);
-		else
-			MP4_LOGD("offset 0x%lX box '%c%c%c%c' size %" PRIu32,
-				ftello(demux->file),
-				(box.type >> 24) & 0xFF,
-				(box.type >> 16) & 0xFF,
-				(box.type >> 8) & 0xFF,
-				box.type & 0xFF, box.size);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(track->timeToSampleEntries == NULL), -EEXIST,
+		"time to sample table already defined");
 
-		if (box.size == 0) {
-			/* box extends to end of file */
-			lastBox = 1;
-			realBoxSize = demux->fileSize - demux->readBytes;
-		} else if (box.size == 1) {
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-				(maxBytes >= parentReadBytes + 16), -EINVAL,
-				"invalid size: %ld expected %ld min",
-				maxBytes, parentReadBytes + 16);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 8);
 
-			/* large size */
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			box.largesize = (uint64_t)ntohl(val32) << 32;
-			MP4_READ_32(demux->file, val32, boxReadBytes);
-			box.largesize |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
-			realBoxSize = box.largesize;
-		} else
-			realBoxSize = box.size;
+	/* version & flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t flags = ntohl(val32);
+	uint8_t version = (flags >> 24) & 0xFF;
+	flags &= ((1 << 24) - 1);
+	MP4_LOGD("# stts: version=%d", version);
+	MP4_LOGD("# stts: flags=%" PRIu32, flags);
 
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-			(maxBytes >= parentReadBytes + realBoxSize), -EINVAL,
-			"invalid size: %ld expected %ld min",
-			maxBytes, parentReadBytes + realBoxSize);
+	/* entry_count */
+	MP4_READ_32(box, val32, boxReadBytes);
+	track->timeToSampleEntryCount = ntohl(val32);
+	MP4_LOGD("# stts: entry_count=%" PRIu32, track->timeToSampleEntryCount);
 
-		/* keep the box in the tree */
-		struct mp4_box_item *item = malloc(sizeof(*item));
-		MP4_RETURN_ERR_IF_FAILED((item != NULL), -ENOMEM);
-		memset(item, 0, sizeof(*item));
-		memcpy(&item->box, &box, sizeof(box));
-		item->parent = parent;
-		if (prev == NULL) {
-			if (parent)
-				parent->child = item;
-		} else {
-			prev->next = item;
-			item->prev = prev;
-		}
-		prev = item;
+	off_t tableBytes = (off_t)track->timeToSampleEntryCount * 8;
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(maxBytes >= 8 + tableBytes), -EINVAL,
+		"invalid size: %ld expected %ld min",
+		maxBytes, 8 + tableBytes);
 
-		switch (box.type) {
-		case MP4_UUID:
-		{
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-				((unsigned)(realBoxSize - boxReadBytes) >=
-				sizeof(box.uuid)), -EINVAL,
-				"invalid size: %ld expected %zu min",
-				realBoxSize - boxReadBytes, sizeof(box.uuid));
+	track->timeToSampleEntries = mp4_demux_malloc_array(demux,
+		track->timeToSampleEntryCount,
+		sizeof(struct mp4_time_to_sample_entry));
+	MP4_RETURN_ERR_IF_FAILED((track->timeToSampleEntries != NULL), -ENOMEM);
 
-			/* box extended type */
-			size_t count = fread(box.uuid, sizeof(box.uuid),
-				1, demux->file);
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((count == 1), -EIO,
-				"failed to read %zu bytes from file",
-				sizeof(box.uuid));
-			boxReadBytes += sizeof(box.uuid);
-			break;
-		}
-		case MP4_MOVIE_BOX:
-		case MP4_USER_DATA_BOX:
-		case MP4_MEDIA_BOX:
-		case MP4_MEDIA_INFORMATION_BOX:
-		case MP4_DATA_INFORMATION_BOX:
-		case MP4_SAMPLE_TABLE_BOX:
-		{
-			off_t _ret = mp4_demux_parse_children(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
-		}
-		case MP4_FILE_TYPE_BOX:
-		{
-			off_t _ret = mp4_demux_parse_ftyp(
-				demux, item, realBoxSize - boxReadBytes);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
-		}
-		case MP4_MOVIE_HEADER_BOX:
-		{
+	/* the table size has been checked, decode without bounds checks;
+	 * the entries are (sample_count, sample_delta) pairs of 32-bit
+	 * words laid out like the file table */
+	mp4_be32_decode((uint32_t *)track->timeToSampleEntries,
+		box->data + boxReadBytes,
+		(size_t)track->timeToSampleEntryCount * 2);
+	boxReadBytes += tableBytes;
+
+	/* skip the rest of the box */
+	MP4_SKIP(box, boxReadBytes, maxBytes);
+
+	return boxReadBytes;
+}
+
+
+static off_t mp4_demux_parse_stss(
+	struct mp4_demux *demux,
+	struct mp4_box_item *parent,
+	struct mp4_box_reader *box,
+	struct mp4_track *track)
+{
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0;
+	uint32_t val32;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
+		"invalid track");
+
+	/* header-only: the table is left unread */
+	if (demux->config.flags & MP4_DEMUX_FLAG_HEADER_ONLY)
+		return 0;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(track->syncSampleEntries == NULL), -EEXIST,
+		"sync sample table already defined");
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 8);
+
+	/* version & flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t flags = ntohl(val32);
+	uint8_t version = (flags >> 24) & 0xFF;
+	flags &= ((1 << 24) - 1);
+	MP4_LOGD("# stss: version=%d", version);
+	MP4_LOGD("# stss: flags=%" PRIu32, flags);
+
+	/* entry_count */
+	MP4_READ_32(box, val32, boxReadBytes);
+	track->syncSampleEntryCount = ntohl(val32);
+	MP4_LOGD("# stss: entry_count=%" PRIu32, track->syncSampleEntryCount);
+
+	off_t tableBytes = (off_t)track->syncSampleEntryCount * 4;
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(maxBytes >= 8 + tableBytes), -EINVAL,
+		"invalid size: %ld expected %ld min",
+		maxBytes, 8 + tableBytes);
+
+	track->syncSampleEntries = mp4_demux_malloc_array(demux,
+		track->syncSampleEntryCount, sizeof(uint32_t));
+	MP4_RETURN_ERR_IF_FAILED((track->syncSampleEntries != NULL), -ENOMEM);
+
+	/* the table size has been checked, decode without bounds checks */
+	mp4_be32_decode(track->syncSampleEntries, box->data + boxReadBytes,
+		track->syncSampleEntryCount);
+	boxReadBytes += tableBytes;
+
+	/* skip the rest of the box */
+	MP4_SKIP(box, boxReadBytes, maxBytes);
+
+	return boxReadBytes;
+}
+
+
+static off_t mp4_demux_parse_stsz(
+	struct mp4_demux *demux,
+	struct mp4_box_item *parent,
+	struct mp4_box_reader *box,
+	struct mp4_track *track)
+{
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0;
+	uint32_t val32;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
+		"invalid track");
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(((track->sampleSize == NULL) &&
+		(track->constantSampleSize == 0)),
+		-EEXIST, "sample size table already defined");
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 12), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 12);
+
+	/* version & flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t flags = ntohl(val32);
+	uint8_t version = (flags >> 24) & 0xFF;
+	flags &= ((1 << 24) - 1);
+	MP4_LOGD("# stsz: version=%d", version);
+	MP4_LOGD("# stsz: flags=%" PRIu32, flags);
+
+	/* sample_size */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t sampleSize = ntohl(val32);
+	MP4_LOGD("# stsz: sample_size=%" PRIu32, sampleSize);
+
+	/* sample_count */
+	MP4_READ_32(box, val32, boxReadBytes);
+	track->sampleCount = ntohl(val32);
+	MP4_LOGD("# stsz: sample_count=%" PRIu32, track->sampleCount);
+
+	/* a constant size has no table to bound the sample count: the
+	 * samples must at least fit in the file */
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		((uint64_t)track->sampleCount * sampleSize <=
+		(uint64_t)demux->fileSize), -EINVAL,
+		"invalid sample count: %" PRIu32 " samples of %" PRIu32
+		" bytes", track->sampleCount, sampleSize);
+
+	/* header-only: only the sample count is needed */
+	if (demux->config.flags & MP4_DEMUX_FLAG_HEADER_ONLY)
+		return boxReadBytes;
+
+	if ((sampleSize != 0) &&
+		(demux->config.flags & MP4_DEMUX_FLAG_COMPACT_TABLES)) {
+		/* constant sample size, no table is needed */
+		track->constantSampleSize = sampleSize;
+		MP4_SKIP(box, boxReadBytes, maxBytes);
+		return boxReadBytes;
+	}
+
+	off_t tableBytes = (sampleSize == 0) ?
+		(off_t)track->sampleCount * 4 : 0;
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(maxBytes >= 12 + tableBytes), -EINVAL,
+		"invalid size: %ld expected %ld min",
+		maxBytes, 12 + tableBytes);
+
+	track->sampleSize = mp4_demux_malloc_array(demux,
+		track->sampleCount, sizeof(uint32_t));
+	MP4_RETURN_ERR_IF_FAILED((track->sampleSize != NULL), -ENOMEM);
+
+	if (sampleSize == 0) {
+		/* the table size has been checked, decode without
+		 * bounds checks */
+		mp4_be32_decode(track->sampleSize, box->data + boxReadBytes,
+			track->sampleCount);
+		boxReadBytes += tableBytes;
+	} else {
+		unsigned int i;
+		for (i = 0; i < track->sampleCount; i++)
+			track->sampleSize[i] = sampleSize;
+	}
+
+	/* skip the rest of the box */
+	MP4_SKIP(box, boxReadBytes, maxBytes);
+
+	return boxReadBytes;
+}
+
+
+static off_t mp4_demux_parse_stsc(
+	struct mp4_demux *demux,
+	struct mp4_box_item *parent,
+	struct mp4_box_reader *box,
+	struct mp4_track *track)
+{
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0;
+	uint32_t val32;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
+		"invalid track");
+
+	/* header-only: the table is left unread */
+	if (demux->config.flags & MP4_DEMUX_FLAG_HEADER_ONLY)
+		return 0;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(track->sampleToChunkEntries == NULL), -EEXIST,
+		"sample to chunk table already defined");
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 8);
+
+	/* version & flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t flags = ntohl(val32);
+	uint8_t version = (flags >> 24) & 0xFF;
+	flags &= ((1 << 24) - 1);
+	MP4_LOGD("# stsc: version=%d", version);
+	MP4_LOGD("# stsc: flags=%" PRIu32, flags);
+
+	/* entry_count */
+	MP4_READ_32(box, val32, boxReadBytes);
+	track->sampleToChunkEntryCount = ntohl(val32);
+	MP4_LOGD("# stsc: entry_count=%" PRIu32,
+		track->sampleToChunkEntryCount);
+
+	off_t tableBytes = (off_t)track->sampleToChunkEntryCount * 12;
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(maxBytes >= 8 + tableBytes), -EINVAL,
+		"invalid size: %ld expected %ld min",
+		maxBytes, 8 + tableBytes);
+
+	track->sampleToChunkEntries = mp4_demux_malloc_array(demux,
+		track->sampleToChunkEntryCount,
+		sizeof(struct mp4_sample_to_chunk_entry));
+	MP4_RETURN_ERR_IF_FAILED((track->sampleToChunkEntries != NULL),
+		-ENOMEM);
+
+	/* the table size has been checked, decode without bounds checks;
+	 * the entries are (first_chunk, samples_per_chunk,
+	 * sample_description_index) triplets of 32-bit words laid out
+	 * like the file table */
+	mp4_be32_decode((uint32_t *)track->sampleToChunkEntries,
+		box->data + boxReadBytes,
+		(size_t)track->sampleToChunkEntryCount * 3);
+	boxReadBytes += tableBytes;
+
+	/* skip the rest of the box */
+	MP4_SKIP(box, boxReadBytes, maxBytes);
+
+	return boxReadBytes;
+}
+
+
+static off_t mp4_demux_parse_stco(
+	struct mp4_demux *demux,
+	struct mp4_box_item *parent,
+	struct mp4_box_reader *box,
+	struct mp4_track *track)
+{
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0;
+	uint32_t val32;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
+		"invalid track");
+
+	/* header-only: the table is left unread */
+	if (demux->config.flags & MP4_DEMUX_FLAG_HEADER_ONLY)
+		return 0;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track->chunkOffset == NULL),
+		-EEXIST, "chunk offset table already defined");
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 8);
+
+	/* version & flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t flags = ntohl(val32);
+	uint8_t version = (flags >> 24) & 0xFF;
+	flags &= ((1 << 24) - 1);
+	MP4_LOGD("# stco: version=%d", version);
+	MP4_LOGD("# stco: flags=%" PRIu32, flags);
+
+	/* entry_count */
+	MP4_READ_32(box, val32, boxReadBytes);
+	track->chunkCount = ntohl(val32);
+	MP4_LOGD("# stco: entry_count=%" PRIu32, track->chunkCount);
+
+	off_t tableBytes = (off_t)track->chunkCount * 4;
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(maxBytes >= 8 + tableBytes), -EINVAL,
+		"invalid size: %ld expected %ld min",
+		maxBytes, 8 + tableBytes);
+
+	track->chunkOffset = mp4_demux_malloc_array(demux,
+		track->chunkCount, sizeof(uint64_t));
+	MP4_RETURN_ERR_IF_FAILED((track->chunkOffset != NULL), -ENOMEM);
+
+	/* the table size has been checked, decode without bounds checks */
+	mp4_be32_decode_u64(track->chunkOffset, box->data + boxReadBytes,
+		track->chunkCount);
+	boxReadBytes += tableBytes;
+
+	/* skip the rest of the box */
+	MP4_SKIP(box, boxReadBytes, maxBytes);
+
+	return boxReadBytes;
+}
+
+
+static off_t mp4_demux_parse_co64(
+	struct mp4_demux *demux,
+	struct mp4_box_item *parent,
+	struct mp4_box_reader *box,
+	struct mp4_track *track)
+{
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0;
+	uint32_t val32;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track != NULL), -EINVAL,
+		"invalid track");
+
+	/* header-only: the table is left unread */
+	if (demux->config.flags & MP4_DEMUX_FLAG_HEADER_ONLY)
+		return 0;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((track->chunkOffset == NULL),
+		-EEXIST, "chunk offset table already defined");
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 8);
+
+	/* version & flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t flags = ntohl(val32);
+	uint8_t version = (flags >> 24) & 0xFF;
+	flags &= ((1 << 24) - 1);
+	MP4_LOGD("# co64: version=%d", version);
+	MP4_LOGD("# co64: flags=%" PRIu32, flags);
+
+	/* entry_count */
+	MP4_READ_32(box, val32, boxReadBytes);
+	track->chunkCount = ntohl(val32);
+	MP4_LOGD("# co64: entry_count=%" PRIu32, track->chunkCount);
+
+	off_t tableBytes = (off_t)track->chunkCount * 8;
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(maxBytes >= 8 + tableBytes), -EINVAL,
+		"invalid size: %ld expected %ld min",
+		maxBytes, 8 + tableBytes);
+
+	track->chunkOffset = mp4_demux_malloc_array(demux,
+		track->chunkCount, sizeof(uint64_t));
+	MP4_RETURN_ERR_IF_FAILED((track->chunkOffset != NULL), -ENOMEM);
+
+	/* the table size has been checked, decode without bounds checks */
+	mp4_be64_decode(track->chunkOffset, box->data + boxReadBytes,
+		track->chunkCount);
+	boxReadBytes += tableBytes;
+
+	/* skip the rest of the box */
+	MP4_SKIP(box, boxReadBytes, maxBytes);
+
+	return boxReadBytes;
+}
+
+
+static off_t mp4_demux_parse_mehd(
+	struct mp4_demux *demux,
+	struct mp4_box_item *parent,
+	struct mp4_box_reader *box)
+{
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0;
+	uint64_t duration;
+	uint32_t val32;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 8);
+
+	/* version & flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t flags = ntohl(val32);
+	uint8_t version = (flags >> 24) & 0xFF;
+	flags &= ((1 << 24) - 1);
+	MP4_LOGD("# mehd: version=%d", version);
+	MP4_LOGD("# mehd: flags=%" PRIu32, flags);
+
+	/* fragment_duration */
+	MP4_READ_32(box, val32, boxReadBytes);
+	duration = ntohl(val32);
+	if (version == 1) {
+		MP4_READ_32(box, val32, boxReadBytes);
+		duration = (duration << 32) |
+			((uint64_t)ntohl(val32) & 0xFFFFFFFFULL);
+	}
+	MP4_LOGD("# mehd: fragment_duration=%" PRIu64, duration);
+
+	/* the movie header duration only covers the initial samples */
+	if (duration > demux->duration)
+		demux->duration = duration;
+
+	/* skip the rest of the box */
+	MP4_SKIP(box, boxReadBytes, maxBytes);
+
+	return boxReadBytes;
+}
+
+
+static off_t mp4_demux_parse_trex(
+	struct mp4_demux *demux,
+	struct mp4_box_item *parent,
+	struct mp4_box_reader *box)
+{
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0;
+	uint32_t val32;
+	struct mp4_track *tk;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 6 * 4), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 6 * 4);
+
+	/* version & flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t flags = ntohl(val32);
+	uint8_t version = (flags >> 24) & 0xFF;
+	flags &= ((1 << 24) - 1);
+	MP4_LOGD("# trex: version=%d", version);
+	MP4_LOGD("# trex: flags=%" PRIu32, flags);
+
+	/* track_ID */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t trackId = ntohl(val32);
+	MP4_LOGD("# trex: track_ID=%" PRIu32, trackId);
+
+	for (tk = demux->track; tk; tk = tk->next) {
+		if (tk->id == trackId)
+			break;
+	}
+	if (tk == NULL) {
+		MP4_LOGW("trex: track %" PRIu32 " not found", trackId);
+		MP4_SKIP(box, boxReadBytes, maxBytes);
+		return boxReadBytes;
+	}
+
+	/* default_sample_description_index */
+	MP4_READ_32(box, val32, boxReadBytes);
+	MP4_LOGD("# trex: default_sample_description_index=%" PRIu32,
+		ntohl(val32));
+
+	/* default_sample_duration */
+	MP4_READ_32(box, val32, boxReadBytes);
+	tk->defaultSampleDuration = ntohl(val32);
+	MP4_LOGD("# trex: default_sample_duration=%" PRIu32,
+		tk->defaultSampleDuration);
+
+	/* default_sample_size */
+	MP4_READ_32(box, val32, boxReadBytes);
+	tk->defaultSampleSize = ntohl(val32);
+	MP4_LOGD("# trex: default_sample_size=%" PRIu32,
+		tk->defaultSampleSize);
+
+	/* default_sample_flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	tk->defaultSampleFlags = ntohl(val32);
+	MP4_LOGD("# trex: default_sample_flags=0x%08" PRIX32,
+		tk->defaultSampleFlags);
+
+	/* skip the rest of the box */
+	MP4_SKIP(box, boxReadBytes, maxBytes);
+
+	return boxReadBytes;
+}
+
+
+static off_t mp4_demux_parse_xyz(
+	struct mp4_demux *demux,
+	struct mp4_box_item *parent,
+	struct mp4_box_reader *box,
+	struct mp4_track *track)
+{
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0;
+	uint16_t val16;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((parent != NULL), -EINVAL,
+		"invalid parent");
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 4), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 4);
+
+	/* location_size */
+	MP4_READ_16(box, val16, boxReadBytes);
+	uint16_t locationSize = ntohs(val16);
+	MP4_LOGD("# xyz: location_size=%d", locationSize);
+
+	/* language_code */
+	MP4_READ_16(box, val16, boxReadBytes);
+	uint16_t languageCode = ntohs(val16);
+	MP4_LOGD("# xyz: language_code=%d", languageCode);
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 4 + locationSize),
+		-EINVAL, "invalid size: %ld expected %d min",
+		maxBytes, 4 + locationSize);
+
+	demux->udtaLocationKey = mp4_demux_malloc(demux, 5);
+	MP4_RETURN_ERR_IF_FAILED((demux->udtaLocationKey != NULL), -ENOMEM);
+	demux->udtaLocationKey[0] = ((parent->box.type >> 24) & 0xFF);
+	demux->udtaLocationKey[1] = ((parent->box.type >> 16) & 0xFF);
+	demux->udtaLocationKey[2] = ((parent->box.type >> 8) & 0xFF);
+	demux->udtaLocationKey[3] = (parent->box.type & 0xFF);
+	demux->udtaLocationKey[4] = '\0';
+
+	demux->udtaLocationValue = mp4_demux_malloc(demux, locationSize + 1);
+	MP4_RETURN_ERR_IF_FAILED((demux->udtaLocationValue != NULL), -ENOMEM);
+	MP4_READ_BYTES(box, demux->udtaLocationValue, locationSize,
+		boxReadBytes);
+	demux->udtaLocationValue[locationSize] = '\0';
+	MP4_LOGD("# xyz: location=%s", demux->udtaLocationValue);
+
+	/* skip the rest of the box */
+	MP4_SKIP(box, boxReadBytes, maxBytes);
+
+	return boxReadBytes;
+}
+
+
+static int mp4_demux_count_ilst_sub_box(
+	struct mp4_demux *demux,
+	struct mp4_box_item *parent,
+	off_t maxBytes,
+	struct mp4_track *track)
+{
+	off_t totalReadBytes = 0, boxReadBytes = 0;
+	off_t originalOffset, realBoxSize;
+	uint32_t val32;
+	int lastBox = 0, count = 0;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 8);
+
+	originalOffset = mp4_demux_io_tell(demux);
+
+	while ((totalReadBytes + 8 <= maxBytes) && (!lastBox)) {
+		boxReadBytes = 0;
+
+		/* box size */
+		MP4_IO_READ_32(demux, val32, boxReadBytes);
+		uint32_t size = ntohl(val32);
+
+		/* box type */
+		MP4_IO_READ_32(demux, val32, boxReadBytes);
+
+		if (size == 0) {
+			/* box extends to end of file */
+			/*TODO*/
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, -ENOSYS,
+				"size == 0 for list element"
+				" is not implemented");
+		} else if (size == 1) {
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+				(maxBytes >= boxReadBytes + 16), -EINVAL,
+				"invalid size: %ld expected %ld min",
+				maxBytes, boxReadBytes + 16);
+
+			/* large size */
+			MP4_IO_READ_32(demux, val32, boxReadBytes);
+			realBoxSize = (uint64_t)ntohl(val32) << 32;
+			MP4_IO_READ_32(demux, val32, boxReadBytes);
+			realBoxSize |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
+		} else
+			realBoxSize = size;
+
+		count++;
+
+		/* skip the rest of the box */
+		MP4_IO_SKIP(demux, boxReadBytes, realBoxSize);
+		totalReadBytes += realBoxSize;
+	}
+
+	int ret = mp4_demux_io_seek(demux, originalOffset);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(ret == 0, ret,
+		"failed to seek to offset %ld in file", originalOffset);
+
+	return count;
+}
+
+
+static off_t mp4_demux_parse_meta_keys(
+	struct mp4_demux *demux,
+	struct mp4_box_item *parent,
+	struct mp4_box_reader *box,
+	struct mp4_track *track)
+{
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0;
+	uint32_t val32, i;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 8);
+
+	/* version & flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t flags = ntohl(val32);
+	uint8_t version = (flags >> 24) & 0xFF;
+	flags &= ((1 << 24) - 1);
+	MP4_LOGD("# keys: version=%d", version);
+	MP4_LOGD("# keys: flags=%" PRIu32, flags);
+
+	/* entry_count */
+	MP4_READ_32(box, val32, boxReadBytes);
+	demux->metaMetadataCount = ntohl(val32);
+	MP4_LOGD("# keys: entry_count=%" PRIu32, demux->metaMetadataCount);
+
+	off_t tableBytes = (off_t)demux->metaMetadataCount * 8;
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(maxBytes >= 8 + tableBytes), -EINVAL,
+		"invalid size: %ld expected %ld min",
+		maxBytes, 8 + tableBytes);
+
+	demux->metaMetadataKey = mp4_demux_calloc(demux, 
+		demux->metaMetadataCount, sizeof(char *));
+	MP4_RETURN_ERR_IF_FAILED((demux->metaMetadataKey != NULL), -ENOMEM);
+
+	demux->metaMetadataValue = mp4_demux_calloc(demux, 
+		demux->metaMetadataCount, sizeof(char *));
+	MP4_RETURN_ERR_IF_FAILED((demux->metaMetadataValue != NULL), -ENOMEM);
+
+	for (i = 0; i < demux->metaMetadataCount; i++) {
+		/* key_size */
+		MP4_READ_32(box, val32, boxReadBytes);
+		uint32_t keySize = ntohl(val32);
+		MP4_LOGD("# keys: key_size=%" PRIu32, keySize);
+
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((keySize >= 8), -EINVAL,
+			"invalid key size: %" PRIu32 " expected %d min",
+			keySize, 8);
+		keySize -= 8;
+
+		/* key_namespace */
+		MP4_READ_32(box, val32, boxReadBytes);
+		uint32_t keyNamespace = ntohl(val32);
+		MP4_LOGD("# keys: key_namespace=%c%c%c%c",
+			(char)((keyNamespace >> 24) & 0xFF),
+			(char)((keyNamespace >> 16) & 0xFF),
+			(char)((keyNamespace >> 8) & 0xFF),
+			(char)(keyNamespace & 0xFF));
+
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+			(maxBytes - boxReadBytes >= keySize), -EINVAL,
+			"invalid size: %ld expected %d min",
+			maxBytes - boxReadBytes, keySize);
+
+		demux->metaMetadataKey[i] =
+			mp4_demux_malloc(demux, keySize + 1);
+		MP4_RETURN_ERR_IF_FAILED((demux->metaMetadataKey[i] != NULL),
+			-ENOMEM);
+		MP4_READ_BYTES(box, demux->metaMetadataKey[i], keySize,
+			boxReadBytes);
+		demux->metaMetadataKey[i][keySize] = '\0';
+		MP4_LOGD("# keys: key_value[%i]=%s",
+			i, demux->metaMetadataKey[i]);
+	}
+
+	/* skip the rest of the box */
+	MP4_SKIP(box, boxReadBytes, maxBytes);
+
+	return boxReadBytes;
+}
+
+
+/* Load a string value of 'len' bytes from the current file position
+ * into a newly allocated, null-terminated buffer */
+static int mp4_demux_load_string(
+	struct mp4_demux *demux,
+	char **str,
+	size_t len)
+{
+	struct mp4_box_reader value;
+	int ret;
+
+	ret = mp4_demux_load_box(demux, &value, len);
+	MP4_RETURN_ERR_IF_FAILED((ret == 0), ret);
+	*str = mp4_demux_malloc(demux, len + 1);
+	MP4_RETURN_ERR_IF_FAILED((*str != NULL), -ENOMEM);
+	memcpy(*str, value.data, len);
+	(*str)[len] = '\0';
+
+	return 0;
+}
+
+
+static off_t mp4_demux_parse_meta_data(
+	struct mp4_demux *demux,
+	struct mp4_box_item *parent,
+	off_t maxBytes,
+	struct mp4_track *track)
+{
+	struct mp4_box_reader header;
+	struct mp4_box_reader *box = &header;
+	off_t boxReadBytes = 0;
+	uint32_t val32;
+	int ret;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((parent->parent != NULL), -EINVAL,
+		"invalid parent");
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 9), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 9);
+
+	/* only the type header is loaded here: the value is then loaded
+	 * for the strings and left in the file for the images */
+	ret = mp4_demux_load_box(demux, &header, 8);
+	MP4_RETURN_ERR_IF_FAILED((ret == 0), ret);
+
+	/* version & class */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t clazz = ntohl(val32);
+	uint8_t version = (clazz >> 24) & 0xFF;
+	clazz &= 0xFF;
+	MP4_LOGD("# data: version=%d", version);
+	MP4_LOGD("# data: class=%" PRIu32, clazz);
+
+	/* reserved */
+	MP4_READ_32(box, val32, boxReadBytes);
+
+	unsigned int valueLen = maxBytes - boxReadBytes;
+
+	if (clazz == MP4_METADATA_CLASS_UTF8) {
+		switch (parent->parent->box.type & 0xFFFFFF) {
+		case MP4_METADATA_TAG_TYPE_ARTIST:
+		case MP4_METADATA_TAG_TYPE_TITLE:
+		case MP4_METADATA_TAG_TYPE_DATE:
+		case MP4_METADATA_TAG_TYPE_COMMENT:
+		case MP4_METADATA_TAG_TYPE_COPYRIGHT:
+		case MP4_METADATA_TAG_TYPE_MAKER:
+		case MP4_METADATA_TAG_TYPE_MODEL:
+		case MP4_METADATA_TAG_TYPE_VERSION:
+		case MP4_METADATA_TAG_TYPE_ENCODER:
+		{
+			/* the arrays are sized by the first ilst pass; the
+			 * tag may also be outside of a udta ilst */
+			if ((demux->udtaMetadataKey == NULL) ||
+				(demux->udtaMetadataValue == NULL) ||
+				(demux->udtaMetadataParseIdx >=
+				demux->udtaMetadataCount)) {
+				MP4_LOGW("unexpected metadata tag, skipped");
+				break;
+			}
+			uint32_t idx = demux->udtaMetadataParseIdx++;
+			demux->udtaMetadataKey[idx] =
+				mp4_demux_malloc(demux, 5);
+			MP4_RETURN_ERR_IF_FAILED(
+				(demux->udtaMetadataKey[idx] != NULL), -ENOMEM);
+			demux->udtaMetadataKey[idx][0] =
+				((parent->parent->box.type >> 24) & 0xFF);
+			demux->udtaMetadataKey[idx][1] =
+				((parent->parent->box.type >> 16) & 0xFF);
+			demux->udtaMetadataKey[idx][2] =
+				((parent->parent->box.type >> 8) & 0xFF);
+			demux->udtaMetadataKey[idx][3] =
+				(parent->parent->box.type & 0xFF);
+			demux->udtaMetadataKey[idx][4] = '\0';
+			ret = mp4_demux_load_string(demux,
+				&demux->udtaMetadataValue[idx], valueLen);
+			MP4_RETURN_ERR_IF_FAILED((ret == 0), ret);
+			boxReadBytes += valueLen;
+			MP4_LOGD("# data: value[%s]=%s",
+				demux->udtaMetadataKey[idx],
+				demux->udtaMetadataValue[idx]);
+			break;
+		}
+		default:
+		{
+			if ((demux->metaMetadataValue != NULL) &&
+				(parent->parent->box.type > 0) &&
+				(parent->parent->box.type <=
+				demux->metaMetadataCount)) {
+				uint32_t idx = parent->parent->box.type - 1;
+				ret = mp4_demux_load_string(demux,
+					&demux->metaMetadataValue[idx],
+					valueLen);
+				MP4_RETURN_ERR_IF_FAILED((ret == 0), ret);
+				boxReadBytes += valueLen;
+				MP4_LOGD("# data: value[%s]=%s",
+					demux->metaMetadataKey[idx],
+					demux->metaMetadataValue[idx]);
+			}
+			break;
+		}
+		}
+	} else if ((clazz == MP4_METADATA_CLASS_JPEG) ||
+		(clazz == MP4_METADATA_CLASS_PNG) ||
+		(clazz == MP4_METADATA_CLASS_BMP)) {
+		uint32_t type = parent->parent->box.type;
+		if (type == MP4_METADATA_TAG_TYPE_COVER) {
+			demux->udtaCoverOffset = box->offset + boxReadBytes;
+			demux->udtaCoverSize = valueLen;
+			switch (clazz) {
+			default:
+			case MP4_METADATA_CLASS_JPEG:
+				demux->udtaCoverType =
+					MP4_METADATA_COVER_TYPE_JPEG;
+				break;
+			case MP4_METADATA_CLASS_PNG:
+				demux->udtaCoverType =
+					MP4_METADATA_COVER_TYPE_PNG;
+				break;
+			case MP4_METADATA_CLASS_BMP:
+				demux->udtaCoverType =
+					MP4_METADATA_COVER_TYPE_BMP;
+				break;
+			}
+			MP4_LOGD("# data: udta cover offset=0x%lX"
+				" size=%d type=%d", demux->udtaCoverOffset,
+				demux->udtaCoverSize, demux->udtaCoverType);
+		} else if ((demux->metaMetadataKey != NULL) && (type > 0) &&
+			(type <= demux->metaMetadataCount) &&
+			(!strcmp(demux->metaMetadataKey[type - 1],
+				MP4_METADATA_KEY_COVER))) {
+			demux->metaCoverOffset = box->offset + boxReadBytes;
+			demux->metaCoverSize = valueLen;
+			switch (clazz) {
+			default:
+			case MP4_METADATA_CLASS_JPEG:
+				demux->metaCoverType =
+					MP4_METADATA_COVER_TYPE_JPEG;
+				break;
+			case MP4_METADATA_CLASS_PNG:
+				demux->metaCoverType =
+					MP4_METADATA_COVER_TYPE_PNG;
+				break;
+			case MP4_METADATA_CLASS_BMP:
+				demux->metaCoverType =
+					MP4_METADATA_COVER_TYPE_BMP;
+				break;
+			}
+			MP4_LOGD("# data: meta cover offset=0x%lX"
+				" size=%d type=%d", demux->metaCoverOffset,
+				demux->metaCoverSize, demux->metaCoverType);
+		}
+	}
+
+	/* the rest of the box is skipped by the caller */
+	return boxReadBytes;
+}
+
+
+static int mp4_demux_is_leaf_box(
+	struct mp4_box_item *parent,
+	uint32_t type)
+{
+	switch (type) {
+	case MP4_FILE_TYPE_BOX:
+	case MP4_MOVIE_HEADER_BOX:
+	case MP4_TRACK_HEADER_BOX:
+	case MP4_TRACK_REFERENCE_BOX:
+	case MP4_HANDLER_REFERENCE_BOX:
+	case MP4_MEDIA_HEADER_BOX:
+	case MP4_VIDEO_MEDIA_HEADER_BOX:
+	case MP4_SOUND_MEDIA_HEADER_BOX:
+	case MP4_HINT_MEDIA_HEADER_BOX:
+	case MP4_NULL_MEDIA_HEADER_BOX:
+	case MP4_SAMPLE_DESCRIPTION_BOX:
+	case MP4_DECODING_TIME_TO_SAMPLE_BOX:
+	case MP4_SYNC_SAMPLE_BOX:
+	case MP4_SAMPLE_SIZE_BOX:
+	case MP4_SAMPLE_TO_CHUNK_BOX:
+	case MP4_CHUNK_OFFSET_BOX:
+	case MP4_CHUNK_OFFSET_64_BOX:
+	case MP4_MOVIE_EXTENDS_HEADER_BOX:
+	case MP4_TRACK_EXTENDS_BOX:
+		return 1;
+	case MP4_LOCATION_BOX:
+		return ((parent) && (parent->box.type == MP4_USER_DATA_BOX));
+	case MP4_KEYS_BOX:
+		return ((parent) && (parent->box.type == MP4_META_BOX));
+	default:
+		return 0;
+	}
+}
+
+
+/* Number of bytes of a leaf box payload to load before parsing it; in
+ * header-only mode the sample tables are skipped without being read
+ * except for the stsz header, which holds the sample count */
+static off_t mp4_demux_leaf_box_load_size(
+	struct mp4_demux *demux,
+	uint32_t type,
+	off_t size)
+{
+	if (!(demux->config.flags & MP4_DEMUX_FLAG_HEADER_ONLY))
+		return size;
+
+	switch (type) {
+	case MP4_SAMPLE_SIZE_BOX:
+		return (size > 12) ? 12 : size;
+	case MP4_DECODING_TIME_TO_SAMPLE_BOX:
+	case MP4_SYNC_SAMPLE_BOX:
+	case MP4_SAMPLE_TO_CHUNK_BOX:
+	case MP4_CHUNK_OFFSET_BOX:
+	case MP4_CHUNK_OFFSET_64_BOX:
+		return 0;
+	default:
+		return size;
+	}
+}
+
+
+static uint64_t mp4_demux_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+/* Account the parsing time of a box; once the table is full the other
+ * box types share its last entry, with a zero type */
+static void mp4_demux_stats_add_box(
+	struct mp4_demux *demux,
+	uint32_t type,
+	uint64_t time)
+{
+	struct mp4_demux_stats *st = &demux->stats;
+	unsigned int i;
+
+	for (i = 0; i < st->box_type_count; i++) {
+		if (st->box_types[i].type == type)
+			break;
+	}
+	if (i == st->box_type_count) {
+		if (i >= MP4_DEMUX_STATS_BOX_TYPE_MAX - 1) {
+			i = MP4_DEMUX_STATS_BOX_TYPE_MAX - 1;
+			st->box_types[i].type = 0;
+			st->box_type_count = MP4_DEMUX_STATS_BOX_TYPE_MAX;
+		} else {
+			st->box_types[i].type = type;
+			st->box_type_count++;
+		}
+	}
+	st->box_types[i].count++;
+	st->box_types[i].parse_time += time;
+}
+
+
+static off_t mp4_demux_parse_children(
+	struct mp4_demux *demux,
+	struct mp4_box_item *parent,
+	off_t maxBytes,
+	struct mp4_track *track)
+{
+	off_t parentReadBytes = 0;
+	int ret = 0, lastBox = 0;
+	struct mp4_box_item *prev = (parent) ? parent->child : NULL;
+
+	/* append after the boxes parsed by a previous walk */
+	while ((prev) && (prev->next))
+		prev = prev->next;
+
+	while ((!mp4_demux_io_eof(demux)) && (!lastBox) &&
+		(parentReadBytes + 8 < maxBytes)) {
+		off_t boxReadBytes = 0, realBoxSize;
+		off_t boxOffset = mp4_demux_io_tell(demux);
+		uint32_t val32;
+		struct mp4_box box;
+		memset(&box, 0, sizeof(box));
+
+		/* box size & type */
+		uint32_t header[2];
+		ret = mp4_demux_io_read(demux, header, sizeof(header));
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to read %zu bytes from file", sizeof(header));
+		boxReadBytes += sizeof(header);
+		box.size = ntohl(header[0]);
+		box.type = ntohl(header[1]);
+		if ((parent) && (parent->box.type == MP4_ILST_BOX) &&
+			(box.type <= demux->metaMetadataCount))
+			MP4_LOGD("offset 0x%lX metadata box size %" PRIu32,
+				mp4_demux_io_tell(demux), box.size);
+		else
+			MP4_LOGD("offset 0x%lX box '%c%c%c%c' size %" PRIu32,
+				mp4_demux_io_tell(demux),
+				(box.type >> 24) & 0xFF,
+				(box.type >> 16) & 0xFF,
+				(box.type >> 8) & 0xFF,
+				box.type & 0xFF, box.size);
+
+		if (box.size == 0) {
+			/* box extends to end of file */
+			lastBox = 1;
+			realBoxSize = demux->fileSize - demux->readBytes;
+		} else if (box.size == 1) {
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+				(maxBytes >= parentReadBytes + 16), -EINVAL,
+				"invalid size: %ld expected %ld min",
+				maxBytes, parentReadBytes + 16);
+
+			/* large size */
+			MP4_IO_READ_32(demux, val32, boxReadBytes);
+			box.largesize = (uint64_t)ntohl(val32) << 32;
+			MP4_IO_READ_32(demux, val32, boxReadBytes);
+			box.largesize |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
+			realBoxSize = box.largesize;
+		} else
+			realBoxSize = box.size;
+
+		/* in fragmented files the fragments are read on demand:
+		 * stop at the first one, which may still be incomplete if
+		 * the file is being written */
+		if ((parent == &demux->root) && (demux->fragmented) &&
+			((box.type == MP4_MOVIE_FRAGMENT_BOX) ||
+			((box.type == MP4_MEDIA_DATA_BOX) &&
+			(maxBytes < parentReadBytes + realBoxSize)))) {
+			demux->firstFragmentOffset = boxOffset;
+			break;
+		}
+
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+			(maxBytes >= parentReadBytes + realBoxSize), -EINVAL,
+			"invalid size: %ld expected %ld min",
+			maxBytes, parentReadBytes + realBoxSize);
+
+		uint64_t startTime = (demux->config.flags &
+			MP4_DEMUX_FLAG_BOX_STATS) ? mp4_demux_time_ns() : 0;
+
+		/* keep the box in the tree */
+		struct mp4_box_item *item =
+			mp4_demux_malloc(demux, sizeof(*item));
+		MP4_RETURN_ERR_IF_FAILED((item != NULL), -ENOMEM);
+		memset(item, 0, sizeof(*item));
+		memcpy(&item->box, &box, sizeof(box));
+		item->parent = parent;
+		if (prev == NULL) {
+			if (parent)
+				parent->child = item;
+		} else {
+			prev->next = item;
+			item->prev = prev;
+		}
+		prev = item;
+
+		/* load the whole payload of the boxes that are parsed
+		 * field by field */
+		struct mp4_box_reader reader = {NULL, 0, 0};
+		if (mp4_demux_is_leaf_box(parent, box.type)) {
+			ret = mp4_demux_load_box(demux, &reader,
+				mp4_demux_leaf_box_load_size(demux, box.type,
+				realBoxSize - boxReadBytes));
+			if (ret < 0)
+				break;
+		}
+
+		switch (box.type) {
+		case MP4_UUID:
+		{
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+				((unsigned)(realBoxSize - boxReadBytes) >=
+				sizeof(box.uuid)), -EINVAL,
+				"invalid size: %ld expected %zu min",
+				realBoxSize - boxReadBytes, sizeof(box.uuid));
+
+			/* box extended type */
+			int _err = mp4_demux_io_read(demux, box.uuid,
+				sizeof(box.uuid));
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((_err == 0), _err,
+				"failed to read %zu bytes from file",
+				sizeof(box.uuid));
+			boxReadBytes += sizeof(box.uuid);
+			break;
+		}
+		case MP4_MOVIE_BOX:
+		{
+			/* one read for the whole moov with custom I/O; in
+			 * header-only mode the tables are skipped instead,
+			 * unless round trips matter more (tail probe) */
+			if ((!(demux->config.flags &
+				MP4_DEMUX_FLAG_HEADER_ONLY)) ||
+				(demux->config.flags &
+				MP4_DEMUX_FLAG_TAIL_PROBE)) {
+				int _err = mp4_demux_io_window_load(demux,
+					mp4_demux_io_tell(demux),
+					realBoxSize - boxReadBytes);
+				MP4_RETURN_ERR_IF_FAILED((_err == 0), _err);
+			}
+			off_t _ret = mp4_demux_parse_children(
+				demux, item, realBoxSize - boxReadBytes, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_MOVIE_EXTENDS_BOX:
+			demux->fragmented = 1;
+			/* fall through */
+		case MP4_USER_DATA_BOX:
+		case MP4_MEDIA_BOX:
+		case MP4_MEDIA_INFORMATION_BOX:
+		case MP4_DATA_INFORMATION_BOX:
+		case MP4_SAMPLE_TABLE_BOX:
+		{
+			off_t _ret = mp4_demux_parse_children(
+				demux, item, realBoxSize - boxReadBytes, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_FILE_TYPE_BOX:
+		{
+			off_t _ret = mp4_demux_parse_ftyp(
+				demux, item, &reader);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_MOVIE_HEADER_BOX:
+		{
 			off_t _ret = mp4_demux_parse_mvhd(
-				demux, item, realBoxSize - boxReadBytes);
+				demux, item, &reader);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_TRACK_BOX:
+		{
+			/* keep the track in the list */
+			struct mp4_track *tk =
+				mp4_demux_malloc(demux, sizeof(*tk));
+			MP4_RETURN_ERR_IF_FAILED((tk != NULL), -ENOMEM);
+			memset(tk, 0, sizeof(*tk));
+			tk->next = demux->track;
+			if (demux->track)
+				demux->track->prev = tk;
+			demux->track = tk;
+			demux->trackCount++;
+
+			off_t _ret = mp4_demux_parse_children(
+				demux, item, realBoxSize - boxReadBytes, tk);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_TRACK_HEADER_BOX:
+		{
+			off_t _ret = mp4_demux_parse_tkhd(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_TRACK_REFERENCE_BOX:
+		{
+			off_t _ret = mp4_demux_parse_tref(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_HANDLER_REFERENCE_BOX:
+		{
+			off_t _ret = mp4_demux_parse_hdlr(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_MEDIA_HEADER_BOX:
+		{
+			off_t _ret = mp4_demux_parse_mdhd(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_VIDEO_MEDIA_HEADER_BOX:
+		{
+			off_t _ret = mp4_demux_parse_vmhd(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_SOUND_MEDIA_HEADER_BOX:
+		{
+			off_t _ret = mp4_demux_parse_smhd(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_HINT_MEDIA_HEADER_BOX:
+		{
+			off_t _ret = mp4_demux_parse_hmhd(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_NULL_MEDIA_HEADER_BOX:
+		{
+			off_t _ret = mp4_demux_parse_nmhd(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_SAMPLE_DESCRIPTION_BOX:
+		{
+			off_t _ret = mp4_demux_parse_stsd(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_DECODING_TIME_TO_SAMPLE_BOX:
+		{
+			off_t _ret = mp4_demux_parse_stts(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_SYNC_SAMPLE_BOX:
+		{
+			off_t _ret = mp4_demux_parse_stss(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_SAMPLE_SIZE_BOX:
+		{
+			off_t _ret = mp4_demux_parse_stsz(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_SAMPLE_TO_CHUNK_BOX:
+		{
+			off_t _ret = mp4_demux_parse_stsc(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_CHUNK_OFFSET_BOX:
+		{
+			off_t _ret = mp4_demux_parse_stco(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_CHUNK_OFFSET_64_BOX:
+		{
+			off_t _ret = mp4_demux_parse_co64(
+				demux, item, &reader, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_MOVIE_EXTENDS_HEADER_BOX:
+		{
+			off_t _ret = mp4_demux_parse_mehd(
+				demux, item, &reader);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_TRACK_EXTENDS_BOX:
+		{
+			off_t _ret = mp4_demux_parse_trex(
+				demux, item, &reader);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_META_BOX:
+		{
+			if ((parent) &&
+				(parent->box.type == MP4_USER_DATA_BOX)) {
+				MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+					(realBoxSize - boxReadBytes >= 4),
+					-EINVAL,
+					"invalid size: %ld expected %d min",
+					realBoxSize - boxReadBytes, 4);
+
+				/* version & flags */
+				MP4_IO_READ_32(demux, val32, boxReadBytes);
+				uint32_t flags = ntohl(val32);
+				uint8_t version = (flags >> 24) & 0xFF;
+				flags &= ((1 << 24) - 1);
+				MP4_LOGD("# meta: version=%d", version);
+				MP4_LOGD("# meta: flags=%" PRIu32, flags);
+
+				off_t _ret = mp4_demux_parse_children(
+					demux, item,
+					realBoxSize - boxReadBytes, track);
+				MP4_RETURN_ERR_IF_FAILED((_ret >= 0),
+					(int)_ret);
+				boxReadBytes += _ret;
+			} else if ((parent) &&
+				(parent->box.type == MP4_MOVIE_BOX)) {
+				off_t _ret = mp4_demux_parse_children(
+					demux, item,
+					realBoxSize - boxReadBytes, track);
+				MP4_RETURN_ERR_IF_FAILED((_ret >= 0),
+					(int)_ret);
+				boxReadBytes += _ret;
+			}
+			break;
+		}
+		case MP4_ILST_BOX:
+		{
+			if ((parent) && (parent->parent) &&
+				(parent->parent->box.type ==
+				MP4_USER_DATA_BOX)) {
+				int _count = mp4_demux_count_ilst_sub_box(
+					demux, item,
+					realBoxSize - boxReadBytes, track);
+				MP4_RETURN_ERR_IF_FAILED((_count >= 0),
+					_count);
+				demux->udtaMetadataCount = _count;
+				if (demux->udtaMetadataCount > 0) {
+					char **key =
+						mp4_demux_calloc(demux,
+						demux->udtaMetadataCount,
+						sizeof(char *));
+					MP4_RETURN_ERR_IF_FAILED(
+						(key != NULL), -ENOMEM);
+					demux->udtaMetadataKey = key;
+
+					char **value =
+						mp4_demux_calloc(demux,
+						demux->udtaMetadataCount,
+						sizeof(char *));
+					MP4_RETURN_ERR_IF_FAILED(
+						(value != NULL), -ENOMEM);
+					demux->udtaMetadataValue = value;
+
+					demux->udtaMetadataParseIdx = 0;
+				}
+			}
+			off_t _ret = mp4_demux_parse_children(
+				demux, item, realBoxSize - boxReadBytes, track);
+			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
+			boxReadBytes += _ret;
+			break;
+		}
+		case MP4_DATA_BOX:
+		{
+			off_t _ret = mp4_demux_parse_meta_data(demux, item,
+				realBoxSize - boxReadBytes, track);
 			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
 			boxReadBytes += _ret;
 			break;
 		}
-		case MP4_TRACK_BOX:
-		{
-			/* keep the track in the list */
-			struct mp4_track *tk = malloc(sizeof(*tk));
-			MP4_RETURN_ERR_IF_FAILED((tk != NULL), -ENOMEM);
-			memset(tk, 0, sizeof(*tk));
-			tk->next = demux->track;
-			if (demux->track)
-				demux->track->prev = tk;
-			demux->track = tk;
-			demux->trackCount++;
+		case MP4_LOCATION_BOX:
+		{
+			if ((parent) &&
+				(parent->box.type == MP4_USER_DATA_BOX)) {
+				off_t _ret = mp4_demux_parse_xyz(
+					demux, item,
+					&reader, track);
+				MP4_RETURN_ERR_IF_FAILED((_ret >= 0),
+					(int)_ret);
+				boxReadBytes += _ret;
+			}
+			break;
+		}
+		case MP4_KEYS_BOX:
+		{
+			if ((parent) && (parent->box.type == MP4_META_BOX)) {
+				off_t _ret = mp4_demux_parse_meta_keys(
+					demux, item,
+					&reader, track);
+				MP4_RETURN_ERR_IF_FAILED((_ret >= 0),
+					(int)_ret);
+				boxReadBytes += _ret;
+			}
+			break;
+		}
+		default:
+		{
+			if ((parent) && (parent->box.type == MP4_ILST_BOX)) {
+				off_t _ret = mp4_demux_parse_children(
+					demux, item,
+					realBoxSize - boxReadBytes, track);
+				MP4_RETURN_ERR_IF_FAILED((_ret >= 0),
+					(int)_ret);
+				boxReadBytes += _ret;
+			}
+			break;
+		}
+		}
+
+		/* skip the rest of the box */
+		if (realBoxSize < boxReadBytes) {
+			MP4_LOGE("invalid box size %ld (read bytes: %ld)",
+				realBoxSize, boxReadBytes);
+			ret = -EIO;
+			break;
+		}
+		int _ret = (realBoxSize > boxReadBytes) ? mp4_demux_io_skip(
+			demux, realBoxSize - boxReadBytes) : 0;
+		if (_ret != 0) {
+			MP4_LOGE("failed to seek %ld bytes forward in file",
+				realBoxSize - boxReadBytes);
+			ret = -EIO;
+			break;
+		}
+
+		mp4_demux_stats_add_box(demux, box.type,
+			(demux->config.flags & MP4_DEMUX_FLAG_BOX_STATS) ?
+			mp4_demux_time_ns() - startTime : 0);
+		parentReadBytes += realBoxSize;
+	}
+
+	return (ret < 0) ? ret : parentReadBytes;
+}
+
+
+/* Expand the run-length sample tables into per-sample offsets and
+ * decoding times; the tables must have been validated beforehand */
+static int mp4_demux_expand_sample_tables(
+	struct mp4_demux *demux,
+	struct mp4_track *tk)
+{
+	unsigned int i, j, k, n;
+	uint32_t lastFirstChunk = 1, lastSamplesPerChunk = 0;
+	uint32_t chunkCount, chunkIdx;
+	uint64_t offsetInChunk;
+
+	tk->sampleOffset = mp4_demux_malloc_array(demux,
+		tk->sampleCount, sizeof(uint64_t));
+	MP4_RETURN_ERR_IF_FAILED((tk->sampleOffset != NULL), -ENOMEM);
+
+	for (i = 0, n = 0, chunkIdx = 0;
+		i < tk->sampleToChunkEntryCount; i++) {
+		chunkCount = tk->sampleToChunkEntries[i].firstChunk -
+			lastFirstChunk;
+		for (j = 0; j < chunkCount; j++, chunkIdx++) {
+			for (k = 0, offsetInChunk = 0;
+				k < lastSamplesPerChunk; k++, n++) {
+				tk->sampleOffset[n] =
+					tk->chunkOffset[chunkIdx] +
+					offsetInChunk;
+				offsetInChunk += tk->sampleSize[n];
+			}
+		}
+		lastFirstChunk = tk->sampleToChunkEntries[i].firstChunk;
+		lastSamplesPerChunk =
+			tk->sampleToChunkEntries[i].samplesPerChunk;
+	}
+	chunkCount = tk->chunkCount - lastFirstChunk + 1;
+	for (j = 0; j < chunkCount; j++, chunkIdx++) {
+		for (k = 0, offsetInChunk = 0;
+			k < lastSamplesPerChunk; k++, n++) {
+			tk->sampleOffset[n] =
+				tk->chunkOffset[chunkIdx] + offsetInChunk;
+			offsetInChunk += tk->sampleSize[n];
+		}
+	}
+
+	tk->sampleDecodingTime = mp4_demux_malloc_array(demux,
+		tk->sampleCount, sizeof(uint64_t));
+	if (tk->sampleDecodingTime == NULL) {
+		mp4_demux_free(demux, tk->sampleOffset);
+		tk->sampleOffset = NULL;
+		MP4_RETURN_ERR_IF_FAILED(0, -ENOMEM);
+	}
+
+	/* the delta is constant within a run: fill each run without the
+	 * serial prefix sum */
+	uint64_t ts = 0;
+	for (i = 0, k = 0; i < tk->timeToSampleEntryCount; i++) {
+		uint32_t count = tk->timeToSampleEntries[i].sampleCount;
+		uint32_t delta = tk->timeToSampleEntries[i].sampleDelta;
+		mp4_u64_fill_step(&tk->sampleDecodingTime[k], ts, delta,
+			count);
+		k += count;
+		ts += (uint64_t)count * delta;
+	}
+
+	return 0;
+}
+
+
+/* Validate the sample tables of a track and build its sample index;
+ * done once per track, at open time or on first use in lazy mode */
+static int mp4_demux_build_sample_tables(
+	struct mp4_demux *demux,
+	struct mp4_track *tk)
+{
+	unsigned int i;
+	uint32_t lastFirstChunk = 1, lastSamplesPerChunk = 0;
+	uint32_t chunkCount;
+	uint64_t sampleCount = 0;
+
+	if (tk->sampleTablesBuilt)
+		return 0;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(!(demux->config.flags & MP4_DEMUX_FLAG_HEADER_ONLY)),
+		-EOPNOTSUPP, "no sample tables in header-only mode");
+
+	for (i = 0; i < tk->sampleToChunkEntryCount; i++) {
+		if ((tk->sampleToChunkEntries[i].firstChunk <
+			lastFirstChunk) ||
+			(tk->sampleToChunkEntries[i].firstChunk >
+			tk->chunkCount + 1)) {
+			MP4_LOGE("invalid first chunk: %d",
+				tk->sampleToChunkEntries[i].firstChunk);
+			return -EPROTO;
+		}
+		chunkCount = tk->sampleToChunkEntries[i].firstChunk -
+			lastFirstChunk;
+		sampleCount += (uint64_t)chunkCount * lastSamplesPerChunk;
+		/* fail before summing more runs than the track has */
+		if (sampleCount > tk->sampleCount) {
+			MP4_LOGE("sample count mismatch: %" PRIu64
+				" vs. %d", sampleCount, tk->sampleCount);
+			return -EPROTO;
+		}
+		lastFirstChunk = tk->sampleToChunkEntries[i].firstChunk;
+		lastSamplesPerChunk =
+			tk->sampleToChunkEntries[i].samplesPerChunk;
+	}
+	chunkCount = tk->chunkCount - lastFirstChunk + 1;
+	sampleCount += (uint64_t)chunkCount * lastSamplesPerChunk;
+
+	if (sampleCount != tk->sampleCount) {
+		MP4_LOGE("sample count mismatch: %" PRIu64 " vs. %d",
+			sampleCount, tk->sampleCount);
+		return -EPROTO;
+	}
+
+	for (i = 0, sampleCount = 0; (i < tk->timeToSampleEntryCount) &&
+		(sampleCount <= tk->sampleCount); i++)
+		sampleCount += tk->timeToSampleEntries[i].sampleCount;
+
+	if (sampleCount != tk->sampleCount) {
+		MP4_LOGE("sample count mismatch: %" PRIu64 " vs. %d",
+			sampleCount, tk->sampleCount);
+		return -EPROTO;
+	}
+
+	mp4_demux_sample_cursor_reset(tk, &tk->cursor);
+
+	/* the fragments start after the samples described in the moov */
+	if (demux->fragmented) {
+		tk->fragmented = 1;
+		tk->fragmentNextOffset = demux->firstFragmentOffset;
+		for (i = 0; i < tk->timeToSampleEntryCount; i++) {
+			tk->fragmentFirstDts += (uint64_t)
+				tk->timeToSampleEntries[i].sampleCount *
+				tk->timeToSampleEntries[i].sampleDelta;
+		}
+		tk->fragmentNextDts = tk->fragmentFirstDts;
+	}
+
+	/* one bit per sample for O(1) sync sample tests */
+	if ((tk->syncSampleEntries) && (tk->sampleCount > 0) &&
+		(tk->syncSampleBits == NULL)) {
+		tk->syncSampleBits = mp4_demux_calloc(demux,
+			(tk->sampleCount + 7) / 8, 1);
+		MP4_RETURN_ERR_IF_FAILED((tk->syncSampleBits != NULL),
+			-ENOMEM);
+		for (i = 0; i < tk->syncSampleEntryCount; i++) {
+			uint32_t idx = tk->syncSampleEntries[i] - 1;
+			if (idx < tk->sampleCount)
+				tk->syncSampleBits[idx >> 3] |= 1 << (idx & 7);
+		}
+	}
+
+	/* in compact mode offsets and decoding times are resolved
+	 * on demand from the sample tables */
+	if (!(demux->config.flags & MP4_DEMUX_FLAG_COMPACT_TABLES)) {
+		int ret = mp4_demux_expand_sample_tables(demux, tk);
+		if (ret < 0)
+			return ret;
+	}
+
+	tk->sampleTablesBuilt = 1;
+
+	return 0;
+}
+
+
+/* Build the sample tables of a track and of its linked metadata track
+ * before they are used */
+static int mp4_demux_prepare_track(
+	struct mp4_demux *demux,
+	struct mp4_track *tk)
+{
+	int ret = mp4_demux_build_sample_tables(demux, tk);
+	if ((ret == 0) && (tk->metadata))
+		ret = mp4_demux_build_sample_tables(demux, tk->metadata);
+	return ret;
+}
+
+
+/* Refresh the file size, which grows while a fragmented file is being
+ * written; mappings keep the size they were created with */
+static int mp4_demux_io_update_size(
+	struct mp4_demux *demux)
+{
+	if (demux->map)
+		return 0;
+
+	if (demux->io.read) {
+		int64_t size = demux->io.size(demux->ioOpaque);
+		if (size < 0)
+			return (int)size;
+		if (size > demux->fileSize)
+			demux->fileSize = size;
+		/* the size callback may have moved the stream position */
+		demux->ioBackendOffset = -1;
+		return 0;
+	}
+
+	int ret = fseeko(demux->file, 0, SEEK_END);
+	if (ret != 0)
+		return -errno;
+	off_t size = ftello(demux->file);
+	if (size > demux->fileSize)
+		demux->fileSize = size;
+
+	return 0;
+}
+
+
+/* Load 'size' bytes at absolute offset 'offset'; see
+ * mp4_demux_load_box() */
+static int mp4_demux_load_box_at(
+	struct mp4_demux *demux,
+	struct mp4_box_reader *box,
+	off_t offset,
+	off_t size)
+{
+	if (demux->map) {
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+			((offset >= 0) && (size >= 0) &&
+			(offset <= demux->fileSize) &&
+			(size <= demux->fileSize - offset)), -EIO,
+			"failed to read %ld bytes from file", size);
+		box->offset = offset;
+		box->size = size;
+		box->data = demux->map + offset;
+		return 0;
+	}
+
+	if ((size_t)size > demux->boxBufferSize) {
+		uint8_t *buf = mp4_demux_scratch_realloc(demux,
+			demux->boxBuffer, demux->boxBufferSize, size);
+		MP4_RETURN_ERR_IF_FAILED((buf != NULL), -ENOMEM);
+		demux->boxBuffer = buf;
+		demux->boxBufferSize = size;
+	}
+
+	box->offset = offset;
+	box->size = size;
+	box->data = demux->boxBuffer;
+
+	if (size > 0) {
+		int ret = mp4_demux_io_pread(demux, offset,
+			demux->boxBuffer, size);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to read %ld bytes from file", size);
+	}
+
+	return 0;
+}
+
+
+/* Get the next child box of an in-memory box payload; returns 1 and
+ * advances 'pos' if there is one, 0 at the end of the payload */
+static int mp4_demux_next_child_box(
+	struct mp4_box_reader *parent,
+	off_t *pos,
+	uint32_t *type,
+	struct mp4_box_reader *child)
+{
+	off_t headerSize = 8;
+	uint64_t size;
+
+	if (parent->size - *pos < 8)
+		return 0;
+
+	size = mp4_demux_be32(parent->data + *pos);
+	*type = mp4_demux_be32(parent->data + *pos + 4);
+	if (size == 1) {
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+			(parent->size - *pos >= 16), -EPROTO,
+			"invalid box size");
+		size = mp4_demux_be64(parent->data + *pos + 8);
+		headerSize = 16;
+	} else if (size == 0) {
+		size = parent->size - *pos;
+	}
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(((size >= (uint64_t)headerSize) &&
+		(size <= (uint64_t)(parent->size - *pos))), -EPROTO,
+		"invalid box size: %" PRIu64, size);
+
+	child->data = parent->data + *pos + headerSize;
+	child->size = size - headerSize;
+	child->offset = parent->offset + *pos + headerSize;
+	*pos += size;
+
+	return 1;
+}
+
+
+static struct mp4_track *mp4_demux_find_track(
+	struct mp4_demux *demux,
+	uint32_t id)
+{
+	struct mp4_track *tk;
+	uint32_t i;
+
+	if ((demux == NULL) || (demux->trackMap == NULL))
+		return NULL;
+
+	for (i = MP4_DEMUX_TRACK_HASH(id) & demux->trackMapMask;
+		(tk = demux->trackMap[i]) != NULL;
+		i = (i + 1) & demux->trackMapMask) {
+		if (tk->id == id)
+			return tk;
+	}
+
+	return NULL;
+}
+
+
+/* Switch a fragmented track between the sample tables of the moov and
+ * those of the movie fragments, keeping the other set for later */
+static void mp4_demux_fragment_swap(
+	struct mp4_track *tk,
+	int fragmentLoaded)
+{
+	struct mp4_sample_tables t = tk->inactiveTables;
+
+	if (tk->fragmentLoaded == fragmentLoaded)
+		return;
+
+	tk->inactiveTables.sampleCount = tk->sampleCount;
+	tk->inactiveTables.sampleSize = tk->sampleSize;
+	tk->inactiveTables.sampleDecodingTime = tk->sampleDecodingTime;
+	tk->inactiveTables.sampleOffset = tk->sampleOffset;
+	tk->inactiveTables.syncSampleEntryCount = tk->syncSampleEntryCount;
+	tk->inactiveTables.syncSampleEntries = tk->syncSampleEntries;
+	tk->inactiveTables.syncSampleBits = tk->syncSampleBits;
+
+	tk->sampleCount = t.sampleCount;
+	tk->sampleSize = t.sampleSize;
+	tk->sampleDecodingTime = t.sampleDecodingTime;
+	tk->sampleOffset = t.sampleOffset;
+	tk->syncSampleEntryCount = t.syncSampleEntryCount;
+	tk->syncSampleEntries = t.syncSampleEntries;
+	tk->syncSampleBits = t.syncSampleBits;
+
+	tk->fragmentLoaded = fragmentLoaded;
+	tk->currentSample = 0;
+	mp4_demux_sample_cursor_reset(tk, &tk->cursor);
+}
+
+
+/* Grow the per-fragment sample tables of a track */
+static int mp4_demux_fragment_reserve(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	uint32_t count)
+{
+	void *p;
+	uint32_t cap = tk->fragmentSampleCapacity;
+
+	if (count <= cap)
+		return 0;
+	MP4_RETURN_ERR_IF_FAILED(
+		((uint64_t)count * sizeof(uint64_t) <= SIZE_MAX), -ENOMEM);
+
+	p = mp4_demux_realloc(demux, tk->sampleSize,
+		cap * sizeof(uint32_t), count * sizeof(uint32_t));
+	MP4_RETURN_ERR_IF_FAILED((p != NULL), -ENOMEM);
+	tk->sampleSize = p;
+	p = mp4_demux_realloc(demux, tk->sampleOffset,
+		cap * sizeof(uint64_t), count * sizeof(uint64_t));
+	MP4_RETURN_ERR_IF_FAILED((p != NULL), -ENOMEM);
+	tk->sampleOffset = p;
+	p = mp4_demux_realloc(demux, tk->sampleDecodingTime,
+		cap * sizeof(uint64_t), count * sizeof(uint64_t));
+	MP4_RETURN_ERR_IF_FAILED((p != NULL), -ENOMEM);
+	tk->sampleDecodingTime = p;
+	p = mp4_demux_realloc(demux, tk->syncSampleEntries,
+		cap * sizeof(uint32_t), count * sizeof(uint32_t));
+	MP4_RETURN_ERR_IF_FAILED((p != NULL), -ENOMEM);
+	tk->syncSampleEntries = p;
+	p = mp4_demux_realloc(demux, tk->syncSampleBits,
+		(cap + 7) / 8, (count + 7) / 8);
+	MP4_RETURN_ERR_IF_FAILED((p != NULL), -ENOMEM);
+	tk->syncSampleBits = p;
+	tk->fragmentSampleCapacity = count;
+
+	return 0;
+}
+
+
+/* State of the track fragment being parsed */
+struct mp4_fragment_state {
+	uint64_t moofOffset;
+	/* end of the data of the previous track fragment in the movie
+	 * fragment, 0 for the first one */
+	uint64_t prevDataEnd;
+	uint64_t baseDataOffset;
+	uint64_t dataOffset;
+	uint64_t dataEnd;
+	uint64_t dts;
+	uint32_t defaultSampleDuration;
+	uint32_t defaultSampleSize;
+	uint32_t defaultSampleFlags;
+	uint32_t sampleCount;
+	uint32_t syncSampleCount;
+	int store;
+};
+
+
+static off_t mp4_demux_parse_tfhd(
+	struct mp4_demux *demux,
+	struct mp4_box_reader *box,
+	struct mp4_track *track,
+	struct mp4_fragment_state *frag)
+{
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0;
+	uint32_t val32;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 8);
+
+	/* version & flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t flags = ntohl(val32) & ((1 << 24) - 1);
+
+	/* track_ID; a NULL track accepts any track, whose defaults are
+	 * then looked up */
+	MP4_READ_32(box, val32, boxReadBytes);
+	if (track == NULL)
+		track = mp4_demux_find_track(demux, ntohl(val32));
+	else if (ntohl(val32) != track->id)
+		return -ENOENT;
+
+	frag->baseDataOffset = ((frag->prevDataEnd == 0) ||
+		(flags & MP4_TFHD_DEFAULT_BASE_IS_MOOF)) ?
+		frag->moofOffset : frag->prevDataEnd;
+	frag->defaultSampleDuration = (track) ?
+		track->defaultSampleDuration : 0;
+	frag->defaultSampleSize = (track) ? track->defaultSampleSize : 0;
+	frag->defaultSampleFlags = (track) ? track->defaultSampleFlags : 0;
+
+	if (flags & MP4_TFHD_BASE_DATA_OFFSET_PRESENT) {
+		MP4_READ_32(box, val32, boxReadBytes);
+		frag->baseDataOffset = (uint64_t)ntohl(val32) << 32;
+		MP4_READ_32(box, val32, boxReadBytes);
+		frag->baseDataOffset |= (uint64_t)ntohl(val32) & 0xFFFFFFFFULL;
+	}
+	if (flags & MP4_TFHD_SAMPLE_DESC_INDEX_PRESENT)
+		MP4_READ_32(box, val32, boxReadBytes);
+	if (flags & MP4_TFHD_DEFAULT_DURATION_PRESENT) {
+		MP4_READ_32(box, val32, boxReadBytes);
+		frag->defaultSampleDuration = ntohl(val32);
+	}
+	if (flags & MP4_TFHD_DEFAULT_SIZE_PRESENT) {
+		MP4_READ_32(box, val32, boxReadBytes);
+		frag->defaultSampleSize = ntohl(val32);
+	}
+	if (flags & MP4_TFHD_DEFAULT_FLAGS_PRESENT) {
+		MP4_READ_32(box, val32, boxReadBytes);
+		frag->defaultSampleFlags = ntohl(val32);
+	}
+	frag->dataOffset = frag->baseDataOffset;
+
+	return boxReadBytes;
+}
+
+
+static off_t mp4_demux_parse_tfdt(
+	struct mp4_demux *demux,
+	struct mp4_box_reader *box,
+	struct mp4_track *track,
+	struct mp4_fragment_state *frag)
+{
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0;
+	uint32_t val32;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 8);
+
+	/* version & flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint8_t version = (ntohl(val32) >> 24) & 0xFF;
+
+	/* baseMediaDecodeTime */
+	MP4_READ_32(box, val32, boxReadBytes);
+	frag->dts = ntohl(val32);
+	if (version == 1) {
+		MP4_READ_32(box, val32, boxReadBytes);
+		frag->dts = (frag->dts << 32) |
+			((uint64_t)ntohl(val32) & 0xFFFFFFFFULL);
+	}
+
+	return boxReadBytes;
+}
+
+
+static off_t mp4_demux_parse_trun(
+	struct mp4_demux *demux,
+	struct mp4_box_reader *box,
+	struct mp4_track *track,
+	struct mp4_fragment_state *frag)
+{
+	off_t maxBytes = box->size;
+	off_t boxReadBytes = 0;
+	uint32_t val32, firstSampleFlags = 0;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((maxBytes >= 8), -EINVAL,
+		"invalid size: %ld expected %d min", maxBytes, 8);
+
+	/* version & flags */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t flags = ntohl(val32) & ((1 << 24) - 1);
+
+	/* sample_count */
+	MP4_READ_32(box, val32, boxReadBytes);
+	uint32_t sampleCount = ntohl(val32);
+
+	if (flags & MP4_TRUN_DATA_OFFSET_PRESENT) {
+		MP4_READ_32(box, val32, boxReadBytes);
+		frag->dataOffset = frag->baseDataOffset +
+			(int64_t)(int32_t)ntohl(val32);
+	}
+	if (flags & MP4_TRUN_FIRST_FLAGS_PRESENT) {
+		MP4_READ_32(box, val32, boxReadBytes);
+		firstSampleFlags = ntohl(val32);
+	}
+
+	off_t entrySize = 4 * (!!(flags & MP4_TRUN_DURATION_PRESENT) +
+		!!(flags & MP4_TRUN_SIZE_PRESENT) +
+		!!(flags & MP4_TRUN_FLAGS_PRESENT) +
+		!!(flags & MP4_TRUN_CTO_PRESENT));
+	off_t tableBytes = (off_t)sampleCount * entrySize;
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(maxBytes - boxReadBytes >= tableBytes), -EINVAL,
+		"invalid size: %ld expected %ld min",
+		maxBytes, boxReadBytes + tableBytes);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(sampleCount <= UINT32_MAX - frag->sampleCount), -EPROTO,
+		"too many samples in fragment");
+	/* without a per-sample table the count is only bounded by the
+	 * sample data, which must fit in the file */
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(((entrySize > 0) ||
+		((uint64_t)sampleCount * ((frag->defaultSampleSize > 0) ?
+		frag->defaultSampleSize : 1) <= (uint64_t)demux->fileSize)),
+		-EPROTO, "too many samples in fragment");
+
+	/* the table size has been checked, decode without bounds checks */
+	const uint8_t *entry = box->data + boxReadBytes;
+	uint32_t i, n = frag->sampleCount;
+	for (i = 0; i < sampleCount; i++, n++) {
+		uint32_t duration = frag->defaultSampleDuration;
+		uint32_t size = frag->defaultSampleSize;
+		uint32_t sampleFlags = ((i == 0) &&
+			(flags & MP4_TRUN_FIRST_FLAGS_PRESENT)) ?
+			firstSampleFlags : frag->defaultSampleFlags;
+		if (flags & MP4_TRUN_DURATION_PRESENT) {
+			duration = mp4_demux_be32(entry);
+			entry += 4;
+		}
+		if (flags & MP4_TRUN_SIZE_PRESENT) {
+			size = mp4_demux_be32(entry);
+			entry += 4;
+		}
+		if (flags & MP4_TRUN_FLAGS_PRESENT) {
+			sampleFlags = mp4_demux_be32(entry);
+			entry += 4;
+		}
+		if (flags & MP4_TRUN_CTO_PRESENT)
+			entry += 4;
+
+		if (frag->store) {
+			track->sampleSize[n] = size;
+			track->sampleOffset[n] = frag->dataOffset;
+			track->sampleDecodingTime[n] = frag->dts;
+			if (!(sampleFlags & MP4_SAMPLE_FLAG_NON_SYNC)) {
+				track->syncSampleEntries[
+					frag->syncSampleCount++] = n + 1;
+				track->syncSampleBits[n >> 3] |= 1 << (n & 7);
+			}
+		}
+		frag->dataOffset += size;
+		frag->dts += duration;
+	}
+	boxReadBytes += tableBytes;
+	frag->sampleCount = n;
+	if (frag->dataOffset > frag->dataEnd)
+		frag->dataEnd = frag->dataOffset;
+
+	/* skip the rest of the box */
+	MP4_SKIP(box, boxReadBytes, maxBytes);
+
+	return boxReadBytes;
+}
+
+
+/* Parse the runs of a track fragment; returns the number of samples,
+ * or -ENOENT if the fragment belongs to another track */
+static int mp4_demux_parse_traf(
+	struct mp4_demux *demux,
+	struct mp4_box_reader *traf,
+	struct mp4_track *track,
+	struct mp4_fragment_state *frag)
+{
+	struct mp4_box_reader child;
+	uint32_t type;
+	off_t pos = 0, ret;
+	int hasHeader = 0;
+
+	while ((ret = mp4_demux_next_child_box(traf, &pos, &type,
+		&child)) > 0) {
+		switch (type) {
+		case MP4_TRACK_FRAGMENT_HEADER_BOX:
+			ret = mp4_demux_parse_tfhd(demux, &child, track, frag);
+			hasHeader = 1;
+			break;
+		case MP4_TRACK_FRAGMENT_DECODE_TIME_BOX:
+			ret = (hasHeader) ? mp4_demux_parse_tfdt(
+				demux, &child, track, frag) : -EPROTO;
+			break;
+		case MP4_TRACK_FRAGMENT_RUN_BOX:
+			ret = (hasHeader) ? mp4_demux_parse_trun(
+				demux, &child, track, frag) : -EPROTO;
+			break;
+		default:
+			ret = 0;
+			break;
+		}
+		if (ret < 0)
+			return (int)ret;
+	}
+
+	return (ret < 0) ? (int)ret : (int)frag->sampleCount;
+}
+
+
+/* Parse the track fragment of a track in a movie fragment into the
+ * sample tables of the track; returns the number of samples, 0 if
+ * the movie fragment has no samples for the track, or -EAGAIN if the
+ * sample data is not completely written yet */
+static int mp4_demux_parse_moof(
+	struct mp4_demux *demux,
+	struct mp4_box_reader *moof,
+	off_t moofOffset,
+	struct mp4_track *track)
+{
+	struct mp4_fragment_state frag, other;
+	struct mp4_box_reader traf;
+	uint32_t type;
+	uint64_t prevDataEnd;
+	off_t pos = 0;
+	int ret, pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		/* first pass: count the samples and check the data is
+		 * available; second pass: fill the sample tables */
+		memset(&frag, 0, sizeof(frag));
+		frag.moofOffset = moofOffset;
+		frag.dts = track->fragmentNextDts;
+		frag.store = pass;
+		prevDataEnd = 0;
+		pos = 0;
+		while ((ret = mp4_demux_next_child_box(moof, &pos, &type,
+			&traf)) > 0) {
+			if (type != MP4_TRACK_FRAGMENT_BOX)
+				continue;
+			frag.prevDataEnd = prevDataEnd;
+			ret = mp4_demux_parse_traf(demux, &traf, track, &frag);
+			if (ret == -ENOENT) {
+				/* another track: only its data end is needed
+				 * for the implicit base of the next one */
+				memset(&other, 0, sizeof(other));
+				other.moofOffset = moofOffset;
+				other.prevDataEnd = prevDataEnd;
+				(void)mp4_demux_parse_traf(demux, &traf, NULL,
+					&other);
+				prevDataEnd = other.dataOffset;
+				continue;
+			}
+			if (ret < 0)
+				return ret;
+			prevDataEnd = frag.dataOffset;
+		}
+		if (ret < 0)
+			return ret;
+		if (frag.sampleCount == 0)
+			return 0;
+		if (pass == 0) {
+			if (frag.dataEnd > (uint64_t)demux->fileSize)
+				return -EAGAIN;
+			/* the moov samples are kept as fragment 0 */
+			mp4_demux_fragment_swap(track, 1);
+			ret = mp4_demux_fragment_reserve(demux, track,
+				frag.sampleCount);
+			if (ret < 0)
+				return ret;
+			memset(track->syncSampleBits, 0,
+				(frag.sampleCount + 7) / 8);
+		}
+	}
+
+	track->sampleCount = frag.sampleCount;
+	track->syncSampleEntryCount = frag.syncSampleCount;
+	track->currentSample = 0;
+	track->fragmentNextDts = frag.dts;
+	MP4_LOGD("track %d: fragment at 0x%lX with %" PRIu32 " samples",
+		track->id, (long)moofOffset, frag.sampleCount);
+
+	return frag.sampleCount;
+}
+
+
+/* Load the next fragment of a track: walk the top-level boxes from the
+ * end of the current fragment until a movie fragment with samples for
+ * the track is found; returns 1 if a fragment was loaded, 0 if no more
+ * fragment is available (yet), or -EAGAIN if the next fragment is not
+ * completely written yet */
+static int mp4_demux_load_next_fragment(
+	struct mp4_demux *demux,
+	struct mp4_track *track)
+{
+	off_t offset = track->fragmentNextOffset;
+	int ret;
+
+	ret = mp4_demux_io_update_size(demux);
+	if (ret < 0)
+		return ret;
+
+	while ((offset > 0) && (demux->fileSize - offset >= 8)) {
+		uint8_t header[16];
+		off_t headerSize = 8;
+		uint64_t size;
+		uint32_t type;
+
+		ret = mp4_demux_io_pread(demux, offset, header, 8);
+		if (ret < 0)
+			return ret;
+		size = mp4_demux_be32(header);
+		type = mp4_demux_be32(header + 4);
+		if (size == 1) {
+			if (demux->fileSize - offset < 16)
+				return 0;
+			ret = mp4_demux_io_pread(demux, offset + 8,
+				header + 8, 8);
+			if (ret < 0)
+				return ret;
+			size = mp4_demux_be64(header + 8);
+			headerSize = 16;
+		} else if (size == 0) {
+			/* last box, still being written */
+			return 0;
+		}
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+			(size >= (uint64_t)headerSize), -EPROTO,
+			"invalid box size: %" PRIu64, size);
+		if (size > (uint64_t)(demux->fileSize - offset))
+			return 0;
+
+		if (type == MP4_MOVIE_FRAGMENT_BOX) {
+			struct mp4_box_reader moof;
+			ret = mp4_demux_load_box_at(demux, &moof,
+				offset + headerSize, size - headerSize);
+			if (ret < 0)
+				return ret;
+			ret = mp4_demux_parse_moof(demux, &moof, offset, track);
+			if (ret < 0)
+				return ret;
+			offset += size;
+			track->fragmentNextOffset = offset;
+			if (ret > 0)
+				return 1;
+		} else {
+			offset += size;
+			track->fragmentNextOffset = offset;
+		}
+	}
+
+	return 0;
+}
+
+
+/* Load the next fragments of a track once its current samples have
+ * all been read; with 'withMetadata' the linked metadata track is
+ * moved to its next fragment too, so that sample indexes match */
+static int mp4_demux_fragment_refill(
+	struct mp4_demux *demux,
+	struct mp4_track *track,
+	int withMetadata)
+{
+	off_t offset = track->fragmentNextOffset;
+	uint64_t dts = track->fragmentNextDts;
+	int ret;
+
+	if ((!track->fragmented) || (track->currentSample < track->sampleCount))
+		return 0;
+
+	ret = mp4_demux_load_next_fragment(demux, track);
+	if (ret <= 0)
+		return (ret == -EAGAIN) ? 0 : ret;
+
+	if ((withMetadata) && (track->metadata) &&
+		(track->metadata->fragmented)) {
+		struct mp4_track *metatk = track->metadata;
+		ret = mp4_demux_load_next_fragment(demux, metatk);
+		if (ret == -EAGAIN) {
+			/* retry both once the metadata is written */
+			track->fragmentNextOffset = offset;
+			track->fragmentNextDts = dts;
+			track->sampleCount = 0;
+			track->currentSample = 0;
+			return 0;
+		} else if (ret == 0) {
+			metatk->sampleCount = 0;
+		}
+	}
+
+	return (ret < 0) ? ret : 0;
+}
+
+
+/* Move a fragmented track to the fragment containing decoding time
+ * 'dts', or to the last available one */
+static int mp4_demux_fragment_seek(
+	struct mp4_demux *demux,
+	struct mp4_track *track,
+	uint64_t dts)
+{
+	int ret;
+
+	if (!track->fragmented)
+		return 0;
+
+	if ((track->fragmentLoaded) && ((track->sampleCount == 0) ||
+		(mp4_demux_sample_dts(track, &track->cursor, 0) > dts))) {
+		/* restart from the moov samples, or from the first
+		 * fragment if the moov has none */
+		track->fragmentNextOffset = demux->firstFragmentOffset;
+		track->fragmentNextDts = track->fragmentFirstDts;
+		if (track->inactiveTables.sampleCount > 0) {
+			mp4_demux_fragment_swap(track, 0);
+		} else {
+			track->sampleCount = 0;
+			track->currentSample = 0;
+			ret = mp4_demux_load_next_fragment(demux, track);
+			if (ret <= 0)
+				return (ret == -EAGAIN) ? 0 : ret;
+		}
+	}
+
+	while (dts >= track->fragmentNextDts) {
+		ret = mp4_demux_load_next_fragment(demux, track);
+		if (ret <= 0)
+			return (ret == -EAGAIN) ? 0 : ret;
+	}
+
+	return 0;
+}
+
+
+/* Read the chapter names from the chapter track; done once, at open
+ * time or on the first mp4_demux_get_chapters() call in lazy mode */
+static int mp4_demux_build_chapters(
+	struct mp4_demux *demux)
+{
+	struct mp4_track *chapTk = NULL;
+
+	if (demux->chaptersBuilt)
+		return 0;
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(!(demux->config.flags & MP4_DEMUX_FLAG_HEADER_ONLY)),
+		-EOPNOTSUPP, "no chapters in header-only mode");
+	demux->chaptersBuilt = 1;
+
+	for (chapTk = demux->track; chapTk; chapTk = chapTk->next) {
+		if (chapTk->type == MP4_TRACK_TYPE_CHAPTERS)
+			break;
+	}
+
+	if (chapTk) {
+		int ret = mp4_demux_build_sample_tables(demux, chapTk);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (chapTk) {
+		unsigned int i;
+		for (i = 0; i < chapTk->sampleCount; i++) {
+			unsigned int sampleSize, readBytes = 0;
+			uint64_t sampleOffset;
+			uint16_t sz;
+			if (demux->chaptersCount >= MP4_CHAPTERS_MAX) {
+				MP4_LOGW("too many chapters, only the first"
+					" %d are kept", MP4_CHAPTERS_MAX);
+				break;
+			}
+			sampleSize = mp4_demux_sample_size(chapTk, i);
+			/* the sample must hold at least the text length */
+			if (sampleSize < 2)
+				continue;
+			sampleOffset = mp4_demux_sample_offset(chapTk,
+				&chapTk->cursor, i);
+			int _ret = mp4_demux_io_seek(demux, sampleOffset);
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(_ret == 0, _ret,
+				"failed to seek %" PRIu64
+				" bytes forward in file", sampleOffset);
+			MP4_IO_READ_16(demux, sz, readBytes);
+			sz = ntohs(sz);
+			if (sz <= sampleSize - readBytes) {
+				char *chapName =
+					mp4_demux_malloc(demux, sz + 1);
+				MP4_RETURN_ERR_IF_FAILED(
+					(chapName != NULL), -ENOMEM);
+				demux->chaptersName[demux->chaptersCount] =
+					chapName;
+				int _err = mp4_demux_io_read(demux,
+					chapName, sz);
+				MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+					(_err == 0), _err,
+					"failed to read %u bytes from file",
+					sz);
+				readBytes += sz;
+				chapName[sz] = '\0';
+				uint64_t chapTime =
+					(mp4_demux_sample_dts(chapTk,
+					&chapTk->cursor, i) *
+					1000000 + chapTk->timescale / 2) /
+					chapTk->timescale;
+				MP4_LOGD("chapter #%d time=%" PRIu64 " '%s'",
+					demux->chaptersCount + 1,
+					chapTime, chapName);
+				demux->chaptersTime[demux->chaptersCount] =
+					chapTime;
+				demux->chaptersCount++;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/* Index the track list: the array gives the tracks by index and the
+ * map by id, at most half full so that probe sequences stay short; on
+ * duplicate ids the first track in list order wins, as when walking
+ * the list */
+static int mp4_demux_build_track_map(
+	struct mp4_demux *demux)
+{
+	struct mp4_track *tk;
+	uint32_t size = 4, i;
+	unsigned int k;
+
+	mp4_demux_free(demux, demux->trackArray);
+	mp4_demux_free(demux, demux->trackMap);
+	demux->trackArray = NULL;
+	demux->trackMap = NULL;
+
+	MP4_RETURN_ERR_IF_FAILED((demux->trackCount <= UINT32_MAX / 4),
+		-ENOMEM);
+	while (size < 2 * demux->trackCount)
+		size <<= 1;
+	demux->trackArray = mp4_demux_calloc(demux, demux->trackCount + 1,
+		sizeof(*demux->trackArray));
+	demux->trackMap = mp4_demux_calloc(demux, size,
+		sizeof(*demux->trackMap));
+	MP4_RETURN_ERR_IF_FAILED(((demux->trackArray != NULL) &&
+		(demux->trackMap != NULL)), -ENOMEM);
+	demux->trackMapMask = size - 1;
+
+	for (tk = demux->track, k = 0; (tk) && (k < demux->trackCount);
+		tk = tk->next, k++) {
+		demux->trackArray[k] = tk;
+		if (mp4_demux_find_track(demux, tk->id) != NULL)
+			continue;
+		for (i = MP4_DEMUX_TRACK_HASH(tk->id) & demux->trackMapMask;
+			demux->trackMap[i] != NULL;
+			i = (i + 1) & demux->trackMapMask)
+			;
+		demux->trackMap[i] = tk;
+	}
+
+	return 0;
+}
+
+
+static int mp4_demux_build_tracks(
+	struct mp4_demux *demux)
+{
+	struct mp4_track *tk = NULL, *videoTk = NULL;
+	struct mp4_track *metaTk = NULL;
+	int videoTrackCount = 0, audioTrackCount = 0, hintTrackCount = 0;
+	int metadataTrackCount = 0, textTrackCount = 0;
+	int ret;
+
+	ret = mp4_demux_build_track_map(demux);
+	if (ret < 0)
+		return ret;
+
+	/* the sample counts are known: size the arena for the per-sample
+	 * tables built below in a single chunk */
+	if ((demux->arena) && (!(demux->config.flags &
+		(MP4_DEMUX_FLAG_LAZY_TABLES | MP4_DEMUX_FLAG_HEADER_ONLY)))) {
+		size_t tablesSize = 0;
+		for (tk = demux->track; tk; tk = tk->next) {
+			tablesSize += (tk->sampleCount + 7) / 8 + 8;
+			if (!(demux->config.flags &
+				MP4_DEMUX_FLAG_COMPACT_TABLES))
+				tablesSize += (size_t)tk->sampleCount *
+					2 * sizeof(uint64_t);
+		}
+		ret = mp4_arena_reserve(demux->arena, tablesSize);
+		if (ret < 0)
+			return ret;
+	}
+
+	for (tk = demux->track; tk; tk = tk->next) {
+		/* the sample times are converted with the media timescale */
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk->timescale != 0),
+			-EPROTO, "missing media header in track %d", tk->id);
+
+		if (!(demux->config.flags & (MP4_DEMUX_FLAG_LAZY_TABLES |
+			MP4_DEMUX_FLAG_HEADER_ONLY))) {
+			ret = mp4_demux_build_sample_tables(demux, tk);
+			if (ret < 0)
+				return ret;
+		}
+
+		switch (tk->type) {
+		case MP4_TRACK_TYPE_VIDEO:
+			videoTrackCount++;
+			videoTk = tk;
+			break;
+		case MP4_TRACK_TYPE_AUDIO:
+			audioTrackCount++;
+			break;
+		case MP4_TRACK_TYPE_HINT:
+			hintTrackCount++;
+			break;
+		case MP4_TRACK_TYPE_METADATA:
+			metadataTrackCount++;
+			metaTk = tk;
+			break;
+		case MP4_TRACK_TYPE_TEXT:
+			textTrackCount++;
+			break;
+		default:
+			break;
+		}
+
+		/* link tracks using track references */
+		if ((tk->referenceType != 0) && (tk->referenceTrackId)) {
+			struct mp4_track *tkRef = mp4_demux_find_track(demux,
+				tk->referenceTrackId);
+			if (tkRef) {
+				if ((tk->referenceType ==
+					MP4_REFERENCE_TYPE_DESCRIPTION)
+					&& (tk->type ==
+					MP4_TRACK_TYPE_METADATA)) {
+					tkRef->metadata = tk;
+					tk->ref = tkRef;
+				} else if ((tk->referenceType ==
+					MP4_REFERENCE_TYPE_CHAPTERS) &&
+					(tkRef->type == MP4_TRACK_TYPE_TEXT)) {
+					tk->chapters = tkRef;
+					tkRef->ref = tk;
+					tkRef->type = MP4_TRACK_TYPE_CHAPTERS;
+				}
+			}
+		}
+	}
+
+	/* workaround: if we have only 1 video track and 1 metadata
+	 * track with no track reference, link them anyway */
+	if ((videoTrackCount == 1) && (metadataTrackCount == 1)
+			&& (audioTrackCount == 0) && (hintTrackCount == 0)
+			&& (videoTk) && (metaTk) && (!videoTk->metadata)) {
+		videoTk->metadata = metaTk;
+		metaTk->ref = videoTk;
+	}
+
+	/* in follow mode the chapter samples may not be written yet */
+	if (!(demux->config.flags & (MP4_DEMUX_FLAG_LAZY_TABLES |
+		MP4_DEMUX_FLAG_FOLLOW | MP4_DEMUX_FLAG_HEADER_ONLY))) {
+		ret = mp4_demux_build_chapters(demux);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+
+static int mp4_demux_build_metadata(
+	struct mp4_demux *demux)
+{
+	unsigned int i, k = 0, metaCount = 0, udtaCount = 0, xyzCount = 0;
+
+	for (i = 0; i < demux->metaMetadataCount; i++) {
+		if ((demux->metaMetadataValue[i]) &&
+			(strlen(demux->metaMetadataValue[i]) > 0) &&
+			(demux->metaMetadataKey[i]) &&
+			(strlen(demux->metaMetadataKey[i]) > 0))
+			metaCount++;
+	}
+
+	for (i = 0; i < demux->udtaMetadataCount; i++) {
+		if ((demux->udtaMetadataValue[i]) &&
+			(strlen(demux->udtaMetadataValue[i]) > 0) &&
+			(demux->udtaMetadataKey[i]) &&
+			(strlen(demux->udtaMetadataKey[i]) > 0))
+			udtaCount++;
+	}
+
+	if ((demux->udtaLocationValue) &&
+		(strlen(demux->udtaLocationValue) > 0) &&
+		(demux->udtaLocationKey) &&
+		(strlen(demux->udtaLocationKey) > 0))
+		xyzCount++;
+
+	demux->finalMetadataCount = metaCount + udtaCount + xyzCount;
+
+	demux->finalMetadataKey = mp4_demux_calloc(demux, 
+		demux->finalMetadataCount, sizeof(char *));
+	MP4_RETURN_ERR_IF_FAILED((demux->finalMetadataKey != NULL), -ENOMEM);
+
+	demux->finalMetadataValue = mp4_demux_calloc(demux, 
+		demux->finalMetadataCount, sizeof(char *));
+	MP4_RETURN_ERR_IF_FAILED((demux->finalMetadataValue != NULL), -ENOMEM);
+
+	for (i = 0; i < demux->metaMetadataCount; i++) {
+		if ((demux->metaMetadataValue[i]) &&
+			(strlen(demux->metaMetadataValue[i]) > 0) &&
+			(demux->metaMetadataKey[i]) &&
+			(strlen(demux->metaMetadataKey[i]) > 0)) {
+			demux->finalMetadataKey[k] =
+				demux->metaMetadataKey[i];
+			demux->finalMetadataValue[k] =
+				demux->metaMetadataValue[i];
+			k++;
+		}
+	}
+
+	for (i = 0; i < demux->udtaMetadataCount; i++) {
+		if ((demux->udtaMetadataValue[i]) &&
+			(strlen(demux->udtaMetadataValue[i]) > 0) &&
+			(demux->udtaMetadataKey[i]) &&
+			(strlen(demux->udtaMetadataKey[i]) > 0)) {
+			demux->finalMetadataKey[k] =
+				demux->udtaMetadataKey[i];
+			demux->finalMetadataValue[k] =
+				demux->udtaMetadataValue[i];
+			k++;
+		}
+	}
+
+	if ((demux->udtaLocationValue) &&
+		(strlen(demux->udtaLocationValue) > 0) &&
+		(demux->udtaLocationKey) &&
+		(strlen(demux->udtaLocationKey) > 0)) {
+		demux->finalMetadataKey[k] = demux->udtaLocationKey;
+		demux->finalMetadataValue[k] = demux->udtaLocationValue;
+		k++;
+	}
+
+	if (demux->metaCoverSize > 0) {
+		demux->finalCoverSize = demux->metaCoverSize;
+		demux->finalCoverOffset = demux->metaCoverOffset;
+		demux->finalCoverType = demux->metaCoverType;
+	} else if (demux->udtaCoverSize > 0) {
+		demux->finalCoverSize = demux->udtaCoverSize;
+		demux->finalCoverOffset = demux->udtaCoverOffset;
+		demux->finalCoverType = demux->udtaCoverType;
+	}
+
+	return 0;
+}
+
+
+#if MP4_LOG_LEVEL >= MP4_LOG_LEVEL_DEBUG
+static void mp4_demux_print_children(
+	struct mp4_demux *demux,
+	struct mp4_box_item *parent,
+	int level)
+{
+	struct mp4_box_item *item = NULL;
+
+	for (item = parent->child; item; item = item->next) {
+		int k;
+		char spaces[101];
+		for (k = 0; k < level && k < 50; k++) {
+			spaces[k * 2] = ' ';
+			spaces[k * 2 + 1] = ' ';
+		}
+		spaces[k * 2] = '\0';
+		char a = (char)((item->box.type >> 24) & 0xFF);
+		char b = (char)((item->box.type >> 16) & 0xFF);
+		char c = (char)((item->box.type >> 8) & 0xFF);
+		char d = (char)(item->box.type & 0xFF);
+		MP4_LOGD("%s- %c%c%c%c size %" PRIu64 "\n", spaces,
+			(a >= 32) ? a : '.', (b >= 32) ? b : '.',
+			(c >= 32) ? c : '.', (d >= 32) ? d : '.',
+			(item->box.size == 1) ?
+			item->box.largesize : item->box.size);
+
+		if (item->child)
+			mp4_demux_print_children(demux, item, level + 1);
+	}
+}
+#endif /* MP4_LOG_LEVEL >= MP4_LOG_LEVEL_DEBUG */
+
+
+static void mp4_demux_free_children(
+	struct mp4_demux *demux,
+	struct mp4_box_item *parent)
+{
+	struct mp4_box_item *item = NULL, *next = NULL;
+
+	for (item = parent->child; item; item = next) {
+		next = item->next;
+		if (item->child)
+			mp4_demux_free_children(demux, item);
+		free(item);
+	}
+}
+
+
+static void mp4_demux_free_tracks(
+	struct mp4_demux *demux)
+{
+	struct mp4_track *tk = NULL, *next = NULL;
+
+	for (tk = demux->track; tk; tk = next) {
+		next = tk->next;
+		free(tk->timeToSampleEntries);
+		free(tk->chunkOffset);
+		free(tk->sampleToChunkEntries);
+		if (!tk->sampleTablesInIndex) {
+			free(tk->sampleDecodingTime);
+			free(tk->sampleSize);
+			free(tk->sampleOffset);
+			free(tk->syncSampleEntries);
+			free(tk->syncSampleBits);
+		}
+		free(tk->inactiveTables.sampleDecodingTime);
+		free(tk->inactiveTables.sampleSize);
+		free(tk->inactiveTables.sampleOffset);
+		free(tk->inactiveTables.syncSampleEntries);
+		free(tk->inactiveTables.syncSampleBits);
+		free(tk->videoSps);
+		free(tk->videoPps);
+		free(tk->metadataContentEncoding);
+		free(tk->metadataMimeFormat);
+		free(tk);
+	}
+	free(demux->trackArray);
+	free(demux->trackMap);
+}
+
+
+/* Find the end of the complete top-level boxes from 'offset', up to
+ * the first movie fragment; the last box of a file that is still being
+ * written may be incomplete or have a size of 0 */
+static off_t mp4_demux_complete_boxes_end(
+	struct mp4_demux *demux,
+	off_t offset)
+{
+	while (demux->fileSize - offset >= 8) {
+		uint8_t header[16];
+		uint64_t size;
+
+		int ret = mp4_demux_io_pread(demux, offset, header, 8);
+		if (ret < 0)
+			return ret;
+		size = mp4_demux_be32(header);
+		if (mp4_demux_be32(header + 4) == MP4_MOVIE_FRAGMENT_BOX)
+			break;
+		if (size == 1) {
+			if (demux->fileSize - offset < 16)
+				break;
+			ret = mp4_demux_io_pread(demux, offset + 8,
+				header + 8, 8);
+			if (ret < 0)
+				return ret;
+			size = mp4_demux_be64(header + 8);
+		} else if (size == 0) {
+			break;
+		}
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((size >= 8), -EPROTO,
+			"invalid box size: %" PRIu64, size);
+		if (size > (uint64_t)(demux->fileSize - offset))
+			break;
+		offset += size;
+	}
+
+	return offset;
+}
+
+
+/* Parse the top-level boxes; in follow mode only the complete boxes
+ * are parsed and the next walk resumes after them */
+static int mp4_demux_parse_root(
+	struct mp4_demux *demux)
+{
+	off_t end = demux->fileSize, retBytes;
+	int ret;
+
+	if (demux->config.flags & MP4_DEMUX_FLAG_FOLLOW) {
+		ret = mp4_demux_io_update_size(demux);
+		if (ret < 0)
+			return ret;
+		end = mp4_demux_complete_boxes_end(demux, demux->parsedOffset);
+		if (end < 0)
+			return (int)end;
+		if (end == demux->parsedOffset)
+			return 0;
+		ret = mp4_demux_io_seek(demux, demux->parsedOffset);
+		if (ret < 0)
+			return ret;
+	}
+
+	retBytes = mp4_demux_parse_children(
+		demux, &demux->root, end - demux->parsedOffset, NULL);
+	if (retBytes < 0) {
+		MP4_LOGE("mp4_demux_parse_children() failed (%ld)", retBytes);
+		return -EIO;
+	} else {
+		demux->readBytes += retBytes;
+		demux->parsedOffset += retBytes;
+	}
+
+	/* the box payloads are no longer needed once parsed */
+	mp4_demux_io_window_clear(demux);
+	if (!demux->boxBufferBorrowed) {
+		free(demux->boxBuffer);
+		demux->boxBuffer = NULL;
+		demux->boxBufferSize = 0;
+	}
+
+	return 0;
+}
+
+
+static int mp4_demux_has_moov(
+	struct mp4_demux *demux)
+{
+	struct mp4_box_item *item;
+
+	for (item = demux->root.child; item; item = item->next) {
+		if (item->box.type == MP4_MOVIE_BOX)
+			return 1;
+	}
+
+	return 0;
+}
+
 
-			off_t _ret = mp4_demux_parse_children(
-				demux, item, realBoxSize - boxReadBytes, tk);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+/* Parse the box tree and build the tracks and metadata once the
+ * I/O backend is set up; in follow mode this is retried by
+ * mp4_demux_poll() until the moov box is complete */
+static int mp4_demux_load(
+	struct mp4_demux *demux)
+{
+	int ret;
+
+	/* read the head and the tail of the file at once: the top-level
+	 * box headers and a trailing moov are usually found in them */
+	if ((demux->config.flags & MP4_DEMUX_FLAG_TAIL_PROBE) &&
+		(!(demux->config.flags & MP4_DEMUX_FLAG_FOLLOW)) &&
+		(demux->io.read) && (demux->parsedOffset == 0)) {
+		off_t head = demux->fileSize;
+		if (head > MP4_DEMUX_TAIL_PROBE_SIZE)
+			head = MP4_DEMUX_TAIL_PROBE_SIZE;
+		ret = mp4_demux_io_window_load(demux, 0, head);
+		if (ret < 0)
+			return ret;
+		off_t tail = demux->fileSize - head;
+		if (tail > MP4_DEMUX_TAIL_PROBE_SIZE)
+			tail = MP4_DEMUX_TAIL_PROBE_SIZE;
+		ret = mp4_demux_io_window_load(demux,
+			demux->fileSize - tail, tail);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = mp4_demux_parse_root(demux);
+	if (ret < 0)
+		return ret;
+
+	if ((demux->config.flags & MP4_DEMUX_FLAG_FOLLOW) &&
+		(!mp4_demux_has_moov(demux))) {
+		MP4_LOGI("waiting for the moov box at offset 0x%lX",
+			(long)demux->parsedOffset);
+		return 0;
+	}
+
+	/* fragments without a moof before the end of the file yet */
+	if ((demux->fragmented) && (demux->firstFragmentOffset == 0))
+		demux->firstFragmentOffset = demux->parsedOffset;
+
+	ret = mp4_demux_build_tracks(demux);
+	if (ret < 0) {
+		MP4_LOGE("mp4_demux_build_tracks() failed (%d)", ret);
+		return -EIO;
+	}
+	ret = mp4_demux_build_metadata(demux);
+	if (ret < 0) {
+		MP4_LOGE("mp4_demux_build_metadata() failed (%d)", ret);
+		return -EIO;
+	}
+
+#if MP4_LOG_LEVEL >= MP4_LOG_LEVEL_DEBUG
+	mp4_demux_print_children(demux, &demux->root, 0);
+#endif /* MP4_LOG_LEVEL >= MP4_LOG_LEVEL_DEBUG */
+	demux->loaded = 1;
+
+	return 0;
+}
+
+
+static struct mp4_demux *mp4_demux_new(
+	const struct mp4_demux_config *config)
+{
+	struct mp4_demux *demux;
+
+	demux = malloc(sizeof(*demux));
+	if (demux == NULL) {
+		MP4_LOGE("allocation failed");
+		return NULL;
+	}
+	memset(demux, 0, sizeof(*demux));
+
+	if (config)
+		demux->config = *config;
+
+	if (demux->config.flags & MP4_DEMUX_FLAG_ARENA) {
+		demux->arena = mp4_arena_new(demux->config.arena_buffer,
+			demux->config.arena_size, MP4_DEMUX_ARENA_CHUNK_SIZE);
+		if (demux->arena == NULL) {
+			MP4_LOGE("arena allocation failed");
+			free(demux);
+			return NULL;
 		}
-		case MP4_TRACK_HEADER_BOX:
-		{
-			off_t _ret = mp4_demux_parse_tkhd(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+	}
+
+	return demux;
+}
+
+
+static int mp4_demux_setup_file(
+	struct mp4_demux *demux,
+	const char *filename)
+{
+	int ret;
+
+	demux->file = fopen(filename, "rb");
+	if (demux->file == NULL) {
+		MP4_LOGE("failed to open file '%s'", filename);
+		return -errno;
+	}
+
+	ret = fseeko(demux->file, 0, SEEK_END);
+	if (ret != 0) {
+		MP4_LOGE("failed to seek to end of file");
+		return -errno;
+	}
+	demux->fileSize = ftello(demux->file);
+	ret = fseeko(demux->file, 0, SEEK_SET);
+	if (ret != 0) {
+		MP4_LOGE("failed to seek to beginning of file");
+		return -errno;
+	}
+
+#ifndef _WIN32
+	/* used to validate sample index caches */
+	struct stat st;
+	if (fstat(fileno(demux->file), &st) == 0)
+		demux->fileMtime = st.st_mtime;
+#endif /* !_WIN32 */
+
+	return 0;
+}
+
+
+static int mp4_demux_setup_mmap(
+	struct mp4_demux *demux,
+	const char *filename)
+{
+#ifdef _WIN32
+	return -ENOSYS;
+#else /* !_WIN32 */
+	int err = 0, ret, fd;
+	struct stat st;
+	void *map;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		MP4_LOGE("failed to open file '%s'", filename);
+		return -errno;
+	}
+
+	ret = fstat(fd, &st);
+	if (ret != 0) {
+		MP4_LOGE("failed to get the size of file '%s'", filename);
+		err = -errno;
+		goto out;
+	}
+	if (st.st_size <= 0) {
+		MP4_LOGE("empty file '%s'", filename);
+		err = -EINVAL;
+		goto out;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		MP4_LOGE("failed to map file '%s'", filename);
+		err = -errno;
+		goto out;
+	}
+	demux->map = map;
+	demux->mapOwned = 1;
+	demux->fileSize = st.st_size;
+	demux->fileMtime = st.st_mtime;
+	demux->mapOffset = 0;
+
+out:
+	/* the mapping stays valid after the descriptor is closed */
+	close(fd);
+	return err;
+#endif /* !_WIN32 */
+}
+
+
+/* Open the media file itself, mapped or with buffered reads */
+static int mp4_demux_setup(
+	struct mp4_demux *demux,
+	const char *filename)
+{
+	/* a mapping does not follow the file size */
+	if ((demux->config.flags & MP4_DEMUX_FLAG_MMAP) &&
+		(!(demux->config.flags & MP4_DEMUX_FLAG_FOLLOW)))
+		return mp4_demux_setup_mmap(demux, filename);
+	else
+		return mp4_demux_setup_file(demux, filename);
+}
+
+
+struct mp4_demux *mp4_demux_open(
+	const char *filename)
+{
+	return mp4_demux_open_ext(filename, NULL);
+}
+
+
+struct mp4_demux *mp4_demux_open_mmap(
+	const char *filename)
+{
+	struct mp4_demux_config config;
+
+	memset(&config, 0, sizeof(config));
+	config.flags = MP4_DEMUX_FLAG_MMAP;
+
+	return mp4_demux_open_ext(filename, &config);
+}
+
+
+struct mp4_demux *mp4_demux_open_ext(
+	const char *filename,
+	const struct mp4_demux_config *config)
+{
+	int err = 0;
+	struct mp4_demux *demux;
+
+	MP4_RETURN_VAL_IF_FAILED(filename != NULL, -EINVAL, NULL);
+	MP4_RETURN_VAL_IF_FAILED(strlen(filename) != 0, -EINVAL, NULL);
+
+	demux = mp4_demux_new(config);
+	if (demux == NULL) {
+		err = -ENOMEM;
+		goto error;
+	}
+
+	err = mp4_demux_setup(demux, filename);
+	if (err < 0)
+		goto error;
+
+	err = mp4_demux_load(demux);
+	if (err < 0)
+		goto error;
+
+	return demux;
+
+error:
+	if (demux)
+		mp4_demux_close(demux);
+
+	MP4_RETURN_VAL_IF_FAILED(0, err, NULL);
+	return NULL;
+}
+
+
+struct mp4_demux *mp4_demux_open_custom(
+	const struct mp4_io_callbacks *callbacks,
+	void *opaque,
+	const struct mp4_demux_config *config)
+{
+	int err = 0;
+	int64_t size;
+	struct mp4_demux *demux;
+
+	MP4_RETURN_VAL_IF_FAILED(callbacks != NULL, -EINVAL, NULL);
+	MP4_RETURN_VAL_IF_FAILED(callbacks->read != NULL, -EINVAL, NULL);
+	MP4_RETURN_VAL_IF_FAILED(callbacks->seek != NULL, -EINVAL, NULL);
+	MP4_RETURN_VAL_IF_FAILED(callbacks->size != NULL, -EINVAL, NULL);
+
+	demux = mp4_demux_new(config);
+	if (demux == NULL) {
+		err = -ENOMEM;
+		goto error;
+	}
+	/* there is no file to map with custom I/O */
+	demux->config.flags &= ~MP4_DEMUX_FLAG_MMAP;
+	demux->io = *callbacks;
+	demux->ioOpaque = opaque;
+
+	size = demux->io.size(demux->ioOpaque);
+	if (size < 0) {
+		MP4_LOGE("failed to get the stream size");
+		err = (int)size;
+		goto error;
+	}
+	demux->fileSize = size;
+
+	err = demux->io.seek(demux->ioOpaque, 0);
+	if (err < 0) {
+		MP4_LOGE("failed to seek to beginning of stream");
+		goto error;
+	}
+	demux->ioOffset = 0;
+	demux->ioBackendOffset = 0;
+
+	err = mp4_demux_load(demux);
+	if (err < 0)
+		goto error;
+
+	return demux;
+
+error:
+	if (demux)
+		mp4_demux_close(demux);
+	else if (callbacks->close)
+		callbacks->close(opaque);
+
+	MP4_RETURN_VAL_IF_FAILED(0, err, NULL);
+	return NULL;
+}
+
+
+struct mp4_demux *mp4_demux_open_buffer(
+	const uint8_t *buffer,
+	size_t size,
+	const struct mp4_demux_config *config)
+{
+	int err = 0;
+	struct mp4_demux *demux;
+
+	MP4_RETURN_VAL_IF_FAILED(buffer != NULL, -EINVAL, NULL);
+	MP4_RETURN_VAL_IF_FAILED(size != 0, -EINVAL, NULL);
+
+	demux = mp4_demux_new(config);
+	if (demux == NULL) {
+		err = -ENOMEM;
+		goto error;
+	}
+
+	/* the buffer is read in place like a file mapping; it is owned
+	 * by the caller and must outlive the demuxer */
+	demux->map = buffer;
+	demux->fileSize = size;
+	demux->mapOffset = 0;
+
+	err = mp4_demux_load(demux);
+	if (err < 0)
+		goto error;
+
+	return demux;
+
+error:
+	if (demux)
+		mp4_demux_close(demux);
+
+	MP4_RETURN_VAL_IF_FAILED(0, err, NULL);
+	return NULL;
+}
+
+
+/* Sample index cache: the built sample tables, track properties,
+ * chapters and metadata are serialized in native byte order, with the
+ * tables 8-byte aligned so that a loaded index is used in place */
+#define MP4_INDEX_MAGIC 0x4d503449 /* "MP4I" */
+#define MP4_INDEX_VERSION 1
+
+
+struct mp4_index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint64_t fileSize;
+	int64_t fileMtime;
+	uint64_t duration;
+	uint64_t creationTime;
+	uint64_t modificationTime;
+	uint64_t coverOffset;
+	uint32_t coverSize;
+	uint32_t coverType;
+	uint32_t timescale;
+	uint32_t trackCount;
+	uint32_t chaptersCount;
+	uint32_t metadataCount;
+};
+
+
+struct mp4_index_track {
+	uint64_t duration;
+	uint64_t creationTime;
+	uint64_t modificationTime;
+	uint32_t id;
+	uint32_t type;
+	uint32_t timescale;
+	uint32_t sampleCount;
+	uint32_t hasSyncSamples;
+	uint32_t syncSampleEntryCount;
+	uint32_t referenceType;
+	uint32_t referenceTrackId;
+	uint32_t refTrackId;
+	uint32_t metadataTrackId;
+	uint32_t chaptersTrackId;
+	uint32_t videoCodec;
+	uint32_t videoWidth;
+	uint32_t videoHeight;
+	uint32_t videoSpsSize;
+	uint32_t videoPpsSize;
+	uint32_t audioCodec;
+	uint32_t audioChannelCount;
+	uint32_t audioSampleSize;
+	uint32_t audioSampleRate;
+};
+
+
+/* With a NULL buffer the writer only computes the index size */
+struct mp4_index_writer {
+	uint8_t *buf;
+	size_t pos;
+};
+
+
+struct mp4_index_reader {
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+};
+
+
+static void mp4_index_write(
+	struct mp4_index_writer *w,
+	const void *data,
+	size_t size)
+{
+	if ((w->buf) && (size > 0))
+		memcpy(w->buf + w->pos, data, size);
+	w->pos += size;
+}
+
+
+static void mp4_index_write_align(
+	struct mp4_index_writer *w)
+{
+	size_t pad = (8 - (w->pos & 7)) & 7;
+
+	if (w->buf)
+		memset(w->buf + w->pos, 0, pad);
+	w->pos += pad;
+}
+
+
+static void mp4_index_write_string(
+	struct mp4_index_writer *w,
+	const char *str)
+{
+	uint32_t len = (str) ? strlen(str) + 1 : 0;
+
+	mp4_index_write(w, &len, sizeof(len));
+	mp4_index_write(w, str, len);
+	mp4_index_write_align(w);
+}
+
+
+static const void *mp4_index_read(
+	struct mp4_index_reader *r,
+	size_t size)
+{
+	const void *data = r->data + r->pos;
+
+	if (size > r->size - r->pos)
+		return NULL;
+	r->pos += size;
+
+	return data;
+}
+
+
+/* Read an 8-byte aligned block of 'count' elements of 'size' bytes */
+static const void *mp4_index_read_table(
+	struct mp4_index_reader *r,
+	uint32_t count,
+	size_t size)
+{
+	const void *data;
+
+	if ((size > 0) && (count > (r->size - r->pos) / size))
+		return NULL;
+	data = mp4_index_read(r, (size_t)count * size);
+	if (data == NULL)
+		return NULL;
+	r->pos = (r->pos + 7) & ~(size_t)7;
+	if (r->pos > r->size)
+		return NULL;
+
+	return data;
+}
+
+
+static int mp4_index_read_string(
+	struct mp4_demux *demux,
+	struct mp4_index_reader *r,
+	char **str)
+{
+	const uint32_t *len = mp4_index_read(r, sizeof(uint32_t));
+	MP4_RETURN_ERR_IF_FAILED((len != NULL), -EPROTO);
+
+	*str = NULL;
+	const char *data = mp4_index_read_table(r, *len, 1);
+	MP4_RETURN_ERR_IF_FAILED((data != NULL), -EPROTO);
+	if (*len == 0)
+		return 0;
+	MP4_RETURN_ERR_IF_FAILED((data[*len - 1] == '\0'), -EPROTO);
+
+	*str = mp4_demux_strdup(demux, data);
+	MP4_RETURN_ERR_IF_FAILED((*str != NULL), -ENOMEM);
+
+	return 0;
+}
+
+
+static void mp4_demux_index_write_track(
+	struct mp4_index_writer *w,
+	struct mp4_track *tk)
+{
+	struct mp4_index_track itk;
+	struct mp4_sample_cursor cursor;
+	uint32_t i;
+
+	memset(&itk, 0, sizeof(itk));
+	itk.duration = tk->duration;
+	itk.creationTime = tk->creationTime;
+	itk.modificationTime = tk->modificationTime;
+	itk.id = tk->id;
+	itk.type = tk->type;
+	itk.timescale = tk->timescale;
+	itk.sampleCount = tk->sampleCount;
+	itk.hasSyncSamples = (tk->syncSampleEntries != NULL);
+	itk.syncSampleEntryCount = tk->syncSampleEntryCount;
+	itk.referenceType = tk->referenceType;
+	itk.referenceTrackId = tk->referenceTrackId;
+	itk.refTrackId = (tk->ref) ? tk->ref->id : 0;
+	itk.metadataTrackId = (tk->metadata) ? tk->metadata->id : 0;
+	itk.chaptersTrackId = (tk->chapters) ? tk->chapters->id : 0;
+	itk.videoCodec = tk->videoCodec;
+	itk.videoWidth = tk->videoWidth;
+	itk.videoHeight = tk->videoHeight;
+	itk.videoSpsSize = (tk->videoSps) ? tk->videoSpsSize : 0;
+	itk.videoPpsSize = (tk->videoPps) ? tk->videoPpsSize : 0;
+	itk.audioCodec = tk->audioCodec;
+	itk.audioChannelCount = tk->audioChannelCount;
+	itk.audioSampleSize = tk->audioSampleSize;
+	itk.audioSampleRate = tk->audioSampleRate;
+	mp4_index_write(w, &itk, sizeof(itk));
+	mp4_index_write_align(w);
+
+	mp4_index_write(w, tk->videoSps, itk.videoSpsSize);
+	mp4_index_write_align(w);
+	mp4_index_write(w, tk->videoPps, itk.videoPpsSize);
+	mp4_index_write_align(w);
+	mp4_index_write_string(w, tk->metadataContentEncoding);
+	mp4_index_write_string(w, tk->metadataMimeFormat);
+
+	/* in compact mode the tables are expanded while written */
+	if (tk->sampleSize) {
+		mp4_index_write(w, tk->sampleSize,
+			tk->sampleCount * sizeof(uint32_t));
+	} else {
+		for (i = 0; i < tk->sampleCount; i++) {
+			mp4_index_write(w, &tk->constantSampleSize,
+				sizeof(uint32_t));
 		}
-		case MP4_TRACK_REFERENCE_BOX:
-		{
-			off_t _ret = mp4_demux_parse_tref(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+	}
+	mp4_index_write_align(w);
+	mp4_demux_sample_cursor_reset(tk, &cursor);
+	if (tk->sampleOffset) {
+		mp4_index_write(w, tk->sampleOffset,
+			tk->sampleCount * sizeof(uint64_t));
+	} else {
+		for (i = 0; i < tk->sampleCount; i++) {
+			uint64_t offset =
+				mp4_demux_sample_offset(tk, &cursor, i);
+			mp4_index_write(w, &offset, sizeof(offset));
 		}
-		case MP4_HANDLER_REFERENCE_BOX:
-		{
-			off_t _ret = mp4_demux_parse_hdlr(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+	}
+	if (tk->sampleDecodingTime) {
+		mp4_index_write(w, tk->sampleDecodingTime,
+			tk->sampleCount * sizeof(uint64_t));
+	} else {
+		for (i = 0; i < tk->sampleCount; i++) {
+			uint64_t dts = mp4_demux_sample_dts(tk, &cursor, i);
+			mp4_index_write(w, &dts, sizeof(dts));
 		}
-		case MP4_MEDIA_HEADER_BOX:
-		{
-			off_t _ret = mp4_demux_parse_mdhd(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+	}
+	if (itk.hasSyncSamples) {
+		mp4_index_write(w, tk->syncSampleEntries,
+			tk->syncSampleEntryCount * sizeof(uint32_t));
+		mp4_index_write_align(w);
+		if (tk->syncSampleBits) {
+			mp4_index_write(w, tk->syncSampleBits,
+				(tk->sampleCount + 7) / 8);
+		} else {
+			/* a track without samples has no bitset */
+			uint8_t zero = 0;
+			for (i = 0; i < (tk->sampleCount + 7) / 8; i++)
+				mp4_index_write(w, &zero, 1);
 		}
-		case MP4_VIDEO_MEDIA_HEADER_BOX:
-		{
-			off_t _ret = mp4_demux_parse_vmhd(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+		mp4_index_write_align(w);
+	}
+}
+
+
+static void mp4_demux_index_write(
+	struct mp4_demux *demux,
+	struct mp4_index_writer *w)
+{
+	struct mp4_index_header hdr;
+	struct mp4_track *tk;
+	unsigned int i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = MP4_INDEX_MAGIC;
+	hdr.version = MP4_INDEX_VERSION;
+	hdr.fileSize = demux->fileSize;
+	hdr.fileMtime = demux->fileMtime;
+	hdr.duration = demux->duration;
+	hdr.creationTime = demux->creationTime;
+	hdr.modificationTime = demux->modificationTime;
+	hdr.coverOffset = demux->finalCoverOffset;
+	hdr.coverSize = demux->finalCoverSize;
+	hdr.coverType = demux->finalCoverType;
+	hdr.timescale = demux->timescale;
+	hdr.trackCount = demux->trackCount;
+	hdr.chaptersCount = demux->chaptersCount;
+	hdr.metadataCount = demux->finalMetadataCount;
+	/* the total size is only known once the tables are written */
+	size_t start = w->pos;
+	mp4_index_write(w, &hdr, sizeof(hdr));
+	mp4_index_write_align(w);
+
+	for (tk = demux->track; tk; tk = tk->next)
+		mp4_demux_index_write_track(w, tk);
+
+	mp4_index_write(w, demux->chaptersTime,
+		demux->chaptersCount * sizeof(uint64_t));
+	mp4_index_write_align(w);
+	for (i = 0; i < demux->chaptersCount; i++)
+		mp4_index_write_string(w, demux->chaptersName[i]);
+
+	for (i = 0; i < demux->finalMetadataCount; i++) {
+		mp4_index_write_string(w, demux->finalMetadataKey[i]);
+		mp4_index_write_string(w, demux->finalMetadataValue[i]);
+	}
+
+	if (w->buf) {
+		hdr.size = w->pos - start;
+		memcpy(w->buf + start, &hdr, sizeof(hdr));
+	}
+}
+
+
+/* Check once at load the sample tables used in place from an index, so
+ * that the sample functions can trust them as when parsed */
+static int mp4_demux_index_check_tables(
+	struct mp4_demux *demux,
+	const struct mp4_track *tk)
+{
+	uint64_t fileSize = (uint64_t)demux->fileSize;
+	uint32_t i;
+
+	for (i = 0; i < tk->sampleCount; i++) {
+		MP4_RETURN_ERR_IF_FAILED(
+			((tk->sampleOffset[i] <= fileSize) &&
+			(tk->sampleSize[i] <= fileSize -
+			tk->sampleOffset[i])), -EPROTO);
+		MP4_RETURN_ERR_IF_FAILED(((i == 0) ||
+			(tk->sampleDecodingTime[i] >=
+			tk->sampleDecodingTime[i - 1])), -EPROTO);
+	}
+	for (i = 0; i < tk->syncSampleEntryCount; i++) {
+		MP4_RETURN_ERR_IF_FAILED(
+			((tk->syncSampleEntries[i] >= 1) &&
+			(tk->syncSampleEntries[i] <= tk->sampleCount)),
+			-EPROTO);
+		MP4_RETURN_ERR_IF_FAILED(((i == 0) ||
+			(tk->syncSampleEntries[i] >
+			tk->syncSampleEntries[i - 1])), -EPROTO);
+	}
+
+	return 0;
+}
+
+
+static int mp4_demux_index_read_track(
+	struct mp4_demux *demux,
+	struct mp4_index_reader *r,
+	struct mp4_track *tk,
+	const struct mp4_index_track *itk)
+{
+	const void *data;
+	uint32_t count = itk->sampleCount;
+	int ret;
+
+	tk->duration = itk->duration;
+	tk->creationTime = itk->creationTime;
+	tk->modificationTime = itk->modificationTime;
+	tk->id = itk->id;
+	tk->type = itk->type;
+	tk->timescale = itk->timescale;
+	tk->referenceType = itk->referenceType;
+	tk->referenceTrackId = itk->referenceTrackId;
+	tk->videoCodec = itk->videoCodec;
+	tk->videoWidth = itk->videoWidth;
+	tk->videoHeight = itk->videoHeight;
+	tk->audioCodec = itk->audioCodec;
+	tk->audioChannelCount = itk->audioChannelCount;
+	tk->audioSampleSize = itk->audioSampleSize;
+	tk->audioSampleRate = itk->audioSampleRate;
+	MP4_RETURN_ERR_IF_FAILED((tk->timescale != 0), -EPROTO);
+	MP4_RETURN_ERR_IF_FAILED((itk->type < MP4_TRACK_TYPE_MAX), -EPROTO);
+	MP4_RETURN_ERR_IF_FAILED((itk->videoSpsSize <= UINT16_MAX) &&
+		(itk->videoPpsSize <= UINT16_MAX), -EPROTO);
+
+	data = mp4_index_read_table(r, itk->videoSpsSize, 1);
+	MP4_RETURN_ERR_IF_FAILED((data != NULL), -EPROTO);
+	if (itk->videoSpsSize > 0) {
+		tk->videoSps = mp4_demux_malloc(demux, itk->videoSpsSize);
+		MP4_RETURN_ERR_IF_FAILED((tk->videoSps != NULL), -ENOMEM);
+		memcpy(tk->videoSps, data, itk->videoSpsSize);
+		tk->videoSpsSize = itk->videoSpsSize;
+	}
+	data = mp4_index_read_table(r, itk->videoPpsSize, 1);
+	MP4_RETURN_ERR_IF_FAILED((data != NULL), -EPROTO);
+	if (itk->videoPpsSize > 0) {
+		tk->videoPps = mp4_demux_malloc(demux, itk->videoPpsSize);
+		MP4_RETURN_ERR_IF_FAILED((tk->videoPps != NULL), -ENOMEM);
+		memcpy(tk->videoPps, data, itk->videoPpsSize);
+		tk->videoPpsSize = itk->videoPpsSize;
+	}
+	ret = mp4_index_read_string(demux, r, &tk->metadataContentEncoding);
+	if (ret < 0)
+		return ret;
+	ret = mp4_index_read_string(demux, r, &tk->metadataMimeFormat);
+	if (ret < 0)
+		return ret;
+
+	/* the sample tables are used in place */
+	tk->sampleTablesInIndex = 1;
+	tk->sampleCount = count;
+	tk->sampleSize = (uint32_t *)mp4_index_read_table(r, count,
+		sizeof(uint32_t));
+	tk->sampleOffset = (uint64_t *)mp4_index_read_table(r, count,
+		sizeof(uint64_t));
+	tk->sampleDecodingTime = (uint64_t *)mp4_index_read_table(r, count,
+		sizeof(uint64_t));
+	MP4_RETURN_ERR_IF_FAILED((tk->sampleSize != NULL) &&
+		(tk->sampleOffset != NULL) &&
+		(tk->sampleDecodingTime != NULL), -EPROTO);
+	if (itk->hasSyncSamples) {
+		tk->syncSampleEntryCount = itk->syncSampleEntryCount;
+		tk->syncSampleEntries = (uint32_t *)mp4_index_read_table(r,
+			itk->syncSampleEntryCount, sizeof(uint32_t));
+		tk->syncSampleBits = (uint8_t *)mp4_index_read_table(r,
+			(count + 7) / 8, 1);
+		MP4_RETURN_ERR_IF_FAILED((tk->syncSampleEntries != NULL) &&
+			(tk->syncSampleBits != NULL), -EPROTO);
+	}
+	ret = mp4_demux_index_check_tables(demux, tk);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"invalid sample tables for track %d in index", tk->id);
+	tk->sampleTablesBuilt = 1;
+
+	return 0;
+}
+
+
+static struct mp4_track *mp4_demux_index_find_track(
+	struct mp4_demux *demux,
+	uint32_t id)
+{
+	return (id != 0) ? mp4_demux_find_track(demux, id) : NULL;
+}
+
+
+/* Load the tracks, chapters and metadata from an index instead of
+ * parsing the file; the index must match the file size and
+ * modification time */
+static int mp4_demux_load_index(
+	struct mp4_demux *demux,
+	const uint8_t *index,
+	size_t size)
+{
+	struct mp4_index_reader r = { index, size, 0 };
+	const struct mp4_index_header *hdr;
+	struct mp4_track *tk, *last = NULL;
+	uint32_t *links;
+	unsigned int i;
+	int ret = 0;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(((uintptr_t)index % 8 == 0),
+		-EINVAL, "misaligned index");
+	hdr = mp4_index_read_table(&r, 1, sizeof(*hdr));
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(((hdr != NULL) &&
+		(hdr->magic == MP4_INDEX_MAGIC) &&
+		(hdr->version == MP4_INDEX_VERSION) &&
+		(hdr->size <= size)), -EPROTO, "invalid index");
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		((hdr->fileSize == (uint64_t)demux->fileSize) &&
+		(hdr->fileMtime == demux->fileMtime)), -ESTALE,
+		"the index does not match the file");
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		((hdr->timescale != 0) &&
+		(hdr->trackCount <= size / sizeof(struct mp4_index_track)) &&
+		(hdr->chaptersCount <= MP4_CHAPTERS_MAX) &&
+		(hdr->metadataCount <= size / 16)), -EPROTO,
+		"invalid index");
+	r.size = hdr->size;
+
+	demux->duration = hdr->duration;
+	demux->creationTime = hdr->creationTime;
+	demux->modificationTime = hdr->modificationTime;
+	demux->timescale = hdr->timescale;
+
+	/* links to the metadata, reference and chapter tracks are
+	 * resolved by id once all the tracks are loaded */
+	links = calloc(hdr->trackCount + 1, 3 * sizeof(uint32_t));
+	MP4_RETURN_ERR_IF_FAILED((links != NULL), -ENOMEM);
+	for (i = 0; i < hdr->trackCount; i++) {
+		const struct mp4_index_track *itk =
+			mp4_index_read_table(&r, 1, sizeof(*itk));
+		if (itk == NULL) {
+			ret = -EPROTO;
+			goto out;
 		}
-		case MP4_SOUND_MEDIA_HEADER_BOX:
-		{
-			off_t _ret = mp4_demux_parse_smhd(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+		tk = mp4_demux_calloc(demux, 1, sizeof(*tk));
+		if (tk == NULL) {
+			ret = -ENOMEM;
+			goto out;
 		}
-		case MP4_HINT_MEDIA_HEADER_BOX:
-		{
-			off_t _ret = mp4_demux_parse_hmhd(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+		if (last)
+			last->next = tk;
+		else
+			demux->track = tk;
+		tk->prev = last;
+		last = tk;
+		demux->trackCount++;
+		links[3 * i] = itk->refTrackId;
+		links[3 * i + 1] = itk->metadataTrackId;
+		links[3 * i + 2] = itk->chaptersTrackId;
+		ret = mp4_demux_index_read_track(demux, &r, tk, itk);
+		if (ret < 0)
+			goto out;
+	}
+	ret = mp4_demux_build_track_map(demux);
+	if (ret < 0)
+		goto out;
+	for (tk = demux->track, i = 0; tk; tk = tk->next, i++) {
+		tk->ref = mp4_demux_index_find_track(demux, links[3 * i]);
+		tk->metadata = mp4_demux_index_find_track(demux,
+			links[3 * i + 1]);
+		tk->chapters = mp4_demux_index_find_track(demux,
+			links[3 * i + 2]);
+	}
+
+	const uint64_t *chaptersTime = mp4_index_read_table(&r,
+		hdr->chaptersCount, sizeof(uint64_t));
+	if (chaptersTime == NULL) {
+		ret = -EPROTO;
+		goto out;
+	}
+	for (i = 0; i < hdr->chaptersCount; i++) {
+		ret = mp4_index_read_string(demux, &r, &demux->chaptersName[i]);
+		if (ret < 0)
+			goto out;
+		demux->chaptersTime[i] = chaptersTime[i];
+		demux->chaptersCount++;
+	}
+	demux->chaptersBuilt = 1;
+
+	/* the strings are owned by the meta lists as when parsed */
+	if (hdr->metadataCount > 0) {
+		demux->metaMetadataKey = mp4_demux_calloc(demux,
+			hdr->metadataCount, sizeof(char *));
+		demux->metaMetadataValue = mp4_demux_calloc(demux,
+			hdr->metadataCount, sizeof(char *));
+		if ((demux->metaMetadataKey == NULL) ||
+			(demux->metaMetadataValue == NULL)) {
+			ret = -ENOMEM;
+			goto out;
 		}
-		case MP4_NULL_MEDIA_HEADER_BOX:
-		{
-			off_t _ret = mp4_demux_parse_nmhd(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
+		demux->metaMetadataCount = hdr->metadataCount;
+	}
+	for (i = 0; i < hdr->metadataCount; i++) {
+		ret = mp4_index_read_string(demux, &r,
+			&demux->metaMetadataKey[i]);
+		if (ret < 0)
+			goto out;
+		ret = mp4_index_read_string(demux, &r,
+			&demux->metaMetadataValue[i]);
+		if (ret < 0)
+			goto out;
+	}
+	demux->metaCoverOffset = hdr->coverOffset;
+	demux->metaCoverSize = hdr->coverSize;
+	demux->metaCoverType = hdr->coverType;
+
+	ret = mp4_demux_build_metadata(demux);
+	if (ret < 0)
+		goto out;
+	demux->loaded = 1;
+
+out:
+	free(links);
+	return ret;
+}
+
+
+int mp4_demux_index_save(
+	struct mp4_demux *demux,
+	void *buffer,
+	size_t buffer_size,
+	size_t *index_size)
+{
+	struct mp4_index_writer w = { NULL, 0 };
+	struct mp4_track *tk;
+	int ret;
+
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(index_size != NULL, -EINVAL);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((demux->loaded) &&
+		(!demux->fragmented), -EOPNOTSUPP,
+		"only complete non-fragmented files can be indexed");
+
+	/* the index holds all the tables */
+	for (tk = demux->track; tk; tk = tk->next) {
+		ret = mp4_demux_build_sample_tables(demux, tk);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to build the sample tables of track %d",
+			tk->id);
+	}
+	ret = mp4_demux_build_chapters(demux);
+	MP4_RETURN_ERR_IF_FAILED((ret == 0), ret);
+
+	mp4_demux_index_write(demux, &w);
+	*index_size = w.pos;
+	if (buffer == NULL)
+		return 0;
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((buffer_size >= w.pos), -ENOBUFS,
+		"buffer too small (%zu bytes, %zu needed)", buffer_size, w.pos);
+
+	w.buf = buffer;
+	w.pos = 0;
+	mp4_demux_index_write(demux, &w);
+
+	return 0;
+}
+
+
+int mp4_demux_index_save_file(
+	struct mp4_demux *demux,
+	const char *index_path)
+{
+	size_t size = 0, pathLen;
+	uint8_t *buf = NULL;
+	char *tmpPath = NULL;
+	FILE *f = NULL;
+	int ret;
+
+	MP4_RETURN_ERR_IF_FAILED(index_path != NULL, -EINVAL);
+
+	ret = mp4_demux_index_save(demux, NULL, 0, &size);
+	if (ret < 0)
+		return ret;
+	buf = malloc(size);
+	pathLen = strlen(index_path);
+	tmpPath = malloc(pathLen + 5);
+	if ((buf == NULL) || (tmpPath == NULL)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	ret = mp4_demux_index_save(demux, buf, size, &size);
+	if (ret < 0)
+		goto out;
+
+	/* write a temporary file and rename it so that readers never
+	 * see a partial index */
+	memcpy(tmpPath, index_path, pathLen);
+	memcpy(tmpPath + pathLen, ".tmp", 5);
+	f = fopen(tmpPath, "wb");
+	if (f == NULL) {
+		ret = -errno;
+		MP4_LOGE("failed to create file '%s'", tmpPath);
+		goto out;
+	}
+	if (fwrite(buf, size, 1, f) != 1)
+		ret = -EIO;
+	if ((fclose(f) != 0) && (ret == 0))
+		ret = -errno;
+	if ((ret == 0) && (rename(tmpPath, index_path) != 0))
+		ret = -errno;
+	if (ret < 0) {
+		MP4_LOGE("failed to write file '%s'", index_path);
+		remove(tmpPath);
+	}
+
+out:
+	free(buf);
+	free(tmpPath);
+	return ret;
+}
+
+
+struct mp4_demux *mp4_demux_open_index(
+	const char *filename,
+	const void *index,
+	size_t index_size,
+	const struct mp4_demux_config *config)
+{
+	int err = 0;
+	struct mp4_demux *demux;
+
+	MP4_RETURN_VAL_IF_FAILED(filename != NULL, -EINVAL, NULL);
+	MP4_RETURN_VAL_IF_FAILED(index != NULL, -EINVAL, NULL);
+
+	demux = mp4_demux_new(config);
+	if (demux == NULL) {
+		err = -ENOMEM;
+		goto error;
+	}
+
+	err = mp4_demux_setup(demux, filename);
+	if (err < 0)
+		goto error;
+
+	/* the index is owned by the caller and must outlive the
+	 * demuxer */
+	err = mp4_demux_load_index(demux, index, index_size);
+	if (err < 0)
+		goto error;
+
+	return demux;
+
+error:
+	if (demux)
+		mp4_demux_close(demux);
+
+	MP4_RETURN_VAL_IF_FAILED(0, err, NULL);
+	return NULL;
+}
+
+
+struct mp4_demux *mp4_demux_open_index_file(
+	const char *filename,
+	const char *index_path,
+	const struct mp4_demux_config *config)
+{
+#ifdef _WIN32
+	MP4_RETURN_VAL_IF_FAILED(0, -ENOSYS, NULL);
+	return NULL;
+#else /* !_WIN32 */
+	int err = 0, fd = -1;
+	struct mp4_demux *demux;
+	struct stat st;
+	void *map;
+
+	MP4_RETURN_VAL_IF_FAILED(filename != NULL, -EINVAL, NULL);
+	MP4_RETURN_VAL_IF_FAILED(index_path != NULL, -EINVAL, NULL);
+
+	demux = mp4_demux_new(config);
+	if (demux == NULL) {
+		err = -ENOMEM;
+		goto error;
+	}
+
+	err = mp4_demux_setup(demux, filename);
+	if (err < 0)
+		goto error;
+
+	fd = open(index_path, O_RDONLY);
+	if ((fd < 0) || (fstat(fd, &st) != 0) || (st.st_size <= 0)) {
+		MP4_LOGE("failed to open file '%s'", index_path);
+		err = (fd < 0) ? -errno : -EINVAL;
+		goto error;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		MP4_LOGE("failed to map file '%s'", index_path);
+		err = -errno;
+		goto error;
+	}
+	close(fd);
+	fd = -1;
+	demux->indexMap = map;
+	demux->indexMapSize = st.st_size;
+
+	err = mp4_demux_load_index(demux, map, st.st_size);
+	if (err < 0)
+		goto error;
+
+	return demux;
+
+error:
+	if (fd >= 0)
+		close(fd);
+	if (demux)
+		mp4_demux_close(demux);
+
+	MP4_RETURN_VAL_IF_FAILED(0, err, NULL);
+	return NULL;
+#endif /* !_WIN32 */
+}
+
+
+/* Shared state of the probe workers: each worker claims the next
+ * unprobed file, so that slow files do not hold back the others */
+struct mp4_probe_pool {
+	const char *const *paths;
+	unsigned int count;
+	unsigned int next;
+	struct mp4_demux_config config;
+	void (*cb)(const char *path, unsigned int index, int status,
+		struct mp4_demux *demux, void *userdata);
+	void *userdata;
+#ifndef _WIN32
+	pthread_mutex_t mutex;
+#endif /* !_WIN32 */
+};
+
+
+/* Probe worker scratch memory, reused from one file to the next */
+struct mp4_probe_scratch {
+	uint8_t *boxBuffer;
+	size_t boxBufferSize;
+};
+
+
+static void mp4_demux_probe_file(
+	struct mp4_probe_pool *pool,
+	unsigned int idx,
+	struct mp4_probe_scratch *scratch)
+{
+	struct mp4_demux *demux;
+	int err;
+
+	demux = mp4_demux_new(&pool->config);
+	if (demux == NULL) {
+		pool->cb(pool->paths[idx], idx, -ENOMEM, NULL,
+			pool->userdata);
+		return;
+	}
+
+	demux->boxBuffer = scratch->boxBuffer;
+	demux->boxBufferSize = scratch->boxBufferSize;
+	demux->boxBufferBorrowed = 1;
+	err = mp4_demux_setup(demux, pool->paths[idx]);
+	if (err == 0)
+		err = mp4_demux_load(demux);
+	/* the buffer may have been reallocated */
+	scratch->boxBuffer = demux->boxBuffer;
+	scratch->boxBufferSize = demux->boxBufferSize;
+	demux->boxBuffer = NULL;
+
+	pool->cb(pool->paths[idx], idx, err, (err == 0) ? demux : NULL,
+		pool->userdata);
+	mp4_demux_close(demux);
+}
+
+
+static void *mp4_demux_probe_worker(
+	void *arg)
+{
+	struct mp4_probe_pool *pool = arg;
+	struct mp4_probe_scratch scratch;
+
+	memset(&scratch, 0, sizeof(scratch));
+
+	for (;;) {
+		unsigned int idx;
+#ifndef _WIN32
+		pthread_mutex_lock(&pool->mutex);
+#endif /* !_WIN32 */
+		idx = pool->next;
+		if (idx < pool->count)
+			pool->next++;
+#ifndef _WIN32
+		pthread_mutex_unlock(&pool->mutex);
+#endif /* !_WIN32 */
+		if (idx >= pool->count)
+			break;
+		mp4_demux_probe_file(pool, idx, &scratch);
+	}
+
+	free(scratch.boxBuffer);
+
+	return NULL;
+}
+
+
+int mp4_demux_probe_files(
+	const char *const *paths,
+	unsigned int count,
+	unsigned int thread_count,
+	const struct mp4_demux_config *config,
+	void (*cb)(const char *path, unsigned int index, int status,
+		struct mp4_demux *demux, void *userdata),
+	void *userdata)
+{
+	struct mp4_probe_pool pool;
+
+	MP4_RETURN_ERR_IF_FAILED((paths != NULL) || (count == 0), -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(cb != NULL, -EINVAL);
+
+	memset(&pool, 0, sizeof(pool));
+	pool.paths = paths;
+	pool.count = count;
+	pool.cb = cb;
+	pool.userdata = userdata;
+	if (config)
+		pool.config = *config;
+	/* probing never needs the per-sample tables; follow mode and
+	 * readahead only apply to sample reads */
+	pool.config.flags |= MP4_DEMUX_FLAG_HEADER_ONLY;
+	pool.config.flags &= ~MP4_DEMUX_FLAG_FOLLOW;
+	pool.config.readahead_size = 0;
+	/* a caller arena buffer cannot be shared between the workers */
+	pool.config.arena_buffer = NULL;
+	pool.config.arena_size = 0;
+
+#ifdef _WIN32
+	mp4_demux_probe_worker(&pool);
+#else /* !_WIN32 */
+	if (thread_count == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = (n > 0) ? (unsigned int)n : 1;
+	}
+	if (thread_count > count)
+		thread_count = count;
+	pthread_mutex_init(&pool.mutex, NULL);
+
+	/* a single worker runs in the calling thread */
+	pthread_t *threads = (thread_count > 1) ?
+		calloc(thread_count, sizeof(*threads)) : NULL;
+
+	unsigned int i, started = 0;
+	for (i = 0; (threads) && (i < thread_count); i++) {
+		if (pthread_create(&threads[i], NULL,
+			mp4_demux_probe_worker, &pool) != 0)
 			break;
+		started++;
+	}
+	/* the calling thread works too if not all the workers started,
+	 * including when the thread array could not be allocated */
+	if (started < thread_count)
+		mp4_demux_probe_worker(&pool);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&pool.mutex);
+	free(threads);
+#endif /* !_WIN32 */
+
+	return 0;
+}
+
+
+int mp4_demux_close(
+	struct mp4_demux *demux)
+{
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((demux->readerCount == 0),
+		-EBUSY, "%u readers still in use", demux->readerCount);
+
+	if (demux) {
+		if (demux->file)
+			fclose(demux->file);
+#ifndef _WIN32
+		if ((demux->map) && (demux->mapOwned))
+			munmap((void *)demux->map, demux->fileSize);
+		if (demux->indexMap)
+			munmap((void *)demux->indexMap, demux->indexMapSize);
+#endif /* !_WIN32 */
+		if (demux->io.close)
+			demux->io.close(demux->ioOpaque);
+		free(demux->boxBuffer);
+		free(demux->readahead);
+		mp4_demux_io_window_clear(demux);
+		if (demux->arena) {
+			/* everything else lives in the arena */
+			mp4_arena_destroy(demux->arena);
+			free(demux);
+			return 0;
+		}
+		mp4_demux_free_children(demux, &demux->root);
+		mp4_demux_free_tracks(demux);
+		unsigned int i;
+		for (i = 0; i < demux->chaptersCount; i++)
+			free(demux->chaptersName[i]);
+		free(demux->udtaLocationKey);
+		free(demux->udtaLocationValue);
+		for (i = 0; i < demux->udtaMetadataCount; i++) {
+			/* the arrays may be missing after a parsing error */
+			if (demux->udtaMetadataKey)
+				free(demux->udtaMetadataKey[i]);
+			if (demux->udtaMetadataValue)
+				free(demux->udtaMetadataValue[i]);
 		}
-		case MP4_SAMPLE_DESCRIPTION_BOX:
-		{
-			off_t _ret = mp4_demux_parse_stsd(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+		free(demux->udtaMetadataKey);
+		free(demux->udtaMetadataValue);
+		for (i = 0; i < demux->metaMetadataCount; i++) {
+			/* the arrays may be missing after a parsing error */
+			if (demux->metaMetadataKey)
+				free(demux->metaMetadataKey[i]);
+			if (demux->metaMetadataValue)
+				free(demux->metaMetadataValue[i]);
 		}
-		case MP4_DECODING_TIME_TO_SAMPLE_BOX:
-		{
-			off_t _ret = mp4_demux_parse_stts(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+		free(demux->metaMetadataKey);
+		free(demux->metaMetadataValue);
+		free(demux->finalMetadataKey);
+		free(demux->finalMetadataValue);
+	}
+
+	free(demux);
+
+	return 0;
+}
+
+
+int mp4_demux_poll(
+	struct mp4_demux *demux)
+{
+	struct mp4_track *tk = NULL;
+	int ret, count = 0;
+
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+
+	if (!demux->loaded) {
+		ret = mp4_demux_load(demux);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to load the file");
+		for (tk = demux->track; (demux->loaded) && (tk);
+			tk = tk->next) {
+			if (tk->type != MP4_TRACK_TYPE_CHAPTERS)
+				count += tk->sampleCount;
 		}
-		case MP4_SYNC_SAMPLE_BOX:
-		{
-			off_t _ret = mp4_demux_parse_stss(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+		return count;
+	}
+
+	if (!demux->fragmented)
+		return 0;
+
+	/* load the new fragments of the tracks that have been read */
+	for (tk = demux->track; tk; tk = tk->next) {
+		if (tk->type == MP4_TRACK_TYPE_CHAPTERS)
+			continue;
+		if ((tk->type == MP4_TRACK_TYPE_METADATA) && (tk->ref))
+			continue;
+
+		ret = mp4_demux_prepare_track(demux, tk);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to build the sample tables of track %d",
+			tk->id);
+		if (tk->currentSample < tk->sampleCount)
+			continue;
+		ret = mp4_demux_fragment_refill(demux, tk, 1);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to load the next fragment of track %d",
+			tk->id);
+		if (tk->currentSample < tk->sampleCount)
+			count += tk->sampleCount - tk->currentSample;
+	}
+
+	return count;
+}
+
+
+/* Find the sample to seek to in a track: the last sample at or before
+ * the target time 'ts' (in track timescale), preferring the first one
+ * if several samples share the same time, moved back to the previous
+ * sync sample if 'sync' is set; returns 1 if found, 0 otherwise */
+static int mp4_demux_seek_sample(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	struct mp4_sample_cursor *cursor,
+	uint64_t ts,
+	int sync,
+	uint32_t *sampleIdx)
+{
+	uint32_t start;
+	uint32_t idx = mp4_demux_sample_lower_bound(tk, ts);
+
+	if ((idx < tk->sampleCount) &&
+		(mp4_demux_sample_dts(tk, cursor, idx) == ts))
+		start = idx;
+	else if (idx > 0)
+		start = idx - 1;
+	else
+		return 0;
+
+	if (sync) {
+		int prevSync = -1;
+		if (!mp4_demux_is_sync_sample(demux, tk, start, &prevSync)) {
+			if (prevSync < 0)
+				return 0;
+			start = prevSync;
 		}
-		case MP4_SAMPLE_SIZE_BOX:
-		{
-			off_t _ret = mp4_demux_parse_stsz(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+	}
+
+	*sampleIdx = start;
+	return 1;
+}
+
+
+int mp4_demux_seek(
+	struct mp4_demux *demux,
+	uint64_t time_offset,
+	int sync)
+{
+	struct mp4_track *tk = NULL;
+	int positioned = 0, tried = 0;
+
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+
+	for (tk = demux->track; tk; tk = tk->next) {
+		if (tk->type == MP4_TRACK_TYPE_CHAPTERS)
+			continue;
+		if ((tk->type == MP4_TRACK_TYPE_METADATA) && (tk->ref))
+			continue;
+
+		int ret = mp4_demux_prepare_track(demux, tk);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to build the sample tables of track %d",
+			tk->id);
+
+		int found;
+		uint32_t start = 0;
+		tried++;
+		uint64_t ts = (time_offset * tk->timescale + 500000) / 1000000;
+		ret = mp4_demux_fragment_seek(demux, tk, ts);
+		if ((ret == 0) && (tk->metadata)) {
+			ret = mp4_demux_fragment_seek(demux, tk->metadata,
+				(time_offset * tk->metadata->timescale +
+				500000) / 1000000);
 		}
-		case MP4_SAMPLE_TO_CHUNK_BOX:
-		{
-			off_t _ret = mp4_demux_parse_stsc(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to load the fragments of track %d", tk->id);
+		found = mp4_demux_seek_sample(demux, tk, &tk->cursor, ts,
+			sync, &start);
+		if (found) {
+			positioned++;
+			tk->currentSample = start;
+			MP4_LOGI("seek to %" PRIu64
+				" -> sample #%" PRIu32 " time %" PRIu64,
+				time_offset, start,
+				(mp4_demux_sample_dts(tk, &tk->cursor, start) *
+				1000000 + tk->timescale / 2) / tk->timescale);
+			if ((tk->metadata) &&
+				(start < tk->metadata->sampleCount) &&
+				(mp4_demux_sample_dts(tk, &tk->cursor, start) ==
+				mp4_demux_sample_dts(tk->metadata,
+				&tk->metadata->cursor, start)))
+				tk->metadata->currentSample = start;
+			else
+				MP4_LOGW("failed to sync metadata"
+					" with ref track");
+		} else {
+			/* the track keeps its position, the others are
+			 * still seeked */
+			MP4_LOGW("unable to seek in track %d", tk->id);
 		}
-		case MP4_CHUNK_OFFSET_BOX:
-		{
-			off_t _ret = mp4_demux_parse_stco(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+	}
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(((positioned > 0) ||
+		(tried == 0)), -ENOENT, "unable to seek in any track");
+
+	return 0;
+}
+
+
+/* Memory of one set of per-sample tables, 'n' being the allocated
+ * sample count and 'syncCount' the allocated sync sample count */
+static size_t mp4_demux_sample_tables_memory(
+	const struct mp4_sample_tables *t,
+	size_t n,
+	size_t syncCount)
+{
+	size_t size = 0;
+
+	if (t->sampleSize)
+		size += n * sizeof(uint32_t);
+	if (t->sampleOffset)
+		size += n * sizeof(uint64_t);
+	if (t->sampleDecodingTime)
+		size += n * sizeof(uint64_t);
+	if (t->syncSampleEntries)
+		size += syncCount * sizeof(uint32_t);
+	if (t->syncSampleBits)
+		size += (n + 7) / 8;
+
+	return size;
+}
+
+
+/* Memory of the sample tables of a track, either parsed, expanded or
+ * loaded from an index */
+static size_t mp4_demux_track_table_memory(
+	const struct mp4_track *tk)
+{
+	struct mp4_sample_tables active = {
+		.sampleCount = tk->sampleCount,
+		.sampleSize = tk->sampleSize,
+		.sampleDecodingTime = tk->sampleDecodingTime,
+		.sampleOffset = tk->sampleOffset,
+		.syncSampleEntryCount = tk->syncSampleEntryCount,
+		.syncSampleEntries = tk->syncSampleEntries,
+		.syncSampleBits = tk->syncSampleBits,
+	};
+	const struct mp4_sample_tables *moov = &active;
+	const struct mp4_sample_tables *frag = NULL;
+	size_t size = 0;
+
+	if (tk->fragmentLoaded) {
+		moov = &tk->inactiveTables;
+		frag = &active;
+	} else if (tk->fragmented) {
+		frag = &tk->inactiveTables;
+	}
+	size += mp4_demux_sample_tables_memory(moov, moov->sampleCount,
+		moov->syncSampleEntryCount);
+	if (frag) {
+		size += mp4_demux_sample_tables_memory(frag,
+			tk->fragmentSampleCapacity,
+			tk->fragmentSampleCapacity);
+	}
+	if (tk->chunkOffset)
+		size += (size_t)tk->chunkCount * sizeof(uint64_t);
+	if (tk->timeToSampleEntries)
+		size += (size_t)tk->timeToSampleEntryCount *
+			sizeof(struct mp4_time_to_sample_entry);
+	if (tk->sampleToChunkEntries)
+		size += (size_t)tk->sampleToChunkEntryCount *
+			sizeof(struct mp4_sample_to_chunk_entry);
+
+	return size;
+}
+
+
+int mp4_demux_get_media_info(
+	struct mp4_demux *demux,
+	struct mp4_media_info *media_info)
+{
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(media_info != NULL, -EINVAL);
+
+	memset(media_info, 0, sizeof(*media_info));
+
+	/* no duration without a movie header */
+	if (demux->timescale > 0) {
+		media_info->duration = (demux->duration * 1000000 +
+			demux->timescale / 2) / demux->timescale;
+	}
+	media_info->creation_time =
+		demux->creationTime - MP4_MAC_TO_UNIX_EPOCH_OFFSET;
+	media_info->modification_time =
+		demux->creationTime - MP4_MAC_TO_UNIX_EPOCH_OFFSET;
+	media_info->track_count = demux->trackCount;
+
+	return 0;
+}
+
+
+int mp4_demux_get_stats(
+	struct mp4_demux *demux,
+	struct mp4_demux_stats *stats)
+{
+	struct mp4_track *tk;
+
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(stats != NULL, -EINVAL);
+
+	memcpy(stats->box_types, demux->stats.box_types,
+		sizeof(stats->box_types));
+	stats->box_type_count = demux->stats.box_type_count;
+	stats->bytes_read = MP4_DEMUX_STAT_GET(demux, bytes_read);
+	stats->read_count = MP4_DEMUX_STAT_GET(demux, read_count);
+	stats->seek_count = MP4_DEMUX_STAT_GET(demux, seek_count);
+	stats->sample_cache_hits =
+		MP4_DEMUX_STAT_GET(demux, sample_cache_hits);
+	stats->sample_cache_misses =
+		MP4_DEMUX_STAT_GET(demux, sample_cache_misses);
+	stats->table_memory = 0;
+	for (tk = demux->track; tk; tk = tk->next)
+		stats->table_memory += mp4_demux_track_table_memory(tk);
+
+	return 0;
+}
+
+
+int mp4_demux_get_track_count(
+	struct mp4_demux *demux)
+{
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+
+	return demux->trackCount;
+}
+
+
+struct mp4_track *mp4_demux_get_track(
+	struct mp4_demux *demux,
+	unsigned int track_id)
+{
+	return mp4_demux_find_track(demux, track_id);
+}
+
+
+struct mp4_track *mp4_demux_get_track_by_idx(
+	struct mp4_demux *demux,
+	unsigned int track_idx)
+{
+	if ((demux == NULL) || (demux->trackArray == NULL) ||
+		(track_idx >= demux->trackCount))
+		return NULL;
+
+	return demux->trackArray[track_idx];
+}
+
+
+int mp4_demux_track_get_info(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	struct mp4_track_info *track_info)
+{
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(track_info != NULL, -EINVAL);
+
+	memset(track_info, 0, sizeof(*track_info));
+
+	if (tk) {
+		track_info->id = tk->id;
+		track_info->type = tk->type;
+		track_info->duration =
+			(tk->duration * 1000000 + tk->timescale / 2) /
+			tk->timescale;
+		track_info->creation_time =
+			tk->creationTime - MP4_MAC_TO_UNIX_EPOCH_OFFSET;
+		track_info->modification_time =
+			tk->creationTime - MP4_MAC_TO_UNIX_EPOCH_OFFSET;
+		track_info->sample_count = tk->sampleCount;
+		track_info->has_metadata = (tk->metadata) ? 1 : 0;
+		if (tk->metadata) {
+			track_info->metadata_content_encoding =
+				tk->metadata->metadataContentEncoding;
+			track_info->metadata_mime_format =
+				tk->metadata->metadataMimeFormat;
+		} else if (tk->type == MP4_TRACK_TYPE_METADATA) {
+			track_info->metadata_content_encoding =
+				tk->metadataContentEncoding;
+			track_info->metadata_mime_format =
+				tk->metadataMimeFormat;
 		}
-		case MP4_CHUNK_OFFSET_64_BOX:
-		{
-			off_t _ret = mp4_demux_parse_co64(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+		if (tk->type == MP4_TRACK_TYPE_VIDEO) {
+			track_info->video_codec = tk->videoCodec;
+			track_info->video_width = tk->videoWidth;
+			track_info->video_height = tk->videoHeight;
+		} else if (tk->type == MP4_TRACK_TYPE_AUDIO) {
+			track_info->audio_codec = tk->audioCodec;
+			track_info->audio_channel_count = tk->audioChannelCount;
+			track_info->audio_sample_size = tk->audioSampleSize;
+			track_info->audio_sample_rate =
+				(float)tk->audioSampleRate / 65536.;
 		}
-		case MP4_META_BOX:
-		{
-			if ((parent) &&
-				(parent->box.type == MP4_USER_DATA_BOX)) {
-				MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-					(realBoxSize - boxReadBytes >= 4),
-					-EINVAL,
-					"invalid size: %ld expected %d min",
-					realBoxSize - boxReadBytes, 4);
+	} else {
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, -ENOENT,
+			"track not found");
+	}
+
+	return 0;
+}
+
+
+int mp4_demux_get_track_info(
+	struct mp4_demux *demux,
+	unsigned int track_idx,
+	struct mp4_track_info *track_info)
+{
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(track_info != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(track_idx < demux->trackCount, -EINVAL);
+
+	return mp4_demux_track_get_info(demux,
+		mp4_demux_get_track_by_idx(demux, track_idx), track_info);
+}
+
+
+int mp4_demux_track_get_avc_decoder_config(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	uint8_t **sps,
+	unsigned int *sps_size,
+	uint8_t **pps,
+	unsigned int *pps_size)
+{
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(sps != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(sps_size != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(pps != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(pps_size != NULL, -EINVAL);
 
-				/* version & flags */
-				MP4_READ_32(demux->file, val32, boxReadBytes);
-				uint32_t flags = ntohl(val32);
-				uint8_t version = (flags >> 24) & 0xFF;
-				flags &= ((1 << 24) - 1);
-				MP4_LOGD("# meta: version=%d", version);
-				MP4_LOGD("# meta: flags=%" PRIu32, flags);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk != NULL), -ENOENT,
+		"track not found");
 
-				off_t _ret = mp4_demux_parse_children(
-					demux, item,
-					realBoxSize - boxReadBytes, track);
-				MP4_RETURN_ERR_IF_FAILED((_ret >= 0),
-					(int)_ret);
-				boxReadBytes += _ret;
-			} else if ((parent) &&
-				(parent->box.type == MP4_MOVIE_BOX)) {
-				off_t _ret = mp4_demux_parse_children(
-					demux, item,
-					realBoxSize - boxReadBytes, track);
-				MP4_RETURN_ERR_IF_FAILED((_ret >= 0),
-					(int)_ret);
-				boxReadBytes += _ret;
-			}
-			break;
-		}
-		case MP4_ILST_BOX:
-		{
-			if ((parent) && (parent->parent) &&
-				(parent->parent->box.type ==
-				MP4_USER_DATA_BOX)) {
-				demux->udtaMetadataCount =
-					mp4_demux_count_ilst_sub_box(
-					demux, item,
-					realBoxSize - boxReadBytes, track);
-				if (demux->udtaMetadataCount > 0) {
-					char **key =
-						calloc(demux->udtaMetadataCount,
-						sizeof(char *));
-					MP4_RETURN_ERR_IF_FAILED(
-						(key != NULL), -ENOMEM);
-					demux->udtaMetadataKey = key;
+	if (tk->videoSps) {
+		*sps = tk->videoSps;
+		*sps_size = tk->videoSpsSize;
+	}
+	if (tk->videoPps) {
+		*pps = tk->videoPps;
+		*pps_size = tk->videoPpsSize;
+	}
 
-					char **value =
-						calloc(demux->udtaMetadataCount,
-						sizeof(char *));
-					MP4_RETURN_ERR_IF_FAILED(
-						(value != NULL), -ENOMEM);
-					demux->udtaMetadataValue = value;
+	return 0;
+}
 
-					demux->udtaMetadataParseIdx = 0;
-				}
-			}
-			off_t _ret = mp4_demux_parse_children(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+
+int mp4_demux_get_track_avc_decoder_config(
+	struct mp4_demux *demux,
+	unsigned int track_id,
+	uint8_t **sps,
+	unsigned int *sps_size,
+	uint8_t **pps,
+	unsigned int *pps_size)
+{
+	return mp4_demux_track_get_avc_decoder_config(demux,
+		mp4_demux_find_track(demux, track_id), sps, sps_size, pps,
+		pps_size);
+}
+
+
+/* Locate the metadata sample linked to sample 'idx' of a track, using
+ * 'cursor' on the metadata track; returns 1 if there is one, 0 if not,
+ * or -EIO if it is out of the file bounds */
+static int mp4_demux_locate_metadata_sample(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	struct mp4_sample_cursor *cursor,
+	uint32_t idx,
+	uint64_t *offset,
+	uint32_t *size)
+{
+	struct mp4_track *metatk = tk->metadata;
+
+	if ((metatk == NULL) || (idx >= metatk->sampleCount))
+		return 0;
+
+	/* TODO: check sync between metadata and ref track */
+	*offset = mp4_demux_sample_offset(metatk, cursor, idx);
+	*size = mp4_demux_sample_size(metatk, idx);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		((*offset <= (uint64_t)demux->fileSize) &&
+		(*size <= (uint64_t)demux->fileSize - *offset)), -EIO,
+		"metadata sample out of file bounds (offset %" PRIu64
+		", size %" PRIu32 ")", *offset, *size);
+
+	return 1;
+}
+
+
+/* Get the metadata sample linked to sample 'idx' of a track into
+ * 'track_sample': read into 'buf' with 'pread' if it fits, or pointed
+ * to in the file mapping if 'pread' is NULL */
+static int mp4_demux_track_get_metadata_sample(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	struct mp4_sample_cursor *cursor,
+	uint32_t idx,
+	int (*pread)(struct mp4_demux *demux, off_t offset, void *buf,
+		size_t size),
+	uint8_t *buf,
+	unsigned int bufSize,
+	struct mp4_track_sample *track_sample)
+{
+	uint64_t offset;
+	uint32_t size;
+	int ret;
+
+	ret = mp4_demux_locate_metadata_sample(demux, tk, cursor, idx,
+		&offset, &size);
+	if (ret <= 0)
+		return ret;
+
+	track_sample->metadata_size = size;
+	if (pread == NULL) {
+		track_sample->metadata_data = demux->map + offset;
+	} else if ((buf) && (size <= bufSize)) {
+		ret = pread(demux, offset, buf, size);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to read %d bytes from file", size);
+	}
+
+	return 0;
+}
+
+
+int mp4_demux_track_get_next_sample(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	uint8_t *sample_buffer,
+	unsigned int sample_buffer_size,
+	uint8_t *metadata_buffer,
+	unsigned int metadata_buffer_size,
+	struct mp4_track_sample *track_sample)
+{
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(track_sample != NULL, -EINVAL);
+
+	memset(track_sample, 0, sizeof(*track_sample));
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk != NULL), -ENOENT,
+		"track not found");
+
+	int ret = mp4_demux_prepare_track(demux, tk);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"failed to build the sample tables of track %d", tk->id);
+	ret = mp4_demux_fragment_refill(demux, tk, 1);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"failed to load the next fragment of track %d", tk->id);
+
+	if (tk->currentSample < tk->sampleCount) {
+		uint32_t size = mp4_demux_sample_size(tk, tk->currentSample);
+		track_sample->sample_size = size;
+		if ((sample_buffer) && (size <= sample_buffer_size)) {
+			int _ret = mp4_demux_io_pread_sample(demux,
+				mp4_demux_sample_offset(tk, &tk->cursor,
+					tk->currentSample),
+				sample_buffer, size);
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((_ret == 0), _ret,
+				"failed to read %d bytes from file", size);
+		} else if (sample_buffer) {
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, -ENOBUFS,
+				"buffer too small (%d bytes, %d needed)",
+				sample_buffer_size, size);
 		}
-		case MP4_DATA_BOX:
-		{
-			off_t _ret = mp4_demux_parse_meta_data(
-				demux, item, realBoxSize - boxReadBytes, track);
-			MP4_RETURN_ERR_IF_FAILED((_ret >= 0), (int)_ret);
-			boxReadBytes += _ret;
-			break;
+		if (tk->metadata) {
+			ret = mp4_demux_track_get_metadata_sample(demux, tk,
+				&tk->metadata->cursor, tk->currentSample,
+				mp4_demux_io_pread_sample, metadata_buffer,
+				metadata_buffer_size, track_sample);
+			if (ret < 0)
+				return ret;
 		}
-		case MP4_LOCATION_BOX:
-		{
-			if ((parent) &&
-				(parent->box.type == MP4_USER_DATA_BOX)) {
-				off_t _ret = mp4_demux_parse_xyz(
-					demux, item,
-					realBoxSize - boxReadBytes, track);
-				MP4_RETURN_ERR_IF_FAILED((_ret >= 0),
-					(int)_ret);
-				boxReadBytes += _ret;
-			}
-			break;
+		mp4_demux_sample_times(tk, &tk->cursor, tk->currentSample,
+			track_sample);
+		tk->currentSample++;
+	}
+
+	return 0;
+}
+
+
+int mp4_demux_get_track_next_sample(
+	struct mp4_demux *demux,
+	unsigned int track_id,
+	uint8_t *sample_buffer,
+	unsigned int sample_buffer_size,
+	uint8_t *metadata_buffer,
+	unsigned int metadata_buffer_size,
+	struct mp4_track_sample *track_sample)
+{
+	return mp4_demux_track_get_next_sample(demux,
+		mp4_demux_find_track(demux, track_id), sample_buffer,
+		sample_buffer_size, metadata_buffer, metadata_buffer_size,
+		track_sample);
+}
+
+
+int mp4_demux_track_get_next_sample_view(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	struct mp4_track_sample *track_sample)
+{
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(track_sample != NULL, -EINVAL);
+
+	memset(track_sample, 0, sizeof(*track_sample));
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((demux->map != NULL), -EOPNOTSUPP,
+		"sample views require a mapped file");
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk != NULL), -ENOENT,
+		"track not found");
+
+	int ret = mp4_demux_prepare_track(demux, tk);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"failed to build the sample tables of track %d", tk->id);
+	ret = mp4_demux_fragment_refill(demux, tk, 1);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"failed to load the next fragment of track %d", tk->id);
+
+	if (tk->currentSample < tk->sampleCount) {
+		uint64_t offset = mp4_demux_sample_offset(tk, &tk->cursor,
+			tk->currentSample);
+		uint32_t size = mp4_demux_sample_size(tk, tk->currentSample);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+			((offset <= (uint64_t)demux->fileSize) &&
+			(size <= (uint64_t)demux->fileSize - offset)), -EIO,
+			"sample out of file bounds (offset %" PRIu64
+			", size %" PRIu32 ")", offset, size);
+		track_sample->sample_size = size;
+		track_sample->sample_data = demux->map + offset;
+		if (tk->metadata) {
+			ret = mp4_demux_track_get_metadata_sample(demux, tk,
+				&tk->metadata->cursor, tk->currentSample,
+				NULL, NULL, 0, track_sample);
+			if (ret < 0)
+				return ret;
 		}
-		case MP4_KEYS_BOX:
-		{
-			if ((parent) && (parent->box.type == MP4_META_BOX)) {
-				off_t _ret = mp4_demux_parse_meta_keys(
-					demux, item,
-					realBoxSize - boxReadBytes, track);
-				MP4_RETURN_ERR_IF_FAILED((_ret >= 0),
-					(int)_ret);
-				boxReadBytes += _ret;
-			}
-			break;
+		mp4_demux_sample_times(tk, &tk->cursor, tk->currentSample,
+			track_sample);
+		tk->currentSample++;
+	}
+
+	return 0;
+}
+
+
+int mp4_demux_get_track_next_sample_view(
+	struct mp4_demux *demux,
+	unsigned int track_id,
+	struct mp4_track_sample *track_sample)
+{
+	return mp4_demux_track_get_next_sample_view(demux,
+		mp4_demux_find_track(demux, track_id), track_sample);
+}
+
+
+int mp4_demux_get_next_sample(
+	struct mp4_demux *demux,
+	unsigned int *track_id,
+	uint8_t *sample_buffer,
+	unsigned int sample_buffer_size,
+	struct mp4_track_sample *track_sample)
+{
+	struct mp4_track *tk = NULL, *next = NULL;
+	uint64_t offset, nextOffset = 0;
+
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(track_id != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(track_sample != NULL, -EINVAL);
+
+	memset(track_sample, 0, sizeof(*track_sample));
+	*track_id = 0;
+
+	/* pick the pending sample with the lowest file offset */
+	for (tk = demux->track; tk; tk = tk->next) {
+		if (tk->type == MP4_TRACK_TYPE_CHAPTERS)
+			continue;
+		int ret = mp4_demux_build_sample_tables(demux, tk);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to build the sample tables of track %d",
+			tk->id);
+		ret = mp4_demux_fragment_refill(demux, tk, 0);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to load the next fragment of track %d",
+			tk->id);
+		if (tk->currentSample >= tk->sampleCount)
+			continue;
+		offset = mp4_demux_sample_offset(tk, &tk->cursor,
+			tk->currentSample);
+		if ((next == NULL) || (offset < nextOffset)) {
+			next = tk;
+			nextOffset = offset;
 		}
-		default:
-		{
-			if ((parent) && (parent->box.type == MP4_ILST_BOX)) {
-				off_t _ret = mp4_demux_parse_children(
-					demux, item,
-					realBoxSize - boxReadBytes, track);
-				MP4_RETURN_ERR_IF_FAILED((_ret >= 0),
-					(int)_ret);
-				boxReadBytes += _ret;
-			}
-			break;
+	}
+
+	if (next == NULL)
+		return 0;
+
+	tk = next;
+	uint32_t size = mp4_demux_sample_size(tk, tk->currentSample);
+	if ((sample_buffer) && (size <= sample_buffer_size)) {
+		int _ret = mp4_demux_io_pread_sample(demux, nextOffset,
+			sample_buffer, size);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((_ret == 0), _ret,
+			"failed to read %d bytes from file", size);
+	} else if (sample_buffer) {
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, -ENOBUFS,
+			"buffer too small (%d bytes, %d needed)",
+			sample_buffer_size, size);
+	}
+	*track_id = tk->id;
+	track_sample->sample_size = size;
+	mp4_demux_sample_times(tk, &tk->cursor, tk->currentSample,
+		track_sample);
+	tk->currentSample++;
+
+	return 0;
+}
+
+
+int mp4_demux_track_is_sync_sample(
+	struct mp4_demux *demux,
+	unsigned int track_id,
+	unsigned int sample_index)
+{
+	struct mp4_track *tk = NULL;
+
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+
+	tk = mp4_demux_find_track(demux, track_id);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk != NULL), -ENOENT,
+		"track not found");
+
+	MP4_RETURN_ERR_IF_FAILED(sample_index < tk->sampleCount, -EINVAL);
+
+	int ret = mp4_demux_build_sample_tables(demux, tk);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"failed to build the sample tables of track %d", tk->id);
+
+	if (!tk->syncSampleBits)
+		return 1;
+
+	return (tk->syncSampleBits[sample_index >> 3] &
+		(1 << (sample_index & 7))) ? 1 : 0;
+}
+
+
+int mp4_demux_get_track_sample_index(
+	struct mp4_demux *demux,
+	unsigned int track_id,
+	unsigned int first_sample,
+	unsigned int max_samples,
+	uint64_t *offsets,
+	uint32_t *sizes,
+	uint64_t *dts,
+	uint8_t *sync)
+{
+	struct mp4_track *tk = NULL;
+	struct mp4_sample_cursor cursor;
+	unsigned int i, count;
+
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+
+	tk = mp4_demux_find_track(demux, track_id);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk != NULL), -ENOENT,
+		"track not found");
+
+	int ret = mp4_demux_build_sample_tables(demux, tk);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"failed to build the sample tables of track %d", tk->id);
+
+	if (first_sample >= tk->sampleCount)
+		return 0;
+	count = tk->sampleCount - first_sample;
+	if (count > max_samples)
+		count = max_samples;
+
+	/* private cursor: the track read position is left untouched */
+	mp4_demux_sample_cursor_reset(tk, &cursor);
+
+	if ((offsets) && (tk->sampleOffset)) {
+		memcpy(offsets, &tk->sampleOffset[first_sample],
+			count * sizeof(uint64_t));
+	} else if (offsets) {
+		for (i = 0; i < count; i++) {
+			offsets[i] = mp4_demux_sample_offset(tk, &cursor,
+				first_sample + i);
 		}
+	}
+
+	if ((sizes) && (tk->sampleSize)) {
+		memcpy(sizes, &tk->sampleSize[first_sample],
+			count * sizeof(uint32_t));
+	} else if (sizes) {
+		for (i = 0; i < count; i++)
+			sizes[i] = tk->constantSampleSize;
+	}
+
+	if (dts) {
+		for (i = 0; i < count; i++) {
+			dts[i] = (mp4_demux_sample_dts(tk, &cursor,
+				first_sample + i) * 1000000 +
+				tk->timescale / 2) / tk->timescale;
 		}
+	}
 
-		/* skip the rest of the box */
-		if (realBoxSize < boxReadBytes) {
-			MP4_LOGE("invalid box size %ld (read bytes: %ld)",
-				realBoxSize, boxReadBytes);
-			ret = -EIO;
-			break;
+	if ((sync) && (!tk->syncSampleEntries)) {
+		/* no stss box: all samples are sync samples */
+		memset(sync, 1, count);
+	} else if (sync) {
+		/* mark the entries in range; the entries are 1-based
+		 * sample numbers in increasing order */
+		uint32_t lo = 0, hi = tk->syncSampleEntryCount;
+		memset(sync, 0, count);
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (tk->syncSampleEntries[mid] <= first_sample)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
-		int _ret = fseeko(demux->file,
-			realBoxSize - boxReadBytes, SEEK_CUR);
-		if (_ret != 0) {
-			MP4_LOGE("failed to seek %ld bytes forward in file",
-				realBoxSize - boxReadBytes);
-			ret = -EIO;
-			break;
+		for (i = lo; i < tk->syncSampleEntryCount; i++) {
+			uint32_t idx = tk->syncSampleEntries[i] - 1;
+			if (idx >= first_sample + count)
+				break;
+			sync[idx - first_sample] = 1;
 		}
-
-		parentReadBytes += realBoxSize;
 	}
 
-	return (ret < 0) ? ret : parentReadBytes;
+	return (int)count;
 }
 
 
-static int mp4_demux_build_tracks(
-	struct mp4_demux *demux)
+int mp4_demux_track_find_sample(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	uint64_t time,
+	enum mp4_sample_lookup lookup,
+	struct mp4_track_sample_info *sample_info)
 {
-	struct mp4_track *tk = NULL, *videoTk = NULL;
-	struct mp4_track *metaTk = NULL, *chapTk = NULL;
-	int videoTrackCount = 0, audioTrackCount = 0, hintTrackCount = 0;
-	int metadataTrackCount = 0, textTrackCount = 0;
+	struct mp4_sample_cursor cursor;
+	uint32_t idx = 0, next;
+	uint64_t ts;
+	int found = 0, prevSync = -1;
 
-	for (tk = demux->track; tk; tk = tk->next) {
-		unsigned int i, j, k, n;
-		uint32_t lastFirstChunk = 1, lastSamplesPerChunk = 0;
-		uint32_t chunkCount, sampleCount = 0, chunkIdx;
-		uint64_t offsetInChunk;
-		for (i = 0; i < tk->sampleToChunkEntryCount; i++) {
-			chunkCount = tk->sampleToChunkEntries[i].firstChunk -
-				lastFirstChunk;
-			sampleCount += chunkCount * lastSamplesPerChunk;
-			lastFirstChunk = tk->sampleToChunkEntries[i].firstChunk;
-			lastSamplesPerChunk =
-				tk->sampleToChunkEntries[i].samplesPerChunk;
-		}
-		chunkCount = tk->chunkCount - lastFirstChunk + 1;
-		sampleCount += chunkCount * lastSamplesPerChunk;
-
-		if (sampleCount != tk->sampleCount) {
-			MP4_LOGE("sample count mismatch: %d vs. %d",
-				sampleCount, tk->sampleCount);
-			return -EPROTO;
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(sample_info != NULL, -EINVAL);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk != NULL), -ENOENT,
+		"track not found");
+
+	memset(sample_info, 0, sizeof(*sample_info));
+
+	int ret = mp4_demux_build_sample_tables(demux, tk);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"failed to build the sample tables of track %d", tk->id);
+
+	/* private cursor: the track read position is left untouched */
+	mp4_demux_sample_cursor_reset(tk, &cursor);
+	ts = (time * tk->timescale + 500000) / 1000000;
+
+	switch (lookup) {
+	case MP4_SAMPLE_LOOKUP_PREVIOUS:
+	case MP4_SAMPLE_LOOKUP_PREVIOUS_SYNC:
+		found = mp4_demux_seek_sample(demux, tk, &cursor, ts,
+			(lookup == MP4_SAMPLE_LOOKUP_PREVIOUS_SYNC), &idx);
+		break;
+	case MP4_SAMPLE_LOOKUP_NEXT_SYNC:
+		idx = mp4_demux_next_sync_sample(tk,
+			mp4_demux_sample_lower_bound(tk, ts));
+		found = (idx < tk->sampleCount);
+		break;
+	case MP4_SAMPLE_LOOKUP_NEAREST_SYNC:
+		/* on a tie the previous sync sample wins */
+		found = mp4_demux_seek_sample(demux, tk, &cursor, ts, 1,
+			&idx);
+		next = mp4_demux_next_sync_sample(tk,
+			mp4_demux_sample_lower_bound(tk, ts));
+		if ((next < tk->sampleCount) && ((!found) ||
+			(mp4_demux_sample_dts(tk, &cursor, next) - ts <
+			ts - mp4_demux_sample_dts(tk, &cursor, idx)))) {
+			idx = next;
+			found = 1;
 		}
+		break;
+	default:
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, -EINVAL,
+			"invalid lookup mode %d", lookup);
+	}
 
-		tk->sampleOffset = malloc(sampleCount * sizeof(uint64_t));
-		MP4_RETURN_ERR_IF_FAILED((tk->sampleOffset != NULL), -ENOMEM);
-
-		lastFirstChunk = 1;
-		lastSamplesPerChunk = 0;
-		for (i = 0, n = 0, chunkIdx = 0;
-			i < tk->sampleToChunkEntryCount; i++) {
-			chunkCount = tk->sampleToChunkEntries[i].firstChunk -
-				lastFirstChunk;
-			for (j = 0; j < chunkCount; j++, chunkIdx++) {
-				for (k = 0, offsetInChunk = 0;
-					k < lastSamplesPerChunk; k++, n++) {
-					tk->sampleOffset[n] =
-						tk->chunkOffset[chunkIdx] +
-						offsetInChunk;
-					offsetInChunk += tk->sampleSize[n];
-				}
-			}
-			lastFirstChunk =
-				tk->sampleToChunkEntries[i].firstChunk;
-			lastSamplesPerChunk =
-				tk->sampleToChunkEntries[i].samplesPerChunk;
-		}
-		chunkCount = tk->chunkCount - lastFirstChunk + 1;
-		for (j = 0; j < chunkCount; j++, chunkIdx++) {
-			for (k = 0, offsetInChunk = 0;
-				k < lastSamplesPerChunk; k++, n++) {
-				tk->sampleOffset[n] =
-					tk->chunkOffset[chunkIdx] +
-					offsetInChunk;
-				offsetInChunk += tk->sampleSize[n];
-			}
-		}
+	/* not an error: the time is out of the track range */
+	if (!found)
+		return -ENOENT;
+
+	sample_info->sample_index = idx;
+	sample_info->sample_dts = (mp4_demux_sample_dts(tk, &cursor, idx) *
+		1000000 + tk->timescale / 2) / tk->timescale;
+	sample_info->sample_offset = mp4_demux_sample_offset(tk, &cursor,
+		idx);
+	sample_info->sample_size = mp4_demux_sample_size(tk, idx);
+	sample_info->sync = mp4_demux_is_sync_sample(demux, tk, idx,
+		&prevSync);
+	sample_info->sync_sample_index = (sample_info->sync) ? idx :
+		(prevSync >= 0) ? (unsigned int)prevSync : 0;
+	sample_info->sync_sample_dts = (mp4_demux_sample_dts(tk, &cursor,
+		sample_info->sync_sample_index) * 1000000 +
+		tk->timescale / 2) / tk->timescale;
 
-		for (i = 0, sampleCount = 0;
-			i < tk->timeToSampleEntryCount; i++)
-			sampleCount += tk->timeToSampleEntries[i].sampleCount;
+	return 0;
+}
 
-		if (sampleCount != tk->sampleCount) {
-			MP4_LOGE("sample count mismatch: %d vs. %d",
-				sampleCount, tk->sampleCount);
-			return -EPROTO;
-		}
 
-		tk->sampleDecodingTime = malloc(sampleCount * sizeof(uint64_t));
-		MP4_RETURN_ERR_IF_FAILED(
-			(tk->sampleDecodingTime != NULL), -ENOMEM);
-
-		uint64_t ts = 0;
-		for (i = 0, k = 0; i < tk->timeToSampleEntryCount; i++) {
-			for (j = 0; j < tk->timeToSampleEntries[i].sampleCount;
-				j++, k++) {
-				tk->sampleDecodingTime[k] = ts;
-				ts += tk->timeToSampleEntries[i].sampleDelta;
-			}
+int mp4_demux_track_read_sample(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	unsigned int sample_index,
+	uint8_t *sample_buffer,
+	unsigned int sample_buffer_size,
+	uint8_t *metadata_buffer,
+	unsigned int metadata_buffer_size,
+	struct mp4_track_sample *track_sample)
+{
+	struct mp4_sample_cursor cursor;
+	struct mp4_track *metatk;
+	uint32_t size;
+	int ret;
+
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(track_sample != NULL, -EINVAL);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk != NULL), -ENOENT,
+		"track not found");
+
+	memset(track_sample, 0, sizeof(*track_sample));
+
+	ret = mp4_demux_build_sample_tables(demux, tk);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"failed to build the sample tables of track %d", tk->id);
+	MP4_RETURN_ERR_IF_FAILED(sample_index < tk->sampleCount, -EINVAL);
+
+	mp4_demux_sample_cursor_reset(tk, &cursor);
+	size = mp4_demux_sample_size(tk, sample_index);
+	track_sample->sample_size = size;
+	if ((sample_buffer) && (size <= sample_buffer_size)) {
+		ret = mp4_demux_io_pread_random(demux,
+			mp4_demux_sample_offset(tk, &cursor, sample_index),
+			sample_buffer, size);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to read %d bytes from file", size);
+	} else if (sample_buffer) {
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, -ENOBUFS,
+			"buffer too small (%d bytes, %d needed)",
+			sample_buffer_size, size);
+	}
+	metatk = tk->metadata;
+	if ((metatk) && (sample_index < metatk->sampleCount)) {
+		struct mp4_sample_cursor metaCursor;
+		ret = mp4_demux_build_sample_tables(demux, metatk);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to build the sample tables of track %d",
+			metatk->id);
+		mp4_demux_sample_cursor_reset(metatk, &metaCursor);
+		ret = mp4_demux_track_get_metadata_sample(demux, tk,
+			&metaCursor, sample_index, mp4_demux_io_pread_random,
+			metadata_buffer, metadata_buffer_size, track_sample);
+		if (ret < 0)
+			return ret;
+	}
+	mp4_demux_sample_times(tk, &cursor, sample_index, track_sample);
+
+	return 0;
+}
+
+int mp4_demux_track_get_next_samples(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	uint8_t *sample_buffer,
+	size_t sample_buffer_size,
+	uint8_t *metadata_buffer,
+	size_t metadata_buffer_size,
+	struct mp4_track_sample *track_samples,
+	unsigned int max_samples)
+{
+	struct mp4_track *metatk;
+	struct mp4_read_run run, metaRun;
+	unsigned int n;
+	int ret;
+
+	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(track_samples != NULL, -EINVAL);
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk != NULL), -ENOENT,
+		"track not found");
+
+	ret = mp4_demux_prepare_track(demux, tk);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"failed to build the sample tables of track %d", tk->id);
+	ret = mp4_demux_fragment_refill(demux, tk, 1);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"failed to load the next fragment of track %d", tk->id);
+
+	metatk = tk->metadata;
+	memset(&run, 0, sizeof(run));
+	memset(&metaRun, 0, sizeof(metaRun));
+
+	for (n = 0; (n < max_samples) &&
+		(tk->currentSample + n < tk->sampleCount); n++) {
+		struct mp4_track_sample *track_sample = &track_samples[n];
+		uint32_t idx = tk->currentSample + n;
+		uint32_t size = mp4_demux_sample_size(tk, idx);
+		uint64_t metaOffset = 0;
+		uint32_t metaSize = 0;
+
+		if (metatk) {
+			ret = mp4_demux_locate_metadata_sample(demux, tk,
+				&metatk->cursor, idx, &metaOffset, &metaSize);
+			if (ret < 0)
+				return ret;
 		}
 
-		switch (tk->type) {
-		case MP4_TRACK_TYPE_VIDEO:
-			videoTrackCount++;
-			videoTk = tk;
-			break;
-		case MP4_TRACK_TYPE_AUDIO:
-			audioTrackCount++;
-			break;
-		case MP4_TRACK_TYPE_HINT:
-			hintTrackCount++;
-			break;
-		case MP4_TRACK_TYPE_METADATA:
-			metadataTrackCount++;
-			metaTk = tk;
-			break;
-		case MP4_TRACK_TYPE_TEXT:
-			textTrackCount++;
+		/* stop at the first sample that does not fit */
+		if ((sample_buffer) && (size > sample_buffer_size -
+			run.bufOffset - run.size))
 			break;
-		default:
+		if ((metadata_buffer) && (metaSize > metadata_buffer_size -
+			metaRun.bufOffset - metaRun.size))
 			break;
-		}
 
-		/* link tracks using track references */
-		if ((tk->referenceType != 0) && (tk->referenceTrackId)) {
-			struct mp4_track *tkRef;
-			int found = 0;
-			for (tkRef = demux->track; tkRef; tkRef = tkRef->next) {
-				if (tkRef->id == tk->referenceTrackId) {
-					found = 1;
-					break;
-				}
-			}
-			if (found) {
-				if ((tk->referenceType ==
-					MP4_REFERENCE_TYPE_DESCRIPTION)
-					&& (tk->type ==
-					MP4_TRACK_TYPE_METADATA)) {
-					tkRef->metadata = tk;
-					tk->ref = tkRef;
-				} else if ((tk->referenceType ==
-					MP4_REFERENCE_TYPE_CHAPTERS) &&
-					(tkRef->type == MP4_TRACK_TYPE_TEXT)) {
-					tk->chapters = tkRef;
-					tkRef->ref = tk;
-					tkRef->type = MP4_TRACK_TYPE_CHAPTERS;
-					chapTk = tkRef;
-				}
-			}
+		memset(track_sample, 0, sizeof(*track_sample));
+		track_sample->sample_size = size;
+		track_sample->metadata_size = metaSize;
+		mp4_demux_sample_times(tk, &tk->cursor, idx, track_sample);
+
+		if (sample_buffer) {
+			ret = mp4_demux_read_run_add(demux, &run,
+				sample_buffer,
+				mp4_demux_sample_offset(tk, &tk->cursor, idx),
+				size);
+			if (ret < 0)
+				return ret;
+		}
+		if ((metadata_buffer) && (metaSize > 0)) {
+			ret = mp4_demux_read_run_add(demux, &metaRun,
+				metadata_buffer, metaOffset, metaSize);
+			if (ret < 0)
+				return ret;
 		}
 	}
 
-	/* workaround: if we have only 1 video track and 1 metadata
-	 * track with no track reference, link them anyway */
-	if ((videoTrackCount == 1) && (metadataTrackCount == 1)
-			&& (audioTrackCount == 0) && (hintTrackCount == 0)
-			&& (videoTk) && (metaTk) && (!videoTk->metadata)) {
-		videoTk->metadata = metaTk;
-		metaTk->ref = videoTk;
+	if (sample_buffer) {
+		ret = mp4_demux_read_run_flush(demux, &run, sample_buffer);
+		if (ret < 0)
+			return ret;
+	}
+	if (metadata_buffer) {
+		ret = mp4_demux_read_run_flush(demux, &metaRun,
+			metadata_buffer);
+		if (ret < 0)
+			return ret;
 	}
 
-	/* build the chapter list */
-	if (chapTk) {
-		unsigned int i;
-		for (i = 0; i < chapTk->sampleCount; i++) {
-			unsigned int sampleSize, readBytes = 0;
-			uint16_t sz;
-			sampleSize = chapTk->sampleSize[i];
-			int _ret = fseeko(demux->file,
-				chapTk->sampleOffset[i], SEEK_SET);
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(_ret == 0, -errno,
-				"failed to seek %" PRIu64
-				" bytes forward in file",
-				chapTk->sampleOffset[i]);
-			MP4_READ_16(demux->file, sz, readBytes);
-			sz = ntohs(sz);
-			if (sz <= sampleSize - readBytes) {
-				char *chapName = malloc(sz + 1);
-				MP4_RETURN_ERR_IF_FAILED(
-					(chapName != NULL), -ENOMEM);
-				demux->chaptersName[demux->chaptersCount] =
-					chapName;
-				size_t count = fread(
-					chapName, sz, 1, demux->file);
-				MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-					(count == 1), -EIO,
-					"failed to read %u bytes from file",
-					sz);
-				readBytes += sz;
-				chapName[sz] = '\0';
-				uint64_t chapTime =
-					(chapTk->sampleDecodingTime[i] *
-					1000000 + chapTk->timescale / 2) /
-					chapTk->timescale;
-				MP4_LOGD("chapter #%d time=%" PRIu64 " '%s'",
-					demux->chaptersCount + 1,
-					chapTime, chapName);
-				demux->chaptersTime[demux->chaptersCount] =
-					chapTime;
-				demux->chaptersCount++;
+	if ((n == 0) && (max_samples > 0) &&
+		(tk->currentSample < tk->sampleCount)) {
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, -ENOBUFS,
+			"buffer too small for sample #%" PRIu32,
+			tk->currentSample);
+	}
+
+	tk->currentSample += n;
+
+	return n;
+}
+
+
+int mp4_demux_get_track_next_samples(
+	struct mp4_demux *demux,
+	unsigned int track_id,
+	uint8_t *sample_buffer,
+	size_t sample_buffer_size,
+	uint8_t *metadata_buffer,
+	size_t metadata_buffer_size,
+	struct mp4_track_sample *track_samples,
+	unsigned int max_samples)
+{
+	return mp4_demux_track_get_next_samples(demux,
+		mp4_demux_find_track(demux, track_id), sample_buffer,
+		sample_buffer_size, metadata_buffer, metadata_buffer_size,
+		track_samples, max_samples);
+}
+
+
+struct mp4_demux_reader *mp4_demux_reader_new(
+	struct mp4_demux *demux,
+	unsigned int track_id)
+{
+	struct mp4_demux_reader *reader;
+	struct mp4_track *tk = NULL;
+
+	MP4_RETURN_VAL_IF_FAILED(demux != NULL, -EINVAL, NULL);
+
+	MP4_LOG_ERR_AND_RETURN_VAL_IF_FAILED(
+		((demux->map != NULL) || (demux->file != NULL)), -EOPNOTSUPP,
+		NULL, "readers require a mapped or stdio-backed file");
+	MP4_LOG_ERR_AND_RETURN_VAL_IF_FAILED((!demux->fragmented),
+		-EOPNOTSUPP, NULL,
+		"readers are not supported on fragmented files");
+
+	tk = mp4_demux_find_track(demux, track_id);
+	MP4_LOG_ERR_AND_RETURN_VAL_IF_FAILED((tk != NULL), -ENOENT, NULL,
+		"track not found");
+
+	/* the shared tables must be complete before readers use them */
+	int ret = mp4_demux_prepare_track(demux, tk);
+	MP4_LOG_ERR_AND_RETURN_VAL_IF_FAILED((ret == 0), ret, NULL,
+		"failed to build the sample tables of track %d", tk->id);
+
+	reader = calloc(1, sizeof(*reader));
+	MP4_RETURN_VAL_IF_FAILED(reader != NULL, -ENOMEM, NULL);
+	reader->demux = demux;
+	reader->track = tk;
+	mp4_demux_sample_cursor_reset(tk, &reader->cursor);
+	if (tk->metadata) {
+		mp4_demux_sample_cursor_reset(tk->metadata,
+			&reader->metadataCursor);
+	}
+	demux->readerCount++;
+
+	return reader;
+}
+
+
+int mp4_demux_reader_destroy(
+	struct mp4_demux_reader *reader)
+{
+	MP4_RETURN_ERR_IF_FAILED(reader != NULL, -EINVAL);
+
+	reader->demux->readerCount--;
+	free(reader);
+
+	return 0;
+}
+
+
+int mp4_demux_reader_seek(
+	struct mp4_demux_reader *reader,
+	uint64_t time_offset,
+	int sync)
+{
+	struct mp4_track *tk;
+	uint32_t start = 0;
+
+	MP4_RETURN_ERR_IF_FAILED(reader != NULL, -EINVAL);
+
+	tk = reader->track;
+	uint64_t ts = (time_offset * tk->timescale + 500000) / 1000000;
+	if (!mp4_demux_seek_sample(reader->demux, tk, &reader->cursor, ts,
+		sync, &start)) {
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, -ENOENT,
+			"unable to seek in track");
+	}
+	reader->currentSample = start;
+
+	return 0;
+}
+
+
+int mp4_demux_reader_get_next_sample(
+	struct mp4_demux_reader *reader,
+	uint8_t *sample_buffer,
+	unsigned int sample_buffer_size,
+	uint8_t *metadata_buffer,
+	unsigned int metadata_buffer_size,
+	struct mp4_track_sample *track_sample)
+{
+	struct mp4_demux *demux;
+	struct mp4_track *tk, *metatk;
+	uint32_t idx, size;
+	int ret;
+
+	MP4_RETURN_ERR_IF_FAILED(reader != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(track_sample != NULL, -EINVAL);
+
+	memset(track_sample, 0, sizeof(*track_sample));
+
+	demux = reader->demux;
+	tk = reader->track;
+	metatk = tk->metadata;
+	idx = reader->currentSample;
+	if (idx >= tk->sampleCount)
+		return 0;
+
+	size = mp4_demux_sample_size(tk, idx);
+	track_sample->sample_size = size;
+	if ((sample_buffer) && (size <= sample_buffer_size)) {
+		ret = mp4_demux_io_pread_shared(demux,
+			mp4_demux_sample_offset(tk, &reader->cursor, idx),
+			sample_buffer, size);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to read %d bytes from file", size);
+	} else if (sample_buffer) {
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, -ENOBUFS,
+			"buffer too small (%d bytes, %d needed)",
+			sample_buffer_size, size);
+	}
+	if (metatk) {
+		ret = mp4_demux_track_get_metadata_sample(demux, tk,
+			&reader->metadataCursor, idx,
+			mp4_demux_io_pread_shared, metadata_buffer,
+			metadata_buffer_size, track_sample);
+		if (ret < 0)
+			return ret;
+	}
+	mp4_demux_sample_times(tk, &reader->cursor, idx, track_sample);
+	reader->currentSample++;
+
+	return 0;
+}
+
+
+/* Prefetch slot: one sample and its linked metadata sample, read in
+ * one buffer; slots are used in sample order as a ring */
+enum mp4_prefetch_state {
+	MP4_PREFETCH_FREE = 0,
+	/* the offsets are set, the reads are not started */
+	MP4_PREFETCH_QUEUED,
+	/* the reads are started by the background thread or io_uring */
+	MP4_PREFETCH_READING,
+	MP4_PREFETCH_READY,
+	/* handed to the consumer until its next call */
+	MP4_PREFETCH_DELIVERED,
+};
+
+
+struct mp4_prefetch_slot {
+	enum mp4_prefetch_state state;
+	int status;
+	uint32_t sample;
+	/* sample and metadata sample file ranges */
+	uint64_t offset[2];
+	uint32_t size[2];
+	uint8_t *data;
+	size_t capacity;
+#ifdef BUILD_LIBURING
+	/* reads submitted and not completed yet */
+	unsigned int pending;
+#endif /* BUILD_LIBURING */
+	struct mp4_track_sample times;
+};
+
+
+struct mp4_demux_prefetch {
+	struct mp4_demux *demux;
+	struct mp4_track *track;
+	/* cursors of the next sample to queue, used by the consumer */
+	struct mp4_sample_cursor cursor;
+	struct mp4_sample_cursor metadataCursor;
+	uint32_t nextSample;
+	struct mp4_prefetch_slot *slots;
+	unsigned int depth;
+	unsigned int head;
+	unsigned int count;
+	/* sample data held by the non-free slots */
+	size_t memory;
+	size_t maxMemory;
+#ifdef BUILD_LIBURING
+	struct io_uring ring;
+	int uring;
+	int fd;
+#endif /* BUILD_LIBURING */
+#ifndef _WIN32
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int threadStarted;
+	int stop;
+#endif /* !_WIN32 */
+};
+
+
+static void mp4_demux_prefetch_lock(
+	struct mp4_demux_prefetch *prefetch)
+{
+#ifndef _WIN32
+	if (prefetch->threadStarted)
+		pthread_mutex_lock(&prefetch->mutex);
+#endif /* !_WIN32 */
+}
+
+
+static void mp4_demux_prefetch_unlock(
+	struct mp4_demux_prefetch *prefetch)
+{
+#ifndef _WIN32
+	if (prefetch->threadStarted)
+		pthread_mutex_unlock(&prefetch->mutex);
+#endif /* !_WIN32 */
+}
+
+
+/* Blocking read of the remaining data of a slot */
+static int mp4_demux_prefetch_read(
+	struct mp4_demux *demux,
+	struct mp4_prefetch_slot *slot)
+{
+	int ret = mp4_demux_io_pread_shared(demux, slot->offset[0],
+		slot->data, slot->size[0]);
+	if ((ret == 0) && (slot->size[1] > 0)) {
+		ret = mp4_demux_io_pread_shared(demux, slot->offset[1],
+			slot->data + slot->size[0], slot->size[1]);
+	}
+	return ret;
+}
+
+
+#ifndef _WIN32
+
+/* Background reader: reads the queued slots in sample order */
+static void *mp4_demux_prefetch_thread(
+	void *arg)
+{
+	struct mp4_demux_prefetch *prefetch = arg;
+	struct mp4_prefetch_slot *slot;
+	unsigned int i;
+
+	pthread_mutex_lock(&prefetch->mutex);
+	while (!prefetch->stop) {
+		slot = NULL;
+		for (i = 0; i < prefetch->count; i++) {
+			struct mp4_prefetch_slot *s = &prefetch->slots[
+				(prefetch->head + i) % prefetch->depth];
+			if (s->state == MP4_PREFETCH_QUEUED) {
+				slot = s;
+				break;
 			}
 		}
+		if (slot == NULL) {
+			pthread_cond_wait(&prefetch->cond, &prefetch->mutex);
+			continue;
+		}
+		slot->state = MP4_PREFETCH_READING;
+		pthread_mutex_unlock(&prefetch->mutex);
+		int ret = mp4_demux_prefetch_read(prefetch->demux, slot);
+		pthread_mutex_lock(&prefetch->mutex);
+		slot->status = ret;
+		slot->state = MP4_PREFETCH_READY;
+		pthread_cond_broadcast(&prefetch->cond);
+	}
+	pthread_mutex_unlock(&prefetch->mutex);
+
+	return NULL;
+}
+
+#endif /* !_WIN32 */
+
+
+#ifdef BUILD_LIBURING
+
+static int mp4_demux_prefetch_submit(
+	struct mp4_demux_prefetch *prefetch,
+	struct mp4_prefetch_slot *slot)
+{
+	unsigned int i, count = (slot->size[1] > 0) ? 2 : 1;
+
+	if (io_uring_sq_space_left(&prefetch->ring) < count)
+		return -EAGAIN;
+
+	slot->state = MP4_PREFETCH_READING;
+	slot->pending = count;
+	for (i = 0; i < count; i++) {
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&prefetch->ring);
+		io_uring_prep_read(sqe, prefetch->fd,
+			slot->data + ((i > 0) ? slot->size[0] : 0),
+			slot->size[i], slot->offset[i]);
+		/* the slots are aligned: the low bit tells the range */
+		io_uring_sqe_set_data(sqe, (void *)((uintptr_t)slot | i));
+	}
+
+	/* on failure the reads stay queued for the next submission */
+	int ret = io_uring_submit(&prefetch->ring);
+	if (ret < 0)
+		MP4_LOGW("io_uring submission failed (%d)", ret);
+
+	return 0;
+}
+
+
+/* Wait for one read completion; a short read is completed with a
+ * blocking read once the other read of the slot is done */
+static int mp4_demux_prefetch_reap(
+	struct mp4_demux_prefetch *prefetch)
+{
+	struct io_uring_cqe *cqe;
+	struct mp4_prefetch_slot *slot;
+	uintptr_t data;
+
+	int ret = io_uring_submit_and_wait(&prefetch->ring, 1);
+	if (ret < 0)
+		return ret;
+	ret = io_uring_peek_cqe(&prefetch->ring, &cqe);
+	if (ret < 0)
+		return ret;
+	data = (uintptr_t)io_uring_cqe_get_data(cqe);
+	slot = (struct mp4_prefetch_slot *)(data & ~(uintptr_t)1);
+	MP4_DEMUX_STAT_ADD(prefetch->demux, read_count, 1);
+	if (cqe->res > 0)
+		MP4_DEMUX_STAT_ADD(prefetch->demux, bytes_read, cqe->res);
+	if (cqe->res < 0)
+		slot->status = cqe->res;
+	else if (((unsigned int)cqe->res < slot->size[data & 1]) &&
+		(slot->status == 0))
+		slot->status = 1;
+	io_uring_cqe_seen(&prefetch->ring, cqe);
+
+	if (--slot->pending == 0) {
+		if (slot->status == 1)
+			slot->status = mp4_demux_prefetch_read(
+				prefetch->demux, slot);
+		slot->state = MP4_PREFETCH_READY;
 	}
 
 	return 0;
 }
 
+#endif /* BUILD_LIBURING */
 
-static int mp4_demux_build_metadata(
-	struct mp4_demux *demux)
+
+/* Queue the next samples while slots and memory are available; at
+ * least one sample is always queued so that samples larger than the
+ * memory cap are still read */
+static int mp4_demux_prefetch_fill(
+	struct mp4_demux_prefetch *prefetch)
 {
-	unsigned int i, k = 0, metaCount = 0, udtaCount = 0, xyzCount = 0;
+	struct mp4_track *tk = prefetch->track, *metatk = tk->metadata;
+	int queued = 0, ret = 0;
+
+	mp4_demux_prefetch_lock(prefetch);
+	while ((prefetch->count < prefetch->depth) &&
+		(prefetch->nextSample < tk->sampleCount)) {
+		struct mp4_prefetch_slot *slot = &prefetch->slots[
+			(prefetch->head + prefetch->count) % prefetch->depth];
+		uint32_t idx = prefetch->nextSample;
+		uint32_t size = mp4_demux_sample_size(tk, idx);
+		uint64_t metaOffset = 0;
+		uint32_t metaSize = 0;
+		if (metatk) {
+			ret = mp4_demux_locate_metadata_sample(
+				prefetch->demux, tk, &prefetch->metadataCursor,
+				idx, &metaOffset, &metaSize);
+			if (ret < 0)
+				break;
+			ret = 0;
+		}
+		size_t total = (size_t)size + metaSize;
 
-	for (i = 0; i < demux->metaMetadataCount; i++) {
-		if ((demux->metaMetadataValue[i]) &&
-			(strlen(demux->metaMetadataValue[i]) > 0) &&
-			(demux->metaMetadataKey[i]) &&
-			(strlen(demux->metaMetadataKey[i]) > 0))
-			metaCount++;
+		if ((prefetch->count > 0) && (prefetch->maxMemory > 0) &&
+			(prefetch->memory + total > prefetch->maxMemory))
+			break;
+		if (total > slot->capacity) {
+			/* only free slots are resized */
+			uint8_t *p = mp4_demux_scratch_realloc(
+				prefetch->demux, slot->data, slot->capacity,
+				total);
+			if (p == NULL) {
+				MP4_LOGE("allocation failed");
+				ret = -ENOMEM;
+				break;
+			}
+			slot->data = p;
+			slot->capacity = total;
+		}
+		slot->sample = idx;
+		slot->status = 0;
+		slot->offset[0] = mp4_demux_sample_offset(tk,
+			&prefetch->cursor, idx);
+		slot->size[0] = size;
+		slot->offset[1] = metaOffset;
+		slot->size[1] = metaSize;
+		memset(&slot->times, 0, sizeof(slot->times));
+		mp4_demux_sample_times(tk, &prefetch->cursor, idx,
+			&slot->times);
+		slot->times.sample_size = size;
+		slot->times.metadata_size = metaSize;
+		slot->state = MP4_PREFETCH_QUEUED;
+		prefetch->memory += total;
+		prefetch->count++;
+		prefetch->nextSample++;
+		queued++;
+#ifdef BUILD_LIBURING
+		/* without ring space the slot is read on delivery */
+		if (prefetch->uring)
+			mp4_demux_prefetch_submit(prefetch, slot);
+#endif /* BUILD_LIBURING */
 	}
+#ifndef _WIN32
+	if ((queued > 0) && (prefetch->threadStarted))
+		pthread_cond_broadcast(&prefetch->cond);
+#endif /* !_WIN32 */
+	mp4_demux_prefetch_unlock(prefetch);
 
-	for (i = 0; i < demux->udtaMetadataCount; i++) {
-		if ((demux->udtaMetadataValue[i]) &&
-			(strlen(demux->udtaMetadataValue[i]) > 0) &&
-			(demux->udtaMetadataKey[i]) &&
-			(strlen(demux->udtaMetadataKey[i]) > 0))
-			udtaCount++;
-	}
+	return ret;
+}
 
-	if ((demux->udtaLocationValue) &&
-		(strlen(demux->udtaLocationValue) > 0) &&
-		(demux->udtaLocationKey) &&
-		(strlen(demux->udtaLocationKey) > 0))
-		xyzCount++;
 
-	demux->finalMetadataCount = metaCount + udtaCount + xyzCount;
+/* Wait until no read of the prefetch is in progress */
+static int mp4_demux_prefetch_drain(
+	struct mp4_demux_prefetch *prefetch)
+{
+	unsigned int i;
 
-	demux->finalMetadataKey = calloc(
-		demux->finalMetadataCount, sizeof(char *));
-	MP4_RETURN_ERR_IF_FAILED((demux->finalMetadataKey != NULL), -ENOMEM);
+	for (i = 0; i < prefetch->count; i++) {
+		struct mp4_prefetch_slot *slot = &prefetch->slots[
+			(prefetch->head + i) % prefetch->depth];
+		mp4_demux_prefetch_lock(prefetch);
+		/* no new read is started on queued slots */
+		if (slot->state == MP4_PREFETCH_QUEUED)
+			slot->state = MP4_PREFETCH_READY;
+#ifndef _WIN32
+		while ((prefetch->threadStarted) &&
+			(slot->state == MP4_PREFETCH_READING))
+			pthread_cond_wait(&prefetch->cond, &prefetch->mutex);
+#endif /* !_WIN32 */
+		mp4_demux_prefetch_unlock(prefetch);
+#ifdef BUILD_LIBURING
+		while ((prefetch->uring) &&
+			(slot->state == MP4_PREFETCH_READING)) {
+			int ret = mp4_demux_prefetch_reap(prefetch);
+			if (ret < 0)
+				return ret;
+		}
+#endif /* BUILD_LIBURING */
+	}
 
-	demux->finalMetadataValue = calloc(
-		demux->finalMetadataCount, sizeof(char *));
-	MP4_RETURN_ERR_IF_FAILED((demux->finalMetadataValue != NULL), -ENOMEM);
+	return 0;
+}
 
-	for (i = 0; i < demux->metaMetadataCount; i++) {
-		if ((demux->metaMetadataValue[i]) &&
-			(strlen(demux->metaMetadataValue[i]) > 0) &&
-			(demux->metaMetadataKey[i]) &&
-			(strlen(demux->metaMetadataKey[i]) > 0)) {
-			demux->finalMetadataKey[k] =
-				demux->metaMetadataKey[i];
-			demux->finalMetadataValue[k] =
-				demux->metaMetadataValue[i];
-			k++;
-		}
+
+struct mp4_demux_prefetch *mp4_demux_prefetch_new(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	unsigned int depth,
+	size_t max_memory)
+{
+	struct mp4_demux_prefetch *prefetch;
+
+	MP4_RETURN_VAL_IF_FAILED(demux != NULL, -EINVAL, NULL);
+	MP4_LOG_ERR_AND_RETURN_VAL_IF_FAILED((tk != NULL), -ENOENT, NULL,
+		"track not found");
+	MP4_LOG_ERR_AND_RETURN_VAL_IF_FAILED(
+		((demux->map != NULL) || (demux->file != NULL)), -EOPNOTSUPP,
+		NULL, "prefetch requires a mapped or stdio-backed file");
+	MP4_LOG_ERR_AND_RETURN_VAL_IF_FAILED((!demux->fragmented),
+		-EOPNOTSUPP, NULL,
+		"prefetch is not supported on fragmented files");
+
+	/* the shared tables must be complete before the reads start */
+	int ret = mp4_demux_prepare_track(demux, tk);
+	MP4_LOG_ERR_AND_RETURN_VAL_IF_FAILED((ret == 0), ret, NULL,
+		"failed to build the sample tables of track %d", tk->id);
+
+	if (depth == 0)
+		depth = MP4_DEMUX_PREFETCH_DEPTH;
+	prefetch = calloc(1, sizeof(*prefetch));
+	MP4_RETURN_VAL_IF_FAILED(prefetch != NULL, -ENOMEM, NULL);
+	prefetch->slots = calloc(depth, sizeof(*prefetch->slots));
+	if (prefetch->slots == NULL) {
+		free(prefetch);
+		MP4_RETURN_VAL_IF_FAILED(0, -ENOMEM, NULL);
+	}
+	prefetch->demux = demux;
+	prefetch->track = tk;
+	prefetch->depth = depth;
+	prefetch->maxMemory = max_memory;
+	mp4_demux_sample_cursor_reset(tk, &prefetch->cursor);
+	if (tk->metadata) {
+		mp4_demux_sample_cursor_reset(tk->metadata,
+			&prefetch->metadataCursor);
 	}
 
-	for (i = 0; i < demux->udtaMetadataCount; i++) {
-		if ((demux->udtaMetadataValue[i]) &&
-			(strlen(demux->udtaMetadataValue[i]) > 0) &&
-			(demux->udtaMetadataKey[i]) &&
-			(strlen(demux->udtaMetadataKey[i]) > 0)) {
-			demux->finalMetadataKey[k] =
-				demux->udtaMetadataKey[i];
-			demux->finalMetadataValue[k] =
-				demux->udtaMetadataValue[i];
-			k++;
+	/* mapped files are read with plain copies from the mapping; the
+	 * page faults are then taken by the background thread */
+#ifdef BUILD_LIBURING
+	if ((demux->file) && (!demux->map) &&
+		(io_uring_queue_init(2 * depth, &prefetch->ring, 0) == 0)) {
+		prefetch->uring = 1;
+		prefetch->fd = fileno(demux->file);
+	}
+	if (!prefetch->uring) {
+#endif /* BUILD_LIBURING */
+#ifndef _WIN32
+		pthread_mutex_init(&prefetch->mutex, NULL);
+		pthread_cond_init(&prefetch->cond, NULL);
+		if (pthread_create(&prefetch->thread, NULL,
+			mp4_demux_prefetch_thread, prefetch) == 0) {
+			prefetch->threadStarted = 1;
+		} else {
+			/* reads are then done on delivery */
+			MP4_LOGW("failed to start the prefetch thread");
+			pthread_cond_destroy(&prefetch->cond);
+			pthread_mutex_destroy(&prefetch->mutex);
 		}
+#endif /* !_WIN32 */
+#ifdef BUILD_LIBURING
 	}
+#endif /* BUILD_LIBURING */
 
-	if ((demux->udtaLocationValue) &&
-		(strlen(demux->udtaLocationValue) > 0) &&
-		(demux->udtaLocationKey) &&
-		(strlen(demux->udtaLocationKey) > 0)) {
-		demux->finalMetadataKey[k] = demux->udtaLocationKey;
-		demux->finalMetadataValue[k] = demux->udtaLocationValue;
-		k++;
-	}
+	demux->readerCount++;
 
-	if (demux->metaCoverSize > 0) {
-		demux->finalCoverSize = demux->metaCoverSize;
-		demux->finalCoverOffset = demux->metaCoverOffset;
-		demux->finalCoverType = demux->metaCoverType;
-	} else if (demux->udtaCoverSize > 0) {
-		demux->finalCoverSize = demux->udtaCoverSize;
-		demux->finalCoverOffset = demux->udtaCoverOffset;
-		demux->finalCoverType = demux->udtaCoverType;
+	return prefetch;
+}
+
+
+int mp4_demux_prefetch_destroy(
+	struct mp4_demux_prefetch *prefetch)
+{
+	unsigned int i;
+
+	MP4_RETURN_ERR_IF_FAILED(prefetch != NULL, -EINVAL);
+
+	/* the buffers may still be the target of reads */
+	int ret = mp4_demux_prefetch_drain(prefetch);
+	if (ret < 0)
+		MP4_LOGW("failed to wait for the prefetch reads (%d)", ret);
+#ifndef _WIN32
+	if (prefetch->threadStarted) {
+		pthread_mutex_lock(&prefetch->mutex);
+		prefetch->stop = 1;
+		pthread_cond_broadcast(&prefetch->cond);
+		pthread_mutex_unlock(&prefetch->mutex);
+		pthread_join(prefetch->thread, NULL);
+		pthread_cond_destroy(&prefetch->cond);
+		pthread_mutex_destroy(&prefetch->mutex);
+	}
+#endif /* !_WIN32 */
+#ifdef BUILD_LIBURING
+	if (prefetch->uring)
+		io_uring_queue_exit(&prefetch->ring);
+#endif /* BUILD_LIBURING */
+
+	for (i = 0; i < prefetch->depth; i++) {
+		mp4_demux_scratch_free(prefetch->demux,
+			prefetch->slots[i].data, prefetch->slots[i].capacity);
 	}
+	free(prefetch->slots);
+	prefetch->demux->readerCount--;
+	free(prefetch);
 
 	return 0;
 }
 
 
-static void mp4_demux_print_children(
-	struct mp4_demux *demux,
-	struct mp4_box_item *parent,
-	int level)
+int mp4_demux_prefetch_seek(
+	struct mp4_demux_prefetch *prefetch,
+	unsigned int sample_index)
 {
-	struct mp4_box_item *item = NULL;
+	MP4_RETURN_ERR_IF_FAILED(prefetch != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(
+		sample_index <= prefetch->track->sampleCount, -EINVAL);
 
-	for (item = parent->child; item; item = item->next) {
-		int k;
-		char spaces[101];
-		for (k = 0; k < level && k < 50; k++) {
-			spaces[k * 2] = ' ';
-			spaces[k * 2 + 1] = ' ';
-		}
-		spaces[k * 2] = '\0';
-		char a = (char)((item->box.type >> 24) & 0xFF);
-		char b = (char)((item->box.type >> 16) & 0xFF);
-		char c = (char)((item->box.type >> 8) & 0xFF);
-		char d = (char)(item->box.type & 0xFF);
-		MP4_LOGD("%s- %c%c%c%c size %" PRIu64 "\n", spaces,
-			(a >= 32) ? a : '.', (b >= 32) ? b : '.',
-			(c >= 32) ? c : '.', (d >= 32) ? d : '.',
-			(item->box.size == 1) ?
-			item->box.largesize : item->box.size);
+	int ret = mp4_demux_prefetch_drain(prefetch);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"failed to wait for the prefetch reads");
 
-		if (item->child)
-			mp4_demux_print_children(demux, item, level + 1);
-	}
+	mp4_demux_prefetch_lock(prefetch);
+	unsigned int i;
+	for (i = 0; i < prefetch->depth; i++)
+		prefetch->slots[i].state = MP4_PREFETCH_FREE;
+	prefetch->head = 0;
+	prefetch->count = 0;
+	prefetch->memory = 0;
+	prefetch->nextSample = sample_index;
+	mp4_demux_prefetch_unlock(prefetch);
+
+	return 0;
 }
 
 
-static void mp4_demux_free_children(
-	struct mp4_demux *demux,
-	struct mp4_box_item *parent)
+int mp4_demux_prefetch_get_next_sample(
+	struct mp4_demux_prefetch *prefetch,
+	struct mp4_track_sample *track_sample)
 {
-	struct mp4_box_item *item = NULL, *next = NULL;
+	struct mp4_prefetch_slot *slot;
+	int ret;
 
-	for (item = parent->child; item; item = next) {
-		next = item->next;
-		if (item->child)
-			mp4_demux_free_children(demux, item);
-		free(item);
+	MP4_RETURN_ERR_IF_FAILED(prefetch != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(track_sample != NULL, -EINVAL);
+
+	memset(track_sample, 0, sizeof(*track_sample));
+
+	/* release the sample delivered by the previous call */
+	mp4_demux_prefetch_lock(prefetch);
+	slot = &prefetch->slots[prefetch->head];
+	if ((prefetch->count > 0) &&
+		(slot->state == MP4_PREFETCH_DELIVERED)) {
+		slot->state = MP4_PREFETCH_FREE;
+		prefetch->memory -= (size_t)slot->size[0] + slot->size[1];
+		prefetch->head = (prefetch->head + 1) % prefetch->depth;
+		prefetch->count--;
+	}
+	mp4_demux_prefetch_unlock(prefetch);
+
+	ret = mp4_demux_prefetch_fill(prefetch);
+	if (ret < 0)
+		return ret;
+	if (prefetch->count == 0)
+		return 0;
+
+	/* wait for the oldest sample */
+	slot = &prefetch->slots[prefetch->head];
+	mp4_demux_prefetch_lock(prefetch);
+#ifndef _WIN32
+	while ((prefetch->threadStarted) &&
+		(slot->state != MP4_PREFETCH_READY))
+		pthread_cond_wait(&prefetch->cond, &prefetch->mutex);
+#endif /* !_WIN32 */
+	mp4_demux_prefetch_unlock(prefetch);
+#ifdef BUILD_LIBURING
+	while ((prefetch->uring) && (slot->state == MP4_PREFETCH_READING)) {
+		ret = mp4_demux_prefetch_reap(prefetch);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to wait for the prefetch reads");
 	}
+#endif /* BUILD_LIBURING */
+	if (slot->state == MP4_PREFETCH_QUEUED) {
+		/* no background reader */
+		slot->status = mp4_demux_prefetch_read(prefetch->demux, slot);
+		slot->state = MP4_PREFETCH_READY;
+	}
+
+	/* a failed sample is dropped so that the next call goes on */
+	mp4_demux_prefetch_lock(prefetch);
+	slot->state = MP4_PREFETCH_DELIVERED;
+	mp4_demux_prefetch_unlock(prefetch);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((slot->status == 0),
+		slot->status, "failed to read sample %" PRIu32
+		" of track %d", slot->sample, prefetch->track->id);
+
+	*track_sample = slot->times;
+	track_sample->sample_data = slot->data;
+	if (slot->size[1] > 0)
+		track_sample->metadata_data = slot->data + slot->size[0];
+
+	return 0;
 }
 
 
-static void mp4_demux_free_tracks(
-	struct mp4_demux *demux)
+/* Parrot video metadata v2: a 60-byte base structure, identifier "P2"
+ * and length in 32-bit words after the 4-byte header, possibly
+ * followed by extensions with the same header, of which the "E1"
+ * extension holds the capture timestamp:
+ *
+ *   0  id, length            4  drone quaternion w, x, y, z (Q2.14)
+ *   12 latitude (Q10.22)     16 longitude (Q10.22)
+ *   20 altitude (Q16.8) and GPS satellite count (8 bits)
+ *   24 ground distance (Q16.16)
+ *   28 speed north, east, down, air speed (Q8.8)
+ *   36 frame base quaternion 44 frame quaternion (Q2.14)
+ *   52 exposure time (Q8.8, ms), gain
+ *   56 state, mode, wifi RSSI, battery percentage
+ *
+ * Latitude, longitude and altitude are -500 and the air speed -1 when
+ * unknown */
+#define MP4_TELEMETRY_PARROT_V2_MIME_FORMAT \
+	"application/octet-stream;type=com.parrot.videometadata2"
+#define MP4_TELEMETRY_PARROT_V2_BASE_ID      0x5032 /* "P2" */
+#define MP4_TELEMETRY_PARROT_V2_BASE_SIZE    (60)
+#define MP4_TELEMETRY_PARROT_V2_TIMESTAMP_ID 0x4531 /* "E1" */
+#define MP4_TELEMETRY_PARROT_V2_UNKNOWN      (-500.)
+
+#define MP4_DEMUX_TELEMETRY_BATCH_SIZE (256)
+
+
+static uint16_t mp4_telemetry_read_16(
+	const uint8_t *p)
 {
-	struct mp4_track *tk = NULL, *next = NULL;
+	return ((uint16_t)p[0] << 8) | p[1];
+}
 
-	for (tk = demux->track; tk; tk = next) {
-		next = tk->next;
-		free(tk->timeToSampleEntries);
-		free(tk->sampleDecodingTime);
-		free(tk->sampleSize);
-		free(tk->chunkOffset);
-		free(tk->sampleToChunkEntries);
-		free(tk->sampleOffset);
-		free(tk->videoSps);
-		free(tk->videoPps);
-		free(tk->metadataContentEncoding);
-		free(tk->metadataMimeFormat);
-		free(tk);
-	}
+
+static uint32_t mp4_telemetry_read_32(
+	const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | p[3];
 }
 
 
-struct mp4_demux *mp4_demux_open(
-	const char *filename)
+static float mp4_telemetry_read_q(
+	const uint8_t *p,
+	unsigned int bits)
 {
-	int err = 0, ret;
-	off_t retBytes;
-	struct mp4_demux *demux;
+	return (float)(int16_t)mp4_telemetry_read_16(p) / (float)(1 << bits);
+}
 
-	MP4_RETURN_VAL_IF_FAILED(filename != NULL, -EINVAL, NULL);
-	MP4_RETURN_VAL_IF_FAILED(strlen(filename) != 0, -EINVAL, NULL);
 
-	demux = malloc(sizeof(*demux));
-	if (demux == NULL) {
-		MP4_LOGE("allocation failed");
-		err = -ENOMEM;
-		goto error;
+static int mp4_telemetry_decode_parrot_v2(
+	const uint8_t *data,
+	size_t size,
+	struct mp4_telemetry *c,
+	unsigned int i)
+{
+	unsigned int k;
+	double val;
+
+	if ((size < MP4_TELEMETRY_PARROT_V2_BASE_SIZE) ||
+		(mp4_telemetry_read_16(data) !=
+		MP4_TELEMETRY_PARROT_V2_BASE_ID))
+		return 0;
+	size_t baseSize = 4 + (size_t)mp4_telemetry_read_16(data + 2) * 4;
+	if ((baseSize < MP4_TELEMETRY_PARROT_V2_BASE_SIZE) ||
+		(baseSize > size))
+		return 0;
+
+	for (k = 0; k < 4; k++) {
+		c->drone_quat[k][i] = mp4_telemetry_read_q(data + 4 + k * 2,
+			14);
+		c->frame_quat[k][i] = mp4_telemetry_read_q(data + 44 + k * 2,
+			14);
 	}
-	memset(demux, 0, sizeof(*demux));
-
-	demux->file = fopen(filename, "rb");
-	if (demux->file == NULL) {
-		MP4_LOGE("failed to open file '%s'", filename);
-		err = -errno;
-		goto error;
+	val = (double)(int32_t)mp4_telemetry_read_32(data + 12) / (1 << 22);
+	if (val != MP4_TELEMETRY_PARROT_V2_UNKNOWN)
+		c->latitude[i] = val;
+	val = (double)(int32_t)mp4_telemetry_read_32(data + 16) / (1 << 22);
+	if (val != MP4_TELEMETRY_PARROT_V2_UNKNOWN)
+		c->longitude[i] = val;
+	uint32_t val32 = mp4_telemetry_read_32(data + 20);
+	val = (double)(int32_t)(val32 & 0xFFFFFF00) / 65536.;
+	if (val != MP4_TELEMETRY_PARROT_V2_UNKNOWN)
+		c->altitude[i] = val;
+	c->gps_sv_count[i] = val32 & 0xFF;
+	c->ground_distance[i] = (float)(int32_t)mp4_telemetry_read_32(
+		data + 24) / 65536.f;
+	c->speed_north[i] = mp4_telemetry_read_q(data + 28, 8);
+	c->speed_east[i] = mp4_telemetry_read_q(data + 30, 8);
+	c->speed_down[i] = mp4_telemetry_read_q(data + 32, 8);
+	if ((int16_t)mp4_telemetry_read_16(data + 34) != -256)
+		c->air_speed[i] = mp4_telemetry_read_q(data + 34, 8);
+	c->exposure_time[i] = (float)mp4_telemetry_read_16(data + 52) /
+		256.f;
+	c->gain[i] = mp4_telemetry_read_16(data + 54);
+	c->wifi_rssi[i] = (int8_t)data[58];
+	c->battery_percentage[i] = data[59];
+
+	/* extensions */
+	size_t off = baseSize;
+	while (off + 4 <= size) {
+		uint16_t id = mp4_telemetry_read_16(data + off);
+		size_t len = (size_t)mp4_telemetry_read_16(data + off + 2) * 4;
+		if (len > size - off - 4)
+			break;
+		if ((id == MP4_TELEMETRY_PARROT_V2_TIMESTAMP_ID) &&
+			(len >= 8)) {
+			c->timestamp[i] =
+				((uint64_t)mp4_telemetry_read_32(
+				data + off + 4) << 32) |
+				mp4_telemetry_read_32(data + off + 8);
+		}
+		off += 4 + len;
 	}
 
-	ret = fseeko(demux->file, 0, SEEK_END);
-	if (ret != 0) {
-		MP4_LOGE("failed to seek to end of file");
-		err = -errno;
-		goto error;
-	}
-	demux->fileSize = ftello(demux->file);
-	ret = fseeko(demux->file, 0, SEEK_SET);
-	if (ret != 0) {
-		MP4_LOGE("failed to seek to beginning of file");
-		err = -errno;
-		goto error;
+	return 1;
+}
+
+
+struct mp4_telemetry_decoder {
+	const char *mimeFormat;
+	/* decode one sample into row 'i', whose values are preset to
+	 * unknown; returns 1 if the sample was decoded, 0 otherwise */
+	int (*decode)(const uint8_t *data, size_t size,
+		struct mp4_telemetry *columns, unsigned int i);
+};
+
+
+static const struct mp4_telemetry_decoder mp4_telemetry_decoders[] = {
+	{
+		MP4_TELEMETRY_PARROT_V2_MIME_FORMAT,
+		mp4_telemetry_decode_parrot_v2,
+	},
+};
+
+
+struct mp4_demux_telemetry {
+	struct mp4_demux *demux;
+	/* metadata track */
+	struct mp4_track *track;
+	const struct mp4_telemetry_decoder *decoder;
+	unsigned int batchSize;
+	uint32_t currentSample;
+	struct mp4_sample_cursor cursor;
+	uint8_t *buffer;
+	size_t bufferSize;
+	/* all the columns, in one allocation */
+	struct mp4_telemetry columns;
+	void *columnData;
+};
+
+
+/* Lay the columns of n entries out from 'base', or only compute the
+ * total size if base is NULL */
+static size_t mp4_telemetry_layout(
+	struct mp4_telemetry *c,
+	uint8_t *base,
+	size_t n)
+{
+	size_t off = 0;
+	unsigned int k;
+
+#define MP4_TELEMETRY_COLUMN(_col) \
+	do { \
+		if (base) \
+			(_col) = (void *)(base + off); \
+		off += (n * sizeof(*(_col)) + 7) & ~(size_t)7; \
+	} while (0)
+
+	MP4_TELEMETRY_COLUMN(c->sample_dts);
+	MP4_TELEMETRY_COLUMN(c->valid);
+	MP4_TELEMETRY_COLUMN(c->timestamp);
+	MP4_TELEMETRY_COLUMN(c->latitude);
+	MP4_TELEMETRY_COLUMN(c->longitude);
+	MP4_TELEMETRY_COLUMN(c->altitude);
+	MP4_TELEMETRY_COLUMN(c->gps_sv_count);
+	MP4_TELEMETRY_COLUMN(c->ground_distance);
+	MP4_TELEMETRY_COLUMN(c->speed_north);
+	MP4_TELEMETRY_COLUMN(c->speed_east);
+	MP4_TELEMETRY_COLUMN(c->speed_down);
+	MP4_TELEMETRY_COLUMN(c->air_speed);
+	for (k = 0; k < 4; k++) {
+		MP4_TELEMETRY_COLUMN(c->drone_quat[k]);
+		MP4_TELEMETRY_COLUMN(c->frame_quat[k]);
 	}
+	MP4_TELEMETRY_COLUMN(c->exposure_time);
+	MP4_TELEMETRY_COLUMN(c->gain);
+	MP4_TELEMETRY_COLUMN(c->wifi_rssi);
+	MP4_TELEMETRY_COLUMN(c->battery_percentage);
 
-	retBytes = mp4_demux_parse_children(
-		demux, &demux->root, demux->fileSize, NULL);
-	if (retBytes < 0) {
-		MP4_LOGE("mp4_demux_parse_children() failed (%ld)", retBytes);
-		err = -EIO;
-		goto error;
-	} else {
-		demux->readBytes += retBytes;
+#undef MP4_TELEMETRY_COLUMN
+
+	return off;
+}
+
+
+/* Preset row 'i' to unknown values */
+static void mp4_telemetry_reset_row(
+	struct mp4_telemetry *c,
+	unsigned int i)
+{
+	unsigned int k;
+
+	c->valid[i] = 0;
+	c->timestamp[i] = 0;
+	c->latitude[i] = NAN;
+	c->longitude[i] = NAN;
+	c->altitude[i] = NAN;
+	c->gps_sv_count[i] = 0;
+	c->ground_distance[i] = NAN;
+	c->speed_north[i] = NAN;
+	c->speed_east[i] = NAN;
+	c->speed_down[i] = NAN;
+	c->air_speed[i] = NAN;
+	for (k = 0; k < 4; k++) {
+		c->drone_quat[k][i] = NAN;
+		c->frame_quat[k][i] = NAN;
 	}
+	c->exposure_time[i] = NAN;
+	c->gain[i] = 0;
+	c->wifi_rssi[i] = 0;
+	c->battery_percentage[i] = 0;
+}
 
-	ret = mp4_demux_build_tracks(demux);
-	if (ret < 0) {
-		MP4_LOGE("mp4_demux_build_tracks() failed (%d)", ret);
-		err = -EIO;
-		goto error;
+
+struct mp4_demux_telemetry *mp4_demux_telemetry_new(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	unsigned int batch_size)
+{
+	struct mp4_demux_telemetry *telemetry;
+	const struct mp4_telemetry_decoder *decoder = NULL;
+	unsigned int i;
+
+	MP4_RETURN_VAL_IF_FAILED(demux != NULL, -EINVAL, NULL);
+	MP4_LOG_ERR_AND_RETURN_VAL_IF_FAILED((tk != NULL), -ENOENT, NULL,
+		"track not found");
+	MP4_LOG_ERR_AND_RETURN_VAL_IF_FAILED((!demux->fragmented),
+		-EOPNOTSUPP, NULL,
+		"telemetry is not supported on fragmented files");
+
+	if (tk->type != MP4_TRACK_TYPE_METADATA)
+		tk = tk->metadata;
+	MP4_LOG_ERR_AND_RETURN_VAL_IF_FAILED((tk != NULL), -ENOENT, NULL,
+		"no metadata track");
+	for (i = 0; i < sizeof(mp4_telemetry_decoders) /
+		sizeof(mp4_telemetry_decoders[0]); i++) {
+		if ((tk->metadataMimeFormat) &&
+			(!strcmp(tk->metadataMimeFormat,
+			mp4_telemetry_decoders[i].mimeFormat))) {
+			decoder = &mp4_telemetry_decoders[i];
+			break;
+		}
 	}
-	ret = mp4_demux_build_metadata(demux);
-	if (ret < 0) {
-		MP4_LOGE("mp4_demux_build_metadata() failed (%d)", ret);
-		err = -EIO;
-		goto error;
+	MP4_LOG_ERR_AND_RETURN_VAL_IF_FAILED((decoder != NULL), -EOPNOTSUPP,
+		NULL, "unsupported metadata format '%s'",
+		(tk->metadataMimeFormat) ? tk->metadataMimeFormat : "");
+
+	int ret = mp4_demux_prepare_track(demux, tk);
+	MP4_LOG_ERR_AND_RETURN_VAL_IF_FAILED((ret == 0), ret, NULL,
+		"failed to build the sample tables of track %d", tk->id);
+
+	if (batch_size == 0)
+		batch_size = MP4_DEMUX_TELEMETRY_BATCH_SIZE;
+	telemetry = calloc(1, sizeof(*telemetry));
+	MP4_RETURN_VAL_IF_FAILED(telemetry != NULL, -ENOMEM, NULL);
+	telemetry->columnData = mp4_demux_scratch_realloc(demux, NULL, 0,
+		mp4_telemetry_layout(&telemetry->columns, NULL, batch_size));
+	if (telemetry->columnData == NULL) {
+		free(telemetry);
+		MP4_RETURN_VAL_IF_FAILED(0, -ENOMEM, NULL);
 	}
+	mp4_telemetry_layout(&telemetry->columns, telemetry->columnData,
+		batch_size);
+	telemetry->demux = demux;
+	telemetry->track = tk;
+	telemetry->decoder = decoder;
+	telemetry->batchSize = batch_size;
+	mp4_demux_sample_cursor_reset(tk, &telemetry->cursor);
+	demux->readerCount++;
+
+	return telemetry;
+}
+
+
+int mp4_demux_telemetry_destroy(
+	struct mp4_demux_telemetry *telemetry)
+{
+	MP4_RETURN_ERR_IF_FAILED(telemetry != NULL, -EINVAL);
+
+	telemetry->demux->readerCount--;
+	mp4_demux_scratch_free(telemetry->demux, telemetry->buffer,
+		telemetry->bufferSize);
+	mp4_demux_scratch_free(telemetry->demux, telemetry->columnData,
+		mp4_telemetry_layout(&telemetry->columns, NULL,
+		telemetry->batchSize));
+	free(telemetry);
 
-	mp4_demux_print_children(demux, &demux->root, 0);
+	return 0;
+}
 
-	return demux;
 
-error:
-	if (demux)
-		mp4_demux_close(demux);
+int mp4_demux_telemetry_seek(
+	struct mp4_demux_telemetry *telemetry,
+	unsigned int sample_index)
+{
+	MP4_RETURN_ERR_IF_FAILED(telemetry != NULL, -EINVAL);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		(sample_index <= telemetry->track->sampleCount), -EINVAL,
+		"invalid sample index %u", sample_index);
 
-	MP4_RETURN_VAL_IF_FAILED(1, err, NULL);
-	return NULL;
+	telemetry->currentSample = sample_index;
+
+	return 0;
 }
 
 
-int mp4_demux_close(
-	struct mp4_demux *demux)
+int mp4_demux_telemetry_read(
+	struct mp4_demux_telemetry *telemetry,
+	struct mp4_telemetry *columns)
 {
-	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	struct mp4_track *tk;
+	struct mp4_telemetry *c;
+	uint32_t i, n, first;
+	uint64_t runOffset = 0;
+	size_t total = 0, runSize = 0, bufOffset = 0;
+	int ret;
+
+	MP4_RETURN_ERR_IF_FAILED(telemetry != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(columns != NULL, -EINVAL);
+
+	tk = telemetry->track;
+	c = &telemetry->columns;
+	first = telemetry->currentSample;
+	n = tk->sampleCount - first;
+	if (n > telemetry->batchSize)
+		n = telemetry->batchSize;
+	c->count = 0;
+
+	for (i = 0; i < n; i++)
+		total += mp4_demux_sample_size(tk, first + i);
+	if (total > telemetry->bufferSize) {
+		uint8_t *p = mp4_demux_scratch_realloc(telemetry->demux,
+			telemetry->buffer, telemetry->bufferSize, total);
+		MP4_RETURN_ERR_IF_FAILED((p != NULL), -ENOMEM);
+		telemetry->buffer = p;
+		telemetry->bufferSize = total;
+	}
 
-	if (demux) {
-		if (demux->file)
-			fclose(demux->file);
-		mp4_demux_free_children(demux, &demux->root);
-		mp4_demux_free_tracks(demux);
-		unsigned int i;
-		for (i = 0; i < demux->chaptersCount; i++)
-			free(demux->chaptersName[i]);
-		free(demux->udtaLocationKey);
-		free(demux->udtaLocationValue);
-		for (i = 0; i < demux->udtaMetadataCount; i++) {
-			free(demux->udtaMetadataKey[i]);
-			free(demux->udtaMetadataValue[i]);
+	/* one read per contiguous range of metadata samples */
+	for (i = 0; i <= n; i++) {
+		uint64_t offset = 0;
+		uint32_t size = 0;
+		if (i < n) {
+			offset = mp4_demux_sample_offset(tk,
+				&telemetry->cursor, first + i);
+			size = mp4_demux_sample_size(tk, first + i);
 		}
-		free(demux->udtaMetadataKey);
-		free(demux->udtaMetadataValue);
-		for (i = 0; i < demux->metaMetadataCount; i++) {
-			free(demux->metaMetadataKey[i]);
-			free(demux->metaMetadataValue[i]);
+		if ((runSize > 0) &&
+			((i == n) || (offset != runOffset + runSize))) {
+			ret = mp4_demux_io_pread_random(telemetry->demux,
+				runOffset, telemetry->buffer + bufOffset,
+				runSize);
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+				"failed to read %zu bytes from file", runSize);
+			bufOffset += runSize;
+			runSize = 0;
 		}
-		free(demux->metaMetadataKey);
-		free(demux->metaMetadataValue);
-		free(demux->finalMetadataKey);
-		free(demux->finalMetadataValue);
+		if (runSize == 0)
+			runOffset = offset;
+		runSize += size;
 	}
 
-	free(demux);
+	for (i = 0, bufOffset = 0; i < n; i++) {
+		uint32_t size = mp4_demux_sample_size(tk, first + i);
+		uint64_t dts = mp4_demux_sample_dts(tk, &telemetry->cursor,
+			first + i);
+		c->sample_dts[i] = (dts * 1000000 + tk->timescale / 2) /
+			tk->timescale;
+		mp4_telemetry_reset_row(c, i);
+		c->valid[i] = (uint8_t)telemetry->decoder->decode(
+			telemetry->buffer + bufOffset, size, c, i);
+		bufOffset += size;
+	}
+	c->count = n;
+	telemetry->currentSample += n;
+	*columns = *c;
 
-	return 0;
+	return (int)n;
 }
 
 
-int mp4_demux_seek(
+int mp4_demux_track_get_ranges(
 	struct mp4_demux *demux,
-	uint64_t time_offset,
-	int sync)
+	struct mp4_track *tk,
+	unsigned int max_ranges,
+	unsigned int *first_samples)
 {
-	struct mp4_track *tk = NULL;
+	unsigned int i, count = 0;
 
 	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(first_samples != NULL, -EINVAL);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk != NULL), -ENOENT,
+		"track not found");
+
+	int ret = mp4_demux_build_sample_tables(demux, tk);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"failed to build the sample tables of track %d", tk->id);
+
+	if ((tk->sampleCount == 0) || (max_ranges == 0))
+		return 0;
+
+	/* even split by sample count, each boundary moved forward to the
+	 * next sync sample; boundaries falling in the same GOP merge */
+	first_samples[count++] = 0;
+	for (i = 1; i < max_ranges; i++) {
+		uint32_t target = (uint32_t)((uint64_t)tk->sampleCount * i /
+			max_ranges);
+		uint32_t idx = mp4_demux_next_sync_sample(tk, target);
+		if (idx >= tk->sampleCount)
+			break;
+		if (idx > first_samples[count - 1])
+			first_samples[count++] = idx;
+	}
 
-	for (tk = demux->track; tk; tk = tk->next) {
-		if (tk->type == MP4_TRACK_TYPE_CHAPTERS)
-			continue;
-		if ((tk->type == MP4_TRACK_TYPE_METADATA) && (tk->ref))
-			continue;
+	return (int)count;
+}
 
-		int found = 0, i;
-		uint64_t ts = (time_offset * tk->timescale + 500000) / 1000000;
-		int start = (unsigned int)(((uint64_t)tk->sampleCount * ts
-				+ tk->duration - 1) / tk->duration);
-		if (start < 0)
-			start = 0;
-		if ((unsigned)start >= tk->sampleCount)
-			start = tk->sampleCount - 1;
-		while (((unsigned)start < tk->sampleCount)
-				&& (tk->sampleDecodingTime[start] < ts))
-			start++;
-		for (i = start; i >= 0; i--) {
-			if (tk->sampleDecodingTime[i] <= ts) {
-				int isSync, prevSync = -1;
-				isSync = mp4_demux_is_sync_sample(
-					demux, tk, i, &prevSync);
-				if ((isSync) || (!sync)) {
-					start = i;
-					found = 1;
-					break;
-				} else if (prevSync >= 0) {
-					start = prevSync;
-					found = 1;
-					break;
-				}
-			}
-		}
-		if (found) {
-			tk->currentSample = start;
-			MP4_LOGI("seek to %" PRIu64
-				" -> sample #%d time %" PRIu64,
-				time_offset, start,
-				(tk->sampleDecodingTime[start] * 1000000 +
-				tk->timescale / 2) / tk->timescale);
-			if ((tk->metadata) &&
-				((unsigned)start < tk->metadata->sampleCount) &&
-				(tk->sampleDecodingTime[start] ==
-				tk->metadata->sampleDecodingTime[start]))
-				tk->metadata->currentSample = start;
-			else
-				MP4_LOGW("failed to sync metadata"
-					" with ref track");
-		} else {
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(1, -ENOENT,
-				"unable to seek in track");
+
+/* Shared state of the range workers: each worker claims the next
+ * range, as the probe workers do with files */
+struct mp4_range_pool {
+	struct mp4_demux *demux;
+	struct mp4_track *track;
+	const unsigned int *firstSamples;
+	unsigned int count;
+	unsigned int next;
+	int status;
+	int (*cb)(struct mp4_demux *demux, unsigned int range_index,
+		unsigned int sample_index,
+		const struct mp4_track_sample *sample, void *userdata);
+	void *userdata;
+#ifndef _WIN32
+	pthread_mutex_t mutex;
+#endif /* !_WIN32 */
+};
+
+
+/* Range worker buffers, reused from one range to the next */
+struct mp4_range_scratch {
+	struct mp4_sample_cursor cursor;
+	struct mp4_sample_cursor metadataCursor;
+	uint8_t *sample;
+	size_t sampleSize;
+	uint8_t *metadata;
+	size_t metadataSize;
+};
+
+
+static int mp4_demux_range_read(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	struct mp4_sample_cursor *cursor,
+	uint32_t idx,
+	uint8_t **buffer,
+	size_t *bufferSize,
+	uint32_t *size)
+{
+	*size = mp4_demux_sample_size(tk, idx);
+	if (*size > *bufferSize) {
+		uint8_t *p = mp4_demux_scratch_realloc(demux, *buffer,
+			*bufferSize, *size);
+		MP4_RETURN_ERR_IF_FAILED((p != NULL), -ENOMEM);
+		*buffer = p;
+		*bufferSize = *size;
+	}
+
+	return mp4_demux_io_pread_shared(demux,
+		mp4_demux_sample_offset(tk, cursor, idx), *buffer, *size);
+}
+
+
+static int mp4_demux_range_process(
+	struct mp4_range_pool *pool,
+	unsigned int range,
+	struct mp4_range_scratch *scratch)
+{
+	struct mp4_track *tk = pool->track, *metatk = tk->metadata;
+	struct mp4_track_sample sample;
+	uint32_t idx, end;
+	int ret;
+
+	end = (range + 1 < pool->count) ? pool->firstSamples[range + 1] :
+		tk->sampleCount;
+	for (idx = pool->firstSamples[range]; idx < end; idx++) {
+		memset(&sample, 0, sizeof(sample));
+		ret = mp4_demux_range_read(pool->demux, tk, &scratch->cursor,
+			idx, &scratch->sample, &scratch->sampleSize,
+			&sample.sample_size);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to read sample %" PRIu32 " of track %d",
+			idx, tk->id);
+		sample.sample_data = scratch->sample;
+		if ((metatk) && (idx < metatk->sampleCount)) {
+			ret = mp4_demux_range_read(pool->demux, metatk,
+				&scratch->metadataCursor, idx,
+				&scratch->metadata, &scratch->metadataSize,
+				&sample.metadata_size);
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+				"failed to read sample %" PRIu32
+				" of track %d", idx, metatk->id);
+			sample.metadata_data = scratch->metadata;
 		}
+		mp4_demux_sample_times(tk, &scratch->cursor, idx, &sample);
+		ret = pool->cb(pool->demux, range, idx, &sample,
+			pool->userdata);
+		if (ret < 0)
+			return ret;
 	}
 
 	return 0;
 }
 
 
-int mp4_demux_get_media_info(
-	struct mp4_demux *demux,
-	struct mp4_media_info *media_info)
+static void *mp4_demux_range_worker(
+	void *arg)
 {
-	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
-	MP4_RETURN_ERR_IF_FAILED(media_info != NULL, -EINVAL);
+	struct mp4_range_pool *pool = arg;
+	struct mp4_range_scratch scratch;
+
+	memset(&scratch, 0, sizeof(scratch));
+	mp4_demux_sample_cursor_reset(pool->track, &scratch.cursor);
+	if (pool->track->metadata) {
+		mp4_demux_sample_cursor_reset(pool->track->metadata,
+			&scratch.metadataCursor);
+	}
 
-	memset(media_info, 0, sizeof(*media_info));
+	for (;;) {
+		unsigned int idx;
+		int ret;
+#ifndef _WIN32
+		pthread_mutex_lock(&pool->mutex);
+#endif /* !_WIN32 */
+		idx = pool->next;
+		if ((idx < pool->count) && (pool->status == 0))
+			pool->next++;
+		else
+			idx = pool->count;
+#ifndef _WIN32
+		pthread_mutex_unlock(&pool->mutex);
+#endif /* !_WIN32 */
+		if (idx >= pool->count)
+			break;
+		ret = mp4_demux_range_process(pool, idx, &scratch);
+		if (ret < 0) {
+#ifndef _WIN32
+			pthread_mutex_lock(&pool->mutex);
+#endif /* !_WIN32 */
+			if (pool->status == 0)
+				pool->status = ret;
+#ifndef _WIN32
+			pthread_mutex_unlock(&pool->mutex);
+#endif /* !_WIN32 */
+		}
+	}
 
-	media_info->duration =
-		(demux->duration * 1000000 + demux->timescale / 2) /
-		demux->timescale;
-	media_info->creation_time =
-		demux->creationTime - MP4_MAC_TO_UNIX_EPOCH_OFFSET;
-	media_info->modification_time =
-		demux->creationTime - MP4_MAC_TO_UNIX_EPOCH_OFFSET;
-	media_info->track_count = demux->trackCount;
+	mp4_demux_scratch_free(pool->demux, scratch.sample,
+		scratch.sampleSize);
+	mp4_demux_scratch_free(pool->demux, scratch.metadata,
+		scratch.metadataSize);
 
-	return 0;
+	return NULL;
 }
 
 
-int mp4_demux_get_track_count(
-	struct mp4_demux *demux)
+int mp4_demux_track_process_ranges(
+	struct mp4_demux *demux,
+	struct mp4_track *tk,
+	unsigned int range_count,
+	unsigned int thread_count,
+	int (*cb)(struct mp4_demux *demux, unsigned int range_index,
+		unsigned int sample_index,
+		const struct mp4_track_sample *sample, void *userdata),
+	void *userdata)
 {
+	struct mp4_range_pool pool;
+	unsigned int *firstSamples;
+	int ret;
+
 	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(cb != NULL, -EINVAL);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk != NULL), -ENOENT,
+		"track not found");
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		((demux->map != NULL) || (demux->file != NULL)), -EOPNOTSUPP,
+		"ranges require a mapped or stdio-backed file");
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((!demux->fragmented),
+		-EOPNOTSUPP, "ranges are not supported on fragmented files");
 
-	return demux->trackCount;
+#ifdef _WIN32
+	thread_count = 1;
+#else /* !_WIN32 */
+	if (thread_count == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = (n > 0) ? (unsigned int)n : 1;
+	}
+#endif /* !_WIN32 */
+	if (range_count == 0)
+		range_count = thread_count;
+
+	/* the shared tables must be complete before the workers start */
+	ret = mp4_demux_prepare_track(demux, tk);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"failed to build the sample tables of track %d", tk->id);
+
+	firstSamples = calloc(range_count, sizeof(*firstSamples));
+	MP4_RETURN_ERR_IF_FAILED((firstSamples != NULL), -ENOMEM);
+	ret = mp4_demux_track_get_ranges(demux, tk, range_count,
+		firstSamples);
+	if (ret <= 0) {
+		free(firstSamples);
+		return ret;
+	}
+
+	memset(&pool, 0, sizeof(pool));
+	pool.demux = demux;
+	pool.track = tk;
+	pool.firstSamples = firstSamples;
+	pool.count = (unsigned int)ret;
+	pool.cb = cb;
+	pool.userdata = userdata;
+	if (thread_count > pool.count)
+		thread_count = pool.count;
+
+#ifdef _WIN32
+	mp4_demux_range_worker(&pool);
+#else /* !_WIN32 */
+	pthread_t *threads = NULL;
+	unsigned int i, started = 0;
+	if (thread_count > 1)
+		threads = calloc(thread_count, sizeof(*threads));
+	pthread_mutex_init(&pool.mutex, NULL);
+	for (i = 0; (threads) && (i < thread_count); i++) {
+		if (pthread_create(&threads[i], NULL,
+			mp4_demux_range_worker, &pool) != 0)
+			break;
+		started++;
+	}
+	/* the calling thread works too if not all the workers started */
+	if (started < thread_count)
+		mp4_demux_range_worker(&pool);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&pool.mutex);
+	free(threads);
+#endif /* !_WIN32 */
+
+	free(firstSamples);
+
+	return pool.status;
 }
 
 
-int mp4_demux_get_track_info(
+/* Cut source track: samples [sample, end) are copied, their decoding
+ * times shifted by baseDts */
+struct mp4_demux_cut_track {
+	struct mp4_track *tk;
+	unsigned int muxTrackId;
+	struct mp4_sample_cursor cursor;
+	uint32_t sample;
+	uint32_t end;
+	uint64_t baseDts;
+	uint64_t nextOffset;
+};
+
+
+/* Microseconds to track timescale, saturated for open-ended times */
+static uint64_t mp4_demux_cut_ticks(
+	uint64_t time,
+	uint32_t timescale)
+{
+	if (time > (UINT64_MAX - 500000) / timescale)
+		return UINT64_MAX;
+	return (time * timescale + 500000) / 1000000;
+}
+
+
+/* Append a byte range of the input file to the output */
+static int mp4_demux_cut_copy(
 	struct mp4_demux *demux,
-	unsigned int track_idx,
-	struct mp4_track_info *track_info)
+	struct mp4_mux *mux,
+	off_t offset,
+	uint64_t size,
+	uint8_t **buffer)
 {
-	struct mp4_track *tk = NULL;
-	unsigned int k;
+	if (size == 0)
+		return 0;
 
-	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
-	MP4_RETURN_ERR_IF_FAILED(track_info != NULL, -EINVAL);
-	MP4_RETURN_ERR_IF_FAILED(track_idx < demux->trackCount, -EINVAL);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(((offset >= 0) &&
+		(offset <= demux->fileSize) &&
+		(size <= (uint64_t)(demux->fileSize - offset))), -EIO,
+		"sample data out of the file");
 
-	memset(track_info, 0, sizeof(*track_info));
+	if (demux->map)
+		return mp4_mux_write_raw(mux, demux->map + offset, size);
 
-	for (tk = demux->track, k = 0; (tk) && (k < track_idx);
-		tk = tk->next, k++)
-		;
+#ifndef _WIN32
+	if (demux->file) {
+		return mp4_mux_copy_fd_range(mux, fileno(demux->file),
+			offset, size);
+	}
+#endif /* !_WIN32 */
 
-	if (tk) {
-		track_info->id = tk->id;
-		track_info->type = tk->type;
-		track_info->duration =
-			(tk->duration * 1000000 + tk->timescale / 2) /
-			tk->timescale;
-		track_info->creation_time =
-			tk->creationTime - MP4_MAC_TO_UNIX_EPOCH_OFFSET;
-		track_info->modification_time =
-			tk->creationTime - MP4_MAC_TO_UNIX_EPOCH_OFFSET;
-		track_info->sample_count = tk->sampleCount;
-		track_info->has_metadata = (tk->metadata) ? 1 : 0;
-		if (tk->metadata) {
-			track_info->metadata_content_encoding =
-				tk->metadata->metadataContentEncoding;
-			track_info->metadata_mime_format =
-				tk->metadata->metadataMimeFormat;
-		} else if (tk->type == MP4_TRACK_TYPE_METADATA) {
-			track_info->metadata_content_encoding =
-				tk->metadataContentEncoding;
-			track_info->metadata_mime_format =
-				tk->metadataMimeFormat;
+	if (*buffer == NULL) {
+		*buffer = mp4_demux_scratch_realloc(demux, NULL, 0,
+			MP4_DEMUX_CUT_BUFFER_SIZE);
+		MP4_RETURN_ERR_IF_FAILED((*buffer != NULL), -ENOMEM);
+	}
+	while (size > 0) {
+		size_t n = (size > MP4_DEMUX_CUT_BUFFER_SIZE) ?
+			MP4_DEMUX_CUT_BUFFER_SIZE : (size_t)size;
+		int ret = mp4_demux_io_pread(demux, offset, *buffer, n);
+		if (ret == 0)
+			ret = mp4_mux_write_raw(mux, *buffer, n);
+		if (ret < 0)
+			return ret;
+		offset += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+
+/* Select the tracks to copy and their sample ranges; the cut starts
+ * at the sync sample of the reference track at or before start_time
+ * and the other tracks are cut at the same time */
+static int mp4_demux_cut_setup(
+	struct mp4_demux *demux,
+	struct mp4_mux *mux,
+	struct mp4_track *ref,
+	uint64_t startTime,
+	uint64_t endTime,
+	struct mp4_demux_cut_track *cts,
+	unsigned int *count)
+{
+	struct mp4_track_info info;
+	struct mp4_sample_cursor cursor;
+	struct mp4_track *tk;
+	struct mp4_demux_cut_track *ct;
+	uint32_t first = 0;
+	uint64_t baseTime;
+	unsigned int k;
+	int ret;
+
+	mp4_demux_sample_cursor_reset(ref, &cursor);
+	if (!mp4_demux_seek_sample(demux, ref, &cursor,
+		mp4_demux_cut_ticks(startTime, ref->timescale), 1, &first))
+		first = 0;
+	baseTime = (first < ref->sampleCount) ?
+		(mp4_demux_sample_dts(ref, &cursor, first) * 1000000 +
+		ref->timescale / 2) / ref->timescale : 0;
+
+	*count = 0;
+	for (tk = demux->track, k = 0; tk; tk = tk->next, k++) {
+		/* linked metadata is cut with its reference track */
+		if ((tk->type == MP4_TRACK_TYPE_METADATA) && (tk->ref))
+			continue;
+		if ((tk->type != MP4_TRACK_TYPE_METADATA) &&
+			((tk->type != MP4_TRACK_TYPE_VIDEO) ||
+			(tk->videoCodec != MP4_VIDEO_CODEC_AVC))) {
+			if (tk->type != MP4_TRACK_TYPE_CHAPTERS)
+				MP4_LOGW("cut: track %d skipped", tk->id);
+			continue;
 		}
-		if (tk->type == MP4_TRACK_TYPE_VIDEO) {
-			track_info->video_codec = tk->videoCodec;
-			track_info->video_width = tk->videoWidth;
-			track_info->video_height = tk->videoHeight;
-		} else if (tk->type == MP4_TRACK_TYPE_AUDIO) {
-			track_info->audio_codec = tk->audioCodec;
-			track_info->audio_channel_count = tk->audioChannelCount;
-			track_info->audio_sample_size = tk->audioSampleSize;
-			track_info->audio_sample_rate =
-				(float)tk->audioSampleRate / 65536.;
+
+		ret = mp4_demux_prepare_track(demux, tk);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+			"failed to build the sample tables of track %d",
+			tk->id);
+		ret = mp4_demux_get_track_info(demux, k, &info);
+		if (ret < 0)
+			return ret;
+		ret = mp4_mux_add_track(mux, &info, tk->timescale);
+		if (ret < 0)
+			return ret;
+		if (tk->videoSps) {
+			int _ret = mp4_mux_set_track_avc_decoder_config(mux,
+				ret, tk->videoSps, tk->videoSpsSize,
+				tk->videoPps, tk->videoPpsSize);
+			if (_ret < 0)
+				return _ret;
 		}
-	} else {
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(1, -ENOENT,
-			"track not found");
+
+		ct = &cts[(*count)++];
+		ct->tk = tk;
+		ct->muxTrackId = ret;
+		mp4_demux_sample_cursor_reset(tk, &ct->cursor);
+		ct->baseDts = mp4_demux_cut_ticks(baseTime, tk->timescale);
+		ct->sample = (tk == ref) ? first :
+			mp4_demux_sample_lower_bound(tk, ct->baseDts);
+		ct->end = mp4_demux_sample_lower_bound(tk,
+			mp4_demux_cut_ticks(endTime, tk->timescale));
+		if (ct->end < ct->sample)
+			ct->end = ct->sample;
+		if ((tk == ref) && (first < tk->sampleCount))
+			ct->baseDts = mp4_demux_sample_dts(tk, &ct->cursor,
+				first);
+
+		if (!tk->metadata)
+			continue;
+
+		/* same sample range, the muxer gave it the next id */
+		struct mp4_demux_cut_track *meta = &cts[(*count)++];
+		meta->tk = tk->metadata;
+		meta->muxTrackId = ct->muxTrackId + 1;
+		mp4_demux_sample_cursor_reset(meta->tk, &meta->cursor);
+		meta->sample = ct->sample;
+		meta->end = ct->end;
+		if (meta->end > meta->tk->sampleCount)
+			meta->end = meta->tk->sampleCount;
+		if (meta->sample > meta->end)
+			meta->sample = meta->end;
+		meta->baseDts = (meta->sample < meta->end) ?
+			mp4_demux_sample_dts(meta->tk, &meta->cursor,
+			meta->sample) : 0;
 	}
 
 	return 0;
 }
 
 
-int mp4_demux_get_track_avc_decoder_config(
+/* Declare the samples of all tracks in file order and copy the
+ * contiguous byte ranges they form at once */
+static int mp4_demux_cut_copy_samples(
 	struct mp4_demux *demux,
-	unsigned int track_id,
-	uint8_t **sps,
-	unsigned int *sps_size,
-	uint8_t **pps,
-	unsigned int *pps_size)
+	struct mp4_mux *mux,
+	struct mp4_demux_cut_track *cts,
+	unsigned int count)
 {
-	struct mp4_track *tk = NULL;
-	int found = 0;
+	struct mp4_demux_cut_track *ct;
+	uint64_t rangeStart = 0, rangeSize = 0;
+	off_t rangeOutput = 0;
+	uint8_t *buffer = NULL;
+	unsigned int i;
+	int ret = 0;
 
-	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
-	MP4_RETURN_ERR_IF_FAILED(sps != NULL, -EINVAL);
-	MP4_RETURN_ERR_IF_FAILED(sps_size != NULL, -EINVAL);
-	MP4_RETURN_ERR_IF_FAILED(pps != NULL, -EINVAL);
-	MP4_RETURN_ERR_IF_FAILED(pps_size != NULL, -EINVAL);
+	for (i = 0; i < count; i++) {
+		ct = &cts[i];
+		if (ct->sample < ct->end) {
+			ct->nextOffset = mp4_demux_sample_offset(ct->tk,
+				&ct->cursor, ct->sample);
+		}
+	}
 
-	for (tk = demux->track; tk; tk = tk->next) {
-		if (tk->id == track_id) {
-			found = 1;
+	for (;;) {
+		for (i = 0, ct = NULL; i < count; i++) {
+			if ((cts[i].sample < cts[i].end) && ((ct == NULL) ||
+				(cts[i].nextOffset < ct->nextOffset)))
+				ct = &cts[i];
+		}
+		if (ct == NULL)
 			break;
+
+		uint32_t size = mp4_demux_sample_size(ct->tk, ct->sample);
+		if ((rangeSize == 0) ||
+			(ct->nextOffset != rangeStart + rangeSize)) {
+			ret = mp4_demux_cut_copy(demux, mux, rangeStart,
+				rangeSize, &buffer);
+			if (ret < 0)
+				goto out;
+			rangeStart = ct->nextOffset;
+			rangeSize = 0;
+			rangeOutput = mp4_mux_get_offset(mux);
 		}
-	}
 
-	if (!found) {
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(1, -ENOENT,
-			"track not found");
+		ret = mp4_mux_add_track_sample_at(mux, ct->muxTrackId,
+			rangeOutput + rangeSize, size,
+			mp4_demux_sample_dts(ct->tk, &ct->cursor, ct->sample) -
+			ct->baseDts,
+			mp4_demux_is_sync_sample(demux, ct->tk, ct->sample,
+			NULL));
+		if (ret < 0)
+			goto out;
+		rangeSize += size;
+
+		ct->sample++;
+		if (ct->sample < ct->end) {
+			ct->nextOffset = mp4_demux_sample_offset(ct->tk,
+				&ct->cursor, ct->sample);
+		}
 	}
 
-	if (tk->videoSps) {
-		*sps = tk->videoSps;
-		*sps_size = tk->videoSpsSize;
-	}
-	if (tk->videoPps) {
-		*pps = tk->videoPps;
-		*pps_size = tk->videoPpsSize;
-	}
+	ret = mp4_demux_cut_copy(demux, mux, rangeStart, rangeSize, &buffer);
 
-	return 0;
+out:
+	mp4_demux_scratch_free(demux, buffer,
+		(buffer) ? MP4_DEMUX_CUT_BUFFER_SIZE : 0);
+	return ret;
 }
 
 
-int mp4_demux_get_track_next_sample(
+int mp4_demux_cut(
 	struct mp4_demux *demux,
-	unsigned int track_id,
-	uint8_t *sample_buffer,
-	unsigned int sample_buffer_size,
-	uint8_t *metadata_buffer,
-	unsigned int metadata_buffer_size,
-	struct mp4_track_sample *track_sample)
+	uint64_t start_time,
+	uint64_t end_time,
+	const char *filename,
+	const struct mp4_mux_config *config)
 {
-	struct mp4_track *tk = NULL;
-	int found = 0;
+	struct mp4_demux_cut_track *cts;
+	struct mp4_mux_config muxConfig;
+	struct mp4_track *tk, *ref = NULL;
+	struct mp4_mux *mux;
+	unsigned int count = 0;
+	int ret;
 
 	MP4_RETURN_ERR_IF_FAILED(demux != NULL, -EINVAL);
-	MP4_RETURN_ERR_IF_FAILED(track_sample != NULL, -EINVAL);
-
-	memset(track_sample, 0, sizeof(*track_sample));
+	MP4_RETURN_ERR_IF_FAILED(filename != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(start_time < end_time, -EINVAL);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((!demux->fragmented),
+		-EOPNOTSUPP, "cutting fragmented files is not supported");
 
+	/* the first video track, or else the first standalone metadata
+	 * track, gives the cut points */
 	for (tk = demux->track; tk; tk = tk->next) {
-		if (tk->id == track_id) {
-			found = 1;
+		if ((tk->type == MP4_TRACK_TYPE_VIDEO) &&
+			(tk->videoCodec == MP4_VIDEO_CODEC_AVC)) {
+			ref = tk;
 			break;
 		}
+		if ((ref == NULL) && (tk->type == MP4_TRACK_TYPE_METADATA) &&
+			(tk->ref == NULL))
+			ref = tk;
 	}
-
-	if (!found) {
-		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(1, -ENOENT,
-			"track not found");
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ref != NULL), -EOPNOTSUPP,
+		"no video or metadata track to cut");
+	ret = mp4_demux_prepare_track(demux, ref);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((ret == 0), ret,
+		"failed to build the sample tables of track %d", ref->id);
+
+	memset(&muxConfig, 0, sizeof(muxConfig));
+	if (config)
+		muxConfig = *config;
+	if ((muxConfig.creation_time == 0) && (demux->creationTime))
+		muxConfig.creation_time =
+			demux->creationTime - MP4_MAC_TO_UNIX_EPOCH_OFFSET;
+	if ((muxConfig.modification_time == 0) && (demux->modificationTime))
+		muxConfig.modification_time = demux->modificationTime -
+			MP4_MAC_TO_UNIX_EPOCH_OFFSET;
+
+	/* a linked metadata track per track at most */
+	cts = calloc(2 * demux->trackCount, sizeof(*cts));
+	MP4_RETURN_ERR_IF_FAILED((cts != NULL), -ENOMEM);
+
+	mux = mp4_mux_open(filename, &muxConfig);
+	if (mux == NULL) {
+		free(cts);
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, -EIO,
+			"failed to create '%s'", filename);
 	}
 
-	if (tk->currentSample < tk->sampleCount) {
-		track_sample->sample_size = tk->sampleSize[tk->currentSample];
-		if ((sample_buffer) &&
-			(tk->sampleSize[tk->currentSample] <=
-			sample_buffer_size)) {
-			int _ret = fseeko(demux->file,
-				tk->sampleOffset[tk->currentSample], SEEK_SET);
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(_ret == 0, -errno,
-				"failed to seek %" PRIu64
-				" bytes forward in file",
-				tk->sampleOffset[tk->currentSample]);
-			size_t count = fread(sample_buffer,
-				tk->sampleSize[tk->currentSample],
-				1, demux->file);
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((count == 1), -EIO,
-				"failed to read %d bytes from file",
-				tk->sampleSize[tk->currentSample]);
-		} else if (sample_buffer) {
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(1, -ENOBUFS,
-				"buffer too small (%d bytes, %d needed)",
-				sample_buffer_size,
-				tk->sampleSize[tk->currentSample]);
-		}
-		if (tk->metadata) {
-			struct mp4_track *metatk = tk->metadata;
-			/* TODO: check sync between metadata and ref track */
-			track_sample->metadata_size =
-				metatk->sampleSize[tk->currentSample];
-			if ((metadata_buffer) &&
-				(metatk->sampleSize[tk->currentSample] <=
-				metadata_buffer_size)) {
-				int _ret = fseeko(demux->file,
-					metatk->sampleOffset[tk->currentSample],
-					SEEK_SET);
-				MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-					_ret == 0, -errno,
-					"failed to seek %" PRIu64
-					" bytes forward in file",
-					metatk->sampleOffset[
-						tk->currentSample]);
-				size_t count = fread(metadata_buffer,
-					metatk->sampleSize[tk->currentSample],
-					1, demux->file);
-				MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
-					(count == 1), -EIO,
-					"failed to read %d bytes from file",
-					metatk->sampleSize[tk->currentSample]);
-			}
-		}
-		track_sample->sample_dts =
-			(tk->sampleDecodingTime[tk->currentSample] * 1000000 +
-			tk->timescale / 2) / tk->timescale;
-		track_sample->next_sample_dts =
-			(tk->currentSample < tk->sampleCount - 1) ?
-			(tk->sampleDecodingTime[tk->currentSample + 1] *
-			1000000 + tk->timescale / 2) / tk->timescale : 0;
-		tk->currentSample++;
-	}
+	ret = mp4_demux_cut_setup(demux, mux, ref, start_time, end_time,
+		cts, &count);
+	if (ret == 0)
+		ret = mp4_demux_cut_copy_samples(demux, mux, cts, count);
 
-	return 0;
+	int _ret = mp4_mux_close(mux);
+	if (ret == 0)
+		ret = _ret;
+	free(cts);
+
+	return ret;
 }
 
 
@@ -3302,6 +9239,9 @@ int mp4_demux_get_chapters(
 	MP4_RETURN_ERR_IF_FAILED(chaptersTime != NULL, -EINVAL);
 	MP4_RETURN_ERR_IF_FAILED(chaptersName != NULL, -EINVAL);
 
+	int ret = mp4_demux_build_chapters(demux);
+	MP4_RETURN_ERR_IF_FAILED((ret == 0), ret);
+
 	*chaptersCount = demux->chaptersCount;
 	*chaptersTime = demux->chaptersTime;
 	*chaptersName = demux->chaptersName;
@@ -3345,18 +9285,14 @@ int mp4_demux_get_metadata_cover(
 			*cover_type = demux->finalCoverType;
 		if ((cover_buffer) &&
 			(demux->finalCoverSize <= cover_buffer_size)) {
-			int _ret = fseeko(demux->file,
-				demux->finalCoverOffset, SEEK_SET);
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(_ret == 0, -errno,
-				"failed to seek %zi bytes forward in file",
-				demux->finalCoverOffset);
-			size_t count = fread(cover_buffer,
-				demux->finalCoverSize, 1, demux->file);
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((count == 1), -EIO,
+			int _ret = mp4_demux_io_pread(demux,
+				demux->finalCoverOffset, cover_buffer,
+				demux->finalCoverSize);
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((_ret == 0), _ret,
 				"failed to read %" PRIu32 " bytes from file",
 				demux->finalCoverSize);
 		} else if (cover_buffer) {
-			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(1, -ENOBUFS,
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, -ENOBUFS,
 				"buffer too small (%d bytes, %d needed)",
 				cover_buffer_size, demux->finalCoverSize);
 		}
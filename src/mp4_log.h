@@ -43,28 +43,74 @@
 extern "C" {
 #endif /* __cplusplus */
 
+/* Compile-time log level: the messages above it are compiled out,
+ * their arguments are not evaluated. With libulog everything is kept
+ * and filtered at runtime, otherwise the debug messages are dropped */
+#define MP4_LOG_LEVEL_NONE	0
+#define MP4_LOG_LEVEL_ERROR	1
+#define MP4_LOG_LEVEL_WARNING	2
+#define MP4_LOG_LEVEL_INFO	3
+#define MP4_LOG_LEVEL_DEBUG	4
+
+#ifndef MP4_LOG_LEVEL
+#  if defined(BUILD_LIBULOG)
+#    define MP4_LOG_LEVEL MP4_LOG_LEVEL_DEBUG
+#  else /* !BUILD_LIBULOG */
+#    define MP4_LOG_LEVEL MP4_LOG_LEVEL_INFO
+#  endif /* !BUILD_LIBULOG */
+#endif /* !MP4_LOG_LEVEL */
+
+#include <stdio.h>
+
 #if defined(BUILD_LIBULOG)
 
 #define ULOG_TAG libmp4
 #include <ulog.h>
 
-#define MP4_LOGD(_fmt, ...)	ULOGD(_fmt, ##__VA_ARGS__)
-#define MP4_LOGI(_fmt, ...)	ULOGI(_fmt, ##__VA_ARGS__)
-#define MP4_LOGW(_fmt, ...)	ULOGW(_fmt, ##__VA_ARGS__)
-#define MP4_LOGE(_fmt, ...)	ULOGE(_fmt, ##__VA_ARGS__)
+#define MP4_LOG_D(_fmt, ...)	ULOGD(_fmt, ##__VA_ARGS__)
+#define MP4_LOG_I(_fmt, ...)	ULOGI(_fmt, ##__VA_ARGS__)
+#define MP4_LOG_W(_fmt, ...)	ULOGW(_fmt, ##__VA_ARGS__)
+#define MP4_LOG_E(_fmt, ...)	ULOGE(_fmt, ##__VA_ARGS__)
 
 #else /* !BUILD_LIBULOG */
 
-#include <stdio.h>
-
 #define MP4_LOG(_fmt, ...)	fprintf(stderr, _fmt "\n", ##__VA_ARGS__)
-#define MP4_LOGD(_fmt, ...)	MP4_LOG("[D]" _fmt, ##__VA_ARGS__)
-#define MP4_LOGI(_fmt, ...)	MP4_LOG("[I]" _fmt, ##__VA_ARGS__)
-#define MP4_LOGW(_fmt, ...)	MP4_LOG("[W]" _fmt, ##__VA_ARGS__)
-#define MP4_LOGE(_fmt, ...)	MP4_LOG("[E]" _fmt, ##__VA_ARGS__)
+#define MP4_LOG_D(_fmt, ...)	MP4_LOG("[D]" _fmt, ##__VA_ARGS__)
+#define MP4_LOG_I(_fmt, ...)	MP4_LOG("[I]" _fmt, ##__VA_ARGS__)
+#define MP4_LOG_W(_fmt, ...)	MP4_LOG("[W]" _fmt, ##__VA_ARGS__)
+#define MP4_LOG_E(_fmt, ...)	MP4_LOG("[E]" _fmt, ##__VA_ARGS__)
 
 #endif /* !BUILD_LIBULOG */
 
+/* a disabled message is still type checked and keeps its arguments
+ * used, but is removed as dead code */
+#define MP4_LOG_NONE(_fmt, ...) \
+	do { \
+		if (0) \
+			fprintf(stderr, _fmt, ##__VA_ARGS__); \
+	} while (0)
+
+#if MP4_LOG_LEVEL >= MP4_LOG_LEVEL_DEBUG
+#  define MP4_LOGD MP4_LOG_D
+#else
+#  define MP4_LOGD MP4_LOG_NONE
+#endif
+#if MP4_LOG_LEVEL >= MP4_LOG_LEVEL_INFO
+#  define MP4_LOGI MP4_LOG_I
+#else
+#  define MP4_LOGI MP4_LOG_NONE
+#endif
+#if MP4_LOG_LEVEL >= MP4_LOG_LEVEL_WARNING
+#  define MP4_LOGW MP4_LOG_W
+#else
+#  define MP4_LOGW MP4_LOG_NONE
+#endif
+#if MP4_LOG_LEVEL >= MP4_LOG_LEVEL_ERROR
+#  define MP4_LOGE MP4_LOG_E
+#else
+#  define MP4_LOGE MP4_LOG_NONE
+#endif
+
 /** Log error with errno */
 #define MP4_LOG_ERRNO(_fct, _err) \
 	MP4_LOGE("%s:%d: %s err=%d(%s)", __func__, __LINE__, \
@@ -0,0 +1,1424 @@
+/**
+ * @file mp4_mux.c
+ * @brief MP4 file library - muxer implementation
+ * @date 14/10/2026
+ * @author aurelien.barre@akaaba.net
+ *
+ * Copyright (c) 2026 Aurelien Barre <aurelien.barre@akaaba.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *   * Neither the name of the copyright holder nor the names of the
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+/* copy_file_range() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#  include <sys/types.h>
+#  include <unistd.h>
+#endif /* !_WIN32 */
+
+#if defined(__linux__) && defined(__GLIBC__) && \
+	((__GLIBC__ > 2) || (__GLIBC_MINOR__ >= 27))
+#  define MP4_MUX_HAVE_COPY_FILE_RANGE
+#endif
+
+#include <libmp4.h>
+
+#include "mp4_priv.h"
+#include "mp4_log.h"
+
+
+#define MP4_FREE_BOX                        0x66726565 /* "free" */
+#define MP4_DATA_ENTRY_URL_BOX              0x75726c20 /* "url " */
+#define MP4_AVC_SAMPLE_ENTRY                0x61766331 /* "avc1" */
+#define MP4_METADATA_SAMPLE_ENTRY           0x6d657474 /* "mett" */
+
+#define MP4_BRAND_ISOM                      0x69736f6d /* "isom" */
+#define MP4_BRAND_ISO2                      0x69736f32 /* "iso2" */
+#define MP4_BRAND_AVC1                      0x61766331 /* "avc1" */
+#define MP4_BRAND_MP41                      0x6d703431 /* "mp41" */
+
+#define MP4_MUX_MOVIE_TIMESCALE (1000)
+#define MP4_MUX_LANGUAGE_UND (0x55c4)
+#define MP4_MUX_WRITE_BUFFER_SIZE (1024 * 1024)
+#define MP4_MUX_TABLE_MIN_CAPACITY (256)
+#define MP4_MUX_COPY_CHUNK_SIZE (1024 * 1024 * 1024)
+/* mdat header with a 64-bit size patched on close */
+#define MP4_MUX_MDAT_HEADER_SIZE (16)
+
+
+struct mp4_mux_time_to_sample_entry {
+	uint32_t sampleCount;
+	uint32_t sampleDelta;
+};
+
+
+struct mp4_mux_sample_to_chunk_entry {
+	uint32_t firstChunk;
+	uint32_t samplesPerChunk;
+};
+
+
+/* The sample tables are run-length encoded as samples are written:
+ * stts runs and stsc entries are merged on the fly, only the sample
+ * sizes, sync sample numbers and chunk offsets are stored per item */
+struct mp4_mux_track {
+	uint32_t id;
+	enum mp4_track_type type;
+	uint32_t timescale;
+	uint64_t creationTime;
+	uint64_t modificationTime;
+
+	uint32_t videoWidth;
+	uint32_t videoHeight;
+	uint16_t videoSpsSize;
+	uint8_t *videoSps;
+	uint16_t videoPpsSize;
+	uint8_t *videoPps;
+
+	char *metadataContentEncoding;
+	char *metadataMimeFormat;
+
+	/* cdsc reference of a linked metadata track */
+	uint32_t referenceTrackId;
+	struct mp4_mux_track *ref;
+	struct mp4_mux_track *metadata;
+
+	uint32_t sampleCount;
+	uint64_t lastDts;
+	uint32_t lastDelta;
+	uint64_t duration;
+
+	uint32_t timeToSampleEntryCount;
+	uint32_t timeToSampleEntryCapacity;
+	struct mp4_mux_time_to_sample_entry *timeToSampleEntries;
+
+	uint32_t sampleSizeCapacity;
+	uint32_t *sampleSize;
+	int variableSampleSize;
+
+	uint32_t syncSampleEntryCount;
+	uint32_t syncSampleEntryCapacity;
+	uint32_t *syncSampleEntries;
+
+	uint32_t sampleToChunkEntryCount;
+	uint32_t sampleToChunkEntryCapacity;
+	struct mp4_mux_sample_to_chunk_entry *sampleToChunkEntries;
+
+	uint32_t chunkCount;
+	uint32_t chunkCapacity;
+	uint64_t *chunkOffset;
+	uint32_t chunkSampleCount;
+
+	struct mp4_mux_track *next;
+};
+
+
+struct mp4_mux {
+	struct mp4_mux_config config;
+	FILE *file;
+	/* current end of the file, including the buffered bytes */
+	off_t offset;
+	uint8_t *buffer;
+	size_t bufferSize;
+	size_t bufferUsed;
+	/* sticky once a write failed, the file layout is then unknown */
+	int error;
+	off_t moovReserveOffset;
+	off_t mdatOffset;
+	uint64_t creationTime;
+	uint64_t modificationTime;
+	struct mp4_mux_track *track;
+	unsigned int trackCount;
+	/* track and end of the last written sample: consecutive samples
+	 * of the same track share a chunk */
+	struct mp4_mux_track *lastTrack;
+	uint64_t lastSampleEnd;
+};
+
+
+/* Box serializer; with a NULL buffer only the size is computed, so
+ * that the moov box can be measured before it is placed */
+struct mp4_mux_writer {
+	uint8_t *buf;
+	size_t pos;
+};
+
+
+static void mp4_mux_write_bytes(
+	struct mp4_mux_writer *w,
+	const void *data,
+	size_t size)
+{
+	if ((w->buf) && (data) && (size > 0))
+		memcpy(w->buf + w->pos, data, size);
+	else if ((w->buf) && (size > 0))
+		memset(w->buf + w->pos, 0, size);
+	w->pos += size;
+}
+
+
+static void mp4_mux_write_8(
+	struct mp4_mux_writer *w,
+	uint8_t val)
+{
+	mp4_mux_write_bytes(w, &val, 1);
+}
+
+
+static void mp4_mux_write_16(
+	struct mp4_mux_writer *w,
+	uint16_t val)
+{
+	uint8_t b[2] = { val >> 8, val };
+
+	mp4_mux_write_bytes(w, b, sizeof(b));
+}
+
+
+static void mp4_mux_write_32(
+	struct mp4_mux_writer *w,
+	uint32_t val)
+{
+	uint8_t b[4] = { val >> 24, val >> 16, val >> 8, val };
+
+	mp4_mux_write_bytes(w, b, sizeof(b));
+}
+
+
+static void mp4_mux_write_64(
+	struct mp4_mux_writer *w,
+	uint64_t val)
+{
+	mp4_mux_write_32(w, (uint32_t)(val >> 32));
+	mp4_mux_write_32(w, (uint32_t)val);
+}
+
+
+/* Returns the box start to give to mp4_mux_box_end() */
+static size_t mp4_mux_box_start(
+	struct mp4_mux_writer *w,
+	uint32_t type)
+{
+	size_t start = w->pos;
+
+	mp4_mux_write_32(w, 0);
+	mp4_mux_write_32(w, type);
+	return start;
+}
+
+
+static size_t mp4_mux_full_box_start(
+	struct mp4_mux_writer *w,
+	uint32_t type,
+	uint8_t version,
+	uint32_t flags)
+{
+	size_t start = mp4_mux_box_start(w, type);
+
+	mp4_mux_write_32(w, ((uint32_t)version << 24) | (flags & 0xFFFFFF));
+	return start;
+}
+
+
+static void mp4_mux_box_end(
+	struct mp4_mux_writer *w,
+	size_t start)
+{
+	if (w->buf) {
+		uint32_t size = w->pos - start;
+		w->buf[start] = size >> 24;
+		w->buf[start + 1] = size >> 16;
+		w->buf[start + 2] = size >> 8;
+		w->buf[start + 3] = size;
+	}
+}
+
+
+static void mp4_mux_write_matrix(
+	struct mp4_mux_writer *w)
+{
+	/* unity matrix */
+	mp4_mux_write_32(w, 0x00010000);
+	mp4_mux_write_32(w, 0);
+	mp4_mux_write_32(w, 0);
+	mp4_mux_write_32(w, 0);
+	mp4_mux_write_32(w, 0x00010000);
+	mp4_mux_write_32(w, 0);
+	mp4_mux_write_32(w, 0);
+	mp4_mux_write_32(w, 0);
+	mp4_mux_write_32(w, 0x40000000);
+}
+
+
+static uint64_t mp4_mux_mac_time(
+	uint64_t unixTime)
+{
+	return (unixTime) ? unixTime + MP4_MAC_TO_UNIX_EPOCH_OFFSET : 0;
+}
+
+
+/* Grow a table to hold at least count + 1 items */
+static int mp4_mux_table_grow(
+	void **table,
+	uint32_t *capacity,
+	uint32_t count,
+	size_t itemSize)
+{
+	uint32_t newCapacity;
+	void *newTable;
+
+	if (count < *capacity)
+		return 0;
+
+	MP4_RETURN_ERR_IF_FAILED((count < UINT32_MAX / 2), -ENOMEM);
+	newCapacity = (*capacity > 0) ? *capacity * 2 :
+		MP4_MUX_TABLE_MIN_CAPACITY;
+	newTable = realloc(*table, (size_t)newCapacity * itemSize);
+	MP4_RETURN_ERR_IF_FAILED((newTable != NULL), -ENOMEM);
+	*table = newTable;
+	*capacity = newCapacity;
+	return 0;
+}
+
+
+static int mp4_mux_flush(
+	struct mp4_mux *mux)
+{
+	if (mux->error)
+		return mux->error;
+
+	if ((mux->bufferUsed > 0) && (fwrite(mux->buffer, 1,
+		mux->bufferUsed, mux->file) != mux->bufferUsed)) {
+		mux->error = -EIO;
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, mux->error,
+			"failed to write %zu bytes", mux->bufferUsed);
+	}
+	mux->bufferUsed = 0;
+	return 0;
+}
+
+
+/* Append to the file through the write buffer; payloads at least as
+ * large as the buffer are written directly */
+static int mp4_mux_write(
+	struct mp4_mux *mux,
+	const void *data,
+	size_t size)
+{
+	int ret;
+
+	if (mux->error)
+		return mux->error;
+
+	if (mux->bufferUsed + size > mux->bufferSize) {
+		ret = mp4_mux_flush(mux);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (size >= mux->bufferSize) {
+		if (fwrite(data, 1, size, mux->file) != size) {
+			mux->error = -EIO;
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, mux->error,
+				"failed to write %zu bytes", size);
+		}
+	} else if (size > 0) {
+		memcpy(mux->buffer + mux->bufferUsed, data, size);
+		mux->bufferUsed += size;
+	}
+	mux->offset += size;
+
+	return 0;
+}
+
+
+static int mp4_mux_write_zeros(
+	struct mp4_mux *mux,
+	size_t size)
+{
+	while (size > 0) {
+		if (mux->bufferUsed == mux->bufferSize) {
+			int ret = mp4_mux_flush(mux);
+			if (ret < 0)
+				return ret;
+		}
+		size_t n = mux->bufferSize - mux->bufferUsed;
+		if (n > size)
+			n = size;
+		memset(mux->buffer + mux->bufferUsed, 0, n);
+		mux->bufferUsed += n;
+		mux->offset += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+
+/* Write at an offset already on disk, used on close to fill the
+ * reserved and placeholder areas */
+static int mp4_mux_pwrite(
+	struct mp4_mux *mux,
+	off_t offset,
+	const void *data,
+	size_t size)
+{
+	int ret = fseeko(mux->file, offset, SEEK_SET);
+	if (ret != 0) {
+		ret = -errno;
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, ret,
+			"failed to seek to %ld", (long)offset);
+	}
+	if (fwrite(data, 1, size, mux->file) != size) {
+		MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, -EIO,
+			"failed to write %zu bytes", size);
+	}
+	return 0;
+}
+
+
+static struct mp4_mux_track *mp4_mux_find_track(
+	struct mp4_mux *mux,
+	unsigned int trackId)
+{
+	struct mp4_mux_track *tk;
+
+	for (tk = mux->track; tk; tk = tk->next) {
+		if (tk->id == trackId)
+			return tk;
+	}
+	return NULL;
+}
+
+
+static struct mp4_mux_track *mp4_mux_new_track(
+	struct mp4_mux *mux,
+	enum mp4_track_type type,
+	uint32_t timescale,
+	const struct mp4_track_info *info)
+{
+	struct mp4_mux_track *tk, *last;
+
+	tk = calloc(1, sizeof(*tk));
+	MP4_RETURN_VAL_IF_FAILED((tk != NULL), -ENOMEM, NULL);
+	tk->id = mux->trackCount + 1;
+	tk->type = type;
+	tk->timescale = timescale;
+	tk->creationTime = mp4_mux_mac_time(info->creation_time);
+	tk->modificationTime = mp4_mux_mac_time(info->modification_time);
+
+	for (last = mux->track; (last) && (last->next); last = last->next)
+		;
+	if (last)
+		last->next = tk;
+	else
+		mux->track = tk;
+	mux->trackCount++;
+
+	return tk;
+}
+
+
+static int mp4_mux_track_set_strings(
+	struct mp4_mux_track *tk,
+	const char *contentEncoding,
+	const char *mimeFormat)
+{
+	if (contentEncoding) {
+		tk->metadataContentEncoding = strdup(contentEncoding);
+		MP4_RETURN_ERR_IF_FAILED(
+			(tk->metadataContentEncoding != NULL), -ENOMEM);
+	}
+	if (mimeFormat) {
+		tk->metadataMimeFormat = strdup(mimeFormat);
+		MP4_RETURN_ERR_IF_FAILED(
+			(tk->metadataMimeFormat != NULL), -ENOMEM);
+	}
+	return 0;
+}
+
+
+/* Account for the end of the open chunk of a track in the sample to
+ * chunk table, merging it with the last entry when possible */
+static int mp4_mux_track_close_chunk(
+	struct mp4_mux_track *tk)
+{
+	struct mp4_mux_sample_to_chunk_entry *entry;
+	uint32_t n = tk->sampleToChunkEntryCount;
+
+	if (tk->chunkSampleCount == 0)
+		return 0;
+
+	if ((n == 0) || (tk->sampleToChunkEntries[n - 1].samplesPerChunk !=
+		tk->chunkSampleCount)) {
+		int ret = mp4_mux_table_grow(
+			(void **)&tk->sampleToChunkEntries,
+			&tk->sampleToChunkEntryCapacity, n,
+			sizeof(*tk->sampleToChunkEntries));
+		if (ret < 0)
+			return ret;
+		entry = &tk->sampleToChunkEntries[n];
+		/* chunk numbers are 1-based */
+		entry->firstChunk = tk->chunkCount;
+		entry->samplesPerChunk = tk->chunkSampleCount;
+		tk->sampleToChunkEntryCount++;
+	}
+	tk->chunkSampleCount = 0;
+
+	return 0;
+}
+
+
+static int mp4_mux_track_add_delta(
+	struct mp4_mux_track *tk,
+	uint32_t delta)
+{
+	uint32_t n = tk->timeToSampleEntryCount;
+
+	if ((n > 0) && (tk->timeToSampleEntries[n - 1].sampleDelta == delta)) {
+		tk->timeToSampleEntries[n - 1].sampleCount++;
+		return 0;
+	}
+
+	int ret = mp4_mux_table_grow((void **)&tk->timeToSampleEntries,
+		&tk->timeToSampleEntryCapacity, n,
+		sizeof(*tk->timeToSampleEntries));
+	if (ret < 0)
+		return ret;
+	tk->timeToSampleEntries[n].sampleCount = 1;
+	tk->timeToSampleEntries[n].sampleDelta = delta;
+	tk->timeToSampleEntryCount++;
+
+	return 0;
+}
+
+
+/* Account for a sample stored at 'offset' in the output file, with
+ * its decoding time in the track timescale */
+static int mp4_mux_track_add_sample(
+	struct mp4_mux *mux,
+	struct mp4_mux_track *tk,
+	uint64_t offset,
+	uint32_t size,
+	uint64_t dts,
+	int sync)
+{
+	int newChunk = ((mux->lastTrack != tk) ||
+		(offset != mux->lastSampleEnd));
+	int ret;
+
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		((tk->sampleCount == 0) || (dts >= tk->lastDts)), -EINVAL,
+		"track %d: decreasing decoding time", tk->id);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		((tk->sampleCount == 0) ||
+		(dts - tk->lastDts <= UINT32_MAX)), -ERANGE,
+		"track %d: sample duration out of range", tk->id);
+	MP4_RETURN_ERR_IF_FAILED((tk->sampleCount < UINT32_MAX), -ERANGE);
+
+	/* reserve the table room first so that a failure leaves the
+	 * track unchanged */
+	ret = mp4_mux_table_grow((void **)&tk->sampleSize,
+		&tk->sampleSizeCapacity, tk->sampleCount,
+		sizeof(*tk->sampleSize));
+	if ((ret == 0) && (sync)) {
+		ret = mp4_mux_table_grow((void **)&tk->syncSampleEntries,
+			&tk->syncSampleEntryCapacity,
+			tk->syncSampleEntryCount,
+			sizeof(*tk->syncSampleEntries));
+	}
+	if ((ret == 0) && (newChunk)) {
+		ret = mp4_mux_table_grow((void **)&tk->chunkOffset,
+			&tk->chunkCapacity, tk->chunkCount,
+			sizeof(*tk->chunkOffset));
+	}
+	if ((ret == 0) && (newChunk))
+		ret = mp4_mux_track_close_chunk(tk);
+	if ((ret == 0) && (tk->sampleCount > 0)) {
+		/* the duration of the previous sample is now known */
+		ret = mp4_mux_track_add_delta(tk,
+			(uint32_t)(dts - tk->lastDts));
+	}
+	if (ret < 0)
+		return ret;
+	if (tk->sampleCount > 0)
+		tk->lastDelta = (uint32_t)(dts - tk->lastDts);
+
+	if (newChunk)
+		tk->chunkOffset[tk->chunkCount++] = offset;
+
+	if ((tk->sampleCount > 0) && (size != tk->sampleSize[0]))
+		tk->variableSampleSize = 1;
+	tk->sampleSize[tk->sampleCount] = size;
+	tk->sampleCount++;
+	/* sync sample numbers are 1-based */
+	if (sync)
+		tk->syncSampleEntries[tk->syncSampleEntryCount++] =
+			tk->sampleCount;
+	tk->chunkSampleCount++;
+	tk->lastDts = dts;
+	mux->lastTrack = tk;
+	mux->lastSampleEnd = offset + size;
+
+	return 0;
+}
+
+
+static int mp4_mux_track_write_sample(
+	struct mp4_mux *mux,
+	struct mp4_mux_track *tk,
+	const uint8_t *data,
+	uint32_t size,
+	uint64_t dtsUs,
+	int sync)
+{
+	uint64_t dts = (dtsUs * tk->timescale + 500000) / 1000000;
+
+	int ret = mp4_mux_track_add_sample(mux, tk, mux->offset, size, dts,
+		sync);
+	if (ret < 0)
+		return ret;
+
+	return mp4_mux_write(mux, data, size);
+}
+
+
+/* Close the open chunk and account for the last sample, which lasts
+ * as long as the previous one */
+static int mp4_mux_track_finalize(
+	struct mp4_mux_track *tk)
+{
+	uint32_t i;
+
+	int ret = mp4_mux_track_close_chunk(tk);
+	if (ret < 0)
+		return ret;
+
+	if (tk->sampleCount > 0) {
+		ret = mp4_mux_track_add_delta(tk, tk->lastDelta);
+		if (ret < 0)
+			return ret;
+	}
+
+	tk->duration = 0;
+	for (i = 0; i < tk->timeToSampleEntryCount; i++) {
+		tk->duration +=
+			(uint64_t)tk->timeToSampleEntries[i].sampleCount *
+			tk->timeToSampleEntries[i].sampleDelta;
+	}
+
+	return 0;
+}
+
+
+static uint64_t mp4_mux_movie_duration(
+	struct mp4_mux_track *tk)
+{
+	return (tk->duration * MP4_MUX_MOVIE_TIMESCALE + tk->timescale / 2) /
+		tk->timescale;
+}
+
+
+static void mp4_mux_write_sample_entry(
+	struct mp4_mux_writer *w,
+	struct mp4_mux_track *tk)
+{
+	size_t entry, avcc;
+	const char *str;
+
+	switch (tk->type) {
+	case MP4_TRACK_TYPE_VIDEO:
+		entry = mp4_mux_box_start(w, MP4_AVC_SAMPLE_ENTRY);
+		/* reserved & data_reference_index */
+		mp4_mux_write_bytes(w, NULL, 6);
+		mp4_mux_write_16(w, 1);
+		/* pre_defined & reserved */
+		mp4_mux_write_bytes(w, NULL, 16);
+		mp4_mux_write_16(w, tk->videoWidth);
+		mp4_mux_write_16(w, tk->videoHeight);
+		/* horizresolution & vertresolution: 72 dpi */
+		mp4_mux_write_32(w, 0x00480000);
+		mp4_mux_write_32(w, 0x00480000);
+		/* reserved */
+		mp4_mux_write_32(w, 0);
+		/* frame_count */
+		mp4_mux_write_16(w, 1);
+		/* compressorname */
+		mp4_mux_write_bytes(w, NULL, 32);
+		/* depth & pre_defined */
+		mp4_mux_write_16(w, 0x0018);
+		mp4_mux_write_16(w, 0xFFFF);
+		if (tk->videoSps) {
+			avcc = mp4_mux_box_start(w,
+				MP4_AVC_DECODER_CONFIG_BOX);
+			/* version, profile, compatibility & level come
+			 * from the SPS */
+			mp4_mux_write_8(w, 1);
+			mp4_mux_write_bytes(w, tk->videoSps + 1, 3);
+			/* 4-byte NAL unit lengths & one SPS */
+			mp4_mux_write_8(w, 0xFF);
+			mp4_mux_write_8(w, 0xE1);
+			mp4_mux_write_16(w, tk->videoSpsSize);
+			mp4_mux_write_bytes(w, tk->videoSps,
+				tk->videoSpsSize);
+			mp4_mux_write_8(w, (tk->videoPps) ? 1 : 0);
+			if (tk->videoPps) {
+				mp4_mux_write_16(w, tk->videoPpsSize);
+				mp4_mux_write_bytes(w, tk->videoPps,
+					tk->videoPpsSize);
+			}
+			mp4_mux_box_end(w, avcc);
+		}
+		mp4_mux_box_end(w, entry);
+		break;
+	case MP4_TRACK_TYPE_METADATA:
+		entry = mp4_mux_box_start(w, MP4_METADATA_SAMPLE_ENTRY);
+		/* reserved & data_reference_index */
+		mp4_mux_write_bytes(w, NULL, 6);
+		mp4_mux_write_16(w, 1);
+		str = (tk->metadataContentEncoding) ?
+			tk->metadataContentEncoding : "";
+		mp4_mux_write_bytes(w, str, strlen(str) + 1);
+		str = (tk->metadataMimeFormat) ? tk->metadataMimeFormat : "";
+		mp4_mux_write_bytes(w, str, strlen(str) + 1);
+		mp4_mux_box_end(w, entry);
+		break;
+	default:
+		break;
+	}
+}
+
+
+static void mp4_mux_write_stbl(
+	struct mp4_mux_writer *w,
+	struct mp4_mux_track *tk)
+{
+	size_t stbl, box;
+	uint32_t i;
+
+	stbl = mp4_mux_box_start(w, MP4_SAMPLE_TABLE_BOX);
+
+	box = mp4_mux_full_box_start(w, MP4_SAMPLE_DESCRIPTION_BOX, 0, 0);
+	mp4_mux_write_32(w, 1);
+	mp4_mux_write_sample_entry(w, tk);
+	mp4_mux_box_end(w, box);
+
+	box = mp4_mux_full_box_start(w, MP4_DECODING_TIME_TO_SAMPLE_BOX,
+		0, 0);
+	mp4_mux_write_32(w, tk->timeToSampleEntryCount);
+	for (i = 0; i < tk->timeToSampleEntryCount; i++) {
+		mp4_mux_write_32(w, tk->timeToSampleEntries[i].sampleCount);
+		mp4_mux_write_32(w, tk->timeToSampleEntries[i].sampleDelta);
+	}
+	mp4_mux_box_end(w, box);
+
+	/* no stss box when all samples are sync samples */
+	if ((tk->type == MP4_TRACK_TYPE_VIDEO) &&
+		(tk->syncSampleEntryCount < tk->sampleCount)) {
+		box = mp4_mux_full_box_start(w, MP4_SYNC_SAMPLE_BOX, 0, 0);
+		mp4_mux_write_32(w, tk->syncSampleEntryCount);
+		for (i = 0; i < tk->syncSampleEntryCount; i++)
+			mp4_mux_write_32(w, tk->syncSampleEntries[i]);
+		mp4_mux_box_end(w, box);
+	}
+
+	box = mp4_mux_full_box_start(w, MP4_SAMPLE_SIZE_BOX, 0, 0);
+	if ((tk->variableSampleSize) || (tk->sampleCount == 0)) {
+		mp4_mux_write_32(w, 0);
+		mp4_mux_write_32(w, tk->sampleCount);
+		for (i = 0; i < tk->sampleCount; i++)
+			mp4_mux_write_32(w, tk->sampleSize[i]);
+	} else {
+		mp4_mux_write_32(w, tk->sampleSize[0]);
+		mp4_mux_write_32(w, tk->sampleCount);
+	}
+	mp4_mux_box_end(w, box);
+
+	box = mp4_mux_full_box_start(w, MP4_SAMPLE_TO_CHUNK_BOX, 0, 0);
+	mp4_mux_write_32(w, tk->sampleToChunkEntryCount);
+	for (i = 0; i < tk->sampleToChunkEntryCount; i++) {
+		mp4_mux_write_32(w, tk->sampleToChunkEntries[i].firstChunk);
+		mp4_mux_write_32(w,
+			tk->sampleToChunkEntries[i].samplesPerChunk);
+		/* sample_description_index */
+		mp4_mux_write_32(w, 1);
+	}
+	mp4_mux_box_end(w, box);
+
+	if ((tk->chunkCount > 0) &&
+		(tk->chunkOffset[tk->chunkCount - 1] > UINT32_MAX)) {
+		box = mp4_mux_full_box_start(w, MP4_CHUNK_OFFSET_64_BOX,
+			0, 0);
+		mp4_mux_write_32(w, tk->chunkCount);
+		for (i = 0; i < tk->chunkCount; i++)
+			mp4_mux_write_64(w, tk->chunkOffset[i]);
+	} else {
+		box = mp4_mux_full_box_start(w, MP4_CHUNK_OFFSET_BOX, 0, 0);
+		mp4_mux_write_32(w, tk->chunkCount);
+		for (i = 0; i < tk->chunkCount; i++)
+			mp4_mux_write_32(w, (uint32_t)tk->chunkOffset[i]);
+	}
+	mp4_mux_box_end(w, box);
+
+	mp4_mux_box_end(w, stbl);
+}
+
+
+static void mp4_mux_write_trak(
+	struct mp4_mux_writer *w,
+	struct mp4_mux_track *tk)
+{
+	size_t trak, mdia, minf, box, child;
+	uint64_t duration = mp4_mux_movie_duration(tk);
+	uint8_t version;
+	const char *name;
+
+	trak = mp4_mux_box_start(w, MP4_TRACK_BOX);
+
+	/* tkhd: enabled & in movie */
+	version = ((tk->creationTime > UINT32_MAX) ||
+		(tk->modificationTime > UINT32_MAX) ||
+		(duration > UINT32_MAX)) ? 1 : 0;
+	box = mp4_mux_full_box_start(w, MP4_TRACK_HEADER_BOX, version, 3);
+	if (version == 1) {
+		mp4_mux_write_64(w, tk->creationTime);
+		mp4_mux_write_64(w, tk->modificationTime);
+		mp4_mux_write_32(w, tk->id);
+		mp4_mux_write_32(w, 0);
+		mp4_mux_write_64(w, duration);
+	} else {
+		mp4_mux_write_32(w, (uint32_t)tk->creationTime);
+		mp4_mux_write_32(w, (uint32_t)tk->modificationTime);
+		mp4_mux_write_32(w, tk->id);
+		mp4_mux_write_32(w, 0);
+		mp4_mux_write_32(w, (uint32_t)duration);
+	}
+	/* reserved, layer, alternate_group, volume & reserved */
+	mp4_mux_write_bytes(w, NULL, 16);
+	mp4_mux_write_matrix(w);
+	mp4_mux_write_32(w, tk->videoWidth << 16);
+	mp4_mux_write_32(w, tk->videoHeight << 16);
+	mp4_mux_box_end(w, box);
+
+	if (tk->referenceTrackId) {
+		box = mp4_mux_box_start(w, MP4_TRACK_REFERENCE_BOX);
+		child = mp4_mux_box_start(w,
+			MP4_REFERENCE_TYPE_DESCRIPTION);
+		mp4_mux_write_32(w, tk->referenceTrackId);
+		mp4_mux_box_end(w, child);
+		mp4_mux_box_end(w, box);
+	}
+
+	mdia = mp4_mux_box_start(w, MP4_MEDIA_BOX);
+
+	version = ((tk->creationTime > UINT32_MAX) ||
+		(tk->modificationTime > UINT32_MAX) ||
+		(tk->duration > UINT32_MAX)) ? 1 : 0;
+	box = mp4_mux_full_box_start(w, MP4_MEDIA_HEADER_BOX, version, 0);
+	if (version == 1) {
+		mp4_mux_write_64(w, tk->creationTime);
+		mp4_mux_write_64(w, tk->modificationTime);
+		mp4_mux_write_32(w, tk->timescale);
+		mp4_mux_write_64(w, tk->duration);
+	} else {
+		mp4_mux_write_32(w, (uint32_t)tk->creationTime);
+		mp4_mux_write_32(w, (uint32_t)tk->modificationTime);
+		mp4_mux_write_32(w, tk->timescale);
+		mp4_mux_write_32(w, (uint32_t)tk->duration);
+	}
+	mp4_mux_write_16(w, MP4_MUX_LANGUAGE_UND);
+	mp4_mux_write_16(w, 0);
+	mp4_mux_box_end(w, box);
+
+	box = mp4_mux_full_box_start(w, MP4_HANDLER_REFERENCE_BOX, 0, 0);
+	mp4_mux_write_32(w, 0);
+	if (tk->type == MP4_TRACK_TYPE_VIDEO) {
+		mp4_mux_write_32(w, MP4_HANDLER_TYPE_VIDEO);
+		name = "VideoHandler";
+	} else {
+		mp4_mux_write_32(w, MP4_HANDLER_TYPE_METADATA);
+		name = "MetadataHandler";
+	}
+	mp4_mux_write_bytes(w, NULL, 12);
+	mp4_mux_write_bytes(w, name, strlen(name) + 1);
+	mp4_mux_box_end(w, box);
+
+	minf = mp4_mux_box_start(w, MP4_MEDIA_INFORMATION_BOX);
+
+	if (tk->type == MP4_TRACK_TYPE_VIDEO) {
+		box = mp4_mux_full_box_start(w, MP4_VIDEO_MEDIA_HEADER_BOX,
+			0, 1);
+		/* graphicsmode & opcolor */
+		mp4_mux_write_bytes(w, NULL, 8);
+	} else {
+		box = mp4_mux_full_box_start(w, MP4_NULL_MEDIA_HEADER_BOX,
+			0, 0);
+	}
+	mp4_mux_box_end(w, box);
+
+	/* a single self-contained data reference */
+	box = mp4_mux_box_start(w, MP4_DATA_INFORMATION_BOX);
+	child = mp4_mux_full_box_start(w, MP4_DATA_REFERENCE_BOX, 0, 0);
+	mp4_mux_write_32(w, 1);
+	mp4_mux_box_end(w, mp4_mux_full_box_start(w,
+		MP4_DATA_ENTRY_URL_BOX, 0, 1));
+	mp4_mux_box_end(w, child);
+	mp4_mux_box_end(w, box);
+
+	mp4_mux_write_stbl(w, tk);
+
+	mp4_mux_box_end(w, minf);
+	mp4_mux_box_end(w, mdia);
+	mp4_mux_box_end(w, trak);
+}
+
+
+static void mp4_mux_write_moov(
+	struct mp4_mux *mux,
+	struct mp4_mux_writer *w)
+{
+	struct mp4_mux_track *tk;
+	uint64_t duration = 0;
+	size_t moov, box;
+	uint8_t version;
+
+	for (tk = mux->track; tk; tk = tk->next) {
+		if (mp4_mux_movie_duration(tk) > duration)
+			duration = mp4_mux_movie_duration(tk);
+	}
+
+	moov = mp4_mux_box_start(w, MP4_MOVIE_BOX);
+
+	version = ((mux->creationTime > UINT32_MAX) ||
+		(mux->modificationTime > UINT32_MAX) ||
+		(duration > UINT32_MAX)) ? 1 : 0;
+	box = mp4_mux_full_box_start(w, MP4_MOVIE_HEADER_BOX, version, 0);
+	if (version == 1) {
+		mp4_mux_write_64(w, mux->creationTime);
+		mp4_mux_write_64(w, mux->modificationTime);
+		mp4_mux_write_32(w, MP4_MUX_MOVIE_TIMESCALE);
+		mp4_mux_write_64(w, duration);
+	} else {
+		mp4_mux_write_32(w, (uint32_t)mux->creationTime);
+		mp4_mux_write_32(w, (uint32_t)mux->modificationTime);
+		mp4_mux_write_32(w, MP4_MUX_MOVIE_TIMESCALE);
+		mp4_mux_write_32(w, (uint32_t)duration);
+	}
+	/* rate & volume */
+	mp4_mux_write_32(w, 0x00010000);
+	mp4_mux_write_16(w, 0x0100);
+	/* reserved */
+	mp4_mux_write_bytes(w, NULL, 10);
+	mp4_mux_write_matrix(w);
+	/* pre_defined */
+	mp4_mux_write_bytes(w, NULL, 24);
+	/* next_track_ID */
+	mp4_mux_write_32(w, mux->trackCount + 1);
+	mp4_mux_box_end(w, box);
+
+	for (tk = mux->track; tk; tk = tk->next)
+		mp4_mux_write_trak(w, tk);
+
+	mp4_mux_box_end(w, moov);
+}
+
+
+/* Write the moov box in the reserved area if it fits, leaving a free
+ * box for the rest, or after the samples otherwise; the chunk offsets
+ * do not depend on the placement so the data is never moved */
+static int mp4_mux_finalize(
+	struct mp4_mux *mux)
+{
+	struct mp4_mux_writer w = { NULL, 0 };
+	struct mp4_mux_track *tk;
+	uint8_t hdr[8];
+	off_t offset;
+	int ret;
+
+	for (tk = mux->track; tk; tk = tk->next) {
+		ret = mp4_mux_track_finalize(tk);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = mp4_mux_flush(mux);
+	if (ret < 0)
+		return ret;
+
+	/* mdat largesize */
+	uint64_t mdatSize = mux->offset - mux->mdatOffset;
+	w.buf = hdr;
+	mp4_mux_write_64(&w, mdatSize);
+	ret = mp4_mux_pwrite(mux, mux->mdatOffset + 8, hdr, 8);
+	if (ret < 0)
+		return ret;
+
+	w.buf = NULL;
+	w.pos = 0;
+	mp4_mux_write_moov(mux, &w);
+	size_t moovSize = w.pos;
+	w.buf = malloc(moovSize);
+	MP4_RETURN_ERR_IF_FAILED((w.buf != NULL), -ENOMEM);
+	w.pos = 0;
+	mp4_mux_write_moov(mux, &w);
+
+	size_t reserve = mux->config.moov_reserve_size;
+	if ((reserve > 0) && ((moovSize == reserve) ||
+		(moovSize + 8 <= reserve))) {
+		offset = mux->moovReserveOffset;
+	} else {
+		if (reserve > 0) {
+			MP4_LOGW("moov box (%zu bytes) larger than the "
+				"reserved %zu bytes, written at the end",
+				moovSize, reserve);
+		}
+		offset = mux->offset;
+	}
+
+	ret = mp4_mux_pwrite(mux, offset, w.buf, moovSize);
+	free(w.buf);
+	if (ret < 0)
+		return ret;
+
+	if ((offset == mux->moovReserveOffset) && (moovSize < reserve)) {
+		/* the remaining bytes are already zeroed */
+		w.buf = hdr;
+		w.pos = 0;
+		mp4_mux_write_32(&w, (uint32_t)(reserve - moovSize));
+		mp4_mux_write_32(&w, MP4_FREE_BOX);
+		ret = mp4_mux_pwrite(mux, offset + moovSize, hdr, 8);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+
+static int mp4_mux_write_header(
+	struct mp4_mux *mux)
+{
+	uint8_t hdr[32];
+	struct mp4_mux_writer w = { hdr, 0 };
+	size_t box;
+	int ret;
+
+	box = mp4_mux_box_start(&w, MP4_FILE_TYPE_BOX);
+	mp4_mux_write_32(&w, MP4_BRAND_ISOM);
+	mp4_mux_write_32(&w, 0x200);
+	mp4_mux_write_32(&w, MP4_BRAND_ISOM);
+	mp4_mux_write_32(&w, MP4_BRAND_ISO2);
+	mp4_mux_write_32(&w, MP4_BRAND_AVC1);
+	mp4_mux_write_32(&w, MP4_BRAND_MP41);
+	mp4_mux_box_end(&w, box);
+	ret = mp4_mux_write(mux, hdr, w.pos);
+	if (ret < 0)
+		return ret;
+
+	size_t reserve = mux->config.moov_reserve_size;
+	mux->moovReserveOffset = mux->offset;
+	if (reserve > 0) {
+		/* free box covering the area, zero-filled */
+		w.pos = 0;
+		mp4_mux_write_32(&w, (uint32_t)reserve);
+		mp4_mux_write_32(&w, MP4_FREE_BOX);
+		ret = mp4_mux_write(mux, hdr, w.pos);
+		if (ret == 0)
+			ret = mp4_mux_write_zeros(mux, reserve - w.pos);
+		if (ret < 0)
+			return ret;
+	}
+
+	/* mdat with a 64-bit size, patched on close */
+	mux->mdatOffset = mux->offset;
+	w.pos = 0;
+	mp4_mux_write_32(&w, 1);
+	mp4_mux_write_32(&w, MP4_MEDIA_DATA_BOX);
+	mp4_mux_write_64(&w, 0);
+	return mp4_mux_write(mux, hdr, w.pos);
+}
+
+
+static void mp4_mux_free_tracks(
+	struct mp4_mux *mux)
+{
+	struct mp4_mux_track *tk, *next;
+
+	for (tk = mux->track; tk; tk = next) {
+		next = tk->next;
+		free(tk->videoSps);
+		free(tk->videoPps);
+		free(tk->metadataContentEncoding);
+		free(tk->metadataMimeFormat);
+		free(tk->timeToSampleEntries);
+		free(tk->sampleSize);
+		free(tk->syncSampleEntries);
+		free(tk->sampleToChunkEntries);
+		free(tk->chunkOffset);
+		free(tk);
+	}
+	mux->track = NULL;
+}
+
+
+struct mp4_mux *mp4_mux_open(
+	const char *filename,
+	const struct mp4_mux_config *config)
+{
+	struct mp4_mux *mux;
+	int ret;
+
+	MP4_RETURN_VAL_IF_FAILED((filename != NULL), -EINVAL, NULL);
+	MP4_LOG_ERR_AND_RETURN_VAL_IF_FAILED(((config == NULL) ||
+		(config->moov_reserve_size == 0) ||
+		((config->moov_reserve_size >= 8) &&
+		(config->moov_reserve_size <= UINT32_MAX))), -EINVAL, NULL,
+		"invalid moov reserve size");
+
+	mux = calloc(1, sizeof(*mux));
+	MP4_RETURN_VAL_IF_FAILED((mux != NULL), -ENOMEM, NULL);
+	if (config)
+		mux->config = *config;
+	mux->creationTime = mp4_mux_mac_time(mux->config.creation_time);
+	mux->modificationTime =
+		mp4_mux_mac_time(mux->config.modification_time);
+
+	mux->bufferSize = (mux->config.write_buffer_size > 0) ?
+		mux->config.write_buffer_size : MP4_MUX_WRITE_BUFFER_SIZE;
+	mux->buffer = malloc(mux->bufferSize);
+	if (mux->buffer == NULL) {
+		ret = -ENOMEM;
+		MP4_LOGE("allocation failed");
+		goto error;
+	}
+
+	mux->file = fopen(filename, "wb");
+	if (mux->file == NULL) {
+		ret = -errno;
+		MP4_LOGE("failed to open file '%s'", filename);
+		goto error;
+	}
+	/* the samples are already buffered */
+	setvbuf(mux->file, NULL, _IONBF, 0);
+
+	ret = mp4_mux_write_header(mux);
+	if (ret < 0)
+		goto error;
+
+	return mux;
+
+error:
+	if (mux->file)
+		fclose(mux->file);
+	free(mux->buffer);
+	free(mux);
+	return NULL;
+}
+
+
+int mp4_mux_close(
+	struct mp4_mux *mux)
+{
+	int ret;
+
+	MP4_RETURN_ERR_IF_FAILED(mux != NULL, -EINVAL);
+
+	ret = mp4_mux_finalize(mux);
+	if (ret < 0)
+		MP4_LOGE("failed to finalize the file (%d)", ret);
+	if ((fclose(mux->file) != 0) && (ret == 0))
+		ret = -EIO;
+
+	mp4_mux_free_tracks(mux);
+	free(mux->buffer);
+	free(mux);
+
+	return ret;
+}
+
+
+int mp4_mux_add_track(
+	struct mp4_mux *mux,
+	const struct mp4_track_info *track_info,
+	uint32_t timescale)
+{
+	struct mp4_mux_track *tk, *metatk;
+	int ret;
+
+	MP4_RETURN_ERR_IF_FAILED(mux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(track_info != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(timescale > 0, -EINVAL);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		((track_info->type == MP4_TRACK_TYPE_VIDEO) ||
+		(track_info->type == MP4_TRACK_TYPE_METADATA)), -EOPNOTSUPP,
+		"only video and metadata tracks are supported");
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(
+		((track_info->type != MP4_TRACK_TYPE_VIDEO) ||
+		(track_info->video_codec == MP4_VIDEO_CODEC_AVC)),
+		-EOPNOTSUPP, "only AVC video is supported");
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((mux->lastTrack == NULL),
+		-EBUSY, "tracks must be added before the first sample");
+
+	tk = mp4_mux_new_track(mux, track_info->type, timescale,
+		track_info);
+	MP4_RETURN_ERR_IF_FAILED((tk != NULL), -ENOMEM);
+
+	if (tk->type == MP4_TRACK_TYPE_METADATA) {
+		ret = mp4_mux_track_set_strings(tk,
+			track_info->metadata_content_encoding,
+			track_info->metadata_mime_format);
+		if (ret < 0)
+			return ret;
+		return tk->id;
+	}
+
+	tk->videoWidth = track_info->video_width;
+	tk->videoHeight = track_info->video_height;
+
+	if (track_info->has_metadata) {
+		/* linked metadata track, as reported by the demuxer */
+		metatk = mp4_mux_new_track(mux, MP4_TRACK_TYPE_METADATA,
+			timescale, track_info);
+		MP4_RETURN_ERR_IF_FAILED((metatk != NULL), -ENOMEM);
+		ret = mp4_mux_track_set_strings(metatk,
+			track_info->metadata_content_encoding,
+			track_info->metadata_mime_format);
+		if (ret < 0)
+			return ret;
+		metatk->referenceTrackId = tk->id;
+		metatk->ref = tk;
+		tk->metadata = metatk;
+	}
+
+	return tk->id;
+}
+
+
+int mp4_mux_set_track_avc_decoder_config(
+	struct mp4_mux *mux,
+	unsigned int track_id,
+	const uint8_t *sps,
+	unsigned int sps_size,
+	const uint8_t *pps,
+	unsigned int pps_size)
+{
+	struct mp4_mux_track *tk;
+
+	MP4_RETURN_ERR_IF_FAILED(mux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(sps != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(pps != NULL, -EINVAL);
+	/* the NAL unit header, profile, compatibility and level */
+	MP4_RETURN_ERR_IF_FAILED((sps_size >= 4) && (sps_size <= 0xFFFF),
+		-EINVAL);
+	MP4_RETURN_ERR_IF_FAILED((pps_size > 0) && (pps_size <= 0xFFFF),
+		-EINVAL);
+
+	tk = mp4_mux_find_track(mux, track_id);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk != NULL), -ENOENT,
+		"track not found");
+	MP4_RETURN_ERR_IF_FAILED((tk->type == MP4_TRACK_TYPE_VIDEO),
+		-EINVAL);
+
+	uint8_t *newSps = malloc(sps_size);
+	uint8_t *newPps = malloc(pps_size);
+	if ((newSps == NULL) || (newPps == NULL)) {
+		free(newSps);
+		free(newPps);
+		MP4_RETURN_ERR_IF_FAILED(0, -ENOMEM);
+	}
+	memcpy(newSps, sps, sps_size);
+	memcpy(newPps, pps, pps_size);
+	free(tk->videoSps);
+	free(tk->videoPps);
+	tk->videoSps = newSps;
+	tk->videoSpsSize = sps_size;
+	tk->videoPps = newPps;
+	tk->videoPpsSize = pps_size;
+
+	return 0;
+}
+
+
+int mp4_mux_write_track_sample(
+	struct mp4_mux *mux,
+	unsigned int track_id,
+	const struct mp4_mux_sample *sample)
+{
+	struct mp4_mux_track *tk;
+	int ret;
+
+	MP4_RETURN_ERR_IF_FAILED(mux != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(sample != NULL, -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(((sample->sample_data != NULL) ||
+		(sample->sample_size == 0)), -EINVAL);
+	MP4_RETURN_ERR_IF_FAILED(((sample->metadata_data != NULL) ||
+		(sample->metadata_size == 0)), -EINVAL);
+
+	tk = mp4_mux_find_track(mux, track_id);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk != NULL), -ENOENT,
+		"track not found");
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk->ref == NULL), -EINVAL,
+		"linked metadata is written with the samples of track %d",
+		tk->referenceTrackId);
+
+	ret = mp4_mux_track_write_sample(mux, tk, sample->sample_data,
+		sample->sample_size, sample->sample_dts, sample->sync);
+	if (ret < 0)
+		return ret;
+
+	/* one metadata sample per sample, possibly empty, so that the
+	 * sample indexes of both tracks match */
+	if (tk->metadata) {
+		ret = mp4_mux_track_write_sample(mux, tk->metadata,
+			sample->metadata_data, sample->metadata_size,
+			sample->sample_dts, 1);
+	}
+
+	return ret;
+}
+
+
+off_t mp4_mux_get_offset(
+	struct mp4_mux *mux)
+{
+	return mux->offset;
+}
+
+
+int mp4_mux_write_raw(
+	struct mp4_mux *mux,
+	const void *data,
+	size_t size)
+{
+	return mp4_mux_write(mux, data, size);
+}
+
+
+int mp4_mux_copy_fd_range(
+	struct mp4_mux *mux,
+	int fd,
+	off_t offset,
+	uint64_t size)
+{
+#ifdef _WIN32
+	return -ENOSYS;
+#else /* !_WIN32 */
+	int ret = mp4_mux_flush(mux);
+	if (ret < 0)
+		return ret;
+
+#ifdef MP4_MUX_HAVE_COPY_FILE_RANGE
+	/* in-kernel copy, falling back to buffered copies when the file
+	 * systems do not support it */
+	int outFd = fileno(mux->file);
+	int copied = 0;
+	while (size > 0) {
+		loff_t inOffset = offset;
+		ssize_t n = copy_file_range(fd, &inOffset, outFd, NULL,
+			(size > MP4_MUX_COPY_CHUNK_SIZE) ?
+			MP4_MUX_COPY_CHUNK_SIZE : (size_t)size, 0);
+		if ((n < 0) && (errno == EINTR))
+			continue;
+		if ((n < 0) && ((errno == EXDEV) || (errno == ENOSYS) ||
+			(errno == EINVAL) || (errno == EOPNOTSUPP)))
+			break;
+		if (n <= 0) {
+			mux->error = (n < 0) ? -errno : -EIO;
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, mux->error,
+				"copy_file_range failed");
+		}
+		offset += n;
+		size -= n;
+		mux->offset += n;
+		copied = 1;
+	}
+	/* the stream position moved behind stdio */
+	if ((copied) && (fseeko(mux->file, mux->offset, SEEK_SET) != 0)) {
+		mux->error = -errno;
+		return mux->error;
+	}
+#endif /* MP4_MUX_HAVE_COPY_FILE_RANGE */
+
+	while (size > 0) {
+		if (mux->bufferUsed == mux->bufferSize) {
+			ret = mp4_mux_flush(mux);
+			if (ret < 0)
+				return ret;
+		}
+		size_t n = mux->bufferSize - mux->bufferUsed;
+		if (n > size)
+			n = size;
+		ssize_t r = pread(fd, mux->buffer + mux->bufferUsed, n,
+			offset);
+		if ((r < 0) && (errno == EINTR))
+			continue;
+		if (r <= 0) {
+			ret = (r < 0) ? -errno : -EIO;
+			MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED(0, ret,
+				"failed to read %zu bytes", n);
+		}
+		mux->bufferUsed += r;
+		mux->offset += r;
+		offset += r;
+		size -= r;
+	}
+
+	return 0;
+#endif /* !_WIN32 */
+}
+
+
+int mp4_mux_add_track_sample_at(
+	struct mp4_mux *mux,
+	unsigned int track_id,
+	uint64_t offset,
+	uint32_t size,
+	uint64_t dts,
+	int sync)
+{
+	struct mp4_mux_track *tk = mp4_mux_find_track(mux, track_id);
+	MP4_LOG_ERR_AND_RETURN_ERR_IF_FAILED((tk != NULL), -ENOENT,
+		"track not found");
+
+	return mp4_mux_track_add_sample(mux, tk, offset, size, dts, sync);
+}
@@ -0,0 +1,133 @@
+/**
+ * @file mp4_priv.h
+ * @brief MP4 file library - private definitions
+ * @date 14/10/2026
+ * @author aurelien.barre@akaaba.net
+ *
+ * Copyright (c) 2026 Aurelien Barre <aurelien.barre@akaaba.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *   * Neither the name of the copyright holder nor the names of the
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MP4_PRIV_H_
+#define _MP4_PRIV_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MP4_UUID                            0x75756964 /* "uuid" */
+#define MP4_FILE_TYPE_BOX                   0x66747970 /* "ftyp" */
+#define MP4_MOVIE_BOX                       0x6d6f6f76 /* "moov" */
+#define MP4_USER_DATA_BOX                   0x75647461 /* "udta" */
+#define MP4_MOVIE_HEADER_BOX                0x6d766864 /* "mvhd" */
+#define MP4_TRACK_BOX                       0x7472616b /* "trak" */
+#define MP4_TRACK_HEADER_BOX                0x746b6864 /* "tkhd" */
+#define MP4_TRACK_REFERENCE_BOX             0x74726566 /* "tref" */
+#define MP4_MEDIA_BOX                       0x6d646961 /* "mdia" */
+#define MP4_MEDIA_HEADER_BOX                0x6d646864 /* "mdhd" */
+#define MP4_HANDLER_REFERENCE_BOX           0x68646c72 /* "hdlr" */
+#define MP4_MEDIA_INFORMATION_BOX           0x6d696e66 /* "minf" */
+#define MP4_VIDEO_MEDIA_HEADER_BOX          0x766d6864 /* "vmhd" */
+#define MP4_SOUND_MEDIA_HEADER_BOX          0x736d6864 /* "smhd" */
+#define MP4_HINT_MEDIA_HEADER_BOX           0x686d6864 /* "hmhd" */
+#define MP4_NULL_MEDIA_HEADER_BOX           0x6e6d6864 /* "nmhd" */
+#define MP4_DATA_INFORMATION_BOX            0x64696e66 /* "dinf" */
+#define MP4_DATA_REFERENCE_BOX              0x64696566 /* "dref" */ /*TODO*/
+#define MP4_SAMPLE_TABLE_BOX                0x7374626c /* "stbl" */
+#define MP4_SAMPLE_DESCRIPTION_BOX          0x73747364 /* "stsd" */
+#define MP4_AVC_DECODER_CONFIG_BOX          0x61766343 /* "avcC" */
+#define MP4_DECODING_TIME_TO_SAMPLE_BOX     0x73747473 /* "stts" */
+#define MP4_SYNC_SAMPLE_BOX                 0x73747373 /* "stss" */
+#define MP4_SAMPLE_SIZE_BOX                 0x7374737a /* "stsz" */
+#define MP4_SAMPLE_TO_CHUNK_BOX             0x73747363 /* "stsc" */
+#define MP4_CHUNK_OFFSET_BOX                0x7374636f /* "stco" */
+#define MP4_CHUNK_OFFSET_64_BOX             0x636f3634 /* "co64" */
+#define MP4_META_BOX                        0x6d657461 /* "meta" */
+#define MP4_KEYS_BOX                        0x6b657973 /* "keys" */
+#define MP4_ILST_BOX                        0x696c7374 /* "ilst" */
+#define MP4_DATA_BOX                        0x64617461 /* "data" */
+#define MP4_LOCATION_BOX                    0xa978797a /* ".xyz" */
+#define MP4_MEDIA_DATA_BOX                  0x6d646174 /* "mdat" */
+#define MP4_MOVIE_EXTENDS_BOX               0x6d766578 /* "mvex" */
+#define MP4_MOVIE_EXTENDS_HEADER_BOX        0x6d656864 /* "mehd" */
+#define MP4_TRACK_EXTENDS_BOX               0x74726578 /* "trex" */
+#define MP4_MOVIE_FRAGMENT_BOX              0x6d6f6f66 /* "moof" */
+#define MP4_MOVIE_FRAGMENT_HEADER_BOX       0x6d666864 /* "mfhd" */
+#define MP4_TRACK_FRAGMENT_BOX              0x74726166 /* "traf" */
+#define MP4_TRACK_FRAGMENT_HEADER_BOX       0x74666864 /* "tfhd" */
+#define MP4_TRACK_FRAGMENT_DECODE_TIME_BOX  0x74666474 /* "tfdt" */
+#define MP4_TRACK_FRAGMENT_RUN_BOX          0x7472756e /* "trun" */
+
+#define MP4_HANDLER_TYPE_VIDEO              0x76696465 /* "vide" */
+#define MP4_HANDLER_TYPE_AUDIO              0x736f756e /* "soun" */
+#define MP4_HANDLER_TYPE_HINT               0x68696e74 /* "hint" */
+#define MP4_HANDLER_TYPE_METADATA           0x6d657461 /* "meta" */
+#define MP4_HANDLER_TYPE_TEXT               0x74657874 /* "text" */
+
+#define MP4_REFERENCE_TYPE_HINT             0x68696e74 /* "hint" */
+#define MP4_REFERENCE_TYPE_DESCRIPTION      0x63647363 /* "cdsc" */
+#define MP4_REFERENCE_TYPE_HINT_USED        0x68696e64 /* "hind" */
+#define MP4_REFERENCE_TYPE_CHAPTERS         0x63686170 /* "chap" */
+
+#define MP4_MAC_TO_UNIX_EPOCH_OFFSET (0x7c25b080UL)
+
+
+struct mp4_mux;
+
+
+/* Muxer internals used by mp4_demux_cut(): the samples are declared
+ * at their final offset and their payloads copied as byte ranges */
+off_t mp4_mux_get_offset(
+	struct mp4_mux *mux);
+
+
+int mp4_mux_write_raw(
+	struct mp4_mux *mux,
+	const void *data,
+	size_t size);
+
+
+int mp4_mux_copy_fd_range(
+	struct mp4_mux *mux,
+	int fd,
+	off_t offset,
+	uint64_t size);
+
+
+/* 'dts' is in the track timescale */
+int mp4_mux_add_track_sample_at(
+	struct mp4_mux *mux,
+	unsigned int track_id,
+	uint64_t offset,
+	uint32_t size,
+	uint64_t dts,
+	int sync);
+
+#endif /* !_MP4_PRIV_H_ */
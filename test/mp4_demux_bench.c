@@ -0,0 +1,856 @@
+/**
+ * @file mp4_demux_bench.c
+ * @brief MP4 file library - demuxer benchmark program
+ * @date 14/10/2026
+ * @author aurelien.barre@akaaba.net
+ *
+ * Copyright (c) 2026 Aurelien Barre <aurelien.barre@akaaba.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *   * Neither the name of the copyright holder nor the names of the
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <libmp4.h>
+
+
+#define BENCH_DEFAULT_FILE          "/tmp/mp4_demux_bench.mp4"
+#define BENCH_DEFAULT_SAMPLES       (54000)
+#define BENCH_DEFAULT_SAMPLE_SIZE   (8192)
+#define BENCH_DEFAULT_GOP           (30)
+#define BENCH_DEFAULT_COVER_SIZE    (65536)
+#define BENCH_DEFAULT_ITERATIONS    (20)
+#define BENCH_DEFAULT_SEEKS         (2000)
+#define BENCH_METADATA_SIZE         (64)
+#define BENCH_FRAME_DURATION        (33333)
+#define BENCH_INPUT_BUFFER_SIZE     (16 * 1024 * 1024)
+
+
+struct bench_config {
+	const char *filename;
+	const char *input;
+	unsigned int sampleCount;
+	unsigned int trackCount;
+	unsigned int chunkSamples;
+	unsigned int sampleSize;
+	unsigned int gop;
+	unsigned int coverSize;
+	int metadata;
+	int moovFirst;
+	int keep;
+	unsigned int iterations;
+	unsigned int seekCount;
+	uint64_t seed;
+	uint32_t flags;
+};
+
+
+/* xorshift64*, seeded from the command line so that the generated
+ * sample sizes and the seek positions are reproducible */
+static uint64_t bench_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 2685821657736338717ULL;
+}
+
+
+static uint64_t bench_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+/* current and peak resident set size in KiB */
+static void bench_rss(long *current, long *peak)
+{
+	struct rusage usage;
+	long pages = 0, rss = 0;
+	FILE *f;
+
+	*current = 0;
+	*peak = 0;
+	f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%ld %ld", &pages, &rss) == 2)
+			*current = rss * (sysconf(_SC_PAGESIZE) / 1024);
+		fclose(f);
+	}
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+		*peak = usage.ru_maxrss;
+}
+
+
+static void bench_print_rss(void)
+{
+	long current, peak;
+
+	bench_rss(&current, &peak);
+	printf("    RSS: %ld KiB (peak %ld KiB)\n", current, peak);
+}
+
+
+static uint32_t bench_sample_size(
+	const struct bench_config *cfg,
+	uint64_t *state)
+{
+	/* sizes spread over [size / 2, size * 3 / 2] so that the stsz box
+	 * is not a constant size table */
+	if (cfg->sampleSize < 2)
+		return cfg->sampleSize;
+	return cfg->sampleSize / 2 +
+		(uint32_t)(bench_rand(state) % (cfg->sampleSize + 1));
+}
+
+
+static void bench_put_32(uint8_t *p, uint32_t val)
+{
+	p[0] = (val >> 24) & 0xFF;
+	p[1] = (val >> 16) & 0xFF;
+	p[2] = (val >> 8) & 0xFF;
+	p[3] = val & 0xFF;
+}
+
+
+static size_t bench_put_item(
+	uint8_t *p,
+	uint32_t type,
+	uint32_t clazz,
+	const uint8_t *value,
+	size_t len)
+{
+	if (p) {
+		bench_put_32(p, (uint32_t)(24 + len));
+		bench_put_32(p + 4, type);
+		bench_put_32(p + 8, (uint32_t)(16 + len));
+		bench_put_32(p + 12, 0x64617461); /* "data" */
+		bench_put_32(p + 16, clazz);
+		bench_put_32(p + 20, 0);
+		memcpy(p + 24, value, len);
+	}
+	return 24 + len;
+}
+
+
+/* Build the udta box with title, artist and comment strings and a
+ * cover; returns its size, only computed if p is NULL */
+static size_t bench_build_udta(
+	uint8_t *p,
+	const struct bench_config *cfg,
+	const uint8_t *cover)
+{
+	static const char title[] = "mp4_demux_bench";
+	static const char artist[] = "libmp4";
+	static const char comment[] = "synthetic benchmark file";
+	size_t ilst = 8, off;
+
+	ilst += bench_put_item(NULL, 0xA96E616D, 1, NULL, strlen(title));
+	ilst += bench_put_item(NULL, 0xA9415254, 1, NULL, strlen(artist));
+	ilst += bench_put_item(NULL, 0xA9636D74, 1, NULL, strlen(comment));
+	if (cfg->coverSize > 0)
+		ilst += bench_put_item(NULL, 0x636F7672, 13, NULL,
+			cfg->coverSize);
+	if (p == NULL)
+		return 8 + 12 + 33 + ilst;
+
+	/* udta */
+	bench_put_32(p, (uint32_t)(8 + 12 + 33 + ilst));
+	bench_put_32(p + 4, 0x75647461);
+	/* meta, version & flags */
+	bench_put_32(p + 8, (uint32_t)(12 + 33 + ilst));
+	bench_put_32(p + 12, 0x6D657461);
+	bench_put_32(p + 16, 0);
+	/* hdlr: version & flags, pre_defined, 'mdir', reserved, name */
+	memset(p + 20, 0, 33);
+	bench_put_32(p + 20, 33);
+	bench_put_32(p + 24, 0x68646C72);
+	bench_put_32(p + 36, 0x6D646972);
+	/* ilst */
+	off = 20 + 33;
+	bench_put_32(p + off, (uint32_t)ilst);
+	bench_put_32(p + off + 4, 0x696C7374);
+	off += 8;
+	off += bench_put_item(p + off, 0xA96E616D, 1,
+		(const uint8_t *)title, strlen(title));
+	off += bench_put_item(p + off, 0xA9415254, 1,
+		(const uint8_t *)artist, strlen(artist));
+	off += bench_put_item(p + off, 0xA9636D74, 1,
+		(const uint8_t *)comment, strlen(comment));
+	if (cfg->coverSize > 0)
+		off += bench_put_item(p + off, 0x636F7672, 13,
+			cover, cfg->coverSize);
+	return off;
+}
+
+
+static int bench_read_box(FILE *f, uint64_t offset, uint64_t *size,
+	uint32_t *type)
+{
+	uint8_t hdr[16];
+
+	if ((fseeko(f, (off_t)offset, SEEK_SET) != 0) ||
+		(fread(hdr, 1, 8, f) != 8))
+		return -EIO;
+	*size = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) |
+		((uint32_t)hdr[2] << 8) | hdr[3];
+	*type = ((uint32_t)hdr[4] << 24) | ((uint32_t)hdr[5] << 16) |
+		((uint32_t)hdr[6] << 8) | hdr[7];
+	if (*size == 1) {
+		if (fread(hdr + 8, 1, 8, f) != 8)
+			return -EIO;
+		*size = 0;
+		for (int i = 8; i < 16; i++)
+			*size = (*size << 8) | hdr[i];
+	}
+	return (*size >= 8) ? 0 : -EINVAL;
+}
+
+
+/* The muxer does not write user data: append the udta box to the moov
+ * box, either at the end of the file or in the free box left after a
+ * moov box written in the reserved area */
+static int bench_add_udta(const struct bench_config *cfg)
+{
+	uint64_t offset = 0, size, moovOffset = 0, moovSize = 0;
+	uint64_t fileSize;
+	uint32_t type;
+	uint8_t *udta, *cover, hdr[8];
+	size_t udtaSize;
+	int ret = 0;
+	FILE *f;
+
+	f = fopen(cfg->filename, "r+b");
+	if (f == NULL)
+		return -errno;
+	fseeko(f, 0, SEEK_END);
+	fileSize = (uint64_t)ftello(f);
+
+	while (offset < fileSize) {
+		ret = bench_read_box(f, offset, &size, &type);
+		if (ret < 0)
+			goto out;
+		if (type == 0x6D6F6F76) {
+			moovOffset = offset;
+			moovSize = size;
+			break;
+		}
+		offset += size;
+	}
+	if (moovSize == 0) {
+		ret = -ENOENT;
+		goto out;
+	}
+
+	udtaSize = bench_build_udta(NULL, cfg, NULL);
+	udta = malloc(udtaSize);
+	cover = malloc(cfg->coverSize + 1);
+	if ((udta == NULL) || (cover == NULL)) {
+		free(udta);
+		free(cover);
+		ret = -ENOMEM;
+		goto out;
+	}
+	/* JPEG start of image, then filler */
+	memset(cover, 0x55, cfg->coverSize + 1);
+	if (cfg->coverSize >= 2) {
+		cover[0] = 0xFF;
+		cover[1] = 0xD8;
+	}
+	bench_build_udta(udta, cfg, cover);
+
+	offset = moovOffset + moovSize;
+	if (offset < fileSize) {
+		ret = bench_read_box(f, offset, &size, &type);
+		if ((ret == 0) && ((type != 0x66726565) ||
+			((size != udtaSize) && (size < udtaSize + 8))))
+			ret = -ENOSPC;
+		if (ret == 0 && size > udtaSize) {
+			/* shrink the free box */
+			bench_put_32(hdr, (uint32_t)(size - udtaSize));
+			bench_put_32(hdr + 4, 0x66726565);
+			if ((fseeko(f, (off_t)(offset + udtaSize),
+				SEEK_SET) != 0) ||
+				(fwrite(hdr, 1, 8, f) != 8))
+				ret = -EIO;
+		}
+	}
+	if ((ret == 0) && ((fseeko(f, (off_t)offset, SEEK_SET) != 0) ||
+		(fwrite(udta, 1, udtaSize, f) != udtaSize)))
+		ret = -EIO;
+	bench_put_32(hdr, (uint32_t)(moovSize + udtaSize));
+	if ((ret == 0) && ((fseeko(f, (off_t)moovOffset, SEEK_SET) != 0) ||
+		(fwrite(hdr, 1, 4, f) != 4)))
+		ret = -EIO;
+	free(udta);
+	free(cover);
+
+out:
+	if (fclose(f) != 0 && ret == 0)
+		ret = -EIO;
+	return ret;
+}
+
+
+static int bench_generate(const struct bench_config *cfg)
+{
+	static const uint8_t sps[] = {
+		0x67, 0x64, 0x00, 0x28, 0xac, 0xd9, 0x40, 0x78,
+		0x02, 0x27, 0xe5, 0x84, 0x00, 0x00, 0x03, 0x00,
+		0x04, 0x00, 0x00, 0x03, 0x00, 0xf0, 0x3c, 0x60,
+		0xc6, 0x58,
+	};
+	static const uint8_t pps[] = {0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0};
+	struct mp4_mux_config config;
+	struct mp4_track_info info;
+	struct mp4_mux_sample sample;
+	struct mp4_mux *mux;
+	unsigned int *ids = NULL, first, i, t, n;
+	uint8_t *data = NULL, meta[BENCH_METADATA_SIZE];
+	uint64_t state = cfg->seed;
+	uint64_t startTime, endTime;
+	int ret = 0;
+
+	startTime = bench_time_ns();
+	memset(&config, 0, sizeof(config));
+	config.creation_time = 1700000000;
+	config.modification_time = 1700000000;
+	if (cfg->moovFirst) {
+		/* worst case of one chunk per sample and no run-length
+		 * compression of the decoding times: 4 bytes of stsz, 8 of
+		 * co64 and 8 of stts per sample, with room for the udta
+		 * box */
+		uint64_t tracks = cfg->trackCount * (cfg->metadata ? 2 : 1);
+		uint64_t reserve = tracks * (2048 + 20 *
+			(uint64_t)cfg->sampleCount +
+			4 * (cfg->sampleCount / cfg->gop + 1));
+		reserve += bench_build_udta(NULL, cfg, NULL) + 4096;
+		if (reserve > UINT32_MAX) {
+			fprintf(stderr, "moov box too large to reserve\n");
+			return -EINVAL;
+		}
+		config.moov_reserve_size = (size_t)reserve;
+	}
+
+	mux = mp4_mux_open(cfg->filename, &config);
+	if (mux == NULL) {
+		fprintf(stderr, "mp4_mux_open() failed\n");
+		return -EIO;
+	}
+
+	ids = calloc(cfg->trackCount, sizeof(*ids));
+	data = malloc(cfg->sampleSize + cfg->sampleSize / 2 + 1);
+	if ((ids == NULL) || (data == NULL)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < cfg->sampleSize + cfg->sampleSize / 2 + 1; i++)
+		data[i] = (uint8_t)bench_rand(&state);
+	memset(meta, 0xA5, sizeof(meta));
+
+	for (t = 0; t < cfg->trackCount; t++) {
+		memset(&info, 0, sizeof(info));
+		info.type = MP4_TRACK_TYPE_VIDEO;
+		info.video_codec = MP4_VIDEO_CODEC_AVC;
+		info.video_width = 1920;
+		info.video_height = 1080;
+		info.has_metadata = cfg->metadata;
+		info.metadata_content_encoding = "";
+		info.metadata_mime_format = "application/octet-stream";
+		ret = mp4_mux_add_track(mux, &info, 90000);
+		if (ret < 0)
+			goto out;
+		ids[t] = (unsigned int)ret;
+		ret = mp4_mux_set_track_avc_decoder_config(mux, ids[t],
+			sps, sizeof(sps), pps, sizeof(pps));
+		if (ret < 0)
+			goto out;
+	}
+
+	/* chunkSamples consecutive samples of each track in turn */
+	for (first = 0; first < cfg->sampleCount; first += n) {
+		n = cfg->sampleCount - first;
+		if (n > cfg->chunkSamples)
+			n = cfg->chunkSamples;
+		for (t = 0; t < cfg->trackCount; t++) {
+			for (i = first; i < first + n; i++) {
+				memset(&sample, 0, sizeof(sample));
+				sample.sample_data = data;
+				sample.sample_size =
+					bench_sample_size(cfg, &state);
+				sample.metadata_data = meta;
+				sample.metadata_size = sizeof(meta);
+				sample.sample_dts =
+					(uint64_t)i * BENCH_FRAME_DURATION;
+				sample.sync = ((i % cfg->gop) == 0);
+				ret = mp4_mux_write_track_sample(mux, ids[t],
+					&sample);
+				if (ret < 0)
+					goto out;
+			}
+		}
+	}
+
+out:
+	free(ids);
+	free(data);
+	if (mp4_mux_close(mux) < 0 && ret == 0)
+		ret = -EIO;
+	if (ret < 0) {
+		fprintf(stderr, "failed to write '%s': %s\n",
+			cfg->filename, strerror(-ret));
+		return ret;
+	}
+	ret = bench_add_udta(cfg);
+	if (ret < 0) {
+		fprintf(stderr, "failed to add the user data: %s\n",
+			strerror(-ret));
+		return ret;
+	}
+	endTime = bench_time_ns();
+	printf("generated '%s' in %.2fms\n", cfg->filename,
+		(double)(endTime - startTime) / 1000000.);
+	return 0;
+}
+
+
+static struct mp4_demux *bench_open(
+	const struct bench_config *cfg,
+	const char *filename,
+	uint32_t flags)
+{
+	struct mp4_demux_config config;
+
+	memset(&config, 0, sizeof(config));
+	config.flags = cfg->flags | flags;
+	return mp4_demux_open_ext(filename, &config);
+}
+
+
+static int bench_open_close(
+	const struct bench_config *cfg,
+	const char *filename)
+{
+	uint64_t startTime, total = 0, best = UINT64_MAX;
+	struct mp4_demux *demux;
+	unsigned int i;
+
+	for (i = 0; i < cfg->iterations; i++) {
+		startTime = bench_time_ns();
+		demux = bench_open(cfg, filename, 0);
+		uint64_t elapsed = bench_time_ns() - startTime;
+		if (demux == NULL) {
+			fprintf(stderr, "mp4_demux_open_ext() failed\n");
+			return -EIO;
+		}
+		if (i == cfg->iterations - 1)
+			bench_print_rss();
+		mp4_demux_close(demux);
+		total += elapsed;
+		if (elapsed < best)
+			best = elapsed;
+	}
+	printf("  open: %u iterations, %.1f us/open (best %.1f us)\n",
+		cfg->iterations, (double)total / cfg->iterations / 1000.,
+		(double)best / 1000.);
+	return 0;
+}
+
+
+static int bench_sequential(
+	struct mp4_demux *demux,
+	uint8_t *buf,
+	unsigned int bufSize)
+{
+	struct mp4_track_sample sample;
+	uint64_t startTime, elapsed, bytes = 0, count = 0;
+	unsigned int trackId;
+	int ret;
+
+	ret = mp4_demux_seek(demux, 0, 0);
+	if (ret < 0)
+		return ret;
+	startTime = bench_time_ns();
+	for (;;) {
+		ret = mp4_demux_get_next_sample(demux, &trackId, buf,
+			bufSize, &sample);
+		if (ret < 0) {
+			fprintf(stderr, "mp4_demux_get_next_sample() "
+				"failed: %s\n", strerror(-ret));
+			return ret;
+		}
+		if (trackId == 0)
+			break;
+		bytes += sample.sample_size;
+		count++;
+	}
+	elapsed = bench_time_ns() - startTime;
+	if (elapsed == 0)
+		elapsed = 1;
+	printf("  sequential: %" PRIu64 " samples, %.1f ns/sample, "
+		"%.1f MB/s\n", count,
+		count ? (double)elapsed / count : 0.,
+		(double)bytes * 1000. / elapsed);
+	bench_print_rss();
+	return 0;
+}
+
+
+static int bench_seek(
+	const struct bench_config *cfg,
+	struct mp4_demux *demux,
+	uint8_t *buf,
+	unsigned int bufSize)
+{
+	struct mp4_media_info media;
+	struct mp4_track_info info;
+	struct mp4_track_sample sample;
+	struct mp4_track *track;
+	uint64_t state = cfg->seed, startTime, elapsed, bytes = 0;
+	unsigned int i;
+	int ret;
+
+	ret = mp4_demux_get_media_info(demux, &media);
+	if (ret < 0)
+		return ret;
+	/* read from the first video track, or the first track if there
+	 * is none */
+	track = mp4_demux_get_track_by_idx(demux, 0);
+	for (i = 0; ; i++) {
+		struct mp4_track *t = mp4_demux_get_track_by_idx(demux, i);
+		if ((t == NULL) ||
+			(mp4_demux_track_get_info(demux, t, &info) < 0))
+			break;
+		if (info.type == MP4_TRACK_TYPE_VIDEO) {
+			track = t;
+			break;
+		}
+	}
+	if ((track == NULL) || (media.duration == 0))
+		return -ENOENT;
+
+	startTime = bench_time_ns();
+	for (i = 0; i < cfg->seekCount; i++) {
+		/* seek to the previous sync sample and read it */
+		ret = mp4_demux_seek(demux, bench_rand(&state) %
+			media.duration, 1);
+		if (ret < 0) {
+			fprintf(stderr, "mp4_demux_seek() failed: %s\n",
+				strerror(-ret));
+			return ret;
+		}
+		ret = mp4_demux_track_get_next_sample(demux, track, buf,
+			bufSize, NULL, 0, &sample);
+		if (ret < 0)
+			return ret;
+		bytes += sample.sample_size;
+	}
+	elapsed = bench_time_ns() - startTime;
+	if (elapsed == 0)
+		elapsed = 1;
+	printf("  seek: %u seeks, %.1f ns/seek, %.1f MB/s\n",
+		cfg->seekCount, (double)elapsed / cfg->seekCount,
+		(double)bytes * 1000. / elapsed);
+	bench_print_rss();
+	return 0;
+}
+
+
+static int bench_metadata(
+	const struct bench_config *cfg,
+	struct mp4_demux *demux)
+{
+	enum mp4_metadata_cover_type coverType;
+	unsigned int i, count = 0, chapters = 0, coverSize = 0;
+	uint64_t startTime, elapsed, bytes = 0;
+	uint64_t *chaptersTime;
+	char **keys, **values, **chaptersName;
+	uint8_t *cover = NULL;
+	int ret;
+
+	/* size the cover buffer with a first call */
+	ret = mp4_demux_get_metadata_cover(demux, NULL, 0, &coverSize,
+		&coverType);
+	if ((ret == 0) && (coverSize > 0)) {
+		cover = malloc(coverSize);
+		if (cover == NULL)
+			return -ENOMEM;
+	}
+
+	startTime = bench_time_ns();
+	for (i = 0; i < cfg->iterations; i++) {
+		ret = mp4_demux_get_metadata_strings(demux, &count, &keys,
+			&values);
+		if (ret < 0)
+			break;
+		ret = mp4_demux_get_chapters(demux, &chapters,
+			&chaptersTime, &chaptersName);
+		if (ret < 0)
+			break;
+		if (cover) {
+			ret = mp4_demux_get_metadata_cover(demux, cover,
+				coverSize, &coverSize, &coverType);
+			if (ret < 0)
+				break;
+			bytes += coverSize;
+		}
+	}
+	elapsed = bench_time_ns() - startTime;
+	free(cover);
+	if (ret < 0) {
+		fprintf(stderr, "metadata read failed: %s\n", strerror(-ret));
+		return ret;
+	}
+	if (elapsed == 0)
+		elapsed = 1;
+	printf("  metadata: %u strings, %u chapters, %u bytes cover, "
+		"%.1f ns/read, %.1f MB/s\n", count, chapters, coverSize,
+		(double)elapsed / cfg->iterations,
+		(double)bytes * 1000. / elapsed);
+	return 0;
+}
+
+
+static void bench_print_stats(struct mp4_demux *demux)
+{
+	struct mp4_demux_stats stats;
+	unsigned int i, j;
+
+	if (mp4_demux_get_stats(demux, &stats) < 0)
+		return;
+	printf("  stats: %" PRIu64 " bytes read, %" PRIu64 " reads, %"
+		PRIu64 " seeks, %" PRIu64 "/%" PRIu64 " cache hits, "
+		"%zu bytes of tables\n", stats.bytes_read, stats.read_count,
+		stats.seek_count, stats.sample_cache_hits,
+		stats.sample_cache_hits + stats.sample_cache_misses,
+		stats.table_memory);
+
+	/* slowest box types first */
+	for (i = 0; (i < stats.box_type_count) && (i < 5); i++) {
+		for (j = i + 1; j < stats.box_type_count; j++) {
+			if (stats.box_types[j].parse_time >
+				stats.box_types[i].parse_time) {
+				struct mp4_demux_box_stats tmp =
+					stats.box_types[i];
+				stats.box_types[i] = stats.box_types[j];
+				stats.box_types[j] = tmp;
+			}
+		}
+		uint32_t type = stats.box_types[i].type;
+		printf("    box '%c%c%c%c': %u, %.1f us\n",
+			((type >> 24) & 0xFF) >= 32 ? (type >> 24) & 0xFF : '.',
+			((type >> 16) & 0xFF) >= 32 ? (type >> 16) & 0xFF : '.',
+			((type >> 8) & 0xFF) >= 32 ? (type >> 8) & 0xFF : '.',
+			(type & 0xFF) >= 32 ? type & 0xFF : '.',
+			stats.box_types[i].count,
+			(double)stats.box_types[i].parse_time / 1000.);
+	}
+}
+
+
+static int bench_run(const struct bench_config *cfg, const char *filename)
+{
+	struct mp4_demux *demux;
+	uint8_t *buf;
+	unsigned int bufSize;
+	int ret;
+
+	printf("benchmarking '%s' (flags 0x%" PRIx32 ")\n", filename,
+		cfg->flags);
+	ret = bench_open_close(cfg, filename);
+	if (ret < 0)
+		return ret;
+
+	bufSize = cfg->input ? BENCH_INPUT_BUFFER_SIZE :
+		cfg->sampleSize + cfg->sampleSize / 2 + BENCH_METADATA_SIZE;
+	buf = malloc(bufSize);
+	if (buf == NULL)
+		return -ENOMEM;
+	/* the box parsing times are only measured for the stats */
+	demux = bench_open(cfg, filename, MP4_DEMUX_FLAG_BOX_STATS);
+	if (demux == NULL) {
+		free(buf);
+		return -EIO;
+	}
+	ret = bench_sequential(demux, buf, bufSize);
+	if (ret == 0)
+		ret = bench_seek(cfg, demux, buf, bufSize);
+	if (ret == 0)
+		ret = bench_metadata(cfg, demux);
+	if (ret == 0)
+		bench_print_stats(demux);
+	mp4_demux_close(demux);
+	free(buf);
+	return ret;
+}
+
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [options]\n"
+		"  -i <file>   benchmark an existing file\n"
+		"  -o <file>   generated file (default %s)\n"
+		"  -n <count>  samples per track (default %u)\n"
+		"  -t <count>  video tracks (default 1)\n"
+		"  -c <count>  samples per chunk (default 1)\n"
+		"  -s <bytes>  mean sample size (default %u)\n"
+		"  -g <count>  sync sample interval (default %u)\n"
+		"  -p <bytes>  cover size, 0 for none (default %u)\n"
+		"  -m          add a linked metadata track per video track\n"
+		"  -f          write the moov box before the samples\n"
+		"  -k          keep the generated file\n"
+		"  -r <count>  open and metadata iterations (default %u)\n"
+		"  -q <count>  random seeks (default %u)\n"
+		"  -S <seed>   random seed (default 1)\n"
+		"  -M, -C, -L  MMAP, COMPACT_TABLES, LAZY_TABLES flags\n",
+		progname, BENCH_DEFAULT_FILE, BENCH_DEFAULT_SAMPLES,
+		BENCH_DEFAULT_SAMPLE_SIZE, BENCH_DEFAULT_GOP,
+		BENCH_DEFAULT_COVER_SIZE, BENCH_DEFAULT_ITERATIONS,
+		BENCH_DEFAULT_SEEKS);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct bench_config cfg;
+	int c, ret;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.filename = BENCH_DEFAULT_FILE;
+	cfg.sampleCount = BENCH_DEFAULT_SAMPLES;
+	cfg.trackCount = 1;
+	cfg.chunkSamples = 1;
+	cfg.sampleSize = BENCH_DEFAULT_SAMPLE_SIZE;
+	cfg.gop = BENCH_DEFAULT_GOP;
+	cfg.coverSize = BENCH_DEFAULT_COVER_SIZE;
+	cfg.iterations = BENCH_DEFAULT_ITERATIONS;
+	cfg.seekCount = BENCH_DEFAULT_SEEKS;
+	cfg.seed = 1;
+
+	while ((c = getopt(argc, argv, "i:o:n:t:c:s:g:p:mfkr:q:S:MCLh")) !=
+		-1) {
+		switch (c) {
+		case 'i':
+			cfg.input = optarg;
+			break;
+		case 'o':
+			cfg.filename = optarg;
+			break;
+		case 'n':
+			cfg.sampleCount = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			cfg.trackCount = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			cfg.chunkSamples = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			cfg.sampleSize = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			cfg.gop = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			cfg.coverSize = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			cfg.metadata = 1;
+			break;
+		case 'f':
+			cfg.moovFirst = 1;
+			break;
+		case 'k':
+			cfg.keep = 1;
+			break;
+		case 'r':
+			cfg.iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			cfg.seekCount = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			cfg.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'M':
+			cfg.flags |= MP4_DEMUX_FLAG_MMAP;
+			break;
+		case 'C':
+			cfg.flags |= MP4_DEMUX_FLAG_COMPACT_TABLES;
+			break;
+		case 'L':
+			cfg.flags |= MP4_DEMUX_FLAG_LAZY_TABLES;
+			break;
+		default:
+			usage(argv[0]);
+			exit(-1);
+		}
+	}
+	if ((cfg.sampleCount == 0) || (cfg.trackCount == 0) ||
+		(cfg.chunkSamples == 0) || (cfg.gop == 0) ||
+		(cfg.iterations == 0) || (cfg.seekCount == 0) ||
+		(cfg.seed == 0)) {
+		usage(argv[0]);
+		exit(-1);
+	}
+
+	if (cfg.input == NULL) {
+		ret = bench_generate(&cfg);
+		if (ret < 0)
+			exit(-1);
+		printf("  %u tracks%s, %u samples, %u samples per chunk, "
+			"moov %s\n", cfg.trackCount,
+			cfg.metadata ? " with metadata" : "",
+			cfg.sampleCount, cfg.chunkSamples,
+			cfg.moovFirst ? "first" : "last");
+	}
+
+	ret = bench_run(&cfg, cfg.input ? cfg.input : cfg.filename);
+	if ((cfg.input == NULL) && (!cfg.keep))
+		unlink(cfg.filename);
+
+	exit((ret < 0) ? -1 : 0);
+}
@@ -0,0 +1,182 @@
+/**
+ * @file mp4_demux_fuzz.c
+ * @brief MP4 file library - demuxer fuzzing target
+ * @date 14/10/2026
+ * @author aurelien.barre@akaaba.net
+ *
+ * Copyright (c) 2026 Aurelien Barre <aurelien.barre@akaaba.net>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ *
+ *   * Neither the name of the copyright holder nor the names of the
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libmp4.h>
+
+
+/* Bounds of the work done per input, so that every run is cheap */
+#define FUZZ_MAX_MEMORY             (64 * 1024 * 1024)
+#define FUZZ_MAX_SAMPLES            (1024)
+#define FUZZ_SAMPLE_BUFFER_SIZE     (65536)
+
+
+static const uint32_t fuzz_flags[] = {
+	0,
+	MP4_DEMUX_FLAG_COMPACT_TABLES | MP4_DEMUX_FLAG_LAZY_TABLES,
+	MP4_DEMUX_FLAG_ARENA,
+	MP4_DEMUX_FLAG_HEADER_ONLY,
+};
+
+
+static void fuzz_demux(
+	struct mp4_demux *demux,
+	uint8_t *buf)
+{
+	struct mp4_media_info info;
+	struct mp4_track_info trackInfo;
+	struct mp4_track_sample sample;
+	unsigned int i, count, trackId;
+	uint64_t *chaptersTime;
+	char **chaptersName, **keys, **values;
+	unsigned int coverSize;
+	enum mp4_metadata_cover_type coverType;
+	uint8_t *sps, *pps;
+	unsigned int spsSize, ppsSize;
+
+	if (mp4_demux_get_media_info(demux, &info) < 0)
+		return;
+
+	count = mp4_demux_get_track_count(demux);
+	for (i = 0; i < count; i++) {
+		if (mp4_demux_get_track_info(demux, i, &trackInfo) < 0)
+			continue;
+		mp4_demux_get_track_avc_decoder_config(demux, trackInfo.id,
+			&sps, &spsSize, &pps, &ppsSize);
+	}
+
+	mp4_demux_get_metadata_strings(demux, &count, &keys, &values);
+	mp4_demux_get_chapters(demux, &count, &chaptersTime,
+		&chaptersName);
+	mp4_demux_get_metadata_cover(demux, buf, FUZZ_SAMPLE_BUFFER_SIZE,
+		&coverSize, &coverType);
+
+	for (i = 0; i < FUZZ_MAX_SAMPLES; i++) {
+		if (mp4_demux_get_next_sample(demux, &trackId, buf,
+			FUZZ_SAMPLE_BUFFER_SIZE, &sample) < 0)
+			break;
+		if (trackId == 0)
+			break;
+	}
+
+	if (info.duration > 0) {
+		mp4_demux_seek(demux, info.duration / 2, 1);
+		mp4_demux_get_next_sample(demux, &trackId, buf,
+			FUZZ_SAMPLE_BUFFER_SIZE, &sample);
+	}
+}
+
+
+int LLVMFuzzerTestOneInput(
+	const uint8_t *data,
+	size_t size)
+{
+	struct mp4_demux_config config;
+	struct mp4_demux *demux;
+	uint8_t *buf;
+	unsigned int i;
+
+	buf = malloc(FUZZ_SAMPLE_BUFFER_SIZE);
+	if (buf == NULL)
+		return 0;
+
+	for (i = 0; i < sizeof(fuzz_flags) / sizeof(fuzz_flags[0]); i++) {
+		memset(&config, 0, sizeof(config));
+		config.flags = fuzz_flags[i];
+		config.max_memory = FUZZ_MAX_MEMORY;
+		demux = mp4_demux_open_buffer(data, size, &config);
+		if (demux == NULL)
+			continue;
+		fuzz_demux(demux, buf);
+		mp4_demux_close(demux);
+	}
+
+	free(buf);
+	return 0;
+}
+
+
+#ifdef MP4_DEMUX_FUZZ_STANDALONE
+
+/* Replay driver for builds without libFuzzer: run each file given on
+ * the command line once through the fuzzing target */
+int main(
+	int argc,
+	char **argv)
+{
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		FILE *f;
+		long size;
+		uint8_t *data;
+
+		f = fopen(argv[i], "rb");
+		if (f == NULL) {
+			fprintf(stderr, "failed to open '%s'\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+		if ((fseek(f, 0, SEEK_END) != 0) || ((size = ftell(f)) < 0) ||
+			(fseek(f, 0, SEEK_SET) != 0)) {
+			fprintf(stderr, "failed to get the size of '%s'\n",
+				argv[i]);
+			fclose(f);
+			return EXIT_FAILURE;
+		}
+		data = malloc((size > 0) ? size : 1);
+		if ((data == NULL) ||
+			(fread(data, 1, size, f) != (size_t)size)) {
+			fprintf(stderr, "failed to read '%s'\n", argv[i]);
+			free(data);
+			fclose(f);
+			return EXIT_FAILURE;
+		}
+		fclose(f);
+		LLVMFuzzerTestOneInput(data, size);
+		free(data);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+#endif /* MP4_DEMUX_FUZZ_STANDALONE */
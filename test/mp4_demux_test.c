@@ -270,26 +270,25 @@ static void mp4_demux_print_frames(struct mp4_demux *demux)
 {
 	struct mp4_track_info tk;
 	struct mp4_track_sample sample;
-	int i, count, ret, found = 0;
-	unsigned int id;
+	struct mp4_track *track = NULL;
+	int i, count, ret;
 
 	count = mp4_demux_get_track_count(demux);
 
 	for (i = 0; i < count; i++) {
-		ret = mp4_demux_get_track_info(demux, i, &tk);
-		if ((ret == 0) && (tk.type == MP4_TRACK_TYPE_VIDEO)) {
-			id = tk.id;
-			found = 1;
+		track = mp4_demux_get_track_by_idx(demux, i);
+		ret = mp4_demux_track_get_info(demux, track, &tk);
+		if ((ret == 0) && (tk.type == MP4_TRACK_TYPE_VIDEO))
 			break;
-		}
+		track = NULL;
 	}
 
-	if (!found)
+	if (track == NULL)
 		return;
 
 	i = 0;
 	do {
-		ret = mp4_demux_get_track_next_sample(demux, id,
+		ret = mp4_demux_track_get_next_sample(demux, track,
 			NULL, 0, NULL, 0, &sample);
 		if (ret == 0) {
 			printf("Frame #%d size=%06" PRIu32